@@ -889,6 +889,7 @@ void bdrv_close(BlockDriverState *bs)
         bs->opaque = NULL;
         bs->drv = NULL;
         bs->copy_on_read = 0;
+        bs->copy_on_read_hint = 0;
         bs->backing_file[0] = '\0';
         bs->backing_format[0] = '\0';
         bs->total_sectors = 0;
@@ -987,6 +988,7 @@ static void bdrv_move_feature_fields(BlockDriverState *bs_dest,
     bs_dest->dev                = bs_src->dev;
     bs_dest->buffer_alignment   = bs_src->buffer_alignment;
     bs_dest->copy_on_read       = bs_src->copy_on_read;
+    bs_dest->copy_on_read_hint  = bs_src->copy_on_read_hint;
 
     bs_dest->enable_write_cache = bs_src->enable_write_cache;
 
@@ -1886,6 +1888,7 @@ static int coroutine_fn bdrv_co_do_readv(BlockDriverState *bs,
 {
     BlockDriver *drv = bs->drv;
     BdrvTrackedRequest req;
+    bool hint = false;
     int ret;
 
     if (!drv) {
@@ -1901,6 +1904,8 @@ static int coroutine_fn bdrv_co_do_readv(BlockDriverState *bs,
     }
 
     if (bs->copy_on_read) {
+        /* Explicit copy-on-read requests come from block jobs */
+        hint = !(flags & BDRV_REQ_COPY_ON_READ);
         flags |= BDRV_REQ_COPY_ON_READ;
     }
     if (flags & BDRV_REQ_COPY_ON_READ) {
@@ -1923,6 +1928,9 @@ static int coroutine_fn bdrv_co_do_readv(BlockDriverState *bs,
 
         if (!ret || pnum != nb_sectors) {
             ret = bdrv_co_do_copy_on_readv(bs, sector_num, nb_sectors, qiov);
+            if (hint && ret >= 0) {
+                bs->copy_on_read_hint = sector_num + nb_sectors;
+            }
             goto out;
         }
     }
@@ -2130,6 +2138,16 @@ void bdrv_get_geometry(BlockDriverState *bs, uint64_t *nb_sectors_ptr)
     *nb_sectors_ptr = length;
 }
 
+/* takes effect on the next bdrv_open() */
+void bdrv_set_metadata_cache(BlockDriverState *bs, uint64_t l2_cache_size,
+                             uint64_t l2_cache_coverage,
+                             uint64_t refcount_cache_size)
+{
+    bs->l2_cache_size = l2_cache_size;
+    bs->l2_cache_coverage = l2_cache_coverage;
+    bs->refcount_cache_size = refcount_cache_size;
+}
+
 /* throttling disk io limits */
 void bdrv_set_io_limits(BlockDriverState *bs,
                         BlockIOLimit *io_limits)
@@ -2487,9 +2505,10 @@ BlockInfoList *qmp_query_block(Error **errp)
 }
 
 /* Consider exposing this as a full fledged QMP command */
-static BlockStats *qmp_query_blockstat(const BlockDriverState *bs, Error **errp)
+static BlockStats *qmp_query_blockstat(BlockDriverState *bs, Error **errp)
 {
     BlockStats *s;
+    BlockDriverInfo bdi;
 
     s = g_malloc0(sizeof(*s));
 
@@ -2509,6 +2528,17 @@ static BlockStats *qmp_query_blockstat(const BlockDriverState *bs, Error **errp)
     s->stats->rd_total_time_ns = bs->total_time_ns[BDRV_ACCT_READ];
     s->stats->flush_total_time_ns = bs->total_time_ns[BDRV_ACCT_FLUSH];
 
+    if (bdrv_get_info(bs, &bdi) >= 0 && bdi.l2_cache_size) {
+        s->stats->has_l2_cache_hits = true;
+        s->stats->l2_cache_hits = bdi.l2_cache_hits;
+        s->stats->has_l2_cache_misses = true;
+        s->stats->l2_cache_misses = bdi.l2_cache_misses;
+        s->stats->has_refcount_cache_hits = true;
+        s->stats->refcount_cache_hits = bdi.refcount_cache_hits;
+        s->stats->has_refcount_cache_misses = true;
+        s->stats->refcount_cache_misses = bdi.refcount_cache_misses;
+    }
+
     if (bs->file) {
         s->has_parent = true;
         s->parent = qmp_query_blockstat(bs->file, NULL);
@@ -3051,6 +3081,65 @@ void bdrv_aio_cancel(BlockDriverAIOCB *acb)
     acb->pool->cancel(acb);
 }
 
+/*
+ * Requests issued between bdrv_io_plug() and bdrv_io_unplug() may be held
+ * back and submitted together at unplug time.  Format drivers pass this on
+ * to the protocol below them.
+ */
+void bdrv_io_plug(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (drv && drv->bdrv_io_plug) {
+        drv->bdrv_io_plug(bs);
+    } else if (bs->file) {
+        bdrv_io_plug(bs->file);
+    }
+}
+
+void bdrv_io_unplug(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (drv && drv->bdrv_io_unplug) {
+        drv->bdrv_io_unplug(bs);
+    } else if (bs->file) {
+        bdrv_io_unplug(bs->file);
+    }
+}
+
+/* Size of the host AIO queue, for protocols that have one */
+int bdrv_set_aio_max_events(BlockDriverState *bs, int max_events)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (drv && drv->bdrv_set_aio_max_events) {
+        return drv->bdrv_set_aio_max_events(bs, max_events);
+    } else if (bs->file) {
+        return bdrv_set_aio_max_events(bs->file, max_events);
+    }
+    return -ENOTSUP;
+}
+
+/*
+ * Returns a host file descriptor from which the contents of bs can be read
+ * directly (e.g. with sendfile()) at the same offsets, or -errno if there is
+ * none.  Reads from it bypass the block layer, so this is refused when the
+ * block layer would change the data or the timing of requests.
+ */
+int bdrv_get_host_fd(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (!drv) {
+        return -ENOMEDIUM;
+    }
+    if (!drv->bdrv_get_host_fd || bs->copy_on_read || bs->io_limits_enabled) {
+        return -ENOTSUP;
+    }
+    return drv->bdrv_get_host_fd(bs);
+}
+
 /* block I/O throttling */
 static bool bdrv_exceed_bps_limits(BlockDriverState *bs, int nb_sectors,
                  bool is_write, double elapsed_time, uint64_t *wait)
@@ -16,6 +16,13 @@ typedef struct BlockDriverInfo {
     /* offset at which the VM state can be saved (0 if not possible) */
     int64_t vm_state_offset;
     bool is_dirty;
+    /* metadata cache statistics, l2_cache_size is 0 if there is no cache */
+    int64_t l2_cache_size;
+    int64_t l2_cache_hits;
+    int64_t l2_cache_misses;
+    int64_t refcount_cache_size;
+    int64_t refcount_cache_hits;
+    int64_t refcount_cache_misses;
 } BlockDriverInfo;
 
 typedef struct BlockFragInfo {
@@ -218,6 +225,10 @@ BlockDriverAIOCB *bdrv_aio_discard(BlockDriverState *bs,
                                    int64_t sector_num, int nb_sectors,
                                    BlockDriverCompletionFunc *cb, void *opaque);
 void bdrv_aio_cancel(BlockDriverAIOCB *acb);
+void bdrv_io_plug(BlockDriverState *bs);
+void bdrv_io_unplug(BlockDriverState *bs);
+int bdrv_set_aio_max_events(BlockDriverState *bs, int max_events);
+int bdrv_get_host_fd(BlockDriverState *bs);
 
 typedef struct BlockRequest {
     /* Fields to be filled by multiwrite caller */
@@ -26,20 +26,43 @@
 #include "qemu-common.h"
 #include "qcow2.h"
 #include "trace.h"
+#include "qemu-coroutine.h"
+
+/* Tables are looked up by offset through a hash table, and replaced in
+ * least recently used order.  All tables live in one allocation so that a
+ * table pointer handed out by qcow2_cache_get() maps back to its entry
+ * without a search.
+ *
+ * Callers in coroutine context hold s->lock.  A miss in the L2 table cache
+ * drops it while the evicted table is written back and the new one is read,
+ * with the entry marked busy so that nobody else uses it meanwhile; other
+ * requests for the same table wait for the I/O to finish.  The refcount
+ * block cache keeps the lock throughout, because the cluster allocator
+ * relies on it between finding free clusters and claiming them. */
 
 typedef struct Qcow2CachedTable {
-    void*   table;
     int64_t offset;
     bool    dirty;
-    int     cache_hits;
+    bool    busy;
     int     ref;
+    int     hash_next;
+    QTAILQ_ENTRY(Qcow2CachedTable) lru;
 } Qcow2CachedTable;
 
 struct Qcow2Cache {
     Qcow2CachedTable*       entries;
+    uint8_t*                tables;
+    int*                    buckets;
     struct Qcow2Cache*      depends;
     int                     size;
+    int                     hash_bits;
+    int                     cluster_bits;
     bool                    depends_on_flush;
+    unsigned                depends_gen;
+    CoQueue                 busy_queue;
+    QTAILQ_HEAD(, Qcow2CachedTable) lru;
+    uint64_t                hits;
+    uint64_t                misses;
 };
 
 Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables)
@@ -50,10 +73,25 @@ Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables)
 
     c = g_malloc0(sizeof(*c));
     c->size = num_tables;
+    c->cluster_bits = s->cluster_bits;
     c->entries = g_malloc0(sizeof(*c->entries) * num_tables);
+    c->tables = qemu_blockalign(bs, (size_t)num_tables << s->cluster_bits);
 
+    /* at least two buckets per table keeps the chains short */
+    c->hash_bits = 1;
+    while ((1 << c->hash_bits) < 2 * num_tables) {
+        c->hash_bits++;
+    }
+    c->buckets = g_malloc(sizeof(*c->buckets) << c->hash_bits);
+    for (i = 0; i < (1 << c->hash_bits); i++) {
+        c->buckets[i] = -1;
+    }
+
+    qemu_co_queue_init(&c->busy_queue);
+    QTAILQ_INIT(&c->lru);
     for (i = 0; i < c->size; i++) {
-        c->entries[i].table = qemu_blockalign(bs, s->cluster_size);
+        c->entries[i].hash_next = -1;
+        QTAILQ_INSERT_TAIL(&c->lru, &c->entries[i], lru);
     }
 
     return c;
@@ -64,34 +102,144 @@ int qcow2_cache_destroy(BlockDriverState* bs, Qcow2Cache *c)
     int i;
 
     for (i = 0; i < c->size; i++) {
-        assert(c->entries[i].ref == 0);
-        qemu_vfree(c->entries[i].table);
+        assert(c->entries[i].ref == 0 && !c->entries[i].busy);
     }
 
+    qemu_vfree(c->tables);
+    g_free(c->buckets);
     g_free(c->entries);
     g_free(c);
 
     return 0;
 }
 
-static int qcow2_cache_flush_dependency(BlockDriverState *bs, Qcow2Cache *c)
+void qcow2_cache_get_stats(Qcow2Cache *c, uint64_t *hits, uint64_t *misses)
+{
+    *hits = c->hits;
+    *misses = c->misses;
+}
+
+int qcow2_cache_get_size(Qcow2Cache *c)
+{
+    return c->size;
+}
+
+static inline void *qcow2_cache_table(Qcow2Cache *c, int i)
+{
+    return c->tables + ((size_t)i << c->cluster_bits);
+}
+
+static inline int qcow2_cache_table_index(Qcow2Cache *c, void *table)
+{
+    ptrdiff_t diff = (uint8_t *)table - c->tables;
+    int i = diff >> c->cluster_bits;
+
+    assert(diff >= 0 && i < c->size &&
+           ((size_t)i << c->cluster_bits) == diff);
+    return i;
+}
+
+static inline int *qcow2_cache_bucket(Qcow2Cache *c, uint64_t offset)
+{
+    uint64_t key = offset >> c->cluster_bits;
+
+    /* Fibonacci hashing: the top bits of the product are well mixed */
+    key *= 0x9e3779b97f4a7c15ULL;
+    return &c->buckets[key >> (64 - c->hash_bits)];
+}
+
+static int qcow2_cache_lookup(Qcow2Cache *c, uint64_t offset)
+{
+    int i;
+
+    for (i = *qcow2_cache_bucket(c, offset); i >= 0;
+         i = c->entries[i].hash_next) {
+        if (c->entries[i].offset == offset) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void qcow2_cache_hash_insert(Qcow2Cache *c, int i)
+{
+    int *bucket = qcow2_cache_bucket(c, c->entries[i].offset);
+
+    c->entries[i].hash_next = *bucket;
+    *bucket = i;
+}
+
+static void qcow2_cache_hash_remove(Qcow2Cache *c, int i)
+{
+    int *p = qcow2_cache_bucket(c, c->entries[i].offset);
+
+    while (*p != i) {
+        assert(*p >= 0);
+        p = &c->entries[*p].hash_next;
+    }
+    *p = c->entries[i].hash_next;
+    c->entries[i].hash_next = -1;
+}
+
+static bool qcow2_cache_may_unlock(BlockDriverState *bs, Qcow2Cache *c)
 {
+    BDRVQcowState *s = bs->opaque;
+
+    return c == s->l2_table_cache && qemu_in_coroutine() && s->lock.locked;
+}
+
+/* Wait until a busy entry may have become available again */
+static void qcow2_cache_wait(BlockDriverState *bs, Qcow2Cache *c)
+{
+    BDRVQcowState *s = bs->opaque;
+    bool locked;
+
+    if (!qemu_in_coroutine()) {
+        qemu_aio_wait();
+        return;
+    }
+
+    locked = s->lock.locked;
+    if (locked) {
+        qemu_co_mutex_unlock(&s->lock);
+    }
+    qemu_co_queue_wait(&c->busy_queue);
+    if (locked) {
+        qemu_co_mutex_lock(&s->lock);
+    }
+}
+
+static int qcow2_cache_do_flush(BlockDriverState *bs, Qcow2Cache *c,
+                                bool unlock);
+
+static int qcow2_cache_flush_dependency(BlockDriverState *bs, Qcow2Cache *c,
+                                        bool unlock)
+{
+    unsigned gen = c->depends_gen;
     int ret;
 
-    ret = qcow2_cache_flush(bs, c->depends);
+    ret = qcow2_cache_do_flush(bs, c->depends, unlock);
     if (ret < 0) {
         return ret;
     }
 
-    c->depends = NULL;
-    c->depends_on_flush = false;
+    /* A dependency added while the lock was dropped isn't covered yet */
+    if (c->depends_gen == gen) {
+        c->depends = NULL;
+        c->depends_on_flush = false;
+    }
 
     return 0;
 }
 
-static int qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c, int i)
+/* Write back table i.  With unlock set, s->lock is dropped around the
+ * write and around the flushes that have to precede it; the caller must
+ * have marked the entry busy. */
+static int qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c, int i,
+                                   bool unlock)
 {
     BDRVQcowState *s = bs->opaque;
+    unsigned gen;
     int ret = 0;
 
     if (!c->entries[i].dirty || !c->entries[i].offset) {
@@ -102,10 +250,17 @@ static int qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c, int i)
                                   c == s->l2_table_cache, i);
 
     if (c->depends) {
-        ret = qcow2_cache_flush_dependency(bs, c);
+        ret = qcow2_cache_flush_dependency(bs, c, unlock);
     } else if (c->depends_on_flush) {
+        gen = c->depends_gen;
+        if (unlock) {
+            qemu_co_mutex_unlock(&s->lock);
+        }
         ret = bdrv_flush(bs->file);
-        if (ret >= 0) {
+        if (unlock) {
+            qemu_co_mutex_lock(&s->lock);
+        }
+        if (ret >= 0 && c->depends_gen == gen) {
             c->depends_on_flush = false;
         }
     }
@@ -120,8 +275,14 @@ static int qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c, int i)
         BLKDBG_EVENT(bs->file, BLKDBG_L2_UPDATE);
     }
 
-    ret = bdrv_pwrite(bs->file, c->entries[i].offset, c->entries[i].table,
-        s->cluster_size);
+    if (unlock) {
+        qemu_co_mutex_unlock(&s->lock);
+    }
+    ret = bdrv_pwrite(bs->file, c->entries[i].offset,
+                      qcow2_cache_table(c, i), s->cluster_size);
+    if (unlock) {
+        qemu_co_mutex_lock(&s->lock);
+    }
     if (ret < 0) {
         return ret;
     }
@@ -131,7 +292,11 @@ static int qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c, int i)
     return 0;
 }
 
-int qcow2_cache_flush(BlockDriverState *bs, Qcow2Cache *c)
+/* Tables are always written with the lock held, since unlike an evicted
+ * table they may be modified at any time; with unlock set only the final
+ * flush of the image file runs without it. */
+static int qcow2_cache_do_flush(BlockDriverState *bs, Qcow2Cache *c,
+                                bool unlock)
 {
     BDRVQcowState *s = bs->opaque;
     int result = 0;
@@ -141,14 +306,20 @@ int qcow2_cache_flush(BlockDriverState *bs, Qcow2Cache *c)
     trace_qcow2_cache_flush(qemu_coroutine_self(), c == s->l2_table_cache);
 
     for (i = 0; i < c->size; i++) {
-        ret = qcow2_cache_entry_flush(bs, c, i);
+        ret = qcow2_cache_entry_flush(bs, c, i, false);
         if (ret < 0 && result != -ENOSPC) {
             result = ret;
         }
     }
 
     if (result == 0) {
+        if (unlock) {
+            qemu_co_mutex_unlock(&s->lock);
+        }
         ret = bdrv_flush(bs->file);
+        if (unlock) {
+            qemu_co_mutex_lock(&s->lock);
+        }
         if (ret < 0) {
             result = ret;
         }
@@ -157,79 +328,83 @@ int qcow2_cache_flush(BlockDriverState *bs, Qcow2Cache *c)
     return result;
 }
 
+int qcow2_cache_flush(BlockDriverState *bs, Qcow2Cache *c)
+{
+    return qcow2_cache_do_flush(bs, c, false);
+}
+
 int qcow2_cache_set_dependency(BlockDriverState *bs, Qcow2Cache *c,
     Qcow2Cache *dependency)
 {
     int ret;
 
     if (dependency->depends) {
-        ret = qcow2_cache_flush_dependency(bs, dependency);
+        ret = qcow2_cache_flush_dependency(bs, dependency, false);
         if (ret < 0) {
             return ret;
         }
     }
 
     if (c->depends && (c->depends != dependency)) {
-        ret = qcow2_cache_flush_dependency(bs, c);
+        ret = qcow2_cache_flush_dependency(bs, c, false);
         if (ret < 0) {
             return ret;
         }
     }
 
     c->depends = dependency;
+    c->depends_gen++;
     return 0;
 }
 
 void qcow2_cache_depends_on_flush(Qcow2Cache *c)
 {
     c->depends_on_flush = true;
+    c->depends_gen++;
 }
 
 static int qcow2_cache_find_entry_to_replace(Qcow2Cache *c)
 {
-    int i;
-    int min_count = INT_MAX;
-    int min_index = -1;
+    Qcow2CachedTable *e;
 
-
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].ref) {
-            continue;
+    /* Unused entries are kept at the head, so this only walks past the
+     * few tables that are currently in use. */
+    QTAILQ_FOREACH(e, &c->lru, lru) {
+        if (!e->ref && !e->busy) {
+            return e - c->entries;
         }
-
-        if (c->entries[i].cache_hits < min_count) {
-            min_index = i;
-            min_count = c->entries[i].cache_hits;
-        }
-
-        /* Give newer hits priority */
-        /* TODO Check how to optimize the replacement strategy */
-        c->entries[i].cache_hits /= 2;
     }
 
-    if (min_index == -1) {
-        /* This can't happen in current synchronous code, but leave the check
-         * here as a reminder for whoever starts using AIO with the cache */
-        abort();
-    }
-    return min_index;
+    return -1;
+}
+
+static void qcow2_cache_entry_done(Qcow2Cache *c, int i)
+{
+    c->entries[i].busy = false;
+    qemu_co_queue_restart_all(&c->busy_queue);
 }
 
 static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
     uint64_t offset, void **table, bool read_from_disk)
 {
     BDRVQcowState *s = bs->opaque;
+    bool unlock = qcow2_cache_may_unlock(bs, c);
     int i;
     int ret;
 
     trace_qcow2_cache_get(qemu_coroutine_self(), c == s->l2_table_cache,
                           offset, read_from_disk);
 
+retry:
     /* Check if the table is already cached */
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].offset == offset) {
-            goto found;
+    i = qcow2_cache_lookup(c, offset);
+    if (i >= 0) {
+        if (c->entries[i].busy) {
+            qcow2_cache_wait(bs, c);
+            goto retry;
         }
+        c->hits++;
+        goto found;
     }
 
     /* If not, write a table back and replace it */
@@ -237,38 +412,65 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
     trace_qcow2_cache_get_replace_entry(qemu_coroutine_self(),
                                         c == s->l2_table_cache, i);
     if (i < 0) {
-        return i;
+        /* Only tables under I/O by other requests can make this happen */
+        if (!unlock) {
+            abort();
+        }
+        qcow2_cache_wait(bs, c);
+        goto retry;
     }
 
-    ret = qcow2_cache_entry_flush(bs, c, i);
-    if (ret < 0) {
-        return ret;
+    if (c->entries[i].dirty && c->entries[i].offset) {
+        /* The lock may be dropped, so look everything up again afterwards */
+        c->entries[i].busy = true;
+        ret = qcow2_cache_entry_flush(bs, c, i, unlock);
+        qcow2_cache_entry_done(c, i);
+        if (ret < 0) {
+            return ret;
+        }
+        goto retry;
     }
+    c->misses++;
 
     trace_qcow2_cache_get_read(qemu_coroutine_self(),
                                c == s->l2_table_cache, i);
-    c->entries[i].offset = 0;
+    if (c->entries[i].offset) {
+        qcow2_cache_hash_remove(c, i);
+    }
+    c->entries[i].offset = offset;
+    qcow2_cache_hash_insert(c, i);
+
     if (read_from_disk) {
         if (c == s->l2_table_cache) {
             BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
         }
 
-        ret = bdrv_pread(bs->file, offset, c->entries[i].table, s->cluster_size);
+        c->entries[i].busy = true;
+        if (unlock) {
+            qemu_co_mutex_unlock(&s->lock);
+        }
+        ret = bdrv_pread(bs->file, offset, qcow2_cache_table(c, i),
+                         s->cluster_size);
+        if (unlock) {
+            qemu_co_mutex_lock(&s->lock);
+        }
+        qcow2_cache_entry_done(c, i);
         if (ret < 0) {
+            /* reuse the now empty entry first */
+            qcow2_cache_hash_remove(c, i);
+            c->entries[i].offset = 0;
+            QTAILQ_REMOVE(&c->lru, &c->entries[i], lru);
+            QTAILQ_INSERT_HEAD(&c->lru, &c->entries[i], lru);
             return ret;
         }
     }
 
-    /* Give the table some hits for the start so that it won't be replaced
-     * immediately. The number 32 is completely arbitrary. */
-    c->entries[i].cache_hits = 32;
-    c->entries[i].offset = offset;
-
     /* And return the right table */
 found:
-    c->entries[i].cache_hits++;
+    QTAILQ_REMOVE(&c->lru, &c->entries[i], lru);
+    QTAILQ_INSERT_TAIL(&c->lru, &c->entries[i], lru);
     c->entries[i].ref++;
-    *table = c->entries[i].table;
+    *table = qcow2_cache_table(c, i);
 
     trace_qcow2_cache_get_done(qemu_coroutine_self(),
                                c == s->l2_table_cache, i);
@@ -290,16 +492,8 @@ int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
 
 int qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table)
 {
-    int i;
-
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].table == *table) {
-            goto found;
-        }
-    }
-    return -ENOENT;
+    int i = qcow2_cache_table_index(c, *table);
 
-found:
     c->entries[i].ref--;
     *table = NULL;
 
@@ -309,15 +503,7 @@ found:
 
 void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table)
 {
-    int i;
-
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].table == table) {
-            goto found;
-        }
-    }
-    abort();
+    int i = qcow2_cache_table_index(c, table);
 
-found:
     c->entries[i].dirty = true;
 }
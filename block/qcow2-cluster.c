@@ -109,6 +109,9 @@ int qcow2_grow_l1_table(BlockDriverState *bs, int min_size, bool exact_size)
  * Loads a L2 table into memory. If the table is in the cache, the cache
  * is used; otherwise the L2 table is loaded from the image file.
  *
+ * A cache miss drops s->lock while reading, so callers must check that
+ * the L1 entry they got l2_offset from hasn't changed meanwhile.
+ *
  * Returns a pointer to the L2 table on success, or NULL if the read from
  * the image file failed.
  */
@@ -159,6 +162,9 @@ static int write_l1_entry(BlockDriverState *bs, int l1_index)
  * table) copy the contents of the old L2 table into the newly allocated one.
  * Otherwise the new table is initialized with zeros.
  *
+ * Returns -EAGAIN if another request replaced the L1 entry while s->lock
+ * was dropped for a cache miss; the caller should look it up again.
+ *
  */
 
 static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
@@ -182,7 +188,8 @@ static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
 
     ret = qcow2_cache_flush(bs, s->refcount_block_cache);
     if (ret < 0) {
-        goto fail;
+        trace_qcow2_l2_allocate_done(bs, l1_index, ret);
+        return ret;
     }
 
     /* allocate a new entry in the l2 cache */
@@ -218,6 +225,13 @@ static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
         }
     }
 
+    /* Someone else may have allocated the same L2 table meanwhile */
+    if (s->l1_table[l1_index] != old_l2_offset) {
+        qcow2_free_clusters(bs, l2_offset, s->l2_size * sizeof(uint64_t));
+        ret = -EAGAIN;
+        goto fail;
+    }
+
     /* write the l2 table to the file */
     BLKDBG_EVENT(bs->file, BLKDBG_L2_ALLOC_WRITE);
 
@@ -233,6 +247,7 @@ static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
     s->l1_table[l1_index] = l2_offset | QCOW_OFLAG_COPIED;
     ret = write_l1_entry(bs, l1_index);
     if (ret < 0) {
+        s->l1_table[l1_index] = old_l2_offset;
         goto fail;
     }
 
@@ -243,7 +258,6 @@ static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
 fail:
     trace_qcow2_l2_allocate_done(bs, l1_index, ret);
     qcow2_cache_put(bs, s->l2_table_cache, (void**) table);
-    s->l1_table[l1_index] = old_l2_offset;
     return ret;
 }
 
@@ -421,6 +435,7 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
 
     /* seek the the l2 offset in the l1 table */
 
+again:
     l1_index = offset >> l1_bits;
     if (l1_index >= s->l1_size) {
         ret = QCOW2_CLUSTER_UNALLOCATED;
@@ -439,6 +454,11 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
     if (ret < 0) {
         return ret;
     }
+    if ((s->l1_table[l1_index] & L1E_OFFSET_MASK) != l2_offset) {
+        /* copied on write while the table was read */
+        qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
+        goto again;
+    }
 
     /* find the cluster offset for the given disk offset */
 
@@ -505,12 +525,13 @@ static int get_cluster_table(BlockDriverState *bs, uint64_t offset,
 {
     BDRVQcowState *s = bs->opaque;
     unsigned int l1_index, l2_index;
-    uint64_t l2_offset;
+    uint64_t l1_entry, l2_offset;
     uint64_t *l2_table = NULL;
     int ret;
 
     /* seek the the l2 offset in the l1 table */
 
+again:
     l1_index = offset >> (s->l2_bits + s->cluster_bits);
     if (l1_index >= s->l1_size) {
         ret = qcow2_grow_l1_table(bs, l1_index + 1, false);
@@ -519,19 +540,27 @@ static int get_cluster_table(BlockDriverState *bs, uint64_t offset,
         }
     }
 
-    l2_offset = s->l1_table[l1_index] & L1E_OFFSET_MASK;
+    l1_entry = s->l1_table[l1_index];
+    l2_offset = l1_entry & L1E_OFFSET_MASK;
 
     /* seek the l2 table of the given l2 offset */
 
-    if (s->l1_table[l1_index] & QCOW_OFLAG_COPIED) {
+    if (l1_entry & QCOW_OFLAG_COPIED) {
         /* load the l2 table in memory */
         ret = l2_load(bs, l2_offset, &l2_table);
         if (ret < 0) {
             return ret;
         }
+        if (s->l1_table[l1_index] != l1_entry) {
+            qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
+            goto again;
+        }
     } else {
         /* First allocate a new L2 table (and do COW if needed) */
         ret = l2_allocate(bs, l1_index, &l2_table);
+        if (ret == -EAGAIN) {
+            goto again;
+        }
         if (ret < 0) {
             return ret;
         }
@@ -774,6 +803,10 @@ static int do_alloc_cluster_offset(BlockDriverState *bs, uint64_t guest_offset,
      * Check if there already is an AIO write request in flight which allocates
      * the same cluster. In this case we need to wait until the previous
      * request has completed and updated the L2 table accordingly.
+     *
+     * Ranges are [start, end) in clusters: requests that merely touch, like
+     * back-to-back sequential writes, or that share an L2 table but no
+     * cluster, go ahead in parallel.
      */
     QLIST_FOREACH(old_alloc, &s->cluster_allocs, next_in_flight) {
 
@@ -782,7 +815,7 @@ static int do_alloc_cluster_offset(BlockDriverState *bs, uint64_t guest_offset,
         uint64_t old_start = old_alloc->offset >> s->cluster_bits;
         uint64_t old_end = old_start + old_alloc->nb_clusters;
 
-        if (end < old_start || start > old_end) {
+        if (end <= old_start || start >= old_end) {
             /* No intersection */
         } else {
             if (start < old_start) {
@@ -1021,27 +1054,150 @@ static int decompress_buffer(uint8_t *out_buf, int out_buf_size,
     return 0;
 }
 
-int qcow2_decompress_cluster(BlockDriverState *bs, uint64_t cluster_offset)
+void qcow2_compressed_cache_init(BDRVQcowState *s)
+{
+    int i;
+
+    for (i = 0; i < COMPRESSED_CACHE_SIZE; i++) {
+        s->compressed_cache[i].offset = -1;
+        s->compressed_cache[i].lru = 0;
+        s->compressed_cache[i].data = NULL;
+    }
+}
+
+void qcow2_compressed_cache_free(BDRVQcowState *s)
+{
+    int i;
+
+    for (i = 0; i < COMPRESSED_CACHE_SIZE; i++) {
+        g_free(s->compressed_cache[i].data);
+        s->compressed_cache[i].data = NULL;
+        s->compressed_cache[i].offset = -1;
+    }
+}
+
+/* Forget decompressed clusters whose compressed data lies in the given range
+ * of the image file, which is about to be reused. */
+void qcow2_compressed_cache_invalidate(BDRVQcowState *s, uint64_t offset,
+                                       uint64_t size)
+{
+    int i;
+
+    /* Also keeps decompressions running without s->lock from being added */
+    s->compressed_cache_gen++;
+
+    for (i = 0; i < COMPRESSED_CACHE_SIZE; i++) {
+        Qcow2CompressedCluster *c = &s->compressed_cache[i];
+        if (c->offset != -1 && c->offset < offset + size && c->end > offset) {
+            c->offset = -1;
+            c->lru = 0;
+        }
+    }
+}
+
+static Qcow2CompressedCluster *compressed_cache_find(BDRVQcowState *s,
+                                                     uint64_t coffset)
+{
+    int i;
+
+    for (i = 0; i < COMPRESSED_CACHE_SIZE; i++) {
+        if (s->compressed_cache[i].offset == coffset) {
+            s->compressed_cache[i].lru = ++s->compressed_cache_lru;
+            return &s->compressed_cache[i];
+        }
+    }
+    return NULL;
+}
+
+static void compressed_cache_add(BDRVQcowState *s, uint64_t coffset,
+                                 uint64_t end, uint8_t *data)
+{
+    Qcow2CompressedCluster *c = &s->compressed_cache[0];
+    int i;
+
+    for (i = 1; i < COMPRESSED_CACHE_SIZE; i++) {
+        if (s->compressed_cache[i].lru < c->lru) {
+            c = &s->compressed_cache[i];
+        }
+    }
+    g_free(c->data);
+    c->data = data;
+    c->offset = coffset;
+    c->end = end;
+    c->lru = ++s->compressed_cache_lru;
+}
+
+typedef struct DecompressJob {
+    uint8_t *out_buf;
+    int out_buf_size;
+    const uint8_t *buf;
+    int buf_size;
+} DecompressJob;
+
+static int decompress_job(void *opaque)
+{
+    DecompressJob *job = opaque;
+
+    if (decompress_buffer(job->out_buf, job->out_buf_size,
+                          job->buf, job->buf_size) < 0) {
+        return -EIO;
+    }
+    return 0;
+}
+
+/* Copy qiov->size bytes of a compressed cluster into qiov.  Called with
+ * s->lock held; the lock is dropped while the cluster is read and
+ * decompressed, so that other requests go on meanwhile. */
+int qcow2_decompress_cluster(BlockDriverState *bs, uint64_t cluster_offset,
+                             int offset_in_cluster, QEMUIOVector *qiov)
 {
     BDRVQcowState *s = bs->opaque;
+    Qcow2CompressedCluster *c;
+    DecompressJob job;
     int ret, csize, nb_csectors, sector_offset;
-    uint64_t coffset;
+    uint64_t coffset, gen;
+    uint8_t *cbuf, *data;
 
     coffset = cluster_offset & s->cluster_offset_mask;
-    if (s->cluster_cache_offset != coffset) {
-        nb_csectors = ((cluster_offset >> s->csize_shift) & s->csize_mask) + 1;
-        sector_offset = coffset & 511;
-        csize = nb_csectors * 512 - sector_offset;
-        BLKDBG_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
-        ret = bdrv_read(bs->file, coffset >> 9, s->cluster_data, nb_csectors);
-        if (ret < 0) {
-            return ret;
-        }
-        if (decompress_buffer(s->cluster_cache, s->cluster_size,
-                              s->cluster_data + sector_offset, csize) < 0) {
-            return -EIO;
-        }
-        s->cluster_cache_offset = coffset;
+    c = compressed_cache_find(s, coffset);
+    if (c) {
+        qemu_iovec_from_buf(qiov, 0, c->data + offset_in_cluster, qiov->size);
+        return 0;
+    }
+
+    nb_csectors = ((cluster_offset >> s->csize_shift) & s->csize_mask) + 1;
+    sector_offset = coffset & 511;
+    csize = nb_csectors * 512 - sector_offset;
+    cbuf = qemu_blockalign(bs, nb_csectors * 512);
+    data = g_malloc(s->cluster_size);
+    gen = s->compressed_cache_gen;
+
+    qemu_co_mutex_unlock(&s->lock);
+    BLKDBG_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
+    ret = bdrv_read(bs->file, coffset >> 9, cbuf, nb_csectors);
+    if (ret >= 0) {
+        job = (DecompressJob) {
+            .out_buf        = data,
+            .out_buf_size   = s->cluster_size,
+            .buf            = cbuf + sector_offset,
+            .buf_size       = csize,
+        };
+        ret = qcow2_co_run_in_thread(bs, decompress_job, &job);
+    }
+    qemu_co_mutex_lock(&s->lock);
+    qemu_vfree(cbuf);
+    if (ret < 0) {
+        g_free(data);
+        return ret;
+    }
+
+    qemu_iovec_from_buf(qiov, 0, data + offset_in_cluster, qiov->size);
+
+    /* Somebody else may have loaded it meanwhile, or freed the data */
+    if (gen == s->compressed_cache_gen && !compressed_cache_find(s, coffset)) {
+        compressed_cache_add(s, coffset, coffset + csize, data);
+    } else {
+        g_free(data);
     }
     return 0;
 }
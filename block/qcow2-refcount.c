@@ -478,6 +478,11 @@ static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
         if (refcount == 0 && cluster_index < s->free_cluster_index) {
             s->free_cluster_index = cluster_index;
         }
+        if (refcount == 0) {
+            /* the host cluster may be reused for other data */
+            qcow2_compressed_cache_invalidate(s, cluster_offset,
+                                              s->cluster_size);
+        }
         refcount_block[block_index] = cpu_to_be16(refcount);
     }
 
@@ -30,6 +30,9 @@
 #include "qemu-error.h"
 #include "qerror.h"
 #include "trace.h"
+#ifdef CONFIG_POSIX
+#include "block/raw-posix-aio.h"
+#endif
 
 /*
   Differences with QCOW:
@@ -284,10 +287,34 @@ static int qcow2_check(BlockDriverState *bs, BdrvCheckResult *result,
     return ret;
 }
 
+/* Number of tables in each metadata cache, from the sizes given with
+ * -drive (in bytes of tables, or bytes of guest disk mapped by the cached
+ * L2 tables).  More L2 tables than the L1 table has entries are useless. */
+static void qcow2_cache_sizes(BlockDriverState *bs, int *l2_tables,
+                              int *refcount_tables)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t l2, refcount;
+
+    l2 = bs->l2_cache_size >> s->cluster_bits;
+    if (bs->l2_cache_coverage) {
+        /* each table maps l2_size clusters */
+        l2 = MAX(l2, DIV_ROUND_UP(bs->l2_cache_coverage,
+                                  (uint64_t)s->l2_size << s->cluster_bits));
+    }
+    l2 = MIN(l2, s->l1_size);
+    refcount = bs->refcount_cache_size >> s->cluster_bits;
+    refcount = MIN(refcount, s->refcount_table_size);
+
+    *l2_tables = MAX(l2, L2_CACHE_SIZE);
+    *refcount_tables = MAX(refcount, REFCOUNT_CACHE_SIZE);
+}
+
 static int qcow2_open(BlockDriverState *bs, int flags)
 {
     BDRVQcowState *s = bs->opaque;
     int len, i, ret = 0;
+    int l2_cache_size, refcount_cache_size;
     QCowHeader header;
     uint64_t ext_end;
 
@@ -429,14 +456,12 @@ static int qcow2_open(BlockDriverState *bs, int flags)
     }
 
     /* alloc L2 table/refcount block cache */
-    s->l2_table_cache = qcow2_cache_create(bs, L2_CACHE_SIZE);
-    s->refcount_block_cache = qcow2_cache_create(bs, REFCOUNT_CACHE_SIZE);
-
-    s->cluster_cache = g_malloc(s->cluster_size);
-    /* one more sector for decompressed data alignment */
-    s->cluster_data = qemu_blockalign(bs, QCOW_MAX_CRYPT_CLUSTERS * s->cluster_size
-                                  + 512);
-    s->cluster_cache_offset = -1;
+    qcow2_cache_sizes(bs, &l2_cache_size, &refcount_cache_size);
+    s->l2_table_cache = qcow2_cache_create(bs, l2_cache_size);
+    s->refcount_block_cache = qcow2_cache_create(bs, refcount_cache_size);
+
+    qcow2_compressed_cache_init(s);
+    QTAILQ_INIT(&s->compress_jobs);
     s->flags = flags;
 
     ret = qcow2_refcount_init(bs);
@@ -511,8 +536,7 @@ static int qcow2_open(BlockDriverState *bs, int flags)
     if (s->l2_table_cache) {
         qcow2_cache_destroy(bs, s->l2_table_cache);
     }
-    g_free(s->cluster_cache);
-    qemu_vfree(s->cluster_data);
+    qcow2_compressed_cache_free(s);
     return ret;
 }
 
@@ -664,15 +688,11 @@ static coroutine_fn int qcow2_co_readv(BlockDriverState *bs, int64_t sector_num,
             break;
 
         case QCOW2_CLUSTER_COMPRESSED:
-            /* add AIO support for compressed blocks ? */
-            ret = qcow2_decompress_cluster(bs, cluster_offset);
+            ret = qcow2_decompress_cluster(bs, cluster_offset,
+                                           index_in_cluster * 512, &hd_qiov);
             if (ret < 0) {
                 goto fail;
             }
-
-            qemu_iovec_from_buf(&hd_qiov, 0,
-                s->cluster_cache + index_in_cluster * 512,
-                512 * cur_nr_sectors);
             break;
 
         case QCOW2_CLUSTER_NORMAL:
@@ -776,8 +796,6 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
 
     qemu_iovec_init(&hd_qiov, qiov->niov);
 
-    s->cluster_cache_offset = -1; /* disable compressed cache */
-
     qemu_co_mutex_lock(&s->lock);
 
     while (remaining_sectors != 0) {
@@ -804,6 +822,11 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
         cluster_offset = l2meta.cluster_offset;
         assert((cluster_offset & 511) == 0);
 
+        /* The clusters are ours now: either they were already allocated, or
+         * l2meta keeps other requests off them until the L2 update below.
+         * Encryption and the data write need no lock. */
+        qemu_co_mutex_unlock(&s->lock);
+
         qemu_iovec_reset(&hd_qiov);
         qemu_iovec_concat(&hd_qiov, qiov, bytes_done,
             cur_nr_sectors * 512);
@@ -827,7 +850,6 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
         }
 
         BLKDBG_EVENT(bs->file, BLKDBG_WRITE_AIO);
-        qemu_co_mutex_unlock(&s->lock);
         trace_qcow2_writev_data(qemu_coroutine_self(),
                                 (cluster_offset >> 9) + index_in_cluster);
         ret = bdrv_co_writev(bs->file,
@@ -864,9 +886,13 @@ fail:
     return ret;
 }
 
+static int qcow2_compress_complete(BlockDriverState *bs, int max_jobs);
+
 static void qcow2_close(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
+
+    qcow2_compress_complete(bs, 0);
     g_free(s->l1_table);
 
     qcow2_cache_flush(bs, s->l2_table_cache);
@@ -880,8 +906,7 @@ static void qcow2_close(BlockDriverState *bs)
     g_free(s->unknown_header_fields);
     cleanup_unknown_header_ext(bs);
 
-    g_free(s->cluster_cache);
-    qemu_vfree(s->cluster_data);
+    qcow2_compressed_cache_free(s);
     qcow2_refcount_close(bs);
     qcow2_free_snapshots(bs);
 }
@@ -1463,30 +1488,86 @@ static int qcow2_truncate(BlockDriverState *bs, int64_t offset)
     return 0;
 }
 
-/* XXX: put compressed sectors first, then all the cluster aligned
-   tables to avoid losing bytes in alignment */
-static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
-                                  const uint8_t *buf, int nb_sectors)
+#ifdef CONFIG_POSIX
+static bool qcow2_use_threads(void)
 {
-    BDRVQcowState *s = bs->opaque;
-    z_stream strm;
-    int ret, out_len;
-    uint8_t *out_buf;
-    uint64_t cluster_offset;
+    static int ret = -1;
 
-    if (nb_sectors == 0) {
-        /* align end of file to a sector boundary to ease reading with
-           sector based I/Os */
-        cluster_offset = bdrv_getlength(bs->file);
-        cluster_offset = (cluster_offset + 511) & ~511;
-        bdrv_truncate(bs->file, cluster_offset);
-        return 0;
+    if (ret < 0) {
+        ret = paio_init() == 0;
+    }
+    return ret;
+}
+#endif
+
+/* Run func(arg) in a worker thread and call cb with its result, or run it
+ * right away where there are no worker threads. */
+void qcow2_thread_submit(BlockDriverState *bs, int (*func)(void *arg),
+                         void *arg, BlockDriverCompletionFunc *cb,
+                         void *opaque)
+{
+#ifdef CONFIG_POSIX
+    if (qcow2_use_threads()) {
+        paio_submit_func(bs, func, arg, cb, opaque);
+        return;
     }
+#endif
+    cb(opaque, func(arg));
+}
 
-    if (nb_sectors != s->cluster_sectors)
-        return -EINVAL;
+typedef struct Qcow2ThreadCo {
+    Coroutine *co;
+    bool done;
+    int ret;
+} Qcow2ThreadCo;
+
+static void qcow2_thread_co_cb(void *opaque, int ret)
+{
+    Qcow2ThreadCo *tc = opaque;
+
+    tc->ret = ret;
+    tc->done = true;
+    if (tc->co != qemu_coroutine_self()) {
+        qemu_coroutine_enter(tc->co, NULL);
+    }
+}
 
-    out_buf = g_malloc(s->cluster_size + (s->cluster_size / 1000) + 128);
+int coroutine_fn qcow2_co_run_in_thread(BlockDriverState *bs,
+                                        int (*func)(void *arg), void *arg)
+{
+    Qcow2ThreadCo tc = {
+        .co = qemu_coroutine_self(),
+    };
+
+    qcow2_thread_submit(bs, func, arg, qcow2_thread_co_cb, &tc);
+    if (!tc.done) {
+        qemu_coroutine_yield();
+    }
+    return tc.ret;
+}
+
+/* Compressed clusters are deflated by worker threads, several at a time.
+ * The caller's buffer is copied, so qcow2_write_compressed() returns as soon
+ * as the job is queued; finished jobs are written to the image in the order
+ * they were submitted, which keeps the file layout the same as with a single
+ * thread.  An error is returned by the call that writes the job out, and the
+ * final call with nb_sectors == 0 waits for all of them. */
+struct Qcow2CompressJob {
+    int64_t sector_num;
+    int cluster_size;
+    uint8_t *buf;
+    uint8_t *out_buf;
+    int out_len;
+    bool done;
+    int ret;
+    QTAILQ_ENTRY(Qcow2CompressJob) next;
+};
+
+static int qcow2_compress_job(void *opaque)
+{
+    Qcow2CompressJob *job = opaque;
+    z_stream strm;
+    int ret;
 
     /* best compression, small window, no zlib header */
     memset(&strm, 0, sizeof(strm));
@@ -1494,52 +1575,143 @@ static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
                        Z_DEFLATED, -12,
                        9, Z_DEFAULT_STRATEGY);
     if (ret != 0) {
-        ret = -EINVAL;
-        goto fail;
+        return -EINVAL;
     }
 
-    strm.avail_in = s->cluster_size;
-    strm.next_in = (uint8_t *)buf;
-    strm.avail_out = s->cluster_size;
-    strm.next_out = out_buf;
+    strm.avail_in = job->cluster_size;
+    strm.next_in = job->buf;
+    strm.avail_out = job->cluster_size;
+    strm.next_out = job->out_buf;
 
     ret = deflate(&strm, Z_FINISH);
     if (ret != Z_STREAM_END && ret != Z_OK) {
         deflateEnd(&strm);
-        ret = -EINVAL;
-        goto fail;
+        return -EINVAL;
     }
-    out_len = strm.next_out - out_buf;
+    job->out_len = strm.next_out - job->out_buf;
 
     deflateEnd(&strm);
 
-    if (ret != Z_STREAM_END || out_len >= s->cluster_size) {
+    if (ret != Z_STREAM_END) {
+        /* could not compress */
+        job->out_len = job->cluster_size;
+    }
+    return 0;
+}
+
+static void qcow2_compress_cb(void *opaque, int ret)
+{
+    Qcow2CompressJob *job = opaque;
+
+    job->ret = ret;
+    job->done = true;
+}
+
+static int qcow2_compress_write(BlockDriverState *bs, Qcow2CompressJob *job)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t cluster_offset;
+    int ret;
+
+    if (job->out_len >= s->cluster_size) {
         /* could not compress: write normal cluster */
-        ret = bdrv_write(bs, sector_num, buf, s->cluster_sectors);
+        ret = bdrv_write(bs, job->sector_num, job->buf, s->cluster_sectors);
         if (ret < 0) {
-            goto fail;
+            return ret;
         }
     } else {
         cluster_offset = qcow2_alloc_compressed_cluster_offset(bs,
-            sector_num << 9, out_len);
+            job->sector_num << 9, job->out_len);
         if (!cluster_offset) {
-            ret = -EIO;
-            goto fail;
+            return -EIO;
         }
         cluster_offset &= s->cluster_offset_mask;
         BLKDBG_EVENT(bs->file, BLKDBG_WRITE_COMPRESSED);
-        ret = bdrv_pwrite(bs->file, cluster_offset, out_buf, out_len);
+        ret = bdrv_pwrite(bs->file, cluster_offset, job->out_buf,
+                          job->out_len);
         if (ret < 0) {
-            goto fail;
+            return ret;
         }
     }
+    return 0;
+}
 
-    ret = 0;
-fail:
-    g_free(out_buf);
+/* Write out finished jobs until at most max_jobs are left in flight */
+static int qcow2_compress_complete(BlockDriverState *bs, int max_jobs)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2CompressJob *job;
+    int ret;
+
+    while ((job = QTAILQ_FIRST(&s->compress_jobs)) != NULL) {
+        if (!job->done) {
+            if (s->nb_compress_jobs <= max_jobs) {
+                break;
+            }
+            qemu_aio_wait();
+            continue;
+        }
+
+        QTAILQ_REMOVE(&s->compress_jobs, job, next);
+        s->nb_compress_jobs--;
+
+        ret = job->ret;
+        if (ret >= 0) {
+            ret = qcow2_compress_write(bs, job);
+        }
+        if (ret < 0 && !s->compress_error) {
+            s->compress_error = ret;
+        }
+        qemu_vfree(job->buf);
+        g_free(job->out_buf);
+        g_free(job);
+    }
+
+    ret = s->compress_error;
+    s->compress_error = 0;
     return ret;
 }
 
+/* XXX: put compressed sectors first, then all the cluster aligned
+   tables to avoid losing bytes in alignment */
+static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
+                                  const uint8_t *buf, int nb_sectors)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2CompressJob *job;
+    uint64_t cluster_offset;
+    int ret;
+
+    if (nb_sectors == 0) {
+        ret = qcow2_compress_complete(bs, 0);
+        if (ret < 0) {
+            return ret;
+        }
+        /* align end of file to a sector boundary to ease reading with
+           sector based I/Os */
+        cluster_offset = bdrv_getlength(bs->file);
+        cluster_offset = (cluster_offset + 511) & ~511;
+        bdrv_truncate(bs->file, cluster_offset);
+        return 0;
+    }
+
+    if (nb_sectors != s->cluster_sectors)
+        return -EINVAL;
+
+    job = g_malloc0(sizeof(*job));
+    job->sector_num = sector_num;
+    job->cluster_size = s->cluster_size;
+    job->buf = qemu_blockalign(bs, s->cluster_size);
+    memcpy(job->buf, buf, s->cluster_size);
+    job->out_buf = g_malloc(s->cluster_size + (s->cluster_size / 1000) + 128);
+
+    QTAILQ_INSERT_TAIL(&s->compress_jobs, job, next);
+    s->nb_compress_jobs++;
+    qcow2_thread_submit(bs, qcow2_compress_job, job, qcow2_compress_cb, job);
+
+    return qcow2_compress_complete(bs, MAX_COMPRESS_JOBS - 1);
+}
+
 static coroutine_fn int qcow2_co_flush_to_os(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
@@ -1572,8 +1744,23 @@ static int64_t qcow2_vm_state_offset(BDRVQcowState *s)
 static int qcow2_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
 {
     BDRVQcowState *s = bs->opaque;
+    uint64_t hits, misses;
+
     bdi->cluster_size = s->cluster_size;
     bdi->vm_state_offset = qcow2_vm_state_offset(s);
+
+    qcow2_cache_get_stats(s->l2_table_cache, &hits, &misses);
+    bdi->l2_cache_size =
+        (int64_t)qcow2_cache_get_size(s->l2_table_cache) * s->cluster_size;
+    bdi->l2_cache_hits = hits;
+    bdi->l2_cache_misses = misses;
+
+    qcow2_cache_get_stats(s->refcount_block_cache, &hits, &misses);
+    bdi->refcount_cache_size =
+        (int64_t)qcow2_cache_get_size(s->refcount_block_cache) *
+        s->cluster_size;
+    bdi->refcount_cache_hits = hits;
+    bdi->refcount_cache_misses = misses;
     return 0;
 }
 
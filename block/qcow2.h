@@ -51,6 +51,7 @@
 #define MIN_CLUSTER_BITS 9
 #define MAX_CLUSTER_BITS 21
 
+/* Default and minimum number of cached tables */
 #define L2_CACHE_SIZE 16
 
 /* Must be at least 4 to cover all cases of refcount table growth */
@@ -58,6 +59,12 @@
 
 #define DEFAULT_CLUSTER_SIZE 65536
 
+/* Number of decompressed clusters kept in memory */
+#define COMPRESSED_CACHE_SIZE 16
+
+/* Compressed clusters that qcow2_write_compressed() keeps in flight */
+#define MAX_COMPRESS_JOBS 16
+
 typedef struct QCowHeader {
     uint32_t magic;
     uint32_t version;
@@ -97,6 +104,15 @@ typedef struct QCowSnapshot {
 struct Qcow2Cache;
 typedef struct Qcow2Cache Qcow2Cache;
 
+typedef struct Qcow2CompressedCluster {
+    uint64_t offset;    /* of the compressed data, -1 if the entry is free */
+    uint64_t end;
+    uint64_t lru;
+    uint8_t *data;      /* the decompressed cluster */
+} Qcow2CompressedCluster;
+
+typedef struct Qcow2CompressJob Qcow2CompressJob;
+
 typedef struct Qcow2UnknownHeaderExtension {
     uint32_t magic;
     uint32_t len;
@@ -149,9 +165,12 @@ typedef struct BDRVQcowState {
     Qcow2Cache* l2_table_cache;
     Qcow2Cache* refcount_block_cache;
 
-    uint8_t *cluster_cache;
-    uint8_t *cluster_data;
-    uint64_t cluster_cache_offset;
+    Qcow2CompressedCluster compressed_cache[COMPRESSED_CACHE_SIZE];
+    uint64_t compressed_cache_lru;
+    uint64_t compressed_cache_gen;
+    QTAILQ_HEAD(, Qcow2CompressJob) compress_jobs;
+    int nb_compress_jobs;
+    int compress_error;
     QLIST_HEAD(QCowClusterAlloc, QCowL2Meta) cluster_allocs;
 
     uint64_t *refcount_table;
@@ -265,6 +284,11 @@ static inline bool qcow2_need_accurate_refcounts(BDRVQcowState *s)
 int qcow2_backing_read1(BlockDriverState *bs, QEMUIOVector *qiov,
                   int64_t sector_num, int nb_sectors);
 int qcow2_update_header(BlockDriverState *bs);
+void qcow2_thread_submit(BlockDriverState *bs, int (*func)(void *arg),
+                         void *arg, BlockDriverCompletionFunc *cb,
+                         void *opaque);
+int coroutine_fn qcow2_co_run_in_thread(BlockDriverState *bs,
+                                        int (*func)(void *arg), void *arg);
 
 /* qcow2-refcount.c functions */
 int qcow2_refcount_init(BlockDriverState *bs);
@@ -288,7 +312,12 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
 /* qcow2-cluster.c functions */
 int qcow2_grow_l1_table(BlockDriverState *bs, int min_size, bool exact_size);
 void qcow2_l2_cache_reset(BlockDriverState *bs);
-int qcow2_decompress_cluster(BlockDriverState *bs, uint64_t cluster_offset);
+int qcow2_decompress_cluster(BlockDriverState *bs, uint64_t cluster_offset,
+                             int offset_in_cluster, QEMUIOVector *qiov);
+void qcow2_compressed_cache_init(BDRVQcowState *s);
+void qcow2_compressed_cache_free(BDRVQcowState *s);
+void qcow2_compressed_cache_invalidate(BDRVQcowState *s, uint64_t offset,
+                                       uint64_t size);
 void qcow2_encrypt_sectors(BDRVQcowState *s, int64_t sector_num,
                      uint8_t *out_buf, const uint8_t *in_buf,
                      int nb_sectors, int enc,
@@ -320,6 +349,8 @@ int qcow2_read_snapshots(BlockDriverState *bs);
 /* qcow2-cache.c functions */
 Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables);
 int qcow2_cache_destroy(BlockDriverState* bs, Qcow2Cache *c);
+void qcow2_cache_get_stats(Qcow2Cache *c, uint64_t *hits, uint64_t *misses);
+int qcow2_cache_get_size(Qcow2Cache *c);
 
 void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table);
 int qcow2_cache_flush(BlockDriverState *bs, Qcow2Cache *c);
@@ -20,14 +20,17 @@
 #define QEMU_AIO_WRITE        0x0002
 #define QEMU_AIO_IOCTL        0x0004
 #define QEMU_AIO_FLUSH        0x0008
+#define QEMU_AIO_FUNC         0x0010
 #define QEMU_AIO_TYPE_MASK \
-	(QEMU_AIO_READ|QEMU_AIO_WRITE|QEMU_AIO_IOCTL|QEMU_AIO_FLUSH)
+	(QEMU_AIO_READ|QEMU_AIO_WRITE|QEMU_AIO_IOCTL|QEMU_AIO_FLUSH| \
+	 QEMU_AIO_FUNC)
 
 /* AIO flags */
 #define QEMU_AIO_MISALIGNED   0x1000
 
 
 /* posix-aio-compat.c - thread pool based implementation */
+int paio_set_max_threads(int n);
 int paio_init(void);
 BlockDriverAIOCB *paio_submit(BlockDriverState *bs, int fd,
         int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
@@ -35,11 +38,17 @@ BlockDriverAIOCB *paio_submit(BlockDriverState *bs, int fd,
 BlockDriverAIOCB *paio_ioctl(BlockDriverState *bs, int fd,
         unsigned long int req, void *buf,
         BlockDriverCompletionFunc *cb, void *opaque);
+BlockDriverAIOCB *paio_submit_func(BlockDriverState *bs,
+        int (*func)(void *arg), void *arg,
+        BlockDriverCompletionFunc *cb, void *opaque);
 
 /* linux-aio.c - Linux native implementation */
 void *laio_init(void);
 BlockDriverAIOCB *laio_submit(BlockDriverState *bs, void *aio_ctx, int fd,
         int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
         BlockDriverCompletionFunc *cb, void *opaque, int type);
+void laio_io_plug(void *aio_ctx);
+void laio_io_unplug(void *aio_ctx);
+int laio_set_max_events(void *aio_ctx, int max_events);
 
 #endif /* QEMU_RAW_POSIX_AIO_H */
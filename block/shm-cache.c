@@ -0,0 +1,594 @@
+/*
+ * Shared memory read cache for backing files
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ */
+
+/*
+ * Many guests booting from overlays over the same backing file read the
+ * same clusters of that file.  The shmcache protocol wraps the backing
+ * file and keeps the blocks it reads in a shared memory segment that all
+ * QEMU processes on the host can attach to, so that only the first guest
+ * has to go to storage.
+ *
+ * Usage: shmcache:[size=SIZE][,name=NAME:]FILENAME
+ *
+ * The segment holds fixed size blocks of the underlying file, keyed by
+ * the identity of the file (device, inode, size and modification time) and
+ * the block number.  A file that is modified gets a new identity, and its
+ * stale blocks age out.  The first process to create the segment sets its
+ * size; blocks are evicted with the clock algorithm when it is full.
+ *
+ * Blocks are copied into the segment with its lock held, so a process
+ * that dies while inserting one leaves nothing behind that the robust lock
+ * doesn't clean up.  Readers copy without the lock and check afterwards
+ * that the slot wasn't reused meanwhile.
+ *
+ * Every process attached to the segment can change what the others read,
+ * so it is created accessible to its owner only.  The cache is read-only.
+ */
+
+#include "qemu-common.h"
+#include "qemu-option.h"
+#include "block_int.h"
+#include <sys/mman.h>
+#include <pthread.h>
+
+#define SHM_CACHE_MAGIC         0x51534843  /* "QSHC" */
+#define SHM_CACHE_VERSION       2
+#define SHM_CACHE_BLOCK_SIZE    65536
+#define SHM_CACHE_DEFAULT_NAME  "/qemu-block-cache"
+#define SHM_CACHE_DEFAULT_SIZE  (256 * 1024 * 1024)
+
+/* How long to wait for another process to initialize the segment, in ms */
+#define SHM_CACHE_INIT_TIMEOUT  5000
+
+typedef struct ShmCacheKey {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    uint64_t mtime;             /* in nanoseconds */
+    uint64_t block;
+} ShmCacheKey;
+
+typedef struct ShmCacheSlot {
+    ShmCacheKey key;
+    int32_t next;               /* hash chain, -1 terminates it */
+    uint32_t seq;               /* changes whenever the slot is reused */
+    uint8_t used;
+    uint8_t referenced;         /* read since the clock hand last passed */
+    uint8_t pad[6];
+} ShmCacheSlot;
+
+typedef struct ShmCacheHeader {
+    uint32_t magic;             /* written last by the creator */
+    uint32_t version;
+    uint64_t size;
+    uint64_t data_offset;
+    uint32_t block_size;
+    uint32_t nb_slots;
+    uint32_t clock_hand;
+    uint32_t pad;
+    pthread_mutex_t lock;       /* protects everything but the block data */
+} ShmCacheHeader;
+
+typedef struct BDRVShmCacheState {
+    ShmCacheHeader *header;
+    int32_t *buckets;           /* one per slot */
+    ShmCacheSlot *slots;
+    uint8_t *data;
+    size_t map_size;
+    ShmCacheKey image;          /* block is unused */
+    int64_t length;
+} BDRVShmCacheState;
+
+static void shm_cache_layout(BDRVShmCacheState *s)
+{
+    ShmCacheHeader *header = s->header;
+
+    s->buckets = (int32_t *)(header + 1);
+    s->slots = (ShmCacheSlot *)(s->buckets + header->nb_slots);
+    s->data = (uint8_t *)header + header->data_offset;
+}
+
+/* Forget all blocks.  Readers in other processes see the slots change. */
+static void shm_cache_reset(BDRVShmCacheState *s)
+{
+    uint32_t i;
+
+    for (i = 0; i < s->header->nb_slots; i++) {
+        s->buckets[i] = -1;
+        s->slots[i].used = 0;
+        s->slots[i].referenced = 0;
+        s->slots[i].next = -1;
+        s->slots[i].seq++;
+    }
+    s->header->clock_hand = 0;
+}
+
+static void shm_cache_lock(BDRVShmCacheState *s)
+{
+    if (pthread_mutex_lock(&s->header->lock) == EOWNERDEAD) {
+        /* The previous owner died half way through an update */
+        shm_cache_reset(s);
+        pthread_mutex_consistent(&s->header->lock);
+    }
+}
+
+static void shm_cache_unlock(BDRVShmCacheState *s)
+{
+    pthread_mutex_unlock(&s->header->lock);
+}
+
+static uint32_t shm_cache_hash(BDRVShmCacheState *s, const ShmCacheKey *key)
+{
+    uint64_t h;
+
+    h = key->ino * 0x9e3779b97f4a7c15ULL;
+    h ^= key->dev + key->mtime + (h << 6) + (h >> 2);
+    h ^= key->block * 0xc2b2ae3d27d4eb4fULL;
+    h ^= h >> 29;
+    return h % s->header->nb_slots;
+}
+
+static int shm_cache_lookup(BDRVShmCacheState *s, const ShmCacheKey *key)
+{
+    int32_t i;
+
+    for (i = s->buckets[shm_cache_hash(s, key)]; i >= 0; i = s->slots[i].next) {
+        if (!memcmp(&s->slots[i].key, key, sizeof(*key))) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void shm_cache_unlink(BDRVShmCacheState *s, int32_t slot)
+{
+    int32_t *p = &s->buckets[shm_cache_hash(s, &s->slots[slot].key)];
+
+    while (*p != slot) {
+        assert(*p >= 0);
+        p = &s->slots[*p].next;
+    }
+    *p = s->slots[slot].next;
+    s->slots[slot].used = 0;
+}
+
+/* Find a slot for a new block, evicting the block it holds if needed */
+static int shm_cache_evict(BDRVShmCacheState *s)
+{
+    uint32_t nb_slots = s->header->nb_slots;
+    uint32_t n;
+    int32_t i;
+
+    for (n = 0; n < 2 * nb_slots; n++) {
+        ShmCacheSlot *slot;
+
+        i = s->header->clock_hand;
+        s->header->clock_hand = (i + 1) % nb_slots;
+        slot = &s->slots[i];
+        if (!slot->used) {
+            return i;
+        }
+        if (slot->referenced) {
+            slot->referenced = 0;
+            continue;
+        }
+        shm_cache_unlink(s, i);
+        return i;
+    }
+    return -1;
+}
+
+/*
+ * Copy part of a cached block into @qiov.  Returns false if the block is not
+ * in the cache, or if it was replaced while it was being copied.
+ */
+static bool shm_cache_read(BDRVShmCacheState *s, const ShmCacheKey *key,
+                           size_t skip, size_t len,
+                           QEMUIOVector *qiov, size_t qiov_offset)
+{
+    ShmCacheSlot *slot;
+    uint32_t seq;
+    bool valid;
+    int i;
+
+    shm_cache_lock(s);
+    i = shm_cache_lookup(s, key);
+    if (i < 0) {
+        shm_cache_unlock(s);
+        return false;
+    }
+    slot = &s->slots[i];
+    slot->referenced = 1;
+    seq = slot->seq;
+    shm_cache_unlock(s);
+
+    qemu_iovec_from_buf(qiov, qiov_offset,
+                        s->data + (size_t)i * s->header->block_size + skip,
+                        len);
+
+    shm_cache_lock(s);
+    valid = slot->seq == seq;
+    shm_cache_unlock(s);
+    return valid;
+}
+
+static void shm_cache_insert(BDRVShmCacheState *s, const ShmCacheKey *key,
+                             const uint8_t *buf)
+{
+    ShmCacheSlot *slot;
+    int32_t *bucket;
+    int i;
+
+    shm_cache_lock(s);
+    if (shm_cache_lookup(s, key) >= 0) {
+        /* Another guest got there first */
+        shm_cache_unlock(s);
+        return;
+    }
+    i = shm_cache_evict(s);
+    if (i < 0) {
+        shm_cache_unlock(s);
+        return;
+    }
+    slot = &s->slots[i];
+    slot->key = *key;
+    slot->used = 1;
+    slot->referenced = 1;
+    slot->seq++;
+    bucket = &s->buckets[shm_cache_hash(s, key)];
+    slot->next = *bucket;
+    *bucket = i;
+
+    memcpy(s->data + (size_t)i * s->header->block_size, buf,
+           s->header->block_size);
+    shm_cache_unlock(s);
+}
+
+static int shm_cache_init_segment(BDRVShmCacheState *s, int fd, uint64_t size)
+{
+    ShmCacheHeader *header;
+    pthread_mutexattr_t attr;
+    uint64_t meta;
+    uint32_t nb_slots;
+
+    meta = sizeof(ShmCacheHeader) + getpagesize();
+    if (size <= meta) {
+        return -EINVAL;
+    }
+    nb_slots = (size - meta) / (SHM_CACHE_BLOCK_SIZE + sizeof(ShmCacheSlot) +
+                                sizeof(int32_t));
+    if (nb_slots == 0) {
+        return -EINVAL;
+    }
+    if (ftruncate(fd, size) < 0) {
+        return -errno;
+    }
+
+    header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (header == MAP_FAILED) {
+        return -errno;
+    }
+    s->header = header;
+    s->map_size = size;
+
+    header->version = SHM_CACHE_VERSION;
+    header->size = size;
+    header->block_size = SHM_CACHE_BLOCK_SIZE;
+    header->nb_slots = nb_slots;
+    header->data_offset = QEMU_ALIGN_UP(sizeof(ShmCacheHeader) +
+                                        nb_slots * (sizeof(int32_t) +
+                                                    sizeof(ShmCacheSlot)),
+                                        getpagesize());
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&header->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    shm_cache_layout(s);
+    shm_cache_reset(s);
+
+    __sync_synchronize();
+    header->magic = SHM_CACHE_MAGIC;
+    return 0;
+}
+
+static int shm_cache_attach_segment(BDRVShmCacheState *s, int fd,
+                                    const char *name)
+{
+    ShmCacheHeader *header;
+    struct stat st;
+    int i;
+
+    /* The creator may not have sized and initialized the segment yet */
+    for (i = 0; ; i++) {
+        if (fstat(fd, &st) < 0) {
+            return -errno;
+        }
+        if (st.st_size >= sizeof(ShmCacheHeader)) {
+            break;
+        }
+        if (i == SHM_CACHE_INIT_TIMEOUT) {
+            goto timeout;
+        }
+        g_usleep(1000);
+    }
+
+    header = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (header == MAP_FAILED) {
+        return -errno;
+    }
+    s->header = header;
+    s->map_size = st.st_size;
+
+    for (i = 0; header->magic != SHM_CACHE_MAGIC; i++) {
+        if (i == SHM_CACHE_INIT_TIMEOUT) {
+            goto timeout;
+        }
+        g_usleep(1000);
+    }
+    __sync_synchronize();
+
+    if (header->version != SHM_CACHE_VERSION ||
+        header->size != st.st_size ||
+        header->block_size != SHM_CACHE_BLOCK_SIZE) {
+        error_report("shmcache: segment %s has an unsupported format", name);
+        return -EINVAL;
+    }
+    shm_cache_layout(s);
+    return 0;
+
+timeout:
+    error_report("shmcache: segment %s was not initialized; remove it from "
+                 "/dev/shm if its creator died", name);
+    return -ETIMEDOUT;
+}
+
+static int shm_cache_attach(BDRVShmCacheState *s, const char *name,
+                            uint64_t size)
+{
+    int fd, ret;
+
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd >= 0) {
+        ret = shm_cache_init_segment(s, fd, size);
+        if (ret < 0) {
+            shm_unlink(name);
+        }
+    } else if (errno == EEXIST) {
+        fd = shm_open(name, O_RDWR, 0);
+        if (fd < 0) {
+            return -errno;
+        }
+        ret = shm_cache_attach_segment(s, fd, name);
+    } else {
+        return -errno;
+    }
+    close(fd);
+
+    if (ret < 0 && s->header) {
+        munmap(s->header, s->map_size);
+        s->header = NULL;
+    }
+    return ret;
+}
+
+static int shm_cache_parse_options(const char *opts, char **name,
+                                   uint64_t *size)
+{
+    char option[32], value[256];
+    const char *p = opts;
+    char *end;
+    int64_t n;
+
+    while (*p) {
+        p = get_opt_name(option, sizeof(option), p, '=');
+        if (*p != '=') {
+            return -EINVAL;
+        }
+        p = get_opt_value(value, sizeof(value), p + 1);
+        if (*p == ',') {
+            p++;
+        }
+
+        if (!strcmp(option, "size")) {
+            n = strtosz(value, &end);
+            if (n <= 0 || *end) {
+                return -EINVAL;
+            }
+            *size = n;
+        } else if (!strcmp(option, "name")) {
+            g_free(*name);
+            *name = g_strdup_printf("%s%s", value[0] == '/' ? "" : "/",
+                                    value);
+        } else {
+            return -EINVAL;
+        }
+    }
+    return 0;
+}
+
+static int shm_cache_open(BlockDriverState *bs, const char *filename, int flags)
+{
+    BDRVShmCacheState *s = bs->opaque;
+    char *name = g_strdup(SHM_CACHE_DEFAULT_NAME);
+    uint64_t size = SHM_CACHE_DEFAULT_SIZE;
+    struct stat st;
+    const char *c;
+    char *path;
+    int fd, ret;
+
+    /* Parse the shmcache: prefix */
+    if (strncmp(filename, "shmcache:", strlen("shmcache:"))) {
+        ret = -EINVAL;
+        goto out;
+    }
+    filename += strlen("shmcache:");
+
+    /* Parse the options, if any */
+    c = strchr(filename, ':');
+    if (c && memchr(filename, '=', c - filename)) {
+        char *opts = g_strndup(filename, c - filename);
+        ret = shm_cache_parse_options(opts, &name, &size);
+        g_free(opts);
+        if (ret < 0) {
+            goto out;
+        }
+        filename = c + 1;
+    }
+
+    /* Other guests share what we read: nothing may change it */
+    if (flags & BDRV_O_RDWR) {
+        ret = -EROFS;
+        goto out;
+    }
+
+    /* Key the cache on the file that is actually read, even if the name
+     * is pointed elsewhere meanwhile */
+    fd = qemu_open(filename, O_RDONLY);
+    if (fd < 0) {
+        ret = -errno;
+        goto out;
+    }
+    if (fstat(fd, &st) < 0) {
+        ret = -errno;
+        close(fd);
+        goto out;
+    }
+    s->image.dev = st.st_dev;
+    s->image.ino = st.st_ino;
+    s->image.size = st.st_size;
+    s->image.mtime = st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec;
+
+    path = g_strdup_printf("/proc/self/fd/%d", fd);
+    ret = bdrv_file_open(&bs->file, path, flags);
+    g_free(path);
+    close(fd);
+    if (ret < 0) {
+        goto out;
+    }
+    s->length = bdrv_getlength(bs->file);
+    if (s->length < 0) {
+        ret = s->length;
+        goto out;
+    }
+
+    ret = shm_cache_attach(s, name, size);
+
+out:
+    g_free(name);
+    return ret;
+}
+
+static void shm_cache_close(BlockDriverState *bs)
+{
+    BDRVShmCacheState *s = bs->opaque;
+
+    munmap(s->header, s->map_size);
+    s->header = NULL;
+}
+
+static int64_t shm_cache_getlength(BlockDriverState *bs)
+{
+    BDRVShmCacheState *s = bs->opaque;
+
+    return s->length;
+}
+
+/* Read a whole block from the file and add it to the cache */
+static int coroutine_fn shm_cache_fill(BlockDriverState *bs,
+                                       const ShmCacheKey *key, uint8_t *buf)
+{
+    BDRVShmCacheState *s = bs->opaque;
+    int64_t offset = key->block * SHM_CACHE_BLOCK_SIZE;
+    size_t len = MIN(SHM_CACHE_BLOCK_SIZE, s->length - offset);
+    size_t aligned = QEMU_ALIGN_UP(len, BDRV_SECTOR_SIZE);
+    QEMUIOVector qiov;
+    struct iovec iov;
+    int ret;
+
+    iov.iov_base = buf;
+    iov.iov_len = aligned;
+    qemu_iovec_init_external(&qiov, &iov, 1);
+    ret = bdrv_co_readv(bs->file, offset >> BDRV_SECTOR_BITS,
+                        aligned >> BDRV_SECTOR_BITS, &qiov);
+    if (ret < 0) {
+        return ret;
+    }
+    memset(buf + len, 0, SHM_CACHE_BLOCK_SIZE - len);
+
+    shm_cache_insert(s, key, buf);
+    return 0;
+}
+
+static int coroutine_fn shm_cache_co_readv(BlockDriverState *bs,
+                                           int64_t sector_num, int nb_sectors,
+                                           QEMUIOVector *qiov)
+{
+    BDRVShmCacheState *s = bs->opaque;
+    int64_t offset = sector_num * BDRV_SECTOR_SIZE;
+    size_t bytes = (size_t)nb_sectors * BDRV_SECTOR_SIZE;
+    size_t done = 0;
+    uint8_t *buf = NULL;
+    ShmCacheKey key = s->image;
+    int ret = 0;
+
+    while (done < bytes) {
+        size_t skip = (offset + done) % SHM_CACHE_BLOCK_SIZE;
+        size_t len = MIN(SHM_CACHE_BLOCK_SIZE - skip, bytes - done);
+
+        key.block = (offset + done) / SHM_CACHE_BLOCK_SIZE;
+        if (offset + done >= s->length) {
+            qemu_iovec_memset(qiov, done, 0, bytes - done);
+            break;
+        }
+        if (!shm_cache_read(s, &key, skip, len, qiov, done)) {
+            if (!buf) {
+                buf = qemu_blockalign(bs->file, SHM_CACHE_BLOCK_SIZE);
+            }
+            ret = shm_cache_fill(bs, &key, buf);
+            if (ret < 0) {
+                break;
+            }
+            qemu_iovec_from_buf(qiov, done, buf + skip, len);
+        }
+        done += len;
+    }
+
+    qemu_vfree(buf);
+    return ret;
+}
+
+static int coroutine_fn shm_cache_co_writev(BlockDriverState *bs,
+                                            int64_t sector_num, int nb_sectors,
+                                            QEMUIOVector *qiov)
+{
+    return -EROFS;
+}
+
+static BlockDriver bdrv_shm_cache = {
+    .format_name        = "shmcache",
+    .protocol_name      = "shmcache",
+
+    .instance_size      = sizeof(BDRVShmCacheState),
+
+    .bdrv_file_open     = shm_cache_open,
+    .bdrv_close         = shm_cache_close,
+    .bdrv_getlength     = shm_cache_getlength,
+
+    .bdrv_co_readv      = shm_cache_co_readv,
+    .bdrv_co_writev     = shm_cache_co_writev,
+};
+
+static void bdrv_shm_cache_init(void)
+{
+    bdrv_register(&bdrv_shm_cache);
+}
+
+block_init(bdrv_shm_cache_init);
@@ -19,19 +19,47 @@ enum {
     /*
      * Size of data buffer for populating the image file.  This should be large
      * enough to process multiple clusters in a single call, so that populating
-     * contiguous regions of the image is efficient.
+     * contiguous regions of the image is efficient.  Adjacent extents that need
+     * copying are merged up to this size.
      */
-    STREAM_BUFFER_SIZE = 512 * 1024, /* in bytes */
+    STREAM_BUFFER_SIZE = 2 * 1024 * 1024, /* in bytes */
+
+    /* Number of populate requests in flight at once */
+    STREAM_MAX_IN_FLIGHT = 4,
+
+    /* Bounds of the window read ahead of the guest, in bytes */
+    STREAM_READAHEAD_MIN = 512 * 1024,
+    STREAM_READAHEAD_MAX = 16 * 1024 * 1024,
 };
 
 #define SLICE_TIME 100000000ULL /* ns */
 
-typedef struct StreamBlockJob {
+typedef struct StreamBlockJob StreamBlockJob;
+
+typedef struct {
+    StreamBlockJob *s;
+    int64_t sector_num;
+    int nb_sectors;         /* 0 if the request is not in flight */
+    void *buf;
+} StreamRequest;
+
+struct StreamBlockJob {
     BlockJob common;
     RateLimit limit;
     BlockDriverState *base;
     char backing_file_id[1024];
-} StreamBlockJob;
+
+    StreamRequest reqs[STREAM_MAX_IN_FLIGHT];
+    int in_flight;
+    int ret;                /* first error of a populate request */
+    bool waiting;           /* stream_run() waits for a request to finish */
+
+    /* Readahead after the last guest read that copy-on-read populated */
+    int64_t ra_hint;
+    int64_t ra_sector;
+    int64_t ra_end;
+    int ra_window;          /* in sectors */
+};
 
 static int coroutine_fn stream_populate(BlockDriverState *bs,
                                         int64_t sector_num, int nb_sectors,
@@ -49,6 +77,163 @@ static int coroutine_fn stream_populate(BlockDriverState *bs,
     return bdrv_co_copy_on_readv(bs, sector_num, nb_sectors, &qiov);
 }
 
+static void coroutine_fn stream_populate_entry(void *opaque)
+{
+    StreamRequest *req = opaque;
+    StreamBlockJob *s = req->s;
+    int ret;
+
+    ret = stream_populate(s->common.bs, req->sector_num, req->nb_sectors,
+                          req->buf);
+    if (ret < 0 && s->ret == 0) {
+        s->ret = ret;
+    }
+    req->nb_sectors = 0;
+    s->in_flight--;
+
+    if (s->waiting) {
+        s->waiting = false;
+        qemu_coroutine_enter(s->common.co, NULL);
+    }
+}
+
+static void stream_dispatch(StreamBlockJob *s, int64_t sector_num,
+                            int nb_sectors)
+{
+    StreamRequest *req = NULL;
+    Coroutine *co;
+    int i;
+
+    for (i = 0; i < STREAM_MAX_IN_FLIGHT; i++) {
+        if (s->reqs[i].nb_sectors == 0) {
+            req = &s->reqs[i];
+            break;
+        }
+    }
+    assert(req);
+
+    req->sector_num = sector_num;
+    req->nb_sectors = nb_sectors;
+    s->in_flight++;
+
+    co = qemu_coroutine_create(stream_populate_entry);
+    qemu_coroutine_enter(co, req);
+}
+
+/* Wait until at most @max_in_flight populate requests are left */
+static void coroutine_fn stream_wait(StreamBlockJob *s, int max_in_flight)
+{
+    while (s->in_flight > max_in_flight) {
+        s->waiting = true;
+        qemu_coroutine_yield();
+    }
+}
+
+/* Skip the sectors that populate requests in flight already cover */
+static int64_t stream_skip_in_flight(StreamBlockJob *s, int64_t sector_num)
+{
+    int i;
+
+    for (i = 0; i < STREAM_MAX_IN_FLIGHT; i++) {
+        StreamRequest *req = &s->reqs[i];
+
+        if (req->nb_sectors && sector_num >= req->sector_num &&
+            sector_num < req->sector_num + req->nb_sectors) {
+            sector_num = req->sector_num + req->nb_sectors;
+            i = -1;
+        }
+    }
+    return sector_num;
+}
+
+/*
+ * Find out whether the sectors at @sector_num must be copied.  Returns 1 if
+ * so, 0 if not, and the number of sectors in *pnum.  Adjacent extents with
+ * the same answer are merged, without running into requests in flight.
+ */
+static int coroutine_fn stream_next_extent(StreamBlockJob *s,
+                                           int64_t sector_num, int64_t end,
+                                           int *pnum)
+{
+    BlockDriverState *bs = s->common.bs;
+    int max = MIN(STREAM_BUFFER_SIZE / BDRV_SECTOR_SIZE, end - sector_num);
+    int total = 0;
+    int first = -1;
+    int i;
+
+    for (i = 0; i < STREAM_MAX_IN_FLIGHT; i++) {
+        StreamRequest *req = &s->reqs[i];
+
+        if (req->nb_sectors && req->sector_num > sector_num) {
+            max = MIN(max, req->sector_num - sector_num);
+        }
+    }
+
+    while (total < max) {
+        int64_t pos = sector_num + total;
+        int ret, n, copy;
+
+        ret = bdrv_co_is_allocated(bs, pos, max - total, &n);
+        if (ret == 1) {
+            /* Allocated in the top, no need to copy.  */
+            copy = 0;
+        } else {
+            /* Copy if allocated in the intermediate images.  Limit to the
+             * known-unallocated area [pos, pos+n).  */
+            ret = bdrv_co_is_allocated_above(bs->backing_hd, s->base,
+                                             pos, n, &n);
+
+            /* Finish early if end of backing file has been reached */
+            if (ret == 0 && n == 0) {
+                n = end - pos;
+            }
+
+            copy = (ret == 1);
+        }
+        trace_stream_one_iteration(s, pos, n, ret);
+        if (ret < 0) {
+            return ret;
+        }
+        if (first >= 0 && copy != first) {
+            break;
+        }
+        first = copy;
+        total += n;
+    }
+
+    *pnum = total;
+    return first;
+}
+
+/*
+ * Pick up the last guest read that had to be copied, and read ahead of it.
+ * The window grows while the guest keeps reading into it.
+ */
+static void stream_update_readahead(StreamBlockJob *s, int64_t sector_num,
+                                    int64_t end)
+{
+    BlockDriverState *bs = s->common.bs;
+    int64_t hint = bs->copy_on_read_hint;
+
+    if (hint) {
+        bs->copy_on_read_hint = 0;
+        if (hint > s->ra_hint && hint <= s->ra_end) {
+            s->ra_window = MIN(s->ra_window * 2,
+                               STREAM_READAHEAD_MAX / BDRV_SECTOR_SIZE);
+        } else {
+            s->ra_window = STREAM_READAHEAD_MIN / BDRV_SECTOR_SIZE;
+        }
+        s->ra_hint = hint;
+        s->ra_sector = hint;
+        s->ra_end = MIN(hint + s->ra_window, end);
+    }
+
+    /* Nothing to do behind the sequential pass */
+    if (s->ra_sector <= sector_num) {
+        s->ra_sector = s->ra_end = 0;
+    }
+}
+
 static void close_unused_images(BlockDriverState *top, BlockDriverState *base,
                                 const char *base_id)
 {
@@ -78,8 +263,7 @@ static void coroutine_fn stream_run(void *opaque)
     BlockDriverState *base = s->base;
     int64_t sector_num, end;
     int ret = 0;
-    int n = 0;
-    void *buf;
+    int i;
 
     s->common.len = bdrv_getlength(bs);
     if (s->common.len < 0) {
@@ -88,65 +272,87 @@ static void coroutine_fn stream_run(void *opaque)
     }
 
     end = s->common.len >> BDRV_SECTOR_BITS;
-    buf = qemu_blockalign(bs, STREAM_BUFFER_SIZE);
+    for (i = 0; i < STREAM_MAX_IN_FLIGHT; i++) {
+        s->reqs[i].s = s;
+        s->reqs[i].buf = qemu_blockalign(bs, STREAM_BUFFER_SIZE);
+    }
 
     /* Turn on copy-on-read for the whole block device so that guest read
      * requests help us make progress.  Only do this when copying the entire
      * backing chain since the copy-on-read operation does not take base into
-     * account.
+     * account.  The guest reads also tell where to read ahead.
      */
     if (!base) {
+        bs->copy_on_read_hint = 0;
         bdrv_enable_copy_on_read(bs);
     }
 
-    for (sector_num = 0; sector_num < end; sector_num += n) {
+    sector_num = 0;
+    while (sector_num < end) {
         uint64_t delay_ns = 0;
-        bool copy;
+        int64_t pos, limit;
+        bool readahead;
+        int n, copy;
 
 wait:
         /* Note that even when no rate limit is applied we need to yield
          * with no pending I/O here so that qemu_aio_flush() returns.
+         * Populate requests in flight finish without issuing new ones.
          */
         block_job_sleep_ns(&s->common, rt_clock, delay_ns);
         if (block_job_is_cancelled(&s->common)) {
             break;
         }
 
-        ret = bdrv_co_is_allocated(bs, sector_num,
-                                   STREAM_BUFFER_SIZE / BDRV_SECTOR_SIZE, &n);
-        if (ret == 1) {
-            /* Allocated in the top, no need to copy.  */
-            copy = false;
+        stream_wait(s, STREAM_MAX_IN_FLIGHT - 1);
+        if (s->ret < 0) {
+            break;
+        }
+
+        /* Data the guest is about to read comes first */
+        stream_update_readahead(s, sector_num, end);
+        readahead = s->ra_sector < s->ra_end;
+        if (readahead) {
+            pos = stream_skip_in_flight(s, s->ra_sector);
+            limit = s->ra_end;
         } else {
-            /* Copy if allocated in the intermediate images.  Limit to the
-             * known-unallocated area [sector_num, sector_num+n).  */
-            ret = bdrv_co_is_allocated_above(bs->backing_hd, base,
-                                             sector_num, n, &n);
+            pos = stream_skip_in_flight(s, sector_num);
+            limit = end;
+        }
 
-            /* Finish early if end of backing file has been reached */
-            if (ret == 0 && n == 0) {
-                n = end - sector_num;
+        if (pos < limit) {
+            copy = stream_next_extent(s, pos, limit, &n);
+            if (copy < 0) {
+                ret = copy;
+                break;
             }
-
-            copy = (ret == 1);
-        }
-        trace_stream_one_iteration(s, sector_num, n, ret);
-        if (ret >= 0 && copy) {
-            if (s->common.speed) {
-                delay_ns = ratelimit_calculate_delay(&s->limit, n);
-                if (delay_ns > 0) {
-                    goto wait;
+            if (copy) {
+                if (s->common.speed) {
+                    /* The rate limit lets through any request that starts
+                     * a slice, so don't send more than a slice's worth */
+                    n = MIN(n, MAX(s->limit.slice_quota, 1));
+                    delay_ns = ratelimit_calculate_delay(&s->limit, n);
+                    if (delay_ns > 0) {
+                        goto wait;
+                    }
                 }
+                stream_dispatch(s, pos, n);
             }
-            ret = stream_populate(bs, sector_num, n, buf);
+            pos += n;
         }
-        if (ret < 0) {
-            break;
+
+        if (readahead) {
+            s->ra_sector = pos;
+        } else {
+            /* Publish progress */
+            s->common.offset += (pos - sector_num) * BDRV_SECTOR_SIZE;
+            sector_num = pos;
         }
-        ret = 0;
+    }
 
-        /* Publish progress */
-        s->common.offset += n * BDRV_SECTOR_SIZE;
+    stream_wait(s, 0);
+    if (ret == 0) {
+        ret = s->ret;
     }
 
     if (!base) {
@@ -165,7 +371,9 @@ wait:
         close_unused_images(bs, base, base_id);
     }
 
-    qemu_vfree(buf);
+    for (i = 0; i < STREAM_MAX_IN_FLIGHT; i++) {
+        qemu_vfree(s->reqs[i].buf);
+    }
     block_job_complete(&s->common, ret);
 }
 
@@ -163,6 +163,14 @@ struct BlockDriver {
         int64_t sector_num, int nb_sectors,
         BlockDriverCompletionFunc *cb, void *opaque);
 
+    /* Queue requests between plug and unplug and submit them together */
+    void (*bdrv_io_plug)(BlockDriverState *bs);
+    void (*bdrv_io_unplug)(BlockDriverState *bs);
+    int (*bdrv_set_aio_max_events)(BlockDriverState *bs, int max_events);
+
+    /* Host file descriptor holding the image data at the guest offsets */
+    int (*bdrv_get_host_fd)(BlockDriverState *bs);
+
     int coroutine_fn (*bdrv_co_readv)(BlockDriverState *bs,
         int64_t sector_num, int nb_sectors, QEMUIOVector *qiov);
     int coroutine_fn (*bdrv_co_writev)(BlockDriverState *bs,
@@ -296,6 +304,10 @@ struct BlockDriverState {
     /* number of in-flight copy-on-read requests */
     unsigned int copy_on_read_in_flight;
 
+    /* end of the last guest read that copy-on-read had to populate, or 0;
+     * block jobs consume it to read ahead of the guest */
+    int64_t copy_on_read_hint;
+
     /* the time for latest disk I/O */
     int64_t slice_time;
     int64_t slice_start;
@@ -306,6 +318,11 @@ struct BlockDriverState {
     QEMUTimer    *block_timer;
     bool         io_limits_enabled;
 
+    /* metadata cache sizes requested for the image, 0 for the default */
+    uint64_t l2_cache_size;
+    uint64_t l2_cache_coverage;
+    uint64_t refcount_cache_size;
+
     /* I/O stats (display with "info blockstats"). */
     uint64_t nr_bytes[BDRV_MAX_IOTYPE];
     uint64_t nr_ops[BDRV_MAX_IOTYPE];
@@ -340,6 +357,9 @@ struct BlockDriverState {
 
 int get_tmp_filename(char *filename, int size);
 
+void bdrv_set_metadata_cache(BlockDriverState *bs, uint64_t l2_cache_size,
+                             uint64_t l2_cache_coverage,
+                             uint64_t refcount_cache_size);
 void bdrv_set_io_limits(BlockDriverState *bs,
                         BlockIOLimit *io_limits);
 
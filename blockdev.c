@@ -293,7 +293,9 @@ DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi)
     const char *devaddr;
     DriveInfo *dinfo;
     BlockIOLimit io_limits;
+    uint64_t l2_cache_size, l2_cache_coverage, refcount_cache_size;
     int snapshot = 0;
+    int aio_max_events = 0;
     bool copy_on_read;
     int ret;
 
@@ -396,6 +398,7 @@ DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi)
            return NULL;
         }
     }
+    aio_max_events = qemu_opt_get_number(opts, "aio-max-events", 0);
 #endif
 
     if ((buf = qemu_opt_get(opts, "format")) != NULL) {
@@ -432,6 +435,17 @@ DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi)
         return NULL;
     }
 
+    /* metadata caches */
+    l2_cache_size = qemu_opt_get_size(opts, "l2-cache-size", 0);
+    l2_cache_coverage = qemu_opt_get_size(opts, "l2-cache-coverage", 0);
+    refcount_cache_size = qemu_opt_get_size(opts, "refcount-cache-size", 0);
+
+    if (l2_cache_size && l2_cache_coverage) {
+        error_report("l2-cache-size and l2-cache-coverage "
+                     "cannot be used at the same time");
+        return NULL;
+    }
+
     on_write_error = BLOCK_ERR_STOP_ENOSPC;
     if ((buf = qemu_opt_get(opts, "werror")) != NULL) {
         if (type != IF_IDE && type != IF_SCSI && type != IF_VIRTIO && type != IF_NONE) {
@@ -545,6 +559,9 @@ DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi)
     /* disk I/O throttling */
     bdrv_set_io_limits(dinfo->bdrv, &io_limits);
 
+    bdrv_set_metadata_cache(dinfo->bdrv, l2_cache_size, l2_cache_coverage,
+                            refcount_cache_size);
+
     switch(type) {
     case IF_IDE:
     case IF_SCSI:
@@ -613,6 +630,15 @@ DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi)
         goto err;
     }
 
+    if (aio_max_events) {
+        ret = bdrv_set_aio_max_events(dinfo->bdrv, aio_max_events);
+        if (ret < 0) {
+            error_report("could not set aio-max-events for %s: %s",
+                         file, strerror(-ret));
+            goto err;
+        }
+    }
+
     if (bdrv_key_required(dinfo->bdrv))
         autostart = 0;
     return dinfo;
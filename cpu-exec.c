@@ -96,6 +96,7 @@ static TranslationBlock *tb_find_slow(CPUArchState *env,
     phys_pc = get_page_addr_code(env, pc);
     phys_page1 = phys_pc & TARGET_PAGE_MASK;
     h = tb_phys_hash_func(phys_pc);
+    tb_lock_enter();
     ptb1 = &tb_phys_hash[h];
     for(;;) {
         tb = *ptb1;
@@ -121,8 +122,17 @@ static TranslationBlock *tb_find_slow(CPUArchState *env,
         ptb1 = &tb->phys_hash_next;
     }
  not_found:
-   /* if no translated code available, then translate it now */
+    /* if no translated code available, then translate it now */
+    tb_lock_exit();
     tb = tb_gen_code(env, pc, cs_base, flags, 0);
+#ifdef CONFIG_LINUX_USER
+    if (afl_tsl_fd >= 0) {
+        afl_request_tsl(tb);
+    }
+#endif
+    tb_lock_enter();
+    /* it is already at the head of the list */
+    goto cache;
 
  found:
     /* Move the last found TB to the head of the list */
@@ -131,11 +141,25 @@ static TranslationBlock *tb_find_slow(CPUArchState *env,
         tb->phys_hash_next = tb_phys_hash[h];
         tb_phys_hash[h] = tb;
     }
-    /* we add the TB in the virtual pc hash table */
-    env->tb_jmp_cache[tb_jmp_cache_hash_func(pc)] = tb;
+ cache:
+    /* we add the TB in the virtual pc hash table, unless another thread
+       invalidated it meanwhile */
+    if (likely(!tb->invalid)) {
+        env->tb_jmp_cache[tb_jmp_cache_hash_func(pc)] = tb;
+    }
+    tb_lock_exit();
     return tb;
 }
 
+#ifdef CONFIG_USER_ONLY
+/* Translate the block at 'pc' unless that is already done.  */
+void tb_prefetch(CPUArchState *env, target_ulong pc, target_ulong cs_base,
+                 uint64_t flags)
+{
+    tb_find_slow(env, pc, cs_base, flags);
+}
+#endif
+
 static inline TranslationBlock *tb_find_fast(CPUArchState *env)
 {
     TranslationBlock *tb;
@@ -546,6 +570,11 @@ int cpu_exec(CPUArchState *env)
                     env->exception_index = EXCP_INTERRUPT;
                     cpu_loop_exit(env);
                 }
+                if (unlikely(tb_insn_bounded) &&
+                    env->insn_count >= tb_insn_limit) {
+                    env->exception_index = EXCP_INTERRUPT;
+                    cpu_loop_exit(env);
+                }
 #if defined(DEBUG_DISAS) || defined(CONFIG_DEBUG_EXEC)
                 if (qemu_loglevel_mask(CPU_LOG_TB_CPU)) {
                     /* restore flags in standard format */
@@ -565,7 +594,6 @@ int cpu_exec(CPUArchState *env)
 #endif
                 }
 #endif /* DEBUG_DISAS || CONFIG_DEBUG_EXEC */
-                spin_lock(&tb_lock);
                 tb = tb_find_fast(env);
                 /* Note: we do it here to avoid a gcc bug on Mac OS X when
                    doing it in tb_find_slow */
@@ -581,13 +609,29 @@ int cpu_exec(CPUArchState *env)
                              tb->tc_ptr, tb->pc,
                              lookup_symbol(tb->pc));
 #endif
+                if (unlikely(qemu_loglevel_mask(CPU_LOG_EXEC_INSN))) {
+                    qemu_log("Trace %p [" TARGET_FMT_lx "]\n%s",
+                             tb->tc_ptr, tb->pc, tb_disas(env, tb));
+                }
                 /* see if we can patch the calling TB. When the TB
                    spans two pages, we cannot safely do a direct
-                   jump. */
+                   jump in system mode.  In user mode the TB is on
+                   the lists of both pages and is unlinked when
+                   either of them is invalidated. */
+#ifdef CONFIG_USER_ONLY
+                if (next_tb != 0 && !tb_insn_bounded) {
+#else
                 if (next_tb != 0 && tb->page_addr[1] == -1) {
-                    tb_add_jump((TranslationBlock *)(next_tb & ~3), next_tb & 3, tb);
+#endif
+                    /* The block came from the jump cache without the
+                       lock; another thread may have invalidated it.  */
+                    tb_lock_enter();
+                    if (likely(!tb->invalid)) {
+                        tb_add_jump((TranslationBlock *)(next_tb & ~3),
+                                    next_tb & 3, tb);
+                    }
+                    tb_lock_exit();
                 }
-                spin_unlock(&tb_lock);
 
                 /* cpu_interrupt might be called while translating the
                    TB, but before it is linked into a potentially
@@ -635,6 +679,7 @@ int cpu_exec(CPUArchState *env)
             /* Reload env after longjmp - the compiler may have smashed all
              * local variables as longjmp is marked 'noreturn'. */
             env = cpu_single_env;
+            tb_lock_reset();
         }
     } /* for(;;) */
 
@@ -246,40 +246,159 @@ size_t qemu_iovec_memset(QEMUIOVector *qiov, size_t offset,
 }
 
 /*
- * Checks if a buffer is all zeroes
- *
- * Attention! The len must be a multiple of 4 * sizeof(long) due to
- * restriction of optimizations in this function.
+ * Checking whether a buffer is all zeroes (or all one byte value) is hot in
+ * qemu-img convert, copy-on-read and RAM migration.  The bulk of the buffer
+ * is checked in blocks of BUFFER_BLOCK bytes by the best implementation the
+ * host CPU supports; only the unaligned head and the tail are checked byte
+ * by byte.
  */
-bool buffer_is_zero(const void *buf, size_t len)
+#define BUFFER_BLOCK 128
+
+/* Use long as the biggest available internal data type that fits into the
+ * CPU register and unroll the loop to smooth out the effect of memory
+ * latency. */
+static bool buffer_is_filled_long(const void *buf, size_t len, uint8_t c)
+{
+    const unsigned long *p = buf;
+    const unsigned long *end = p + len / sizeof(long);
+    unsigned long val = c * (~0UL / 255);
+
+    for (; p < end; p += 4) {
+        if ((p[0] ^ val) | (p[1] ^ val) | (p[2] ^ val) | (p[3] ^ val)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+
+static bool buffer_is_filled_sse2(const void *buf, size_t len, uint8_t c)
+{
+    const __m128i *p = buf;
+    const __m128i *end = p + len / sizeof(__m128i);
+    __m128i val = _mm_set1_epi8(c);
+    __m128i zero = _mm_setzero_si128();
+
+    for (; p < end; p += 8) {
+        __m128i t = _mm_or_si128(
+            _mm_or_si128(_mm_or_si128(_mm_xor_si128(p[0], val),
+                                      _mm_xor_si128(p[1], val)),
+                         _mm_or_si128(_mm_xor_si128(p[2], val),
+                                      _mm_xor_si128(p[3], val))),
+            _mm_or_si128(_mm_or_si128(_mm_xor_si128(p[4], val),
+                                      _mm_xor_si128(p[5], val)),
+                         _mm_or_si128(_mm_xor_si128(p[6], val),
+                                      _mm_xor_si128(p[7], val))));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(t, zero)) != 0xFFFF) {
+            return false;
+        }
+    }
+    return true;
+}
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+static bool buffer_is_filled_avx2(const void *buf, size_t len, uint8_t c)
 {
-    /*
-     * Use long as the biggest available internal data type that fits into the
-     * CPU register and unroll the loop to smooth out the effect of memory
-     * latency.
-     */
+    const __m256i *p = buf;
+    const __m256i *end = p + len / sizeof(__m256i);
+    __m256i val = _mm256_set1_epi8(c);
+
+    for (; p < end; p += 4) {
+        __m256i t = _mm256_or_si256(
+            _mm256_or_si256(_mm256_xor_si256(_mm256_load_si256(p), val),
+                            _mm256_xor_si256(_mm256_load_si256(p + 1), val)),
+            _mm256_or_si256(_mm256_xor_si256(_mm256_load_si256(p + 2), val),
+                            _mm256_xor_si256(_mm256_load_si256(p + 3), val)));
+        if (!_mm256_testz_si256(t, t)) {
+            return false;
+        }
+    }
+    return true;
+}
+#pragma GCC pop_options
+#endif
 
-    size_t i;
-    long d0, d1, d2, d3;
-    const long * const data = buf;
+/* Takes a BUFFER_BLOCK aligned buffer whose length is a multiple of
+ * BUFFER_BLOCK */
+static bool (*buffer_is_filled_accel)(const void *buf, size_t len,
+                                      uint8_t c) = buffer_is_filled_long;
 
-    assert(len % (4 * sizeof(long)) == 0);
-    len /= sizeof(long);
+static void __attribute__((constructor)) init_buffer_is_filled(void)
+{
+#ifdef __SSE2__
+    buffer_is_filled_accel = buffer_is_filled_sse2;
+#endif
+#ifdef CONFIG_AVX2_OPT
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        buffer_is_filled_accel = buffer_is_filled_avx2;
+    }
+#endif
+}
+
+static bool buffer_is_filled(const void *buf, size_t len, uint8_t c)
+{
+    const uint8_t *p = buf;
+    size_t head, bulk, i;
 
-    for (i = 0; i < len; i += 4) {
-        d0 = data[i + 0];
-        d1 = data[i + 1];
-        d2 = data[i + 2];
-        d3 = data[i + 3];
+    /* Buffers that are not uniform usually differ right at the start */
+    head = MIN(len, sizeof(long));
+    for (i = 0; i < head; i++) {
+        if (p[i] != c) {
+            return false;
+        }
+    }
 
-        if (d0 || d1 || d2 || d3) {
+    head = -(uintptr_t)p & (BUFFER_BLOCK - 1);
+    if (head >= len) {
+        head = len;
+    }
+    for (i = 0; i < head; i++) {
+        if (p[i] != c) {
             return false;
         }
     }
+    p += head;
+    len -= head;
 
+    bulk = len & ~(size_t)(BUFFER_BLOCK - 1);
+    if (bulk && !buffer_is_filled_accel(p, bulk, c)) {
+        return false;
+    }
+    p += bulk;
+    len -= bulk;
+
+    for (i = 0; i < len; i++) {
+        if (p[i] != c) {
+            return false;
+        }
+    }
     return true;
 }
 
+/*
+ * Checks if a buffer is all zeroes
+ */
+bool buffer_is_zero(const void *buf, size_t len)
+{
+    return buffer_is_filled(buf, len, 0);
+}
+
+/*
+ * Checks if all bytes of a buffer have the same value
+ */
+bool buffer_is_uniform(const void *buf, size_t len)
+{
+    return len == 0 || buffer_is_filled(buf, len, *(const uint8_t *)buf);
+}
+
 #ifndef _WIN32
 /* Sets a specific flag */
 int fcntl_setfl(int fd, int flag)
@@ -6,6 +6,7 @@
 
 #include "cpu.h"
 #include "disas.h"
+#include "qemu-tls.h"
 
 /* Filled in by elfload.c.  Simplistic, but will do for now. */
 struct syminfo *syminfos = NULL;
@@ -151,6 +152,223 @@ print_insn_thumb1(bfd_vma pc, disassemble_info *info)
 }
 #endif
 
+#ifdef CONFIG_CAPSTONE
+/* Opening a capstone handle is expensive, so each thread keeps one around
+   for as long as the requested mode does not change.  */
+typedef struct CapDisas {
+    csh handle;
+    cs_insn *insn;
+    cs_arch arch;
+    cs_mode mode;
+    bool open;
+    bool failed;        /* cs_open() refused arch/mode */
+} CapDisas;
+
+static DEFINE_TLS(CapDisas, cap_disas);
+
+/* Map the target_disas() flags to a capstone mode.  Returns false if
+   capstone does not know the target.  */
+static bool cap_target_mode(int flags, cs_arch *arch, cs_mode *mode)
+{
+#if defined(TARGET_I386)
+    *arch = CS_ARCH_X86;
+    if (flags == 2) {
+        *mode = CS_MODE_64;
+    } else if (flags == 1) {
+        *mode = CS_MODE_16;
+    } else {
+        *mode = CS_MODE_32;
+    }
+#elif defined(TARGET_ARM)
+    *arch = CS_ARCH_ARM;
+    *mode = (flags & 1) ? CS_MODE_THUMB : CS_MODE_ARM;
+#ifdef TARGET_WORDS_BIGENDIAN
+    if (!(flags & 2)) {
+        *mode |= CS_MODE_BIG_ENDIAN;
+    }
+#else
+    if (flags & 2) {
+        *mode |= CS_MODE_BIG_ENDIAN;
+    }
+#endif
+#elif defined(TARGET_PPC)
+    *arch = CS_ARCH_PPC;
+#ifdef TARGET_PPC64
+    *mode = CS_MODE_64;
+#else
+    *mode = CS_MODE_32;
+#endif
+    if (!(flags >> 16)) {
+        *mode |= CS_MODE_BIG_ENDIAN;
+    }
+#elif defined(TARGET_MIPS)
+    *arch = CS_ARCH_MIPS;
+#ifdef TARGET_MIPS64
+    *mode = CS_MODE_MIPS64;
+#else
+    *mode = CS_MODE_MIPS32;
+#endif
+#ifdef TARGET_WORDS_BIGENDIAN
+    *mode |= CS_MODE_BIG_ENDIAN;
+#endif
+#elif defined(TARGET_SPARC)
+    *arch = CS_ARCH_SPARC;
+    *mode = CS_MODE_BIG_ENDIAN;
+#ifdef TARGET_SPARC64
+    *mode |= CS_MODE_V9;
+#endif
+#elif defined(TARGET_S390X)
+    *arch = CS_ARCH_SYSZ;
+    *mode = CS_MODE_BIG_ENDIAN;
+#else
+    return false;
+#endif
+    return true;
+}
+
+/* Smallest instruction, used to step over bytes capstone cannot decode. */
+static int cap_insn_unit(cs_arch arch, cs_mode mode)
+{
+    switch (arch) {
+    case CS_ARCH_X86:
+        return 1;
+    case CS_ARCH_ARM:
+        return (mode & CS_MODE_THUMB) ? 2 : 4;
+    case CS_ARCH_SYSZ:
+        return 2;
+    default:
+        return 4;
+    }
+}
+
+static CapDisas *cap_get(int flags, bool detail)
+{
+    CapDisas *cd = &tls_var(cap_disas);
+    cs_arch arch;
+    cs_mode mode;
+
+    if (!cap_target_mode(flags, &arch, &mode)) {
+        return NULL;
+    }
+    if ((cd->open || cd->failed) && (cd->arch != arch || cd->mode != mode)) {
+        if (cd->open) {
+            cs_free(cd->insn, 1);
+            cs_close(&cd->handle);
+        }
+        cd->open = false;
+        cd->failed = false;
+    }
+    if (cd->failed) {
+        /* a library built without this architecture */
+        return NULL;
+    }
+    if (!cd->open) {
+        cd->arch = arch;
+        cd->mode = mode;
+        if (cs_open(arch, mode, &cd->handle) != CS_ERR_OK) {
+            cd->failed = true;
+            return NULL;
+        }
+        /* cs_malloc() only reserves room for the details if they are on */
+        cs_option(cd->handle, CS_OPT_DETAIL, CS_OPT_ON);
+        cd->insn = cs_malloc(cd->handle);
+        cd->open = true;
+    }
+    cs_option(cd->handle, CS_OPT_DETAIL, detail ? CS_OPT_ON : CS_OPT_OFF);
+    return cd;
+}
+
+static void cap_dump_insn(fprintf_function fprintf_fn, FILE *out,
+                          target_ulong pc, const uint8_t *bytes, int len,
+                          const char *mnemonic, const char *op_str)
+{
+    char hex[2 * sizeof(((cs_insn *)0)->bytes) + 1];
+    int i;
+
+    for (i = 0; i < len; i++) {
+        snprintf(hex + 2 * i, 3, "%02x", bytes[i]);
+    }
+    hex[2 * len] = '\0';
+    fprintf_fn(out, "0x" TARGET_FMT_lx ":  %-12s  %-8s %s\n",
+               pc, hex, mnemonic, op_str);
+}
+
+/* Walk the instructions in 'buf', which holds the code at 'pc'.  Each
+   one is printed if 'fprintf_fn' is set and passed to 'fn' if that is
+   set.  At most 'max_insns' are decoded if it is positive.  Returns
+   the number of bytes consumed.  */
+static size_t cap_disas_buf(CapDisas *cd, const uint8_t *buf, size_t size,
+                            target_ulong pc, int max_insns,
+                            fprintf_function fprintf_fn, FILE *out,
+                            disas_insn_fn fn, void *opaque)
+{
+    const uint8_t *p = buf;
+    uint64_t addr = pc;
+    int unit = cap_insn_unit(cd->arch, cd->mode);
+    int n = 0;
+
+    while (size > 0 && (max_insns <= 0 || n < max_insns)) {
+        if (cs_disasm_iter(cd->handle, &p, &size, &addr, cd->insn)) {
+            if (fprintf_fn) {
+                cap_dump_insn(fprintf_fn, out, cd->insn->address,
+                              cd->insn->bytes, cd->insn->size,
+                              cd->insn->mnemonic, cd->insn->op_str);
+            }
+            if (fn) {
+                fn(opaque, cd->insn->address, cd->insn);
+            }
+        } else {
+            int len = MIN(unit, size);
+            if (fprintf_fn) {
+                cap_dump_insn(fprintf_fn, out, addr, p, len, "(bad)", "");
+            }
+            p += len;
+            size -= len;
+            addr += len;
+        }
+        n++;
+    }
+    return p - buf;
+}
+
+static bool cap_disas_target(fprintf_function fprintf_fn, FILE *out,
+                             target_ulong code, target_ulong size, int flags)
+{
+    CapDisas *cd = cap_get(flags, false);
+    uint8_t *buf;
+
+    if (!cd) {
+        return false;
+    }
+    buf = g_malloc(size);
+    cpu_memory_rw_debug(cpu_single_env, code, buf, size, 0);
+    cap_disas_buf(cd, buf, size, code, 0, fprintf_fn, out, NULL, NULL);
+    g_free(buf);
+    return true;
+}
+
+/* Decode the guest code at 'code' with capstone and pass every
+   instruction, including its operand details, to 'fn'.  'flags' are
+   the same as for target_disas().  Returns the number of bytes decoded,
+   or -1 if capstone cannot handle this target.  */
+int target_disas_insns(target_ulong code, target_ulong size, int flags,
+                       disas_insn_fn fn, void *opaque)
+{
+    CapDisas *cd = cap_get(flags, true);
+    uint8_t *buf;
+    size_t len;
+
+    if (!cd) {
+        return -1;
+    }
+    buf = g_malloc(size);
+    cpu_memory_rw_debug(cpu_single_env, code, buf, size, 0);
+    len = cap_disas_buf(cd, buf, size, code, 0, NULL, NULL, fn, opaque);
+    g_free(buf);
+    return len;
+}
+#endif /* CONFIG_CAPSTONE */
+
 /* Disassemble this for me please... (debugging). 'flags' has the following
    values:
     i386 - 1 means 16 bit code, 2 means 64 bit code
@@ -158,14 +376,21 @@ print_insn_thumb1(bfd_vma pc, disassemble_info *info)
     ppc  - nonzero means little endian
     other targets - unused
  */
-void target_disas(FILE *out, target_ulong code, target_ulong size, int flags)
+static void target_disas_fn(fprintf_function fprintf_fn, FILE *out,
+                            target_ulong code, target_ulong size, int flags)
 {
     target_ulong pc;
     int count;
     struct disassemble_info disasm_info;
     int (*print_insn)(bfd_vma pc, disassemble_info *info);
 
-    INIT_DISASSEMBLE_INFO(disasm_info, out, fprintf);
+#ifdef CONFIG_CAPSTONE
+    if (cap_disas_target(fprintf_fn, out, code, size, flags)) {
+        return;
+    }
+#endif
+
+    INIT_DISASSEMBLE_INFO(disasm_info, out, fprintf_fn);
 
     disasm_info.read_memory_func = target_read_memory;
     disasm_info.buffer_vma = code;
@@ -249,39 +474,108 @@ void target_disas(FILE *out, target_ulong code, target_ulong size, int flags)
     disasm_info.mach = bfd_mach_lm32;
     print_insn = print_insn_lm32;
 #else
-    fprintf(out, "0x" TARGET_FMT_lx
-	    ": Asm output not supported on this arch\n", code);
+    fprintf_fn(out, "0x" TARGET_FMT_lx
+               ": Asm output not supported on this arch\n", code);
     return;
 #endif
 
     for (pc = code; size > 0; pc += count, size -= count) {
-	fprintf(out, "0x" TARGET_FMT_lx ":  ", pc);
+	fprintf_fn(out, "0x" TARGET_FMT_lx ":  ", pc);
 	count = print_insn(pc, &disasm_info);
 #if 0
         {
             int i;
             uint8_t b;
-            fprintf(out, " {");
+            fprintf_fn(out, " {");
             for(i = 0; i < count; i++) {
                 target_read_memory(pc + i, &b, 1, &disasm_info);
-                fprintf(out, " %02x", b);
+                fprintf_fn(out, " %02x", b);
             }
-            fprintf(out, " }");
+            fprintf_fn(out, " }");
         }
 #endif
-	fprintf(out, "\n");
+	fprintf_fn(out, "\n");
 	if (count < 0)
 	    break;
         if (size < count) {
-            fprintf(out,
-                    "Disassembler disagrees with translator over instruction "
-                    "decoding\n"
-                    "Please report this to qemu-devel@nongnu.org\n");
+            fprintf_fn(out,
+                       "Disassembler disagrees with translator over instruction "
+                       "decoding\n"
+                       "Please report this to qemu-devel@nongnu.org\n");
             break;
         }
     }
 }
 
+void target_disas(FILE *out, target_ulong code, target_ulong size, int flags)
+{
+    target_disas_fn(fprintf, out, code, size, flags);
+}
+
+static int GCC_FMT_ATTR(2, 3) disas_gstring_printf(FILE *f,
+                                                   const char *fmt, ...)
+{
+    va_list ap;
+    char *str;
+    int len;
+
+    va_start(ap, fmt);
+    str = g_strdup_vprintf(fmt, ap);
+    va_end(ap);
+    len = strlen(str);
+    g_string_append((GString *)f, str);
+    g_free(str);
+    return len;
+}
+
+/* The target_disas() flags the translator used for 'tb'.  */
+static int tb_disas_flags(CPUArchState *env, TranslationBlock *tb)
+{
+#if defined(TARGET_I386)
+#ifdef TARGET_X86_64
+    if (tb->flags & HF_CS64_MASK) {
+        return 2;
+    }
+#endif
+    return !(tb->flags & HF_CS32_MASK);
+#elif defined(TARGET_ARM)
+    return ARM_TBFLAG_THUMB(tb->flags) |
+        (ARM_TBFLAG_BSWAP_CODE(tb->flags) << 1);
+#elif defined(TARGET_PPC)
+    return env->bfd_mach | (env->hflags & (1 << MSR_LE) ? 1 << 16 : 0);
+#elif defined(TARGET_CRIS)
+    return env->pregs[PR_VR];
+#elif defined(TARGET_ALPHA) || defined(TARGET_S390X)
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+/* Guest disassembly of 'tb'.  The text is produced the first time it
+   is asked for and kept in the block until tb_alloc() reuses the slot,
+   so tracing every executed block does not disassemble it each time.  */
+const char *tb_disas(CPUArchState *env, TranslationBlock *tb)
+{
+    GString *str;
+    char *text;
+
+    text = tb->disas;
+    if (text) {
+        return text;
+    }
+    str = g_string_new(NULL);
+    target_disas_fn(disas_gstring_printf, (FILE *)str, tb->pc, tb->size,
+                    tb_disas_flags(env, tb));
+    text = g_string_free(str, FALSE);
+    /* two threads may run the block for the first time together */
+    if (!__sync_bool_compare_and_swap(&tb->disas, NULL, text)) {
+        g_free(text);
+        text = tb->disas;
+    }
+    return text;
+}
+
 /* Disassemble this for me please... (debugging). */
 void disas(FILE *out, void *code, unsigned long size)
 {
@@ -390,17 +684,76 @@ monitor_fprintf(FILE *stream, const char *fmt, ...)
     return 0;
 }
 
+#ifdef CONFIG_CAPSTONE
+/* Longest instruction, the most the monitor reads ahead.  */
+static int cap_insn_max(cs_arch arch, cs_mode mode)
+{
+    switch (arch) {
+    case CS_ARCH_X86:
+        return 15;
+    case CS_ARCH_SYSZ:
+        return 6;
+    default:
+        return 4;
+    }
+}
+#endif
+
 void monitor_disas(Monitor *mon, CPUArchState *env,
                    target_ulong pc, int nb_insn, int is_physical, int flags)
 {
     int count, i;
     struct disassemble_info disasm_info;
     int (*print_insn)(bfd_vma pc, disassemble_info *info);
-
-    INIT_DISASSEMBLE_INFO(disasm_info, (FILE *)mon, monitor_fprintf);
+#ifdef CONFIG_CAPSTONE
+    CapDisas *cd;
+#endif
 
     monitor_disas_env = env;
     monitor_disas_is_physical = is_physical;
+
+#ifdef CONFIG_CAPSTONE
+    cd = cap_get(flags, false);
+    if (cd) {
+        uint8_t buf[sizeof(cd->insn->bytes)];
+        int unit = cap_insn_unit(cd->arch, cd->mode);
+        int max = cap_insn_max(cd->arch, cd->mode);
+
+        for (i = 0; i < nb_insn; i++) {
+            const uint8_t *p;
+            uint64_t addr;
+            size_t size;
+            int len = 0;
+            bool ok;
+
+            /* Read one unit more until the instruction decodes, so the
+               last one never reads past the range into what may be the
+               end of the mapping.  */
+            do {
+                monitor_read_memory(pc + len, buf + len, unit, NULL);
+                len += unit;
+                p = buf;
+                size = len;
+                addr = pc;
+                ok = cs_disasm_iter(cd->handle, &p, &size, &addr, cd->insn);
+            } while (!ok && len < max);
+            if (ok) {
+                cap_dump_insn(monitor_fprintf, (FILE *)mon, pc,
+                              cd->insn->bytes, cd->insn->size,
+                              cd->insn->mnemonic, cd->insn->op_str);
+                pc += cd->insn->size;
+            } else {
+                cap_dump_insn(monitor_fprintf, (FILE *)mon, pc, buf, unit,
+                              "(bad)", "");
+                pc += unit;
+            }
+        }
+        return;
+    }
+#endif
+
+    INIT_DISASSEMBLE_INFO(disasm_info, (FILE *)mon, monitor_fprintf);
+
     disasm_info.read_memory_func = monitor_read_memory;
     disasm_info.print_address_func = generic_print_target_address;
 
@@ -13,6 +13,19 @@ void monitor_disas(Monitor *mon, CPUArchState *env,
 
 /* Look up symbol for debugging purpose.  Returns "" if unknown. */
 const char *lookup_symbol(target_ulong orig_addr);
+
+struct TranslationBlock;
+const char *tb_disas(CPUArchState *env, struct TranslationBlock *tb);
+
+#ifdef CONFIG_CAPSTONE
+#include <capstone.h>
+
+/* Called by target_disas_insns() for each decoded guest instruction. */
+typedef void (*disas_insn_fn)(void *opaque, uint64_t pc, const cs_insn *insn);
+
+int target_disas_insns(target_ulong code, target_ulong size, int flags,
+                       disas_insn_fn fn, void *opaque);
+#endif
 #endif
 
 struct syminfo;
@@ -21,6 +21,7 @@
 #define _EXEC_ALL_H_
 
 #include "qemu-common.h"
+#include "qemu-tls.h"
 
 /* allow to see translation results - the slowdown should be negligible, so we leave it */
 //#define DEBUG_DISAS
@@ -70,9 +71,9 @@ typedef struct TranslationBlock TranslationBlock;
 
 #define OPPARAM_BUF_SIZE (OPC_BUF_SIZE * MAX_OPC_PARAM)
 
-extern target_ulong gen_opc_pc[OPC_BUF_SIZE];
-extern uint8_t gen_opc_instr_start[OPC_BUF_SIZE];
-extern uint16_t gen_opc_icount[OPC_BUF_SIZE];
+extern TCG_THREAD target_ulong gen_opc_pc[OPC_BUF_SIZE];
+extern TCG_THREAD uint8_t gen_opc_instr_start[OPC_BUF_SIZE];
+extern TCG_THREAD uint16_t gen_opc_icount[OPC_BUF_SIZE];
 
 #include "qemu-log.h"
 
@@ -81,6 +82,23 @@ void gen_intermediate_code_pc(CPUArchState *env, struct TranslationBlock *tb);
 void restore_state_to_opc(CPUArchState *env, struct TranslationBlock *tb,
                           int pc_pos);
 
+#ifdef TARGET_HAS_INSN_RECORDS
+/* Guest instruction boundaries of a TB of the translation store.  They
+   are stored right after its host code so that cpu_restore_state() can
+   look up the faulting instruction: the shared code cannot be generated
+   again in place.  Private blocks are translated again instead.  */
+typedef struct TBInsnRecord {
+    uint32_t host_start; /* offset of the first host insn from tc_ptr */
+    uint16_t icount;
+    uint16_t data;       /* target specific, see insn_record_data() */
+    target_ulong pc;
+} TBInsnRecord;
+
+uint16_t insn_record_data(int pc_pos);
+void restore_state_to_insn(CPUArchState *env, struct TranslationBlock *tb,
+                           const TBInsnRecord *rec);
+#endif
+
 void cpu_gen_init(void);
 int cpu_gen_code(CPUArchState *env, struct TranslationBlock *tb,
                  int *gen_code_size_ptr);
@@ -148,6 +166,8 @@ struct TranslationBlock {
     uint16_t cflags;    /* compile flags */
 #define CF_COUNT_MASK  0x7fff
 #define CF_LAST_IO     0x8000 /* Last insn may be an IO access.  */
+    uint16_t invalid;   /* set once tb_phys_invalidate removed the block */
+    uint16_t stored;    /* the code lives in the shared translation store */
 
     uint8_t *tc_ptr;    /* pointer to the translated code */
     /* next matching tb for physical address. */
@@ -162,8 +182,11 @@ struct TranslationBlock {
     uint16_t tb_next_offset[2]; /* offset of original jump target */
 #ifdef USE_DIRECT_JUMP
     uint16_t tb_jmp_offset[2]; /* offset of jump instruction */
-#else
-    uintptr_t tb_next[2]; /* address of jump generated code */
+#endif
+#if !defined(USE_DIRECT_JUMP) || defined(CONFIG_USER_ONLY)
+    /* address of jump generated code; the shared code of stored blocks
+       jumps through it rather than being patched */
+    uintptr_t tb_next[2];
 #endif
     /* list of TBs jumping to this one. This is a circular list using
        the two least significant bits of the pointers to tell what is
@@ -172,6 +195,15 @@ struct TranslationBlock {
     struct TranslationBlock *jmp_next[2];
     struct TranslationBlock *jmp_first;
     uint32_t icount;
+    /* number of times this block was entered, if TB profiling is on */
+    uint64_t exec_count;
+    /* guest disassembly for exec_insn tracing, see tb_disas() */
+    char *disas;
+#ifdef TARGET_HAS_INSN_RECORDS
+    /* nb_insn_records entries plus one terminating the host code */
+    TBInsnRecord *insn_records;
+    uint32_t nb_insn_records;
+#endif
 };
 
 static inline unsigned int tb_jmp_cache_hash_page(target_ulong pc)
@@ -196,6 +228,64 @@ static inline unsigned int tb_phys_hash_func(tb_page_addr_t pc)
 
 void tb_free(TranslationBlock *tb);
 void tb_flush(CPUArchState *env);
+#ifdef CONFIG_USER_ONLY
+/* Set when the translation buffer must be flushed as soon as no CPU is
+   executing generated code.  */
+extern int tb_flush_pending;
+void tb_flush_exclusive(CPUArchState *env);
+#endif
+/* TB profiling: perf map export and per-TB execution counters */
+extern int tb_profile_top;
+void tb_perfmap_enable(void);
+void tb_profile_enable(int top);
+void tb_profile_report(void);
+#ifdef CONFIG_USER_ONLY
+/* Translation store shared between processes (linux-user -tbstore) */
+void tb_store_init(const char *path, CPUArchState *env);
+#endif
+/* Edge coverage for fuzzing.  When tb_coverage_map is set, the TBs
+   starting in [tb_coverage_start, tb_coverage_end) add one to the map
+   entry of the edge from the previous TB when they are entered, the
+   way AFL instruments programs.  */
+#define TB_COVERAGE_MAP_SIZE (1 << 16)
+extern uint8_t *tb_coverage_map;
+extern target_ulong tb_coverage_start, tb_coverage_end;
+
+static inline int tb_coverage(target_ulong pc)
+{
+    return tb_coverage_map && pc >= tb_coverage_start &&
+        pc < tb_coverage_end;
+}
+
+static inline uint32_t tb_coverage_loc(target_ulong pc)
+{
+    return ((pc >> 4) ^ (pc << 8)) & (TB_COVERAGE_MAP_SIZE - 1);
+}
+#ifdef CONFIG_LINUX_USER
+/* AFL fork server: blocks translated in a child are translated again by
+   the server so that the next children start with them.  */
+extern int afl_tsl_fd;
+void afl_request_tsl(TranslationBlock *tb);
+#endif
+#ifdef CONFIG_USER_ONLY
+void tb_prefetch(CPUArchState *env, target_ulong pc, target_ulong cs_base,
+                 uint64_t flags);
+#endif
+/* Set by the translator when the code it generates refers to data of
+   this process other than the CPU state, so that it cannot be shared.  */
+extern TCG_THREAD int tb_gen_private;
+/* Set when the translator must fill gen_opc_pc[] and friends even
+   though it is not called for cpu_restore_state().  */
+extern TCG_THREAD int tb_gen_insn_starts;
+#ifdef CONFIG_USER_ONLY
+void tb_decode_cache_fork_start(void);
+void tb_decode_cache_fork_end(int child);
+#endif
+/* Guest instruction counting (linux-user record/replay) */
+extern int tb_count_insns;
+extern int tb_insn_bounded;
+extern uint64_t tb_insn_limit;
+void tb_unchain_all(void);
 void tb_link_page(TranslationBlock *tb,
                   tb_page_addr_t phys_pc, tb_page_addr_t phys_page2);
 void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr);
@@ -254,7 +344,15 @@ void tb_set_jmp_target1(uintptr_t jmp_addr, uintptr_t addr);
 static inline void tb_set_jmp_target(TranslationBlock *tb,
                                      int n, uintptr_t addr)
 {
-    uint16_t offset = tb->tb_jmp_offset[n];
+    uint16_t offset;
+
+#ifdef CONFIG_USER_ONLY
+    if (tb->stored) {
+        tb->tb_next[n] = addr;
+        return;
+    }
+#endif
+    offset = tb->tb_jmp_offset[n];
     tb_set_jmp_target1((uintptr_t)(tb->tc_ptr + offset), addr);
 }
 
@@ -289,6 +387,14 @@ TranslationBlock *tb_find_pc(uintptr_t pc_ptr);
 
 extern spinlock_t tb_lock;
 
+/* tb_lock protects tbs[], the physical hash table and the page and jump
+   lists of the TBs.  These take it recursively; the lock is dropped by
+   tb_lock_reset() when cpu_exec() is reentered through longjmp.  In user
+   mode take mmap_lock() first when both are needed.  */
+void tb_lock_enter(void);
+void tb_lock_exit(void);
+void tb_lock_reset(void);
+
 extern int tb_invalidated_flag;
 
 /* The return address may point to the start of the next instruction.
@@ -25,6 +25,7 @@
 #else
 #include <sys/types.h>
 #include <sys/mman.h>
+#include <sys/file.h>
 #endif
 
 #include "qemu-common.h"
@@ -38,8 +39,13 @@
 #include "qemu-timer.h"
 #include "memory.h"
 #include "exec-memory.h"
+#include "disas.h"
 #if defined(CONFIG_USER_ONLY)
 #include <qemu.h>
+#include <sched.h>
+#if defined(CONFIG_LINUX_USER)
+#include <link.h>
+#endif
 #if defined(__FreeBSD__) || defined(__FreeBSD_kernel__)
 #include <sys/param.h>
 #if __FreeBSD_version >= 700104
@@ -58,6 +64,7 @@
 #else /* !CONFIG_USER_ONLY */
 #include "xen-mapcache.h"
 #include "trace.h"
+#include "qmp-commands.h"
 #endif
 
 #include "cputlb.h"
@@ -86,6 +93,8 @@ TranslationBlock *tb_phys_hash[CODE_GEN_PHYS_HASH_SIZE];
 static int nb_tbs;
 /* any access to the tbs or the page table must use this lock */
 spinlock_t tb_lock = SPIN_LOCK_UNLOCKED;
+/* nesting depth of tb_lock in the calling thread */
+static TCG_THREAD int tb_lock_count;
 
 #if defined(__arm__) || defined(__sparc__)
 /* The prologue must be reachable with a direct jump. ARM and Sparc64
@@ -105,9 +114,92 @@ spinlock_t tb_lock = SPIN_LOCK_UNLOCKED;
 uint8_t code_gen_prologue[1024] code_gen_section;
 static uint8_t *code_gen_buffer;
 static unsigned long code_gen_buffer_size;
+/* address space set aside for the buffer to grow into */
+static unsigned long code_gen_buffer_reserved;
+static int code_gen_huge_pages;
 /* threshold to flush the translated code buffer */
 static unsigned long code_gen_buffer_max_size;
-static uint8_t *code_gen_ptr;
+/* bytes of generated code since the last flush, for statistics */
+static unsigned long code_gen_bytes;
+
+/* The buffer is carved into regions, each with its own slice of tbs[]
+   and its own fill pointer.  A thread generates code into a region
+   without holding tb_lock while it marks the region busy, so that TBs
+   within a region are ordered by tc_ptr in tbs[].  It keeps to the same
+   region while that has room, then takes a fresh one, or shares one that
+   still has room once all have been handed out.  The buffer is flushed
+   only when no region has room left.  System emulation translates from
+   a single thread and uses one region covering the whole buffer.  */
+static unsigned long code_gen_region_size;
+/* threshold to leave a region, leaving room for the largest TB */
+static unsigned long code_gen_region_max_size;
+static int code_gen_nb_regions;
+static int code_gen_region_max_blocks;
+static int code_gen_regions_used;
+static int *code_gen_region_nb_tbs;
+/* where the next TB of each region goes */
+static uint8_t **code_gen_region_ptr;
+/* set while a thread generates code into the region */
+static uint8_t *code_gen_region_busy;
+/* region last used by the calling thread, valid while tb_flush_count
+   is unchanged */
+static TCG_THREAD int code_gen_region = -1;
+static TCG_THREAD int code_gen_region_flush;
+/* TB the calling thread is generating code for */
+static TCG_THREAD TranslationBlock *code_gen_tb;
+
+#if defined(CONFIG_LINUX_USER) && defined(TARGET_HAS_TB_STORE) && \
+    defined(TARGET_HAS_INSN_RECORDS) && \
+    (defined(__i386__) || defined(__x86_64__))
+/* Translated code can be shared between processes through a file that
+   all of them map at the same address.  Only on x86 hosts, where the
+   blocks of the private buffer reach the store with 32-bit jumps.  */
+#define USE_TB_STORE
+#endif
+
+#ifdef USE_TB_STORE
+typedef struct TBStoreHeader {
+    char magic[8];
+    /* the store may only be used by processes where these match */
+    char target[16];
+    uint64_t entry_size;
+    uint64_t prologue;      /* address of code_gen_prologue */
+    uint8_t build_id[32];   /* tb_store_build_id() */
+    uint64_t guest_base;
+    uint64_t config;        /* cpu_tb_store_config() */
+    /* layout, fixed when the file is created */
+    uint64_t size;
+    uint64_t base;          /* address the file is mapped at */
+    uint64_t buckets;       /* offsets from base */
+    uint64_t entries;
+    uint64_t code;
+    uint32_t max_entries;
+    /* only changed with the file locked */
+    uint32_t nb_entries;
+    uint64_t code_used;
+} TBStoreHeader;
+
+typedef struct TBStoreEntry {
+    uint32_t next;          /* index + 1 of the next entry in the bucket */
+    uint32_t guest_code;    /* offset of a copy of the guest code */
+    TranslationBlock tb;    /* as translated, without the list links */
+} TBStoreEntry;
+
+static int tb_store_fd = -1;
+/* the mapping starts with the header */
+static TBStoreHeader *tb_store;
+static uint32_t *tb_store_buckets;
+static TBStoreEntry *tb_store_entries;
+/* The TranslationBlock of each entry in this process.  The code refers
+   to it, so it lives at the same address in all processes, right after
+   the file.  */
+static TranslationBlock *tb_store_tbs;
+/* tb_flush_count + 1 when the block of an entry was set up */
+static int *tb_store_claimed;
+/* set while the calling thread translates into the store */
+static TCG_THREAD int tb_store_locked;
+static void tb_store_unlock(void);
+#endif
 
 //#if !defined(CONFIG_USER_ONLY)
 #if !defined(CONFIG_USER_ONLY) || defined(CONFIG_USER_KVM)
@@ -224,6 +316,36 @@ static void memory_map_init(void);
 /* statistics */
 static int tb_flush_count;
 static int tb_phys_invalidate_count;
+/* time of the last flush and how long the buffer lasted before it */
+static int64_t tb_flush_time;
+static int64_t tb_flush_interval;
+
+/* TB profiling.  When tb_profile_top is non zero, each TB counts its
+   entries in tb->exec_count; the counts of flushed or invalidated TBs
+   are accumulated per guest PC in tb_profile_table.  */
+int tb_profile_top;
+static GHashTable *tb_profile_table;
+static FILE *tb_perfmap_file;
+
+/* Guest instruction counting.  When tb_count_insns is set each TB adds
+   its length to env->insn_count on entry.  When tb_insn_bounded is also
+   set, cpu_exec() returns EXCP_INTERRUPT instead of entering a TB once
+   env->insn_count has reached tb_insn_limit, and stops chaining TBs so
+   that every block boundary passes through that check.  Whoever sets
+   tb_insn_bounded must call tb_unchain_all() first.  */
+int tb_count_insns;
+int tb_insn_bounded;
+uint64_t tb_insn_limit = UINT64_MAX;
+
+TCG_THREAD int tb_gen_private;
+
+uint8_t *tb_coverage_map;
+target_ulong tb_coverage_start, tb_coverage_end;
+
+typedef struct TBProfileEntry {
+    uint64_t pc;
+    uint64_t count;
+} TBProfileEntry;
 
 #ifdef _WIN32
 static void map_exec(void *addr, long size)
@@ -504,6 +626,14 @@ bool memory_region_is_unassigned(MemoryRegion *mr)
 #endif
 
 #define DEFAULT_CODE_GEN_BUFFER_SIZE (32 * 1024 * 1024)
+/* When no size is given the buffer starts at the default size and
+   doubles, up to this much address space reserved up front, each time
+   it fills up faster than CODE_GEN_GROW_INTERVAL.  Pages of the
+   reserve that are never written cost no memory.  */
+#define MAX_CODE_GEN_BUFFER_SIZE (256 * 1024 * 1024)
+#define CODE_GEN_GROW_INTERVAL (2 * 1000000000LL)
+/* number of code regions threads can translate into in parallel */
+#define CODE_GEN_REGIONS 32
 
 #if defined(CONFIG_USER_ONLY)
 /* Currently it is not recommended to allocate big chunks of data in
@@ -512,28 +642,78 @@ bool memory_region_is_unassigned(MemoryRegion *mr)
 #endif
 
 #ifdef USE_STATIC_CODE_GEN_BUFFER
-static uint8_t static_code_gen_buffer[DEFAULT_CODE_GEN_BUFFER_SIZE]
+#if HOST_LONG_BITS == 64
+#define STATIC_CODE_GEN_BUFFER_SIZE (4 * DEFAULT_CODE_GEN_BUFFER_SIZE)
+#else
+/* leave the address space to the guest */
+#define STATIC_CODE_GEN_BUFFER_SIZE DEFAULT_CODE_GEN_BUFFER_SIZE
+#endif
+static uint8_t static_code_gen_buffer[STATIC_CODE_GEN_BUFFER_SIZE]
                __attribute__((aligned (CODE_GEN_ALIGN)));
 #endif
 
+/* Use 'size' bytes of the reserved buffer.  Only called when no
+   translated code is live.  */
+static void code_gen_resize(unsigned long size)
+{
+    code_gen_buffer_size = size;
+    code_gen_buffer_max_size = code_gen_buffer_size -
+        (TCG_MAX_OP_SIZE * OPC_BUF_SIZE);
+    code_gen_region_size = code_gen_buffer_size;
+#ifdef CONFIG_LINUX_USER
+    code_gen_region_size = MAX(code_gen_buffer_size / CODE_GEN_REGIONS,
+                               4 * (code_gen_buffer_size -
+                                    code_gen_buffer_max_size));
+    code_gen_region_size = MIN(code_gen_region_size, code_gen_buffer_size) &
+        ~(CODE_GEN_ALIGN - 1);
+#endif
+    code_gen_nb_regions = MIN(code_gen_buffer_size / code_gen_region_size,
+                              CODE_GEN_REGIONS);
+    code_gen_region_max_size = code_gen_region_size -
+        (code_gen_buffer_size - code_gen_buffer_max_size);
+    code_gen_max_blocks = code_gen_buffer_size / CODE_GEN_AVG_BLOCK_SIZE;
+    code_gen_region_max_blocks = code_gen_max_blocks / code_gen_nb_regions;
+}
+
+/* Ask for the buffer to be backed by huge pages, which cuts the iTLB
+   misses of jumping around a large amount of translated code.  */
+static void code_gen_advise(void)
+{
+    uintptr_t start, end;
+
+    start = ((uintptr_t)code_gen_buffer + qemu_real_host_page_size - 1) &
+        ~(uintptr_t)(qemu_real_host_page_size - 1);
+    end = ((uintptr_t)code_gen_buffer + code_gen_buffer_reserved) &
+        ~(uintptr_t)(qemu_real_host_page_size - 1);
+    code_gen_huge_pages = end > start &&
+        qemu_madvise((void *)start, end - start, QEMU_MADV_HUGEPAGE) == 0;
+}
+
 static void code_gen_alloc(unsigned long tb_size)
 {
+    unsigned long size;
+
 #ifdef USE_STATIC_CODE_GEN_BUFFER
     code_gen_buffer = static_code_gen_buffer;
-    code_gen_buffer_size = DEFAULT_CODE_GEN_BUFFER_SIZE;
-    map_exec(code_gen_buffer, code_gen_buffer_size);
+    code_gen_buffer_reserved = STATIC_CODE_GEN_BUFFER_SIZE;
+    size = DEFAULT_CODE_GEN_BUFFER_SIZE;
+    map_exec(code_gen_buffer, code_gen_buffer_reserved);
 #else
-    code_gen_buffer_size = tb_size;
-    if (code_gen_buffer_size == 0) {
+    size = tb_size;
+    if (size == 0) {
 #if defined(CONFIG_USER_ONLY)
-        code_gen_buffer_size = DEFAULT_CODE_GEN_BUFFER_SIZE;
+        size = DEFAULT_CODE_GEN_BUFFER_SIZE;
 #else
         /* XXX: needs adjustments */
-        code_gen_buffer_size = (unsigned long)(ram_size / 4);
+        size = (unsigned long)(ram_size / 4);
 #endif
     }
-    if (code_gen_buffer_size < MIN_CODE_GEN_BUFFER_SIZE)
-        code_gen_buffer_size = MIN_CODE_GEN_BUFFER_SIZE;
+    if (size < MIN_CODE_GEN_BUFFER_SIZE)
+        size = MIN_CODE_GEN_BUFFER_SIZE;
+    code_gen_buffer_reserved = size;
+    if (tb_size == 0 && size < MAX_CODE_GEN_BUFFER_SIZE) {
+        code_gen_buffer_reserved = MAX_CODE_GEN_BUFFER_SIZE;
+    }
     /* The code gen buffer location may have constraints depending on
        the host cpu and OS */
 #if defined(__linux__) 
@@ -541,30 +721,30 @@ static void code_gen_alloc(unsigned long tb_size)
         int flags;
         void *start = NULL;
 
-        flags = MAP_PRIVATE | MAP_ANONYMOUS;
+        flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
 #if defined(__x86_64__)
         flags |= MAP_32BIT;
         /* Cannot map more than that */
-        if (code_gen_buffer_size > (800 * 1024 * 1024))
-            code_gen_buffer_size = (800 * 1024 * 1024);
+        if (code_gen_buffer_reserved > (800 * 1024 * 1024))
+            code_gen_buffer_reserved = (800 * 1024 * 1024);
 #elif defined(__sparc__) && HOST_LONG_BITS == 64
         // Map the buffer below 2G, so we can use direct calls and branches
         start = (void *) 0x40000000UL;
-        if (code_gen_buffer_size > (512 * 1024 * 1024))
-            code_gen_buffer_size = (512 * 1024 * 1024);
+        if (code_gen_buffer_reserved > (512 * 1024 * 1024))
+            code_gen_buffer_reserved = (512 * 1024 * 1024);
 #elif defined(__arm__)
         /* Keep the buffer no bigger than 16MB to branch between blocks */
-        if (code_gen_buffer_size > 16 * 1024 * 1024)
-            code_gen_buffer_size = 16 * 1024 * 1024;
+        if (code_gen_buffer_reserved > 16 * 1024 * 1024)
+            code_gen_buffer_reserved = 16 * 1024 * 1024;
 #elif defined(__s390x__)
         /* Map the buffer so that we can use direct calls and branches.  */
         /* We have a +- 4GB range on the branches; leave some slop.  */
-        if (code_gen_buffer_size > (3ul * 1024 * 1024 * 1024)) {
-            code_gen_buffer_size = 3ul * 1024 * 1024 * 1024;
+        if (code_gen_buffer_reserved > (3ul * 1024 * 1024 * 1024)) {
+            code_gen_buffer_reserved = 3ul * 1024 * 1024 * 1024;
         }
         start = (void *)0x90000000UL;
 #endif
-        code_gen_buffer = mmap(start, code_gen_buffer_size,
+        code_gen_buffer = mmap(start, code_gen_buffer_reserved,
                                PROT_WRITE | PROT_READ | PROT_EXEC,
                                flags, -1, 0);
         if (code_gen_buffer == MAP_FAILED) {
@@ -585,16 +765,16 @@ static void code_gen_alloc(unsigned long tb_size)
         flags |= MAP_FIXED;
         addr = (void *)0x40000000;
         /* Cannot map more than that */
-        if (code_gen_buffer_size > (800 * 1024 * 1024))
-            code_gen_buffer_size = (800 * 1024 * 1024);
+        if (code_gen_buffer_reserved > (800 * 1024 * 1024))
+            code_gen_buffer_reserved = (800 * 1024 * 1024);
 #elif defined(__sparc__) && HOST_LONG_BITS == 64
         // Map the buffer below 2G, so we can use direct calls and branches
         addr = (void *) 0x40000000UL;
-        if (code_gen_buffer_size > (512 * 1024 * 1024)) {
-            code_gen_buffer_size = (512 * 1024 * 1024);
+        if (code_gen_buffer_reserved > (512 * 1024 * 1024)) {
+            code_gen_buffer_reserved = (512 * 1024 * 1024);
         }
 #endif
-        code_gen_buffer = mmap(addr, code_gen_buffer_size,
+        code_gen_buffer = mmap(addr, code_gen_buffer_reserved,
                                PROT_WRITE | PROT_READ | PROT_EXEC, 
                                flags, -1, 0);
         if (code_gen_buffer == MAP_FAILED) {
@@ -603,15 +783,20 @@ static void code_gen_alloc(unsigned long tb_size)
         }
     }
 #else
-    code_gen_buffer = g_malloc(code_gen_buffer_size);
-    map_exec(code_gen_buffer, code_gen_buffer_size);
+    /* no reserve: the whole allocation would be committed */
+    code_gen_buffer_reserved = size;
+    code_gen_buffer = g_malloc(code_gen_buffer_reserved);
+    map_exec(code_gen_buffer, code_gen_buffer_reserved);
 #endif
+    size = MIN(size, code_gen_buffer_reserved);
 #endif /* !USE_STATIC_CODE_GEN_BUFFER */
     map_exec(code_gen_prologue, sizeof(code_gen_prologue));
-    code_gen_buffer_max_size = code_gen_buffer_size -
-        (TCG_MAX_OP_SIZE * OPC_BUF_SIZE);
-    code_gen_max_blocks = code_gen_buffer_size / CODE_GEN_AVG_BLOCK_SIZE;
-    tbs = g_malloc(code_gen_max_blocks * sizeof(TranslationBlock));
+    code_gen_resize(size);
+    tbs = g_malloc0((code_gen_buffer_reserved / CODE_GEN_AVG_BLOCK_SIZE) *
+                    sizeof(TranslationBlock));
+    code_gen_region_nb_tbs = g_malloc0(CODE_GEN_REGIONS * sizeof(int));
+    code_gen_region_ptr = g_malloc0(CODE_GEN_REGIONS * sizeof(uint8_t *));
+    code_gen_region_busy = g_malloc0(CODE_GEN_REGIONS);
 }
 
 /* Must be called before using the QEMU cpus. 'tb_size' is the size
@@ -621,9 +806,9 @@ void tcg_exec_init(unsigned long tb_size)
 {
     cpu_gen_init();
     code_gen_alloc(tb_size);
-    code_gen_ptr = code_gen_buffer;
-    tcg_register_jit(code_gen_buffer, code_gen_buffer_size);
+    tcg_register_jit(code_gen_buffer, code_gen_buffer_reserved);
     page_init();
+    code_gen_advise();
 #if !defined(CONFIG_USER_ONLY) || !defined(CONFIG_USE_GUEST_BASE)
     /* There's no guest base to take into account, so go ahead and
        initialize the prologue now.  */
@@ -721,30 +906,173 @@ void cpu_exec_init(CPUArchState *env)
 #endif
 }
 
-/* Allocate a new translation block. Flush the translation buffer if
-   too many translation blocks or too much generated code. */
-static TranslationBlock *tb_alloc(target_ulong pc)
+void tb_lock_enter(void)
+{
+    if (tb_lock_count++ == 0) {
+        spin_lock(&tb_lock);
+    }
+}
+
+void tb_lock_exit(void)
+{
+    if (--tb_lock_count == 0) {
+        spin_unlock(&tb_lock);
+    }
+}
+
+static inline uint8_t *code_gen_region_start(int region)
+{
+    return code_gen_buffer + (unsigned long)region * code_gen_region_size;
+}
+
+static inline int code_gen_region_of(TranslationBlock *tb)
+{
+    return (tb - tbs) / code_gen_region_max_blocks;
+}
+
+static inline int code_gen_region_room(int r)
+{
+    return code_gen_region_nb_tbs[r] < code_gen_region_max_blocks &&
+        code_gen_region_ptr[r] - code_gen_region_start(r) <
+        code_gen_region_max_size;
+}
+
+/* Pick the region the calling thread generates its next TB into: the
+   one it used last if it still has room, else a fresh one, else another
+   one with room that no thread is writing to.  Return -1 if there is
+   none, setting '*busy' if some region with room is only in use.  Must
+   be called with tb_lock held.  */
+static int code_gen_region_pick(int *busy)
+{
+    int i, r = code_gen_region;
+
+    *busy = 0;
+    if (r >= 0 && code_gen_region_flush == tb_flush_count &&
+        !code_gen_region_busy[r] && code_gen_region_room(r)) {
+        return r;
+    }
+    if (code_gen_regions_used < code_gen_nb_regions) {
+        r = code_gen_regions_used++;
+        code_gen_region_ptr[r] = code_gen_region_start(r);
+    } else {
+        /* start after our last region to spread threads around */
+        if (code_gen_region_flush != tb_flush_count) {
+            r = -1;
+        }
+        for (i = 0; i < code_gen_regions_used; i++) {
+            r = (r + 1) % code_gen_regions_used;
+            if (code_gen_region_room(r)) {
+                if (!code_gen_region_busy[r]) {
+                    break;
+                }
+                *busy = 1;
+            }
+        }
+        if (i == code_gen_regions_used) {
+            return -1;
+        }
+    }
+    code_gen_region = r;
+    code_gen_region_flush = tb_flush_count;
+    return r;
+}
+
+/* Allocate a new translation block and mark its region busy until
+   code_gen_region_release().  Return NULL if no region has room for
+   it, which means the buffer must be flushed unless '*busy' is set.
+   Must be called with tb_lock held.  */
+static TranslationBlock *tb_alloc(target_ulong pc, int *busy)
 {
     TranslationBlock *tb;
+    int r;
 
-    if (nb_tbs >= code_gen_max_blocks ||
-        (code_gen_ptr - code_gen_buffer) >= code_gen_buffer_max_size)
+    r = code_gen_region_pick(busy);
+    if (r < 0) {
         return NULL;
-    tb = &tbs[nb_tbs++];
+    }
+    tb = &tbs[r * code_gen_region_max_blocks + code_gen_region_nb_tbs[r]++];
+    nb_tbs++;
+    code_gen_region_busy[r] = 1;
+    tb->tc_ptr = code_gen_region_ptr[r];
     tb->pc = pc;
     tb->cflags = 0;
+    tb->invalid = 0;
+    tb->stored = 0;
+    tb->exec_count = 0;
+    g_free(tb->disas);
+    tb->disas = NULL;
+#ifdef TARGET_HAS_INSN_RECORDS
+    tb->insn_records = NULL;
+#endif
     return tb;
 }
 
+/* The code of 'tb' takes 'code_bytes' from its region: let the next TB
+   go after it.  Must be called with tb_lock held.  */
+static void code_gen_region_release(TranslationBlock *tb,
+                                    unsigned long code_bytes)
+{
+    int r = code_gen_region_of(tb);
+
+    code_gen_region_ptr[r] = tb->tc_ptr + code_bytes;
+    code_gen_region_busy[r] = 0;
+}
+
+/* Drop 'tb', whose generation was interrupted by a guest fault.  It is
+   the last TB of its region since nobody else writes to a busy region.
+   Must be called with tb_lock held.  */
+static void code_gen_region_abort(TranslationBlock *tb)
+{
+    int r = code_gen_region_of(tb);
+
+    if (code_gen_region_busy[r] &&
+        tb == &tbs[r * code_gen_region_max_blocks +
+                   code_gen_region_nb_tbs[r] - 1]) {
+        code_gen_region_nb_tbs[r]--;
+        nb_tbs--;
+    }
+    code_gen_region_busy[r] = 0;
+}
+
 void tb_free(TranslationBlock *tb)
 {
+    int r;
+
     /* In practice this is mostly used for single use temporary TB
        Ignore the hard cases and just back up if this TB happens to
-       be the last one generated.  */
-    if (nb_tbs > 0 && tb == &tbs[nb_tbs - 1]) {
-        code_gen_ptr = tb->tc_ptr;
+       be the last one generated in its region.  */
+    tb_lock_enter();
+    r = code_gen_region_of(tb);
+    if (tb >= tbs && r < code_gen_regions_used &&
+        code_gen_region_nb_tbs[r] > 0 &&
+        tb == &tbs[r * code_gen_region_max_blocks +
+                   code_gen_region_nb_tbs[r] - 1]) {
+        code_gen_bytes -= code_gen_region_ptr[r] - tb->tc_ptr;
+        code_gen_region_ptr[r] = tb->tc_ptr;
+        code_gen_region_nb_tbs[r]--;
         nb_tbs--;
     }
+    tb_lock_exit();
+}
+
+void tb_lock_reset(void)
+{
+#ifdef USE_TB_STORE
+    /* a guest fault while translating into the store */
+    if (tb_store_locked) {
+        tb_store_unlock();
+    }
+#endif
+    if (code_gen_tb) {
+        /* a guest fault while generating code */
+        tb_lock_enter();
+        code_gen_region_abort(code_gen_tb);
+        code_gen_tb = NULL;
+    }
+    if (tb_lock_count) {
+        tb_lock_count = 0;
+        spin_unlock(&tb_lock);
+    }
 }
 
 static inline void invalidate_page_bitmap(PageDesc *p)
@@ -756,6 +1084,148 @@ static inline void invalidate_page_bitmap(PageDesc *p)
     p->code_write_count = 0;
 }
 
+/* Move the execution count of TB into the per guest PC table.  */
+static void tb_profile_fold(TranslationBlock *tb)
+{
+    TBProfileEntry *e;
+    uint64_t pc = tb->pc;
+
+    if (tb->exec_count == 0) {
+        return;
+    }
+    e = g_hash_table_lookup(tb_profile_table, &pc);
+    if (!e) {
+        e = g_malloc0(sizeof(*e));
+        e->pc = pc;
+        g_hash_table_insert(tb_profile_table, &e->pc, e);
+    }
+    e->count += tb->exec_count;
+    tb->exec_count = 0;
+}
+
+static void tb_profile_fold_all(void)
+{
+    TranslationBlock *first;
+    int r, i;
+
+    for (r = 0; r < code_gen_regions_used; r++) {
+        first = &tbs[r * code_gen_region_max_blocks];
+        for (i = 0; i < code_gen_region_nb_tbs[r]; i++) {
+            tb_profile_fold(&first[i]);
+        }
+    }
+}
+
+static void tb_perfmap_add(TranslationBlock *tb, int code_size)
+{
+    const char *symbol = lookup_symbol(tb->pc);
+
+    fprintf(tb_perfmap_file, "%" PRIxPTR " %x guest:" TARGET_FMT_lx "%s%s\n",
+            (uintptr_t)tb->tc_ptr, code_size, tb->pc,
+            symbol[0] ? ":" : "", symbol);
+}
+
+/* Forget the map entries of a flushed buffer: the addresses are about
+   to be reused by other blocks and perf would attribute their samples
+   to whatever entry it finds first.  */
+static void tb_perfmap_flush(void)
+{
+    fflush(tb_perfmap_file);
+    if (ftruncate(fileno(tb_perfmap_file), 0) < 0) {
+        return;
+    }
+    rewind(tb_perfmap_file);
+}
+
+static void tb_profile_atexit(void)
+{
+    static bool registered;
+
+    if (!registered) {
+        registered = true;
+        atexit(tb_profile_report);
+    }
+}
+
+/* Write JIT symbols to /tmp/perf-<pid>.map so that host perf can
+   attribute samples in the code buffer to guest code.  */
+void tb_perfmap_enable(void)
+{
+    char path[64];
+
+    snprintf(path, sizeof(path), "/tmp/perf-%d.map", (int)getpid());
+    tb_perfmap_file = fopen(path, "w");
+    if (!tb_perfmap_file) {
+        fprintf(stderr, "qemu: could not open %s: %s\n", path,
+                strerror(errno));
+        return;
+    }
+    tb_profile_atexit();
+}
+
+/* Count TB entries and report the TOP most executed blocks at exit.  */
+void tb_profile_enable(int top)
+{
+    tb_profile_top = top;
+    tb_profile_table = g_hash_table_new_full(g_int64_hash, g_int64_equal,
+                                             NULL, g_free);
+    tb_profile_atexit();
+}
+
+static int tb_profile_cmp(const void *a, const void *b)
+{
+    const TBProfileEntry *ea = *(const TBProfileEntry **)a;
+    const TBProfileEntry *eb = *(const TBProfileEntry **)b;
+
+    if (ea->count != eb->count) {
+        return ea->count > eb->count ? -1 : 1;
+    }
+    return ea->pc < eb->pc ? -1 : ea->pc > eb->pc;
+}
+
+static void tb_profile_collect(gpointer key, gpointer value, gpointer opaque)
+{
+    g_ptr_array_add(opaque, value);
+}
+
+/* Flush the perf map and print the hot block report.  This may be
+   called both from the exit syscalls and from atexit().  */
+void tb_profile_report(void)
+{
+    static bool reported;
+    GPtrArray *entries;
+    uint64_t total = 0;
+    int i;
+
+    if (tb_perfmap_file) {
+        fflush(tb_perfmap_file);
+    }
+    if (!tb_profile_top || reported) {
+        return;
+    }
+    reported = true;
+
+    tb_profile_fold_all();
+    entries = g_ptr_array_new();
+    g_hash_table_foreach(tb_profile_table, tb_profile_collect, entries);
+    for (i = 0; i < entries->len; i++) {
+        total += ((TBProfileEntry *)g_ptr_array_index(entries, i))->count;
+    }
+    qsort(entries->pdata, entries->len, sizeof(gpointer), tb_profile_cmp);
+
+    fprintf(stderr, "TB profile: %u blocks, %" PRIu64 " executions\n",
+            entries->len, total);
+    fprintf(stderr, "%-18s %20s %7s  %s\n", "guest pc", "count", "%",
+            "symbol");
+    for (i = 0; i < entries->len && i < tb_profile_top; i++) {
+        TBProfileEntry *e = g_ptr_array_index(entries, i);
+        fprintf(stderr, "0x%016" PRIx64 " %20" PRIu64 " %6.2f%%  %s\n",
+                e->pc, e->count, total ? e->count * 100.0 / total : 0.0,
+                lookup_symbol(e->pc));
+    }
+    g_ptr_array_free(entries, TRUE);
+}
+
 /* Set to NULL all the 'first_tb' fields in all PageDescs. */
 
 static void page_flush_tb_1 (int level, void **lp)
@@ -787,21 +1257,64 @@ static void page_flush_tb(void)
     }
 }
 
-/* flush all the translation blocks */
-/* XXX: tb_flush is currently not thread safe */
-void tb_flush(CPUArchState *env1)
+#ifdef CONFIG_USER_ONLY
+int tb_flush_pending;
+
+/* Have every CPU leave the generated code so that the buffer can be
+   flushed by the first one to reach a point where none of them runs it
+   (cpu_exec_start/cpu_exec_end in linux-user).  */
+static void tb_flush_request(void)
 {
     CPUArchState *env;
+
+    tb_flush_pending = 1;
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        cpu_exit(env);
+    }
+}
+
+/* Flush the translation buffer.  No other CPU may be executing
+   generated code.  */
+void tb_flush_exclusive(CPUArchState *env1)
+#else
+static void tb_flush_exclusive(CPUArchState *env1)
+#endif
+{
+    CPUArchState *env;
+    int64_t now;
+    int full;
 #if defined(DEBUG_FLUSH)
     fprintf(stderr, "qemu: flush code_size=%ld nb_tbs=%d avg_tb_size=%ld\n",
-           (unsigned long)(code_gen_ptr - code_gen_buffer),
-           nb_tbs, nb_tbs > 0 ?
-           ((unsigned long)(code_gen_ptr - code_gen_buffer)) / nb_tbs : 0);
+           code_gen_bytes, nb_tbs, nb_tbs > 0 ? code_gen_bytes / nb_tbs : 0);
 #endif
-    if ((unsigned long)(code_gen_ptr - code_gen_buffer) > code_gen_buffer_size)
+    if (code_gen_bytes > code_gen_buffer_size)
         cpu_abort(env1, "Internal error: code buffer overflow\n");
 
+    tb_lock_enter();
+    if (tb_profile_top) {
+        tb_profile_fold_all();
+    }
+    if (tb_perfmap_file) {
+        tb_perfmap_flush();
+    }
+    /* flushes on reset or for debugging happen with the buffer mostly
+       empty and say nothing about the working set */
+    full = code_gen_bytes >= code_gen_buffer_max_size / 2 ||
+        nb_tbs >= code_gen_max_blocks / 2;
+    now = get_clock_realtime();
+    if (full && tb_flush_time) {
+        tb_flush_interval = now - tb_flush_time;
+        if (tb_flush_interval < CODE_GEN_GROW_INTERVAL &&
+            code_gen_buffer_size < code_gen_buffer_reserved) {
+            code_gen_resize(MIN(code_gen_buffer_size * 2,
+                                code_gen_buffer_reserved));
+        }
+    }
+    tb_flush_time = now;
     nb_tbs = 0;
+    code_gen_regions_used = 0;
+    memset(code_gen_region_nb_tbs, 0, CODE_GEN_REGIONS * sizeof(int));
+    memset(code_gen_region_busy, 0, CODE_GEN_REGIONS);
 
     for(env = first_cpu; env != NULL; env = env->next_cpu) {
         memset (env->tb_jmp_cache, 0, TB_JMP_CACHE_SIZE * sizeof (void *));
@@ -810,10 +1323,28 @@ void tb_flush(CPUArchState *env1)
     memset (tb_phys_hash, 0, CODE_GEN_PHYS_HASH_SIZE * sizeof (void *));
     page_flush_tb();
 
-    code_gen_ptr = code_gen_buffer;
+    code_gen_bytes = 0;
     /* XXX: flush processor icache at this point if cache flush is
        expensive */
     tb_flush_count++;
+#ifdef CONFIG_USER_ONLY
+    tb_flush_pending = 0;
+#endif
+    tb_lock_exit();
+}
+
+/* flush all the translation blocks */
+void tb_flush(CPUArchState *env1)
+{
+#ifdef CONFIG_USER_ONLY
+    /* Other threads may be running code from the buffer: defer the
+       flush until they are all stopped.  */
+    if (first_cpu && first_cpu->next_cpu) {
+        tb_flush_request();
+        return;
+    }
+#endif
+    tb_flush_exclusive(env1);
 }
 
 #ifdef DEBUG_TB_CHECK
@@ -922,6 +1453,29 @@ static inline void tb_reset_jump(TranslationBlock *tb, int n)
     tb_set_jmp_target(tb, n, (uintptr_t)(tb->tc_ptr + tb->tb_next_offset[n]));
 }
 
+/* Undo every direct jump between blocks, so that each block returns to
+   cpu_exec() again.  Called when tb_insn_bounded gets set.  */
+void tb_unchain_all(void)
+{
+    TranslationBlock *tb;
+    int r, i, n;
+
+    tb_lock_enter();
+    for (r = 0; r < code_gen_regions_used; r++) {
+        tb = &tbs[r * code_gen_region_max_blocks];
+        for (i = 0; i < code_gen_region_nb_tbs[r]; i++, tb++) {
+            for (n = 0; n < 2; n++) {
+                if (tb->jmp_next[n]) {
+                    tb_reset_jump(tb, n);
+                    tb->jmp_next[n] = NULL;
+                }
+            }
+            tb->jmp_first = (TranslationBlock *)((uintptr_t)tb | 2);
+        }
+    }
+    tb_lock_exit();
+}
+
 void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
 {
     CPUArchState *env;
@@ -930,6 +1484,7 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
     tb_page_addr_t phys_pc;
     TranslationBlock *tb1, *tb2;
 
+    tb_lock_enter();
     /* remove the TB from the hash list */
     phys_pc = tb->page_addr[0] + (tb->pc & ~TARGET_PAGE_MASK);
     h = tb_phys_hash_func(phys_pc);
@@ -949,6 +1504,7 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
     }
 
     tb_invalidated_flag = 1;
+    tb->invalid = 1;
 
     /* remove the TB from the hash list */
     h = tb_jmp_cache_hash_func(tb->pc);
@@ -961,7 +1517,8 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
     tb_jmp_remove(tb, 0);
     tb_jmp_remove(tb, 1);
 
-    /* suppress any remaining jumps to this TB */
+    /* suppress any remaining jumps to this TB.  In user mode they may
+       come from TBs on any page, not only from the invalidated one. */
     tb1 = tb->jmp_first;
     for(;;) {
         n1 = (uintptr_t)tb1 & 3;
@@ -975,7 +1532,11 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
     }
     tb->jmp_first = (TranslationBlock *)((uintptr_t)tb | 2); /* fail safe */
 
+    if (tb_profile_top) {
+        tb_profile_fold(tb);
+    }
     tb_phys_invalidate_count++;
+    tb_lock_exit();
 }
 
 static inline void set_bits(uint8_t *tab, int start, int len)
@@ -1033,42 +1594,487 @@ static void build_page_bitmap(PageDesc *p)
     }
 }
 
+#ifdef USE_TB_STORE
+
+#define TB_STORE_MAGIC "QEMUTBS2"
+#define TB_STORE_SIZE (256 * 1024 * 1024)
+#define TB_STORE_BUCKETS (64 * 1024)
+/* bytes of the store used by a block on average, code included */
+#define TB_STORE_AVG_BLOCK_SIZE 1024
+/* room needed to translate one block: code, insn records, guest code */
+#define TB_STORE_MARGIN (TCG_MAX_OP_SIZE * OPC_BUF_SIZE +                 \
+                         (OPC_BUF_SIZE + 2) * sizeof(TBInsnRecord) +      \
+                         2 * TARGET_PAGE_SIZE)
+
+static inline unsigned int tb_store_hash(target_ulong pc)
+{
+    return ((pc >> 1) ^ (pc >> 17)) & (TB_STORE_BUCKETS - 1);
+}
+
+/* Whether blocks translated now are the same in every process.  */
+static inline int tb_store_usable(CPUArchState *env)
+{
+    return tb_store && !singlestep && !env->singlestep_enabled &&
+        QTAILQ_EMPTY(&env->breakpoints) && !tb_profile_top &&
+        !tb_count_insns && !tb_coverage_map;
+}
+
+static void tb_store_unlock(void)
+{
+    mprotect(tb_store, tb_store->size, PROT_READ | PROT_EXEC);
+    flock(tb_store_fd, LOCK_UN);
+    tb_store_locked = 0;
+}
+
+/* Give this process the block of entry 'i'.  Returns NULL if it is
+   already set up, in which case tb_store_tbs[i] is linked or about to
+   be.  */
+static TranslationBlock *tb_store_claim(uint32_t i)
+{
+    TranslationBlock *tb = &tb_store_tbs[i];
+
+    if (tb_store_claimed[i] == tb_flush_count + 1 && !tb->invalid) {
+        return NULL;
+    }
+    tb_store_claimed[i] = tb_flush_count + 1;
+    return tb;
+}
+
+/* Look for a block translated by any process for the guest code at
+   'pc'.  The copy of the guest code kept with each entry must match
+   the code this process has there, which is only compared when it is
+   mapped readable.  Called with mmap_lock and tb_lock held.  */
+static TranslationBlock *tb_store_lookup(target_ulong pc,
+                                         target_ulong cs_base, int flags,
+                                         int *link)
+{
+    TBStoreEntry *e;
+    TranslationBlock *tb;
+    target_ulong last;
+    uint32_t i;
+
+    i = tb_store_buckets[tb_store_hash(pc)];
+    while (i != 0) {
+        smp_rmb();
+        e = &tb_store_entries[i - 1];
+        last = pc + e->tb.size - 1;
+        if (e->tb.pc == pc && e->tb.cs_base == cs_base &&
+            e->tb.flags == flags &&
+            (page_get_flags(pc) & PAGE_READ) &&
+            (page_get_flags(last) & PAGE_READ) &&
+            memcmp(g2h(pc), (uint8_t *)tb_store + e->guest_code,
+                   e->tb.size) == 0) {
+            tb = tb_store_claim(i - 1);
+            *link = tb != NULL;
+            if (!tb) {
+                return &tb_store_tbs[i - 1];
+            }
+            *tb = e->tb;
+            tb->invalid = 0;
+            tb->exec_count = 0;
+            return tb;
+        }
+        i = e->next;
+    }
+    return NULL;
+}
+
+/* Translate a block straight into the store and publish it.  Only code
+   from pages the guest cannot write is published, so that the copy of
+   the guest code matches what was translated.  Called with tb_lock
+   held.  Returns NULL if the block must be translated privately.  */
+static TranslationBlock *tb_store_gen(CPUArchState *env, target_ulong pc,
+                                      target_ulong cs_base, int flags)
+{
+    TBStoreHeader *h = tb_store;
+    TBStoreEntry *e;
+    TranslationBlock *tb;
+    uint64_t guest_code;
+    uint32_t i, b;
+    int code_size;
+
+    if (h->nb_entries >= h->max_entries ||
+        h->code_used + TB_STORE_MARGIN > h->size ||
+        (page_get_flags(pc) & PAGE_WRITE_ORG)) {
+        return NULL;
+    }
+    /* never wait for another process */
+    if (flock(tb_store_fd, LOCK_EX | LOCK_NB) < 0) {
+        return NULL;
+    }
+    tb_store_locked = 1;
+    tb = NULL;
+    i = h->nb_entries;
+    if (i >= h->max_entries || h->code_used + TB_STORE_MARGIN > h->size) {
+        goto out;
+    }
+    mprotect(h, h->size, PROT_READ | PROT_WRITE | PROT_EXEC);
+    tb = &tb_store_tbs[i];
+    tb->pc = pc;
+    tb->cs_base = cs_base;
+    tb->flags = flags;
+    tb->cflags = 0;
+    tb->invalid = 0;
+    tb->stored = 1;
+    tb->exec_count = 0;
+    tb->insn_records = NULL;
+    tb->tc_ptr = (uint8_t *)h + h->code_used;
+    tb_gen_private = 0;
+    cpu_gen_code(env, tb, &code_size);
+    if (tb_gen_private ||
+        (page_get_flags(pc + tb->size - 1) & PAGE_WRITE_ORG)) {
+        tb = NULL;
+        goto out;
+    }
+    guest_code = h->code_used + code_size;
+    memcpy((uint8_t *)h + guest_code, g2h(pc), tb->size);
+    e = &tb_store_entries[i];
+    e->guest_code = guest_code;
+    e->tb = *tb;
+    b = tb_store_hash(pc);
+    e->next = tb_store_buckets[b];
+    smp_wmb();
+    tb_store_buckets[b] = i + 1;
+    h->code_used = (guest_code + tb->size + CODE_GEN_ALIGN - 1) &
+        ~(CODE_GEN_ALIGN - 1);
+    h->nb_entries = i + 1;
+    tb_store_claimed[i] = tb_flush_count + 1;
+ out:
+    tb_store_unlock();
+    return tb;
+}
+
+static TranslationBlock *tb_store_find_pc(uintptr_t tc_ptr)
+{
+    int m_min, m_max, m;
+    uintptr_t v;
+
+    m_min = 0;
+    m_max = tb_store->nb_entries - 1;
+    while (m_min <= m_max) {
+        m = (m_min + m_max) >> 1;
+        v = (uintptr_t)tb_store_entries[m].tb.tc_ptr;
+        if (v == tc_ptr) {
+            return &tb_store_tbs[m];
+        } else if (tc_ptr < v) {
+            m_max = m - 1;
+        } else {
+            m_min = m + 1;
+        }
+    }
+    return m_max < 0 ? NULL : &tb_store_tbs[m_max];
+}
+
+#ifndef NT_GNU_BUILD_ID
+#define NT_GNU_BUILD_ID 3
+#endif
+
+static int tb_store_note(struct dl_phdr_info *info, size_t size,
+                         void *opaque)
+{
+    uint8_t *id = opaque;
+    const ElfW(Nhdr) *n;
+    uintptr_t p, end;
+    int i;
+
+    for (i = 0; i < info->dlpi_phnum; i++) {
+        if (info->dlpi_phdr[i].p_type != PT_NOTE) {
+            continue;
+        }
+        p = info->dlpi_addr + info->dlpi_phdr[i].p_vaddr;
+        end = p + info->dlpi_phdr[i].p_memsz;
+        while (p + sizeof(*n) <= end) {
+            n = (const ElfW(Nhdr) *)p;
+            p += sizeof(*n) + QEMU_ALIGN_UP(n->n_namesz, 4);
+            if (n->n_type == NT_GNU_BUILD_ID && n->n_namesz == 4 &&
+                memcmp(n + 1, "GNU", 4) == 0) {
+                memcpy(id, (void *)p,
+                       MIN(n->n_descsz, sizeof(((TBStoreHeader *)0)->build_id)));
+                return 2;
+            }
+            p += QEMU_ALIGN_UP(n->n_descsz, 4);
+        }
+    }
+    /* the executable comes first, do not look further */
+    return 1;
+}
+
+/* Identify the QEMU binary by its GNU build ID, or by the file it was
+   run from if it was linked without one.  */
+static void tb_store_build_id(uint8_t *id, size_t size)
+{
+    struct stat st;
+    uint32_t file[5];
+
+    memset(id, 0, size);
+    if (dl_iterate_phdr(tb_store_note, id) == 2) {
+        return;
+    }
+    if (stat("/proc/self/exe", &st) == 0) {
+        file[0] = st.st_dev;
+        file[1] = st.st_ino;
+        file[2] = st.st_size;
+        file[3] = st.st_mtime;
+        file[4] = st.st_mtim.tv_nsec;
+        memcpy(id, file, MIN(sizeof(file), size));
+    }
+}
+
+/* Reserve the address space for the file and the TranslationBlocks
+   that follow it, at the address recorded in the header if there is
+   one.  Blocks of the private buffer must reach the store with 32-bit
+   jumps.  */
+static int tb_store_map(int fd, TBStoreHeader *h)
+{
+    size_t tbs_size = HOST_PAGE_ALIGN(h->max_entries *
+                                      sizeof(TranslationBlock));
+    size_t total = h->size + tbs_size;
+    uintptr_t buf = (uintptr_t)code_gen_buffer;
+    uintptr_t hint = h->base;
+    uint8_t *p;
+
+    if (!hint) {
+        if (buf > total + (64 << 20)) {
+            hint = (buf - total - (64 << 20)) & qemu_host_page_mask;
+        } else {
+            hint = HOST_PAGE_ALIGN(buf + code_gen_buffer_reserved +
+                                   (64 << 20));
+        }
+    }
+    p = mmap((void *)hint, total, PROT_NONE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED) {
+        return -1;
+    }
+    if ((h->base && (uintptr_t)p != h->base)
+#if HOST_LONG_BITS == 64
+        || MAX((uintptr_t)p + total, buf + code_gen_buffer_reserved) -
+           MIN((uintptr_t)p, buf) >= (1UL << 31)
+#endif
+        ) {
+        munmap(p, total);
+        return -1;
+    }
+    if (mmap(p, h->size, PROT_READ | PROT_EXEC, MAP_SHARED | MAP_FIXED,
+             fd, 0) == MAP_FAILED ||
+        mmap(p + h->size, tbs_size, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE,
+             -1, 0) == MAP_FAILED) {
+        munmap(p, total);
+        return -1;
+    }
+    h->base = (uintptr_t)p;
+    tb_store = (TBStoreHeader *)p;
+    tb_store_buckets = (uint32_t *)(p + h->buckets);
+    tb_store_entries = (TBStoreEntry *)(p + h->entries);
+    tb_store_tbs = (TranslationBlock *)(p + h->size);
+    tb_store_claimed = g_malloc0(h->max_entries * sizeof(int));
+    return 0;
+}
+
+/* Open the translation store 'path', creating it if needed.  The store
+   is not used if it was created by a different QEMU binary, for another
+   CPU or guest base, or if its address is not free in this process.  */
+void tb_store_init(const char *path, CPUArchState *env)
+{
+    TBStoreHeader want, h;
+    int fd, created;
+
+    fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        perror(path);
+        exit(1);
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    flock(fd, LOCK_EX);
+
+    memset(&want, 0, sizeof(want));
+    memcpy(want.magic, TB_STORE_MAGIC, sizeof(want.magic));
+    pstrcpy(want.target, sizeof(want.target), TARGET_ARCH);
+    want.entry_size = sizeof(TBStoreEntry);
+    want.prologue = (uintptr_t)code_gen_prologue;
+    tb_store_build_id(want.build_id, sizeof(want.build_id));
+#if defined(CONFIG_USE_GUEST_BASE)
+    want.guest_base = guest_base;
+#endif
+    want.config = cpu_tb_store_config(env);
+
+    created = 0;
+    if (pread(fd, &h, sizeof(h), 0) != sizeof(h) ||
+        memcmp(h.magic, TB_STORE_MAGIC, sizeof(h.magic)) != 0) {
+        h = want;
+        h.size = TB_STORE_SIZE;
+        h.max_entries = TB_STORE_SIZE / TB_STORE_AVG_BLOCK_SIZE;
+        h.buckets = QEMU_ALIGN_UP(sizeof(h), 64);
+        h.entries = QEMU_ALIGN_UP(h.buckets + TB_STORE_BUCKETS *
+                                  sizeof(uint32_t), 64);
+        h.code = HOST_PAGE_ALIGN(h.entries +
+                                 h.max_entries * sizeof(TBStoreEntry));
+        h.code_used = h.code;
+        if (ftruncate(fd, 0) < 0 || ftruncate(fd, h.size) < 0) {
+            perror(path);
+            exit(1);
+        }
+        created = 1;
+    } else if (memcmp(&h, &want, offsetof(TBStoreHeader, size)) != 0) {
+        fprintf(stderr, "qemu: %s was created by another QEMU binary or "
+                "configuration, not using it\n", path);
+        goto fail;
+    }
+    if (tb_store_map(fd, &h) < 0) {
+        fprintf(stderr, "qemu: %s cannot be mapped at 0x%" PRIx64
+                ", not using it\n", path, h.base);
+        goto fail;
+    }
+    if (created && pwrite(fd, &h, sizeof(h), 0) != sizeof(h)) {
+        perror(path);
+        exit(1);
+    }
+    flock(fd, LOCK_UN);
+    tb_store_fd = fd;
+    return;
+
+ fail:
+    flock(fd, LOCK_UN);
+    close(fd);
+}
+
+#elif defined(CONFIG_USER_ONLY)
+
+void tb_store_init(const char *path, CPUArchState *env)
+{
+    fprintf(stderr, "qemu: no translation store for this target or host\n");
+}
+
+#endif /* USE_TB_STORE */
+
+/* Size of the host code of 'tb', without the insn records that
+   cpu_gen_code() may have appended to it.  */
+static int tb_host_code_size(TranslationBlock *tb, int code_size)
+{
+#ifdef TARGET_HAS_INSN_RECORDS
+    if (tb->insn_records) {
+        return tb->insn_records[tb->nb_insn_records].host_start;
+    }
+#endif
+    return code_size;
+}
+
+/* Add a new TB to the lookup tables and to the pages it covers.  */
+static void tb_gen_link(CPUArchState *env, TranslationBlock *tb,
+                        tb_page_addr_t phys_pc, int invalidate_count,
+                        int code_size, unsigned long code_bytes)
+{
+    tb_page_addr_t phys_page2;
+    target_ulong virt_page2;
+
+    /* check next page if needed */
+    virt_page2 = (tb->pc + tb->size - 1) & TARGET_PAGE_MASK;
+    phys_page2 = -1;
+    if ((tb->pc & TARGET_PAGE_MASK) != virt_page2) {
+        phys_page2 = get_page_addr_code(env, virt_page2);
+    }
+    mmap_lock();
+    tb_lock_enter();
+    if (code_bytes) {
+        code_gen_region_release(tb, code_bytes);
+        code_gen_tb = NULL;
+    }
+    code_gen_bytes += code_bytes;
+    if (tb_perfmap_file) {
+        tb_perfmap_add(tb, tb_host_code_size(tb, code_size));
+    }
+    tb_link_page(tb, phys_pc, phys_page2);
+    if (tb_phys_invalidate_count != invalidate_count) {
+        /* Some code was invalidated while we translated, maybe the one
+           we read: run this block once but do not keep it.  */
+        tb_phys_invalidate(tb, -1);
+    }
+    tb_lock_exit();
+    mmap_unlock();
+}
+
 TranslationBlock *tb_gen_code(CPUArchState *env,
                               target_ulong pc, target_ulong cs_base,
                               int flags, int cflags)
 {
     TranslationBlock *tb;
     uint8_t *tc_ptr;
-    tb_page_addr_t phys_pc, phys_page2;
-    target_ulong virt_page2;
-    int code_gen_size;
+    tb_page_addr_t phys_pc;
+    unsigned long code_bytes;
+    int code_gen_size, invalidate_count, busy;
 
     phys_pc = get_page_addr_code(env, pc);
-    tb = tb_alloc(pc);
+#ifdef USE_TB_STORE
+    if (cflags == 0 && tb_store_usable(env)) {
+        int link = 1;
+
+        invalidate_count = tb_phys_invalidate_count;
+        /* the guest code compared by the lookup must stay mapped */
+        mmap_lock();
+        tb_lock_enter();
+        tb = tb_store_lookup(pc, cs_base, flags, &link);
+        mmap_unlock();
+        if (!tb) {
+            tb = tb_store_gen(env, pc, cs_base, flags);
+        }
+        tb_lock_exit();
+        if (tb) {
+            if (link) {
+                tb_gen_link(env, tb, phys_pc, invalidate_count, 0, 0);
+            }
+            return tb;
+        }
+    }
+#endif
+    tb_lock_enter();
+    tb = tb_alloc(pc, &busy);
+#if defined(TARGET_HAS_PARALLEL_TRANSLATION) && defined(CONFIG_USER_ONLY)
+    while (!tb && busy) {
+        /* the regions with room left are being written to: wait for
+           one to be released rather than flush a buffer with room */
+        tb_lock_exit();
+        sched_yield();
+        tb_lock_enter();
+        tb = tb_alloc(pc, &busy);
+    }
+#endif
     if (!tb) {
+#ifdef CONFIG_USER_ONLY
+        if (first_cpu->next_cpu) {
+            /* Other threads may be running code from the buffer: stop
+               them all and retry once it has been flushed.  */
+            tb_flush_request();
+            env->exception_index = EXCP_INTERRUPT;
+            cpu_loop_exit(env);
+        }
+#endif
         /* flush must be done */
-        tb_flush(env);
+        tb_flush_exclusive(env);
         /* cannot fail at this point */
-        tb = tb_alloc(pc);
+        tb = tb_alloc(pc, &busy);
         /* Don't forget to invalidate previous TB info.  */
         tb_invalidated_flag = 1;
     }
-    tc_ptr = code_gen_ptr;
-    tb->tc_ptr = tc_ptr;
+    tc_ptr = tb->tc_ptr;
     tb->cs_base = cs_base;
     tb->flags = flags;
     tb->cflags = cflags;
+    invalidate_count = tb_phys_invalidate_count;
+    code_gen_tb = tb;
+#ifdef TARGET_HAS_PARALLEL_TRANSLATION
+    /* Nobody else writes to the region while it is busy, and the
+       translator only uses per-thread state.  */
+    tb_lock_exit();
     cpu_gen_code(env, tb, &code_gen_size);
-    code_gen_ptr = (void *)(((uintptr_t)code_gen_ptr + code_gen_size +
-                             CODE_GEN_ALIGN - 1) & ~(CODE_GEN_ALIGN - 1));
-
-    /* check next page if needed */
-    virt_page2 = (pc + tb->size - 1) & TARGET_PAGE_MASK;
-    phys_page2 = -1;
-    if ((pc & TARGET_PAGE_MASK) != virt_page2) {
-        phys_page2 = get_page_addr_code(env, virt_page2);
-    }
-    tb_link_page(tb, phys_pc, phys_page2);
+#else
+    cpu_gen_code(env, tb, &code_gen_size);
+    tb_lock_exit();
+#endif
+    code_bytes = (((uintptr_t)tc_ptr + code_gen_size + CODE_GEN_ALIGN - 1) &
+                  ~(uintptr_t)(CODE_GEN_ALIGN - 1)) - (uintptr_t)tc_ptr;
+    tb_gen_link(env, tb, phys_pc, invalidate_count, code_gen_size,
+                code_bytes);
     return tb;
 }
 
@@ -1084,7 +2090,7 @@ void tb_invalidate_phys_range(tb_page_addr_t start, tb_page_addr_t end,
 {
 /* we also need to invalidate the pages in user mode s2e */
 #ifdef CONFIG_USER_KVM
-    kvm_user_update_pageDesc(start, end, is_cpu_write_access, 1);
+    ram_memory_update_page(start, end, is_cpu_write_access, 1);
 #endif
     while (start < end) {
         tb_invalidate_phys_page_range(start, end, is_cpu_write_access);
@@ -1120,6 +2126,7 @@ void tb_invalidate_phys_page_range(tb_page_addr_t start, tb_page_addr_t end,
     p = page_find(start >> TARGET_PAGE_BITS);
     if (!p)
         return;
+    tb_lock_enter();
     if (!p->code_bitmap &&
         ++p->code_write_count >= SMC_BITMAP_USE_THRESHOLD &&
         is_cpu_write_access) {
@@ -1193,6 +2200,7 @@ void tb_invalidate_phys_page_range(tb_page_addr_t start, tb_page_addr_t end,
         }
     }
 #endif
+    tb_lock_exit();
 #ifdef TARGET_HAS_PRECISE_SMC
     if (current_tb_modified) {
         /* we generate a block containing just the instruction
@@ -1253,6 +2261,7 @@ static void tb_invalidate_phys_page(tb_page_addr_t addr,
     p = page_find(addr >> TARGET_PAGE_BITS);
     if (!p)
         return;
+    tb_lock_enter();
     tb = p->first_tb;
 #ifdef TARGET_HAS_PRECISE_SMC
     if (tb && pc != 0) {
@@ -1281,6 +2290,7 @@ static void tb_invalidate_phys_page(tb_page_addr_t addr,
         tb = tb->page_next[n];
     }
     p->first_tb = NULL;
+    tb_lock_exit();
 #ifdef TARGET_HAS_PRECISE_SMC
     if (current_tb_modified) {
         /* we generate a block containing just the instruction
@@ -1363,6 +2373,7 @@ void tb_link_page(TranslationBlock *tb,
     /* Grab the mmap lock to stop another thread invalidating this TB
        before we are done.  */
     mmap_lock();
+    tb_lock_enter();
     /* add in the physical hash table */
     h = tb_phys_hash_func(phys_pc);
     ptb = &tb_phys_hash[h];
@@ -1389,29 +2400,37 @@ void tb_link_page(TranslationBlock *tb,
 #ifdef DEBUG_TB_CHECK
     tb_page_check();
 #endif
+    tb_lock_exit();
     mmap_unlock();
 }
 
-/* find the TB 'tb' such that tb[0].tc_ptr <= tc_ptr <
-   tb[1].tc_ptr. Return NULL if not found */
-TranslationBlock *tb_find_pc(uintptr_t tc_ptr)
+static TranslationBlock *tb_find_pc_locked(uintptr_t tc_ptr)
 {
-    int m_min, m_max, m;
+    int m_min, m_max, m, r;
     uintptr_t v;
-    TranslationBlock *tb;
+    TranslationBlock *tb, *first;
 
     if (nb_tbs <= 0)
         return NULL;
     if (tc_ptr < (uintptr_t)code_gen_buffer ||
-        tc_ptr >= (uintptr_t)code_gen_ptr) {
+        tc_ptr >= (uintptr_t)code_gen_region_start(code_gen_regions_used)) {
+        return NULL;
+    }
+    /* only the TBs of the region holding tc_ptr are candidates */
+    r = (tc_ptr - (uintptr_t)code_gen_buffer) / code_gen_region_size;
+    first = &tbs[r * code_gen_region_max_blocks];
+    if (tc_ptr >= (uintptr_t)code_gen_region_ptr[r]) {
         return NULL;
     }
     /* binary search (cf Knuth) */
     m_min = 0;
-    m_max = nb_tbs - 1;
+    m_max = code_gen_region_nb_tbs[r] - 1;
+    if (m_max < 0) {
+        return NULL;
+    }
     while (m_min <= m_max) {
         m = (m_min + m_max) >> 1;
-        tb = &tbs[m];
+        tb = &first[m];
         v = (uintptr_t)tb->tc_ptr;
         if (v == tc_ptr)
             return tb;
@@ -1421,7 +2440,26 @@ TranslationBlock *tb_find_pc(uintptr_t tc_ptr)
             m_min = m + 1;
         }
     }
-    return &tbs[m_max];
+    return &first[m_max];
+}
+
+/* find the TB 'tb' such that tb[0].tc_ptr <= tc_ptr <
+   tb[1].tc_ptr. Return NULL if not found */
+TranslationBlock *tb_find_pc(uintptr_t tc_ptr)
+{
+    TranslationBlock *tb;
+
+#ifdef USE_TB_STORE
+    if (tb_store && tc_ptr >= (uintptr_t)tb_store &&
+        tc_ptr < (uintptr_t)tb_store + tb_store->size) {
+        return tb_store_find_pc(tc_ptr);
+    }
+#endif
+    /* other threads append to the regions concurrently */
+    tb_lock_enter();
+    tb = tb_find_pc_locked(tc_ptr);
+    tb_lock_exit();
+    return tb;
 }
 
 static void tb_reset_jump_recursive(TranslationBlock *tb);
@@ -2062,7 +3100,7 @@ void page_set_flags(target_ulong start, target_ulong end, int flags)
 {
 /* we also need to update the corresponding page flags in user mode s2e */
 #ifdef CONFIG_USER_KVM
-    	kvm_user_update_pageDesc(start, end, flags, 0);
+    	ram_memory_update_page(start, end, flags, 0);
 #endif
     target_ulong addr, len;
 
@@ -4201,15 +5239,21 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
 {
     int i, target_code_size, max_target_code_size;
     int direct_jmp_count, direct_jmp2_count, cross_page;
+    uint64_t tlb_victim_hits, tlb_fills;
     TranslationBlock *tb;
+    CPUArchState *env;
 
     target_code_size = 0;
     max_target_code_size = 0;
     cross_page = 0;
     direct_jmp_count = 0;
     direct_jmp2_count = 0;
-    for(i = 0; i < nb_tbs; i++) {
+    for (i = 0; i < code_gen_regions_used * code_gen_region_max_blocks; i++) {
         tb = &tbs[i];
+        if (i % code_gen_region_max_blocks >=
+            code_gen_region_nb_tbs[i / code_gen_region_max_blocks]) {
+            continue;
+        }
         target_code_size += tb->size;
         if (tb->size > max_target_code_size)
             max_target_code_size = tb->size;
@@ -4224,16 +5268,20 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
     }
     /* XXX: avoid using doubles ? */
     cpu_fprintf(f, "Translation buffer state:\n");
-    cpu_fprintf(f, "gen code size       %td/%ld\n",
-                code_gen_ptr - code_gen_buffer, code_gen_buffer_max_size);
+    cpu_fprintf(f, "gen code size       %ld/%ld (%ld%%)\n",
+                code_gen_bytes, code_gen_buffer_max_size,
+                code_gen_bytes * 100 / code_gen_buffer_max_size);
+    cpu_fprintf(f, "buffer size         %ld (reserved %ld, huge pages %s)\n",
+                code_gen_buffer_size, code_gen_buffer_reserved,
+                code_gen_huge_pages ? "on" : "off");
     cpu_fprintf(f, "TB count            %d/%d\n", 
                 nb_tbs, code_gen_max_blocks);
     cpu_fprintf(f, "TB avg target size  %d max=%d bytes\n",
                 nb_tbs ? target_code_size / nb_tbs : 0,
                 max_target_code_size);
-    cpu_fprintf(f, "TB avg host size    %td bytes (expansion ratio: %0.1f)\n",
-                nb_tbs ? (code_gen_ptr - code_gen_buffer) / nb_tbs : 0,
-                target_code_size ? (double) (code_gen_ptr - code_gen_buffer) / target_code_size : 0);
+    cpu_fprintf(f, "TB avg host size    %ld bytes (expansion ratio: %0.1f)\n",
+                nb_tbs ? code_gen_bytes / nb_tbs : 0,
+                target_code_size ? (double) code_gen_bytes / target_code_size : 0);
     cpu_fprintf(f, "cross page TB count %d (%d%%)\n",
             cross_page,
             nb_tbs ? (cross_page * 100) / nb_tbs : 0);
@@ -4244,11 +5292,55 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
                 nb_tbs ? (direct_jmp2_count * 100) / nb_tbs : 0);
     cpu_fprintf(f, "\nStatistics:\n");
     cpu_fprintf(f, "TB flush count      %d\n", tb_flush_count);
+    if (tb_flush_interval) {
+        cpu_fprintf(f, "TB flush interval   %" PRId64 " ms\n",
+                    tb_flush_interval / 1000000);
+    }
     cpu_fprintf(f, "TB invalidate count %d\n", tb_phys_invalidate_count);
     cpu_fprintf(f, "TLB flush count     %d\n", tlb_flush_count);
+    tlb_victim_hits = 0;
+    tlb_fills = 0;
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        tlb_victim_hits += env->tlb_victim_hits;
+        tlb_fills += env->tlb_fills;
+    }
+    cpu_fprintf(f, "TLB miss count      %" PRId64 " (victim TLB hits %"
+                PRId64 " %d%%)\n", tlb_victim_hits + tlb_fills,
+                tlb_victim_hits,
+                tlb_victim_hits + tlb_fills ?
+                (int)(tlb_victim_hits * 100 / (tlb_victim_hits + tlb_fills)) :
+                0);
     tcg_dump_info(f, cpu_fprintf);
 }
 
+TranslationBufferInfo *qmp_query_translation_buffer(Error **errp)
+{
+    TranslationBufferInfo *info = g_malloc0(sizeof(*info));
+    int64_t target_code_size = 0;
+    int i;
+
+    for (i = 0; i < code_gen_regions_used * code_gen_region_max_blocks; i++) {
+        if (i % code_gen_region_max_blocks <
+            code_gen_region_nb_tbs[i / code_gen_region_max_blocks]) {
+            target_code_size += tbs[i].size;
+        }
+    }
+    info->code_size = code_gen_bytes;
+    info->code_capacity = code_gen_buffer_max_size;
+    info->buffer_size = code_gen_buffer_size;
+    info->buffer_reserved = code_gen_buffer_reserved;
+    info->huge_pages = code_gen_huge_pages;
+    info->tb_count = nb_tbs;
+    info->tb_capacity = code_gen_max_blocks;
+    info->avg_target_size = nb_tbs ? target_code_size / nb_tbs : 0;
+    info->avg_host_size = nb_tbs ? code_gen_bytes / nb_tbs : 0;
+    info->flush_count = tb_flush_count;
+    info->flush_interval = tb_flush_interval / 1000000;
+    info->invalidate_count = tb_phys_invalidate_count;
+
+    return info;
+}
+
 /*
  * A helper function for the _utterly broken_ virtio device model to find out if
  * it's running on a big endian machine. Don't do this at home kids!
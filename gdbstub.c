@@ -35,7 +35,7 @@
 #include "gdbstub.h"
 #endif
 
-#define MAX_PACKET_LENGTH 4096
+#define MAX_PACKET_LENGTH 0x10000
 
 #include "cpu.h"
 #include "qemu_socket.h"
@@ -295,6 +295,14 @@ typedef struct GDBState {
     int line_csum;
     uint8_t last_packet[MAX_PACKET_LENGTH + 4];
     int last_packet_len;
+    int no_ack; /* QStartNoAckMode negotiated */
+    /* Scratch buffers for gdb_handle_packet; too big for the stack of
+       a linux-user guest thread.  */
+    char str_buf[MAX_PACKET_LENGTH];
+    uint8_t mem_buf[MAX_PACKET_LENGTH];
+#ifdef CONFIG_USER_ONLY
+    char *memory_map; /* qXfer:memory-map:read annex, built at offset 0 */
+#endif
     int signal;
 #ifdef CONFIG_USER_ONLY
     int fd;
@@ -459,6 +467,11 @@ static int put_packet_binary(GDBState *s, const char *buf, int len)
         s->last_packet_len = p - s->last_packet;
         put_buffer(s, (uint8_t *)s->last_packet, s->last_packet_len);
 
+        if (s->no_ack) {
+            /* Nothing will come back, so nothing to retransmit.  */
+            s->last_packet_len = 0;
+            break;
+        }
 #ifdef CONFIG_USER_ONLY
         i = get_char(s);
         if (i < 0)
@@ -1766,6 +1779,11 @@ static int cpu_gdb_write_register(CPUArchState *env, uint8_t *mem_buf, int n)
 
 #if !defined(TARGET_XTENSA)
 static int num_g_regs = NUM_CORE_REGS;
+/* Every register we describe, including coprocessors registered without
+   a fixed 'g' position.  */
+static int num_xml_g_regs = NUM_CORE_REGS;
+#else
+#define num_xml_g_regs num_g_regs
 #endif
 
 #ifdef GDB_CORE_XML
@@ -1895,6 +1913,7 @@ void gdb_register_coprocessor(CPUArchState * env,
 
     /* Add to end of list.  */
     last_reg += num_regs;
+    num_xml_g_regs = last_reg;
     *p = s;
     if (g_pos) {
         if (g_pos != s->base_reg) {
@@ -2050,14 +2069,148 @@ static CPUArchState *find_cpu(uint32_t thread_id)
     return NULL;
 }
 
+/* Number of registers transferred by 'g'/'G'.  A gdb that read our
+   target description lays the 'g' packet out from it, so it can take
+   the coprocessor registers in the same round trip instead of fetching
+   them one 'p' at a time.  Older gdbs reject an over-long reply.  */
+static int gdb_num_g_regs(void)
+{
+    return gdb_has_xml ? num_xml_g_regs : num_g_regs;
+}
+
+/* Reply to a qXfer read of [offset, offset + len) in a TOTAL_LEN byte
+   annex.  */
+static void gdb_xfer_reply(GDBState *s, const char *data,
+                           target_ulong total_len,
+                           target_ulong offset, target_ulong len)
+{
+    char *buf = s->str_buf;
+
+    if (offset > total_len) {
+        put_packet(s, "E00");
+        return;
+    }
+    if (len > (MAX_PACKET_LENGTH - 5) / 2)
+        len = (MAX_PACKET_LENGTH - 5) / 2;
+    if (len < total_len - offset) {
+        buf[0] = 'm';
+        len = memtox(buf + 1, data + offset, len);
+    } else {
+        buf[0] = 'l';
+        len = memtox(buf + 1, data + offset, total_len - offset);
+    }
+    put_packet_binary(s, buf, len + 1);
+}
+
+#ifdef CONFIG_USER_ONLY
+typedef struct GDBMemoryMap {
+    char *xml;
+    size_t len, size;
+    abi_ulong start, end; /* pending region, merged across prot changes */
+    int valid;
+} GDBMemoryMap;
+
+static void memory_map_flush(GDBMemoryMap *m)
+{
+    int n;
+
+    if (!m->valid) {
+        return;
+    }
+    for (;;) {
+        n = snprintf(m->xml + m->len, m->size - m->len,
+                     "<memory type=\"ram\" start=\"0x" TARGET_ABI_FMT_lx
+                     "\" length=\"0x" TARGET_ABI_FMT_lx "\"/>",
+                     m->start, (abi_ulong)(m->end - m->start));
+        if (n < m->size - m->len) {
+            break;
+        }
+        m->size *= 2;
+        m->xml = g_realloc(m->xml, m->size);
+    }
+    m->len += n;
+    m->valid = 0;
+}
+
+static int memory_map_region(void *priv, abi_ulong start, abi_ulong end,
+                             unsigned long prot)
+{
+    GDBMemoryMap *m = priv;
+
+    if (!(prot & PAGE_VALID)) {
+        return 0;
+    }
+    /* Guest mappings are all plain memory as far as gdb is concerned;
+       it must still be able to plant breakpoints in read-only text.  */
+    if (m->valid && m->end == start) {
+        m->end = end;
+        return 0;
+    }
+    memory_map_flush(m);
+    m->start = start;
+    m->end = end;
+    m->valid = 1;
+    return 0;
+}
+
+static char *gdb_memory_map_xml(void)
+{
+    static const char header[] =
+        "<?xml version=\"1.0\"?>"
+        "<!DOCTYPE memory-map PUBLIC \"+//IDN gnu.org//DTD GDB Memory Map V1.0//EN\" "
+        "\"http://sourceware.org/gdb/gdb-memory-map.dtd\">"
+        "<memory-map>";
+    static const char footer[] = "</memory-map>";
+    GDBMemoryMap m;
+
+    m.size = 4096;
+    m.xml = g_malloc(m.size);
+    m.len = sizeof(header) - 1;
+    memcpy(m.xml, header, m.len);
+    m.valid = 0;
+    walk_memory_regions(&m, memory_map_region);
+    memory_map_flush(&m);
+    if (m.len + sizeof(footer) > m.size) {
+        m.size = m.len + sizeof(footer);
+        m.xml = g_realloc(m.xml, m.size);
+    }
+    memcpy(m.xml + m.len, footer, sizeof(footer));
+    return m.xml;
+}
+#endif
+
+/* Decode the '}'-escaped binary payload of an 'X' packet.  Returns the
+   number of bytes stored in MEM, or -1 if the payload is malformed.  */
+static int gdb_unescape_binary(uint8_t *mem, int size,
+                               const char *p, const char *end)
+{
+    int len = 0;
+
+    while (p < end) {
+        uint8_t c = *p++;
+
+        if (c == '}') {
+            if (p == end) {
+                return -1;
+            }
+            c = *p++ ^ 0x20;
+        }
+        if (len == size) {
+            return -1;
+        }
+        mem[len++] = c;
+    }
+    return len;
+}
+
 static int gdb_handle_packet(GDBState *s, const char *line_buf)
 {
     CPUArchState *env;
     const char *p;
     uint32_t thread;
     int ch, reg_size, type, res;
-    char buf[MAX_PACKET_LENGTH];
-    uint8_t mem_buf[MAX_PACKET_LENGTH];
+    char *buf = s->str_buf;
+    uint8_t *mem_buf = s->mem_buf;
     uint8_t *registers;
     target_ulong addr, len;
 
@@ -2069,7 +2222,7 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
     switch(ch) {
     case '?':
         /* TODO: Make this return the correct value for user-mode.  */
-        snprintf(buf, sizeof(buf), "T%02xthread:%02x;", GDB_SIGNAL_TRAP,
+        snprintf(buf, MAX_PACKET_LENGTH, "T%02xthread:%02x;", GDB_SIGNAL_TRAP,
                  cpu_index(s->c_cpu));
         put_packet(s, buf);
         /* Remove all the breakpoints when this query is issued,
@@ -2201,7 +2354,7 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
         cpu_synchronize_state(s->g_cpu);
         env = s->g_cpu;
         len = 0;
-        for (addr = 0; addr < num_g_regs; addr++) {
+        for (addr = 0; addr < gdb_num_g_regs(); addr++) {
             reg_size = gdb_read_register(s->g_cpu, mem_buf + len, addr);
             len += reg_size;
         }
@@ -2214,7 +2367,7 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
         registers = mem_buf;
         len = strlen(p) / 2;
         hextomem((uint8_t *)registers, p, len);
-        for (addr = 0; addr < num_g_regs && len > 0; addr++) {
+        for (addr = 0; addr < gdb_num_g_regs() && len > 0; addr++) {
             reg_size = gdb_write_register(s->g_cpu, registers, addr);
             len -= reg_size;
             registers += reg_size;
@@ -2226,6 +2379,9 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
         if (*p == ',')
             p++;
         len = strtoull(p, NULL, 16);
+        if (len > (MAX_PACKET_LENGTH - 1) / 2) {
+            len = (MAX_PACKET_LENGTH - 1) / 2;
+        }
         if (target_memory_rw_debug(s->g_cpu, addr, mem_buf, len, 0) != 0) {
             put_packet (s, "E14");
         } else {
@@ -2233,6 +2389,24 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
             put_packet(s, buf);
         }
         break;
+    case 'x':
+        /* Binary memory read: 'b' followed by the escaped data, so a
+           reply carries up to twice as much memory as 'm'.  */
+        addr = strtoull(p, (char **)&p, 16);
+        if (*p == ',')
+            p++;
+        len = strtoull(p, NULL, 16);
+        if (len > (MAX_PACKET_LENGTH - 2) / 2) {
+            len = (MAX_PACKET_LENGTH - 2) / 2;
+        }
+        if (target_memory_rw_debug(s->g_cpu, addr, mem_buf, len, 0) != 0) {
+            put_packet(s, "E14");
+        } else {
+            buf[0] = 'b';
+            len = memtox(buf + 1, (const char *)mem_buf, len);
+            put_packet_binary(s, buf, len + 1);
+        }
+        break;
     case 'M':
         addr = strtoull(p, (char **)&p, 16);
         if (*p == ',')
@@ -2240,6 +2414,10 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
         len = strtoull(p, (char **)&p, 16);
         if (*p == ':')
             p++;
+        if (len > strlen(p) / 2) {
+            put_packet(s, "E22");
+            break;
+        }
         hextomem(mem_buf, p, len);
         if (target_memory_rw_debug(s->g_cpu, addr, mem_buf, len, 1) != 0) {
             put_packet(s, "E14");
@@ -2247,6 +2425,31 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
             put_packet(s, "OK");
         }
         break;
+    case 'X':
+        addr = strtoull(p, (char **)&p, 16);
+        if (*p == ',')
+            p++;
+        len = strtoull(p, (char **)&p, 16);
+        if (*p != ':') {
+            put_packet(s, "E22");
+            break;
+        }
+        p++;
+        /* The payload may contain NULs; take its end from the raw
+           line length rather than strlen.  */
+        res = gdb_unescape_binary(mem_buf, MAX_PACKET_LENGTH, p,
+                                  line_buf + s->line_buf_index);
+        if (res < 0 || res != len) {
+            put_packet(s, "E22");
+            break;
+        }
+        if (len != 0 &&
+            target_memory_rw_debug(s->g_cpu, addr, mem_buf, len, 1) != 0) {
+            put_packet(s, "E14");
+        } else {
+            put_packet(s, "OK");
+        }
+        break;
     case 'p':
         /* Older gdb are really dumb, and don't use 'g' if 'p' is avaialable.
            This works, but can be very slow.  Anything new enough to
@@ -2334,7 +2537,7 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
         /* parse any 'q' packets here */
         if (!strcmp(p,"qemu.sstepbits")) {
             /* Query Breakpoint bit definitions */
-            snprintf(buf, sizeof(buf), "ENABLE=%x,NOIRQ=%x,NOTIMER=%x",
+            snprintf(buf, MAX_PACKET_LENGTH, "ENABLE=%x,NOIRQ=%x,NOTIMER=%x",
                      SSTEP_ENABLE,
                      SSTEP_NOIRQ,
                      SSTEP_NOTIMER);
@@ -2345,7 +2548,7 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
             p += 10;
             if (*p != '=') {
                 /* Display current setting */
-                snprintf(buf, sizeof(buf), "0x%x", sstep_flags);
+                snprintf(buf, MAX_PACKET_LENGTH, "0x%x", sstep_flags);
                 put_packet(s, buf);
                 break;
             }
@@ -2365,7 +2568,7 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
         } else if (strcmp(p,"sThreadInfo") == 0) {
         report_cpuinfo:
             if (s->query_cpu) {
-                snprintf(buf, sizeof(buf), "m%x", cpu_index(s->query_cpu));
+                snprintf(buf, MAX_PACKET_LENGTH, "m%x", cpu_index(s->query_cpu));
                 put_packet(s, buf);
                 s->query_cpu = s->query_cpu->next_cpu;
             } else
@@ -2376,7 +2579,7 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
             env = find_cpu(thread);
             if (env != NULL) {
                 cpu_synchronize_state(env);
-                len = snprintf((char *)mem_buf, sizeof(mem_buf),
+                len = snprintf((char *)mem_buf, MAX_PACKET_LENGTH,
                                "CPU#%d [%s]", env->cpu_index,
                                env->halted ? "halted " : "running");
                 memtohex(buf, mem_buf, len);
@@ -2388,7 +2591,7 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
         else if (strncmp(p, "Offsets", 7) == 0) {
             TaskState *ts = s->c_cpu->opaque;
 
-            snprintf(buf, sizeof(buf),
+            snprintf(buf, MAX_PACKET_LENGTH,
                      "Text=" TARGET_ABI_FMT_lx ";Data=" TARGET_ABI_FMT_lx
                      ";Bss=" TARGET_ABI_FMT_lx,
                      ts->info->code_offset,
@@ -2414,13 +2617,43 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
         }
 #endif /* !CONFIG_USER_ONLY */
         if (strncmp(p, "Supported", 9) == 0) {
-            snprintf(buf, sizeof(buf), "PacketSize=%x", MAX_PACKET_LENGTH);
+            snprintf(buf, MAX_PACKET_LENGTH, "PacketSize=%x", MAX_PACKET_LENGTH);
+            pstrcat(buf, MAX_PACKET_LENGTH, ";QStartNoAckMode+");
+            /* gdb only sends 'x' to stubs that announce it.  */
+            pstrcat(buf, MAX_PACKET_LENGTH, ";binary-upload+");
 #ifdef GDB_CORE_XML
-            pstrcat(buf, sizeof(buf), ";qXfer:features:read+");
+            pstrcat(buf, MAX_PACKET_LENGTH, ";qXfer:features:read+");
+#endif
+#ifdef CONFIG_USER_ONLY
+            pstrcat(buf, MAX_PACKET_LENGTH, ";qXfer:memory-map:read+");
 #endif
             put_packet(s, buf);
             break;
         }
+        if (strcmp(p, "StartNoAckMode") == 0) {
+            /* The OK itself is still acknowledged.  */
+            put_packet(s, "OK");
+            s->no_ack = 1;
+            break;
+        }
+#ifdef CONFIG_USER_ONLY
+        if (strncmp(p, "Xfer:memory-map:read::", 22) == 0) {
+            p += 22;
+            addr = strtoul(p, (char **)&p, 16);
+            if (*p == ',')
+                p++;
+            len = strtoul(p, (char **)&p, 16);
+            /* Snapshot the mappings when gdb starts reading so that
+               later chunks come from the same document.  */
+            if (addr == 0 || !s->memory_map) {
+                g_free(s->memory_map);
+                s->memory_map = gdb_memory_map_xml();
+            }
+            gdb_xfer_reply(s, s->memory_map, strlen(s->memory_map),
+                           addr, len);
+            break;
+        }
+#endif
 #ifdef GDB_CORE_XML
         if (strncmp(p, "Xfer:features:read:", 19) == 0) {
             const char *xml;
@@ -2430,7 +2663,7 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
             p += 19;
             xml = get_feature_xml(p, &p);
             if (!xml) {
-                snprintf(buf, sizeof(buf), "E00");
+                snprintf(buf, MAX_PACKET_LENGTH, "E00");
                 put_packet(s, buf);
                 break;
             }
@@ -2443,21 +2676,7 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
             len = strtoul(p, (char **)&p, 16);
 
             total_len = strlen(xml);
-            if (addr > total_len) {
-                snprintf(buf, sizeof(buf), "E00");
-                put_packet(s, buf);
-                break;
-            }
-            if (len > (MAX_PACKET_LENGTH - 5) / 2)
-                len = (MAX_PACKET_LENGTH - 5) / 2;
-            if (len < total_len - addr) {
-                buf[0] = 'm';
-                len = memtox(buf + 1, xml + addr, len);
-            } else {
-                buf[0] = 'l';
-                len = memtox(buf + 1, xml + addr, total_len - addr);
-            }
-            put_packet_binary(s, buf, len + 1);
+            gdb_xfer_reply(s, xml, total_len, addr, len);
             break;
         }
 #endif
@@ -2687,12 +2906,16 @@ static void gdb_read_byte(GDBState *s, int ch)
                 csum += s->line_buf[i];
             }
             if (s->line_csum != (csum & 0xff)) {
-                reply = '-';
-                put_buffer(s, &reply, 1);
+                if (!s->no_ack) {
+                    reply = '-';
+                    put_buffer(s, &reply, 1);
+                }
                 s->state = RS_IDLE;
             } else {
-                reply = '+';
-                put_buffer(s, &reply, 1);
+                if (!s->no_ack) {
+                    reply = '+';
+                    put_buffer(s, &reply, 1);
+                }
                 s->state = gdb_handle_packet(s, s->line_buf);
             }
             break;
@@ -2921,6 +3144,7 @@ static void gdb_chr_event(void *opaque, int event)
     case CHR_EVENT_OPENED:
         vm_stop(RUN_STATE_PAUSED);
         gdb_has_xml = 0;
+        gdbserver_state->no_ack = 0;
         break;
     default:
         break;
@@ -2,13 +2,82 @@
 
 /* Helpers for instruction counting code generation.  */
 
-static TCGArg *icount_arg;
-static int icount_label;
+static TCG_THREAD TCGArg *icount_arg;
+static TCG_THREAD int icount_label;
+
+/* Count the entries into the TB being translated (TB profiling).  */
+static inline void gen_tb_exec_count(void)
+{
+    TCGv_ptr ptr;
+    TCGv_i64 count;
+
+    ptr = tcg_const_ptr(tcg_ctx.tb_exec_count);
+    count = tcg_temp_new_i64();
+    tcg_gen_ld_i64(count, ptr, 0);
+    tcg_gen_addi_i64(count, count, 1);
+    tcg_gen_st_i64(count, ptr, 0);
+    tcg_temp_free_i64(count);
+    tcg_temp_free_ptr(ptr);
+}
+
+/* Add the length of the TB being translated to env->insn_count.  The
+   length is only known once translation is done, so load it from the
+   TB at run time.  */
+static inline void gen_tb_insn_count(void)
+{
+    TCGv_ptr ptr;
+    TCGv_i64 count, n;
+
+    ptr = tcg_const_ptr(tcg_ctx.tb_icount);
+    n = tcg_temp_new_i64();
+    tcg_gen_ld32u_i64(n, ptr, 0);
+    count = tcg_temp_new_i64();
+    tcg_gen_ld_i64(count, cpu_env, offsetof(CPUArchState, insn_count));
+    tcg_gen_add_i64(count, count, n);
+    tcg_gen_st_i64(count, cpu_env, offsetof(CPUArchState, insn_count));
+    tcg_temp_free_i64(count);
+    tcg_temp_free_i64(n);
+    tcg_temp_free_ptr(ptr);
+}
+
+/* Bump the coverage map entry of the edge from the previous TB to this
+   one, then make this TB the previous one.  The previous location is
+   kept shifted so that A->B and B->A are different edges.  */
+static inline void gen_tb_coverage(void)
+{
+    uint32_t loc = tcg_ctx.tb_coverage_loc;
+    TCGv_i32 idx, count;
+    TCGv_ptr ptr;
+
+    idx = tcg_temp_new_i32();
+    tcg_gen_ld_i32(idx, cpu_env, offsetof(CPUArchState, coverage_prev));
+    tcg_gen_xori_i32(idx, idx, loc);
+    ptr = tcg_temp_new_ptr();
+    tcg_gen_ext_i32_ptr(ptr, idx);
+    tcg_gen_addi_ptr(ptr, ptr, (tcg_target_long)tcg_ctx.tb_coverage_map);
+    count = tcg_temp_new_i32();
+    tcg_gen_ld8u_i32(count, ptr, 0);
+    tcg_gen_addi_i32(count, count, 1);
+    tcg_gen_st8_i32(count, ptr, 0);
+    tcg_gen_movi_i32(idx, loc >> 1);
+    tcg_gen_st_i32(idx, cpu_env, offsetof(CPUArchState, coverage_prev));
+    tcg_temp_free_i32(count);
+    tcg_temp_free_ptr(ptr);
+    tcg_temp_free_i32(idx);
+    tb_gen_private = 1;
+}
 
 static inline void gen_icount_start(void)
 {
     TCGv_i32 count;
 
+    if (tcg_ctx.tb_exec_count)
+        gen_tb_exec_count();
+    if (tcg_ctx.tb_icount)
+        gen_tb_insn_count();
+    if (tcg_ctx.tb_coverage_map)
+        gen_tb_coverage();
+
     if (!use_icount)
         return;
 
@@ -140,6 +140,30 @@ int kvm_set_user_mode_memory_region(abi_ulong start_addr, abi_ulong memory_size)
     mem.flags = 0;
     return kvm_vm_ioctl(s, KVM_SET_USER_MEMORY_REGION, &mem);
 }
+
+/* Whether the backend takes KVM_USER_REGISTER_MEM_BATCH.  If it does
+ * not, callers register memory one region at a time as they go. */
+bool kvm_user_has_memory_batch(void)
+{
+    static int has_mem_batch = -1;
+
+    if (has_mem_batch < 0) {
+        has_mem_batch = kvm_check_extension(kvm_state,
+                                            KVM_CAP_USER_MEM_BATCH) > 0;
+    }
+    return has_mem_batch;
+}
+
+/* Register all memory of a freshly loaded image in one round trip.
+ * Returns -ENOSYS if the backend does not support batches; the caller
+ * then falls back to registering the segments one by one. */
+int kvm_user_register_memory_batch(struct kvm_user_mem_batch *batch)
+{
+    if (!kvm_user_has_memory_batch()) {
+        return -ENOSYS;
+    }
+    return kvm_vm_ioctl(kvm_state, KVM_USER_REGISTER_MEM_BATCH, batch);
+}
 #endif
 
 static KVMSlot *kvm_alloc_slot(KVMState *s)
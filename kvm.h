@@ -123,6 +123,8 @@ int kvm_register_fixed_memory_region(const char *name, uintptr_t start, uint64_t
 #ifdef CONFIG_USER_KVM
 int kvm_set_user_mode_memory_region(abi_ulong start_addr, abi_ulong memory_size);
 void kvm_user_update_pageDesc (target_ulong start_addr, target_ulong sizeOrend, int flags, bool invalidate);
+bool kvm_user_has_memory_batch(void);
+int kvm_user_register_memory_batch(struct kvm_user_mem_batch *batch);
 #endif
 #ifdef NEED_CPU_H
 int kvm_init_vcpu(CPUArchState *env);
@@ -15,12 +15,10 @@
 #include <libaio.h>
 
 /*
- * Queue size (per-device).
+ * Default queue size (per-device), see laio_set_max_events().
  *
- * XXX: eventually we need to communicate this to the guest and/or make it
- *      tunable by the guest.  If we get more outstanding requests at a time
- *      than this we will get EAGAIN from io_submit which is communicated to
- *      the guest as an I/O error.
+ * Requests beyond the queue size wait in s->pending until earlier ones
+ * complete, instead of failing with EAGAIN from io_submit.
  */
 #define MAX_EVENTS 128
 
@@ -32,13 +30,22 @@ struct qemu_laiocb {
     size_t nbytes;
     QEMUIOVector *qiov;
     bool is_read;
-    QLIST_ENTRY(qemu_laiocb) node;
+    bool queued;
+    QSIMPLEQ_ENTRY(qemu_laiocb) next;
 };
 
 struct qemu_laio_state {
     io_context_t ctx;
     int efd;
-    int count;
+    int count;          /* requests queued or in flight */
+    int in_flight;      /* requests submitted to the kernel */
+    int max_events;
+
+    /* requests not submitted yet, because we are plugged or the queue is
+     * full */
+    QSIMPLEQ_HEAD(, qemu_laiocb) pending;
+    int nb_pending;
+    int plugged;
 };
 
 static inline ssize_t io_event_ret(struct io_event *ev)
@@ -76,14 +83,66 @@ static void qemu_laio_process_completion(struct qemu_laio_state *s,
     qemu_aio_release(laiocb);
 }
 
+/*
+ * Submits as many pending requests as the queue has room for, with a single
+ * io_submit call per batch.  Requests the kernel refuses with anything but
+ * EAGAIN are completed with the error.
+ */
+static void laio_submit_pending(struct qemu_laio_state *s)
+{
+    struct iocb *iocbs[MAX_EVENTS];
+    struct qemu_laiocb *laiocb;
+    int i, n, ret;
+
+    while (s->nb_pending && s->in_flight < s->max_events) {
+        n = MIN(s->nb_pending, s->max_events - s->in_flight);
+        n = MIN(n, ARRAY_SIZE(iocbs));
+        i = 0;
+        QSIMPLEQ_FOREACH(laiocb, &s->pending, next) {
+            if (i == n) {
+                break;
+            }
+            iocbs[i++] = &laiocb->iocb;
+        }
+
+        ret = io_submit(s->ctx, n, iocbs);
+        if (ret == -EAGAIN) {
+            /* retried when a request completes */
+            break;
+        }
+        if (ret < 0) {
+            /* the first request is bad, fail it and go on with the rest */
+            laiocb = QSIMPLEQ_FIRST(&s->pending);
+            QSIMPLEQ_REMOVE_HEAD(&s->pending, next);
+            s->nb_pending--;
+            laiocb->queued = false;
+            laiocb->ret = ret;
+            qemu_laio_process_completion(s, laiocb);
+            continue;
+        }
+
+        for (i = 0; i < ret; i++) {
+            laiocb = QSIMPLEQ_FIRST(&s->pending);
+            QSIMPLEQ_REMOVE_HEAD(&s->pending, next);
+            laiocb->queued = false;
+        }
+        s->nb_pending -= ret;
+        s->in_flight += ret;
+    }
+}
+
+/*
+ * Completion callbacks may wait for other requests and get here again, so
+ * the events are reaped into an array local to each call.
+ */
 static void qemu_laio_completion_cb(void *opaque)
 {
     struct qemu_laio_state *s = opaque;
 
     while (1) {
-        struct io_event events[MAX_EVENTS];
         uint64_t val;
         ssize_t ret;
+        struct io_event events[MAX_EVENTS];
         struct timespec ts = { 0 };
         int nevents, i;
 
@@ -97,17 +156,32 @@ static void qemu_laio_completion_cb(void *opaque)
         if (ret != 8)
             break;
 
-        do {
-            nevents = io_getevents(s->ctx, val, MAX_EVENTS, events, &ts);
-        } while (nevents == -EINTR);
+        /* val events are ready; reap them MAX_EVENTS at a time */
+        while (val > 0) {
+            do {
+                nevents = io_getevents(s->ctx, MIN(val, MAX_EVENTS),
+                                       MAX_EVENTS, events, &ts);
+            } while (nevents == -EINTR);
+
+            if (nevents <= 0) {
+                break;
+            }
+            val -= MIN(val, nevents);
+            s->in_flight -= nevents;
 
-        for (i = 0; i < nevents; i++) {
-            struct iocb *iocb = events[i].obj;
-            struct qemu_laiocb *laiocb =
-                    container_of(iocb, struct qemu_laiocb, iocb);
+            for (i = 0; i < nevents; i++) {
+                struct iocb *iocb = events[i].obj;
+                struct qemu_laiocb *laiocb =
+                        container_of(iocb, struct qemu_laiocb, iocb);
 
-            laiocb->ret = io_event_ret(&events[i]);
-            qemu_laio_process_completion(s, laiocb);
+                laiocb->ret = io_event_ret(&events[i]);
+                qemu_laio_process_completion(s, laiocb);
+            }
+        }
+
+        /* there is room in the queue again */
+        if (!s->plugged) {
+            laio_submit_pending(s);
         }
     }
 }
@@ -116,18 +190,34 @@ static int qemu_laio_flush_cb(void *opaque)
 {
     struct qemu_laio_state *s = opaque;
 
+    /* Nothing would ever wake us up for requests nobody submits */
+    if (s->in_flight == 0 && s->nb_pending) {
+        laio_submit_pending(s);
+    }
+
     return (s->count > 0) ? 1 : 0;
 }
 
 static void laio_cancel(BlockDriverAIOCB *blockacb)
 {
     struct qemu_laiocb *laiocb = (struct qemu_laiocb *)blockacb;
+    struct qemu_laio_state *s = laiocb->ctx;
     struct io_event event;
     int ret;
 
     if (laiocb->ret != -EINPROGRESS)
         return;
 
+    if (laiocb->queued) {
+        /* not submitted yet */
+        QSIMPLEQ_REMOVE(&s->pending, laiocb, qemu_laiocb, next);
+        s->nb_pending--;
+        laiocb->queued = false;
+        laiocb->ret = -ECANCELED;
+        qemu_laio_process_completion(s, laiocb);
+        return;
+    }
+
     /*
      * Note that as of Linux 2.6.31 neither the block device code nor any
      * filesystem implements cancellation of AIO request.
@@ -136,6 +226,7 @@ static void laio_cancel(BlockDriverAIOCB *blockacb)
     ret = io_cancel(laiocb->ctx->ctx, &laiocb->iocb, &event);
     if (ret == 0) {
         laiocb->ret = -ECANCELED;
+        s->in_flight--;
         return;
     }
 
@@ -163,6 +254,7 @@ BlockDriverAIOCB *laio_submit(BlockDriverState *bs, void *aio_ctx, int fd,
     struct qemu_laiocb *laiocb;
     struct iocb *iocbs;
     off_t offset = sector_num * 512;
+    int ret;
 
     laiocb = qemu_aio_get(&laio_pool, bs, cb, opaque);
     laiocb->nbytes = nb_sectors * 512;
@@ -170,6 +262,7 @@ BlockDriverAIOCB *laio_submit(BlockDriverState *bs, void *aio_ctx, int fd,
     laiocb->ret = -EINPROGRESS;
     laiocb->is_read = (type == QEMU_AIO_READ);
     laiocb->qiov = qiov;
+    laiocb->queued = false;
 
     iocbs = &laiocb->iocb;
 
@@ -189,8 +282,21 @@ BlockDriverAIOCB *laio_submit(BlockDriverState *bs, void *aio_ctx, int fd,
     io_set_eventfd(&laiocb->iocb, s->efd);
     s->count++;
 
-    if (io_submit(s->ctx, 1, &iocbs) < 0)
-        goto out_dec_count;
+    if (!s->plugged && !s->nb_pending && s->in_flight < s->max_events) {
+        /* The callback must not run before we return, so errors are
+         * reported here rather than through laio_submit_pending(). */
+        ret = io_submit(s->ctx, 1, &iocbs);
+        if (ret == 1) {
+            s->in_flight++;
+            return &laiocb->common;
+        } else if (ret != -EAGAIN) {
+            goto out_dec_count;
+        }
+    }
+
+    laiocb->queued = true;
+    QSIMPLEQ_INSERT_TAIL(&s->pending, laiocb, next);
+    s->nb_pending++;
     return &laiocb->common;
 
 out_dec_count:
@@ -200,6 +306,51 @@ out_free_aiocb:
     return NULL;
 }
 
+/*
+ * Between laio_io_plug() and laio_io_unplug(), requests are only queued;
+ * the last unplug submits them together.  Plugs nest.
+ */
+void laio_io_plug(void *aio_ctx)
+{
+    struct qemu_laio_state *s = aio_ctx;
+
+    s->plugged++;
+}
+
+void laio_io_unplug(void *aio_ctx)
+{
+    struct qemu_laio_state *s = aio_ctx;
+
+    assert(s->plugged > 0);
+    if (--s->plugged == 0) {
+        laio_submit_pending(s);
+    }
+}
+
+/*
+ * Changes the queue size.  Only possible while no request is in flight,
+ * which is the case right after the device has been opened.
+ */
+int laio_set_max_events(void *aio_ctx, int max_events)
+{
+    struct qemu_laio_state *s = aio_ctx;
+    io_context_t ctx = 0;
+
+    if (max_events <= 0) {
+        return -EINVAL;
+    }
+    if (s->count) {
+        return -EBUSY;
+    }
+    if (io_setup(max_events, &ctx) != 0) {
+        return -EINVAL;
+    }
+    io_destroy(s->ctx);
+    s->ctx = ctx;
+    s->max_events = max_events;
+    return 0;
+}
+
 void *laio_init(void)
 {
     struct qemu_laio_state *s;
@@ -213,6 +364,9 @@ void *laio_init(void)
     if (io_setup(MAX_EVENTS, &s->ctx) != 0)
         goto out_close_efd;
 
+    s->max_events = MAX_EVENTS;
+    QSIMPLEQ_INIT(&s->pending);
+
     qemu_aio_set_fd_handler(s->efd, qemu_laio_completion_cb, NULL,
         qemu_laio_flush_cb, s);
 
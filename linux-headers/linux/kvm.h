@@ -936,6 +936,35 @@ struct kvm_user_update_page {
 };
 
 #define KVM_USER_UPDATE_PAGEDESC _IOW(KVMIO, 0xf6, struct kvm_user_update_page)
+
+/* Used by user mode qemu to register all memory of a loaded image at once.
+   Like KVM_CAP_MEM_FIXED_REGION and KVM_USER_UPDATE_PAGEDESC this is not
+   an upstream KVM interface but one between qemu and the user mode s2e
+   backend; see docs/user-kvm-mem-batch.txt.  */
+#define KVM_CAP_USER_MEM_BATCH 257
+struct kvm_user_mem_segment {
+    __u64 start_address;
+    __u64 size;
+    __u32 prot;
+    __u32 pad;
+};
+
+/* ELF object that owns the segments in [start_address, end_address) */
+struct kvm_user_mem_image {
+    __u64 name;                 /* const char * */
+    __u64 load_bias;
+    __u64 start_address;
+    __u64 end_address;
+};
+
+struct kvm_user_mem_batch {
+    __u32 nr_segments;
+    __u32 nr_images;
+    __u64 segments;             /* struct kvm_user_mem_segment * */
+    __u64 images;               /* struct kvm_user_mem_image * */
+};
+
+#define KVM_USER_REGISTER_MEM_BATCH _IOW(KVMIO, 0xf7, struct kvm_user_mem_batch)
 #define KVM_DEV_ASSIGN_ENABLE_IOMMU	(1 << 0)
 #define KVM_DEV_ASSIGN_PCI_2_3		(1 << 1)
 #define KVM_DEV_ASSIGN_MASK_INTX	(1 << 2)
@@ -0,0 +1,173 @@
+/*
+ *  AFL coverage map and fork server
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* When run by afl-fuzz, __AFL_SHM_ID names the shared memory segment
+   of the coverage map, which the translated code updates directly (see
+   gen_tb_coverage()).  Only the code of the main binary is covered
+   unless AFL_INST_LIBS is set.
+
+   The fork server runs once the binary is loaded: for each test case
+   it forks a child that starts at the entry point, so exec and loading
+   are paid once.  Children report the blocks of the main binary they
+   translate, and the server translates them too so that the following
+   children inherit them.  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/shm.h>
+#include <sys/wait.h>
+
+#include "qemu.h"
+
+/* control and status pipes set up by afl-fuzz */
+#define AFL_FORKSRV_FD 198
+
+int afl_tsl_fd = -1;
+
+typedef struct AFLRequest {
+    uint64_t pc;
+    uint64_t cs_base;
+    uint64_t flags;
+} AFLRequest;
+
+void afl_init(struct image_info *info)
+{
+    const char *id = getenv("__AFL_SHM_ID");
+    void *map;
+
+    if (!id) {
+        return;
+    }
+    map = shmat(atoi(id), NULL, 0);
+    if (map == (void *)-1) {
+        perror("qemu: __AFL_SHM_ID");
+        exit(1);
+    }
+    /* the parent checks that the map is not empty to tell that the
+       binary is instrumented */
+    *(uint8_t *)map = 1;
+    tb_coverage_map = map;
+    if (getenv("AFL_INST_LIBS")) {
+        tb_coverage_start = 0;
+        tb_coverage_end = (target_ulong)-1;
+    } else {
+        tb_coverage_start = info->start_code;
+        tb_coverage_end = info->end_code;
+    }
+}
+
+static ssize_t afl_read(int fd, void *buf, size_t len)
+{
+    ssize_t n;
+
+    do {
+        n = read(fd, buf, len);
+    } while (n < 0 && errno == EINTR);
+    return n;
+}
+
+/* Translate the blocks reported by a child until it exits.  */
+static void afl_wait_tsl(CPUArchState *env, int fd)
+{
+    AFLRequest req;
+
+    while (afl_read(fd, &req, sizeof(req)) == sizeof(req)) {
+        tb_prefetch(env, req.pc, req.cs_base, req.flags);
+    }
+    close(fd);
+}
+
+void afl_request_tsl(TranslationBlock *tb)
+{
+    AFLRequest req;
+
+    /* Other code may be mapped differently in the server.  */
+    if (tb->pc < tb_coverage_start || tb->pc + tb->size > tb_coverage_end ||
+        tb->cflags != 0) {
+        return;
+    }
+    req.pc = tb->pc;
+    req.cs_base = tb->cs_base;
+    req.flags = tb->flags;
+    if (write(afl_tsl_fd, &req, sizeof(req)) != sizeof(req)) {
+        close(afl_tsl_fd);
+        afl_tsl_fd = -1;
+    }
+}
+
+/* The fork server waits for the pipe to be closed: do not keep it open
+   in processes the guest forks.  */
+void afl_fork_child(void)
+{
+    if (afl_tsl_fd >= 0) {
+        close(afl_tsl_fd);
+        afl_tsl_fd = -1;
+    }
+}
+
+void afl_forkserver(CPUArchState *env)
+{
+    uint32_t msg = 0;
+    int tsl[2], status;
+    pid_t child;
+
+    if (!tb_coverage_map) {
+        return;
+    }
+    /* afl-fuzz is not running us as a fork server */
+    if (write(AFL_FORKSRV_FD + 1, &msg, 4) != 4) {
+        return;
+    }
+    for (;;) {
+        if (afl_read(AFL_FORKSRV_FD, &msg, 4) != 4) {
+            exit(2);
+        }
+        if (pipe(tsl) < 0) {
+            perror("qemu: fork server");
+            exit(4);
+        }
+        fcntl(tsl[1], F_SETFD, FD_CLOEXEC);
+        child = fork();
+        if (child < 0) {
+            perror("qemu: fork server");
+            exit(4);
+        }
+        if (child == 0) {
+            close(AFL_FORKSRV_FD);
+            close(AFL_FORKSRV_FD + 1);
+            close(tsl[0]);
+            afl_tsl_fd = tsl[1];
+            env->coverage_prev = 0;
+            return;
+        }
+        close(tsl[1]);
+        if (write(AFL_FORKSRV_FD + 1, &child, 4) != 4) {
+            exit(5);
+        }
+        afl_wait_tsl(env, tsl[0]);
+        if (waitpid(child, &status, 0) < 0) {
+            exit(6);
+        }
+        if (write(AFL_FORKSRV_FD + 1, &status, 4) != 4) {
+            exit(7);
+        }
+    }
+}
@@ -16,6 +16,7 @@
 
 #include "qemu.h"
 #include "disas.h"
+#include "qemu-barrier.h"
 
 #ifdef _ARCH_PPC64
 #undef ARCH_DLINFO
@@ -1373,6 +1374,7 @@ static abi_ulong create_elf_tables(abi_ulong p, int argc, int envc,
     for (i = 0; i < 16; i++) {
         k_rand_bytes[i] = rand();
     }
+    replay_random(k_rand_bytes, sizeof(k_rand_bytes));
     sp -= 16;
     u_rand_bytes = sp;
     /* FIXME - check return value of memcpy_to_target() for failure */
@@ -1679,6 +1681,10 @@ static void load_elf_image(const char *image_name, int image_fd,
         probe_guest_base(image_name, loaddr, hiaddr);
     }
     load_bias = load_addr - loaddr;
+#ifdef CONFIG_USER_KVM
+    ram_memory_add_image(image_name, load_bias, load_addr,
+                         hiaddr + load_bias);
+#endif
 
 #ifdef CONFIG_USE_FDPIC
     {
@@ -1796,9 +1802,7 @@ static void load_elf_image(const char *image_name, int image_fd,
         info->brk = info->end_code;
     }
 
-    if (qemu_log_enabled()) {
-        load_symbols(ehdr, image_fd, load_bias);
-    }
+    load_symbols(ehdr, image_fd, load_bias);
 
     close(image_fd);
     return;
@@ -1841,6 +1845,42 @@ static void load_elf_interp(const char *filename, struct image_info *info,
     exit(-1);
 }
 
+/* Symbol information for one loaded ELF object.  The file is mapped
+   read-only when the image is loaded, but the symbol table is only
+   parsed on the first lookup.  The sorted table is kept relative to
+   the load bias, so that it can be shared through the symbol cache
+   between runs that load the object at different addresses.
+
+   Lookups can come from several threads at once (translation, the
+   perf map, logging), so the first one loads the table under
+   syminfo_mutex.  The table is published before its size, and
+   "loaded" is set last; a lookup that sees "loaded" needs no lock.  */
+struct elf_syminfo {
+    struct syminfo s;
+    const uint8_t *image;
+    size_t image_size;
+    struct stat image_stat;
+    abi_ulong load_bias;
+    abi_ulong e_shoff;
+    int e_shnum;
+    bool loaded;
+};
+
+/* Header of a symbol cache file.  The file name carries the identity
+   of the ELF object; the header guards against stale or foreign
+   entries.  The filtered, sorted symbols follow the header.  */
+#define ELF_SYMCACHE_MAGIC   0x51534331 /* "QSC1" */
+
+struct elf_symcache_header {
+    uint32_t magic;
+    uint16_t machine;
+    uint16_t sym_size;
+    uint64_t file_size;
+    uint64_t file_mtime;
+    uint32_t nsyms;
+    uint32_t pad;
+};
+
 static int symfind(const void *s0, const void *s1)
 {
     target_ulong addr = *(target_ulong *)s0;
@@ -1854,18 +1894,45 @@ static int symfind(const void *s0, const void *s1)
     return result;
 }
 
+#if defined(CONFIG_USE_NPTL)
+static pthread_mutex_t syminfo_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static void elf_syminfo_load(struct elf_syminfo *es);
+
 static const char *lookup_symbolxx(struct syminfo *s, target_ulong orig_addr)
 {
-#if ELF_CLASS == ELFCLASS32
-    struct elf_sym *syms = s->disas_symtab.elf32;
-#else
-    struct elf_sym *syms = s->disas_symtab.elf64;
-#endif
+    struct elf_syminfo *es = container_of(s, struct elf_syminfo, s);
+    target_ulong addr = orig_addr - es->load_bias;
+    struct elf_sym *syms;
 
     // binary search
     struct elf_sym *sym;
 
-    sym = bsearch(&orig_addr, syms, s->disas_num_syms, sizeof(*syms), symfind);
+    if (!es->loaded) {
+#if defined(CONFIG_USE_NPTL)
+        pthread_mutex_lock(&syminfo_mutex);
+#endif
+        if (!es->loaded) {
+            elf_syminfo_load(es);
+            smp_wmb();
+            es->loaded = true;
+        }
+#if defined(CONFIG_USE_NPTL)
+        pthread_mutex_unlock(&syminfo_mutex);
+#endif
+    }
+    smp_rmb();
+#if ELF_CLASS == ELFCLASS32
+    syms = s->disas_symtab.elf32;
+#else
+    syms = s->disas_symtab.elf64;
+#endif
+    if (s->disas_num_syms == 0) {
+        return "";
+    }
+
+    sym = bsearch(&addr, syms, s->disas_num_syms, sizeof(*syms), symfind);
     if (sym != NULL) {
         return s->disas_strtab + sym->st_name;
     }
@@ -1883,21 +1950,125 @@ static int symcmp(const void *s0, const void *s1)
         : ((sym0->st_value > sym1->st_value) ? 1 : 0);
 }
 
-/* Best attempt to load symbols from this ELF object. */
-static void load_symbols(struct elfhdr *hdr, int fd, abi_ulong load_bias)
+static char *elf_symcache_path(const struct elf_syminfo *es)
+{
+    if (!symcache_dir) {
+        return NULL;
+    }
+    return g_strdup_printf("%s/" TARGET_ARCH "-%" PRIx64 "-%" PRIx64
+                           "-%" PRIx64 "-%" PRIx64 ".sym", symcache_dir,
+                           (uint64_t)es->image_stat.st_dev,
+                           (uint64_t)es->image_stat.st_ino,
+                           (uint64_t)es->image_stat.st_size,
+                           (uint64_t)es->image_stat.st_mtime);
+}
+
+static void elf_symcache_fill_header(const struct elf_syminfo *es,
+                                     struct elf_symcache_header *hdr,
+                                     int nsyms)
+{
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->magic = ELF_SYMCACHE_MAGIC;
+    hdr->machine = ELF_MACHINE;
+    hdr->sym_size = sizeof(struct elf_sym);
+    hdr->file_size = es->image_stat.st_size;
+    hdr->file_mtime = es->image_stat.st_mtime;
+    hdr->nsyms = nsyms;
+}
+
+/* Map the sorted symbol table from the cache.  Returns the number of
+   symbols, or 0 if there is no usable cache entry.  */
+static int elf_symcache_map(const struct elf_syminfo *es,
+                            struct elf_sym **psyms)
+{
+    struct elf_symcache_header want, *hdr;
+    struct stat st;
+    char *path;
+    void *map;
+    int fd;
+
+    path = elf_symcache_path(es);
+    if (!path) {
+        return 0;
+    }
+    fd = open(path, O_RDONLY);
+    g_free(path);
+    if (fd < 0) {
+        return 0;
+    }
+    if (fstat(fd, &st) < 0 || st.st_size < sizeof(*hdr)) {
+        close(fd);
+        return 0;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return 0;
+    }
+
+    hdr = map;
+    elf_symcache_fill_header(es, &want, hdr->nsyms);
+    if (memcmp(hdr, &want, sizeof(want)) != 0 || hdr->nsyms == 0
+        || st.st_size != sizeof(*hdr) + hdr->nsyms * sizeof(struct elf_sym)) {
+        munmap(map, st.st_size);
+        return 0;
+    }
+
+    *psyms = (struct elf_sym *)(hdr + 1);
+    return hdr->nsyms;
+}
+
+/* Best effort: publish the sorted table for later runs.  The entry is
+   written under a temporary name and renamed, so that concurrent
+   readers never observe a partial file.  */
+static void elf_symcache_store(const struct elf_syminfo *es,
+                               const struct elf_sym *syms, int nsyms)
+{
+    struct elf_symcache_header hdr;
+    char *path, *tmp;
+    size_t len = nsyms * sizeof(*syms);
+    int fd;
+
+    path = elf_symcache_path(es);
+    if (!path) {
+        return;
+    }
+    tmp = g_strdup_printf("%s.%d", path, (int)getpid());
+    fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (fd >= 0) {
+        elf_symcache_fill_header(es, &hdr, nsyms);
+        if (write(fd, &hdr, sizeof(hdr)) == sizeof(hdr)
+            && write(fd, syms, len) == len
+            && close(fd) == 0) {
+            fd = -1;
+            if (rename(tmp, path) < 0) {
+                unlink(tmp);
+            }
+        } else {
+            close(fd);
+            unlink(tmp);
+        }
+    }
+    g_free(tmp);
+    g_free(path);
+}
+
+/* Parse, filter and sort the symbol table of a mapped ELF object.
+   Called with syminfo_mutex held on the first lookup that reaches
+   this object.  */
+static void elf_syminfo_load(struct elf_syminfo *es)
 {
     int i, shnum, nsyms, sym_idx = 0, str_idx = 0;
     struct elf_shdr *shdr;
-    char *strings = NULL;
-    struct syminfo *s = NULL;
     struct elf_sym *new_syms, *syms = NULL;
 
-    shnum = hdr->e_shnum;
+    shnum = es->e_shnum;
     i = shnum * sizeof(struct elf_shdr);
-    shdr = (struct elf_shdr *)alloca(i);
-    if (pread(fd, shdr, i, hdr->e_shoff) != i) {
+    if (shnum == 0 || es->e_shoff + i > es->image_size) {
         return;
     }
+    shdr = (struct elf_shdr *)alloca(i);
+    memcpy(shdr, es->image + es->e_shoff, i);
 
     bswap_shdr(shdr, shnum);
     for (i = 0; i < shnum; ++i) {
@@ -1912,23 +2083,26 @@ static void load_symbols(struct elfhdr *hdr, int fd, abi_ulong load_bias)
     return;
 
  found:
-    /* Now know where the strtab and symtab are.  Snarf them.  */
-    s = malloc(sizeof(*s));
-    if (!s) {
-        goto give_up;
+    /* Now know where the strtab and symtab are.  The string table is
+       used in place from the mapping.  */
+    if (str_idx >= shnum
+        || shdr[str_idx].sh_offset + shdr[str_idx].sh_size > es->image_size
+        || shdr[sym_idx].sh_offset + shdr[sym_idx].sh_size > es->image_size) {
+        return;
     }
+    es->s.disas_strtab = (const char *)es->image + shdr[str_idx].sh_offset;
 
-    i = shdr[str_idx].sh_size;
-    s->disas_strtab = strings = malloc(i);
-    if (!strings || pread(fd, strings, i, shdr[str_idx].sh_offset) != i) {
-        goto give_up;
+    nsyms = elf_symcache_map(es, &syms);
+    if (nsyms) {
+        goto done;
     }
 
     i = shdr[sym_idx].sh_size;
     syms = malloc(i);
-    if (!syms || pread(fd, syms, i, shdr[sym_idx].sh_offset) != i) {
-        goto give_up;
+    if (!syms) {
+        return;
     }
+    memcpy(syms, es->image + shdr[sym_idx].sh_offset, i);
 
     nsyms = i / sizeof(struct elf_sym);
     for (i = 0; i < nsyms; ) {
@@ -1936,7 +2110,8 @@ static void load_symbols(struct elfhdr *hdr, int fd, abi_ulong load_bias)
         /* Throw away entries which we do not need.  */
         if (syms[i].st_shndx == SHN_UNDEF
             || syms[i].st_shndx >= SHN_LORESERVE
-            || ELF_ST_TYPE(syms[i].st_info) != STT_FUNC) {
+            || ELF_ST_TYPE(syms[i].st_info) != STT_FUNC
+            || syms[i].st_name >= shdr[str_idx].sh_size) {
             if (i < --nsyms) {
                 syms[i] = syms[nsyms];
             }
@@ -1945,14 +2120,14 @@ static void load_symbols(struct elfhdr *hdr, int fd, abi_ulong load_bias)
             /* The bottom address bit marks a Thumb or MIPS16 symbol.  */
             syms[i].st_value &= ~(target_ulong)1;
 #endif
-            syms[i].st_value += load_bias;
             i++;
         }
     }
 
     /* No "useful" symbol.  */
     if (nsyms == 0) {
-        goto give_up;
+        free(syms);
+        return;
     }
 
     /* Attempt to free the storage associated with the local symbols
@@ -1961,28 +2136,52 @@ static void load_symbols(struct elfhdr *hdr, int fd, abi_ulong load_bias)
        many symbols we managed to discard.  */
     new_syms = realloc(syms, nsyms * sizeof(*syms));
     if (new_syms == NULL) {
-        goto give_up;
+        free(syms);
+        return;
     }
     syms = new_syms;
 
     qsort(syms, nsyms, sizeof(*syms), symcmp);
+    elf_symcache_store(es, syms, nsyms);
 
-    s->disas_num_syms = nsyms;
+ done:
 #if ELF_CLASS == ELFCLASS32
-    s->disas_symtab.elf32 = syms;
+    es->s.disas_symtab.elf32 = syms;
 #else
-    s->disas_symtab.elf64 = syms;
+    es->s.disas_symtab.elf64 = syms;
 #endif
-    s->lookup_symbol = lookup_symbolxx;
-    s->next = syminfos;
-    syminfos = s;
+    smp_wmb();
+    es->s.disas_num_syms = nsyms;
+}
 
-    return;
+/* Register this ELF object for symbol lookup.  Only the mapping is
+   set up here; the symbol table itself is loaded on demand.  */
+static void load_symbols(struct elfhdr *hdr, int fd, abi_ulong load_bias)
+{
+    struct elf_syminfo *es;
+    struct stat st;
+    void *image;
+
+    if (hdr->e_shnum == 0 || fstat(fd, &st) < 0 || st.st_size == 0) {
+        return;
+    }
+
+    image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (image == MAP_FAILED) {
+        return;
+    }
 
-give_up:
-    free(s);
-    free(strings);
-    free(syms);
+    es = g_malloc0(sizeof(*es));
+    es->image = image;
+    es->image_size = st.st_size;
+    es->image_stat = st;
+    es->load_bias = load_bias;
+    es->e_shoff = hdr->e_shoff;
+    es->e_shnum = hdr->e_shnum;
+
+    es->s.lookup_symbol = lookup_symbolxx;
+    es->s.next = syminfos;
+    syminfos = &es->s;
 }
 
 int load_elf_binary(struct linux_binprm * bprm, struct target_pt_regs * regs,
@@ -1996,6 +2195,11 @@ int load_elf_binary(struct linux_binprm * bprm, struct target_pt_regs * regs,
     info->mmap = 0;
     info->rss = 0;
 
+#ifdef CONFIG_USER_KVM
+    /* Register the memory of the image, the interpreter and the stack
+       with the backend in one go, once everything is laid out.  */
+    ram_memory_begin();
+#endif
     load_elf_image(bprm->filename, bprm->fd, info,
                    &elf_interpreter, bprm->buf);
 
@@ -2056,6 +2260,9 @@ int load_elf_binary(struct linux_binprm * bprm, struct target_pt_regs * regs,
 #ifdef USE_ELF_CORE_DUMP
     bprm->core_dump = &elf_core_dump;
 #endif
+#ifdef CONFIG_USER_KVM
+    ram_memory_commit();
+#endif
 
     return 0;
 }
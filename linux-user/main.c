@@ -69,6 +69,10 @@ static void usage(void);
 
 static const char *interp_prefix = CONFIG_QEMU_INTERP_PREFIX;
 const char *qemu_uname_release = CONFIG_UNAME_RELEASE;
+/* Directory holding sorted ELF symbol tables across runs, if any.  */
+const char *symcache_dir;
+/* File through which translated code is shared with other processes.  */
+static const char *tb_store_path;
 
 /* XXX: on x86 MAP_GROWSDOWN only works if ESP <= address + 32, so
    we allocate a bigger stack. Need a better solution, for example
@@ -165,14 +169,14 @@ static int pending_cpus;
 /* Make sure everything is in a consistent state for calling fork().  */
 void fork_start(void)
 {
-    pthread_mutex_lock(&tb_lock);
-    pthread_mutex_lock(&exclusive_lock);
     mmap_fork_start();
+    pthread_mutex_lock(&exclusive_lock);
+    pthread_mutex_lock(&tb_lock);
+    tb_decode_cache_fork_start();
 }
 
 void fork_end(int child)
 {
-    mmap_fork_end(child);
     if (child) {
         /* Child processes created by fork() only have a single thread.
            Discard information about the parent threads.  */
@@ -184,11 +188,14 @@ void fork_end(int child)
         pthread_cond_init(&exclusive_cond, NULL);
         pthread_cond_init(&exclusive_resume, NULL);
         pthread_mutex_init(&tb_lock, NULL);
+        tb_decode_cache_fork_end(child);
         gdbserver_fork(thread_env);
     } else {
-        pthread_mutex_unlock(&exclusive_lock);
+        tb_decode_cache_fork_end(child);
         pthread_mutex_unlock(&tb_lock);
+        pthread_mutex_unlock(&exclusive_lock);
     }
+    mmap_fork_end(child);
 }
 
 /* Wait for pending exclusive operations to complete.  The exclusive lock
@@ -229,10 +236,23 @@ static inline void end_exclusive(void)
     pthread_mutex_unlock(&exclusive_lock);
 }
 
+/* Flush the translation buffer if another CPU asked for it (see
+   tb_flush), now that this one does not run generated code.  */
+static void cpu_exec_flush(CPUArchState *env)
+{
+    start_exclusive();
+    if (tb_flush_pending) {
+        tb_flush_exclusive(env);
+    }
+    end_exclusive();
+}
+
 /* Wait for exclusive ops to finish, and begin cpu execution.  */
 static inline void cpu_exec_start(CPUArchState *env)
 {
-
+    if (unlikely(tb_flush_pending)) {
+        cpu_exec_flush(env);
+    }
     pthread_mutex_lock(&exclusive_lock);
     exclusive_idle();
     env->running = 1;
@@ -252,6 +272,9 @@ static inline void cpu_exec_end(CPUArchState *env)
     }
     exclusive_idle();
     pthread_mutex_unlock(&exclusive_lock);
+    if (unlikely(tb_flush_pending)) {
+        cpu_exec_flush(env);
+    }
 }
 
 void cpu_list_lock(void)
@@ -671,6 +694,8 @@ do_kernel_trap(CPUARMState *env)
     return 0;
 }
 
+/* Store exclusive with every other CPU stopped.  Only used for the
+   cases helper_strex cannot do with a host compare-and-swap.  */
 static int do_strex(CPUARMState *env)
 {
     uint32_t val;
@@ -3241,6 +3266,40 @@ static void handle_arg_reserved_va(const char *arg)
 }
 #endif
 
+static void handle_arg_symcache(const char *arg)
+{
+    symcache_dir = strdup(arg);
+}
+
+static void handle_arg_perfmap(const char *arg)
+{
+    tb_perfmap_enable();
+}
+
+static void handle_arg_tbprof(const char *arg)
+{
+    int top = atoi(arg);
+    if (top <= 0) {
+        usage();
+    }
+    tb_profile_enable(top);
+}
+
+static void handle_arg_record(const char *arg)
+{
+    replay_init(arg, REPLAY_RECORD);
+}
+
+static void handle_arg_replay(const char *arg)
+{
+    replay_init(arg, REPLAY_PLAY);
+}
+
+static void handle_arg_tbstore(const char *arg)
+{
+    tb_store_path = strdup(arg);
+}
+
 static void handle_arg_singlestep(const char *arg)
 {
     singlestep = 1;
@@ -3298,6 +3357,18 @@ static const struct qemu_argument arg_table[] = {
      "logfile",     "override default logfile location"},
     {"p",          "QEMU_PAGESIZE",    true,  handle_arg_pagesize,
      "pagesize",   "set the host page size to 'pagesize'"},
+    {"symcache",   "QEMU_SYMCACHE",    true,  handle_arg_symcache,
+     "dir",        "cache sorted ELF symbol tables in 'dir'"},
+    {"perfmap",    "QEMU_PERFMAP",     false, handle_arg_perfmap,
+     "",           "write translated blocks to /tmp/perf-<pid>.map"},
+    {"tbprof",     "QEMU_TBPROF",      true,  handle_arg_tbprof,
+     "count",      "count block executions, report the 'count' hottest"},
+    {"record",     "QEMU_RECORD",      true,  handle_arg_record,
+     "file",       "log syscall results and signals to 'file'"},
+    {"replay",     "QEMU_REPLAY",      true,  handle_arg_replay,
+     "file",       "replay a run recorded with -record"},
+    {"tbstore",    "QEMU_TB_STORE",    true,  handle_arg_tbstore,
+     "file",       "share translated code with other processes via 'file'"},
     {"singlestep", "QEMU_SINGLESTEP",  false, handle_arg_singlestep,
      "",           "run in singlestep mode"},
     {"strace",     "QEMU_STRACE",      false, handle_arg_strace,
@@ -3678,6 +3749,10 @@ int main(int argc, char **argv, char **envp)
        the real value of GUEST_BASE into account.  */
     tcg_prologue_init(&tcg_ctx);
 #endif
+    if (tb_store_path) {
+        tb_store_init(tb_store_path, env);
+    }
+    afl_init(info);
 
 #if defined(TARGET_I386)
 /* what are the flags for?*/
@@ -3997,6 +4072,8 @@ int main(int argc, char **argv, char **envp)
 	cpu_synchronize_all_post_init();
 	user_kvm_cpu_exec(env);
 #else
+       /* each test case starts here when run by afl-fuzz */
+       afl_forkserver(env);
        cpu_loop(env);
 #endif
    return 0;
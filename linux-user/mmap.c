@@ -39,7 +39,7 @@
 #endif
 //#define DEBUG_MMAP
 #ifdef CONFIG_USER_KVM
-void ram_memory_change(abi_ulong start, abi_ulong size, int prot) {
+static void ram_memory_register(abi_ulong start, abi_ulong size, int prot) {
 	int ret = 0;
 		debug_page_alloc();
         	ret = kvm_register_fixed_memory_region(NULL, start, size, 0);
@@ -53,6 +53,167 @@ void ram_memory_change(abi_ulong start, abi_ulong size, int prot) {
 		abort();
 	}
 }
+
+/* Load-time transaction.  While an executable and its interpreter are
+   being laid out, memory registrations and page descriptor updates are
+   only queued.  ram_memory_commit() hands the registrations to the
+   backend in one batch, together with the identity of the ELF objects
+   that were loaded, and then replays the page descriptor updates, so
+   the backend sees them in the same order as without a batch.  Without
+   KVM_CAP_USER_MEM_BATCH nothing is queued.  See
+   docs/user-kvm-mem-batch.txt for the interface.  */
+static struct {
+    bool open;
+    bool active;
+    int nr_segments, max_segments;
+    int nr_images, max_images;
+    int nr_pages, max_pages;
+    struct kvm_user_mem_segment *segments;
+    struct kvm_user_mem_image *images;
+    struct kvm_user_update_page *pages;
+} ram_batch;
+
+void ram_memory_begin(void)
+{
+    assert(!ram_batch.open);
+    ram_batch.open = true;
+    ram_batch.active = kvm_user_has_memory_batch();
+}
+
+void ram_memory_add_image(const char *name, abi_ulong load_bias,
+                          abi_ulong start, abi_ulong end)
+{
+    struct kvm_user_mem_image *image;
+
+    if (!ram_batch.active) {
+        return;
+    }
+    if (ram_batch.nr_images == ram_batch.max_images) {
+        ram_batch.max_images = ram_batch.max_images * 2 + 2;
+        ram_batch.images = g_renew(struct kvm_user_mem_image,
+                                   ram_batch.images, ram_batch.max_images);
+    }
+    image = &ram_batch.images[ram_batch.nr_images++];
+    image->name = (uintptr_t)g_strdup(name);
+    image->load_bias = load_bias;
+    image->start_address = start;
+    image->end_address = end;
+}
+
+/* Merge each queued segment into the one before it if they have the
+   same protection and overlap or touch, e.g. a PT_LOAD segment and its
+   bss.  Segments with different protections are never merged, and the
+   queue order is kept, since a later registration of an overlapping
+   range takes precedence.  */
+static void ram_batch_coalesce(void)
+{
+    struct kvm_user_mem_segment *seg = ram_batch.segments;
+    int i, n = 0;
+
+    if (ram_batch.nr_segments == 0) {
+        return;
+    }
+    for (i = 1; i < ram_batch.nr_segments; i++) {
+        uint64_t start = seg[n].start_address;
+        uint64_t end = start + seg[n].size;
+        uint64_t i_end = seg[i].start_address + seg[i].size;
+
+        if (seg[i].prot == seg[n].prot
+            && seg[i].start_address <= end && i_end >= start) {
+            start = MIN(start, seg[i].start_address);
+            end = MAX(end, i_end);
+            seg[n].start_address = start;
+            seg[n].size = end - start;
+        } else {
+            seg[++n] = seg[i];
+        }
+    }
+    ram_batch.nr_segments = n + 1;
+}
+
+void ram_memory_commit(void)
+{
+    struct kvm_user_mem_batch batch;
+    struct kvm_user_update_page *page;
+    int i;
+
+    assert(ram_batch.open);
+    ram_batch.open = false;
+    if (!ram_batch.active) {
+        return;
+    }
+    ram_batch.active = false;
+
+    ram_batch_coalesce();
+    batch.nr_segments = ram_batch.nr_segments;
+    batch.nr_images = ram_batch.nr_images;
+    batch.segments = (uintptr_t)ram_batch.segments;
+    batch.images = (uintptr_t)ram_batch.images;
+    if (batch.nr_segments
+        && kvm_user_register_memory_batch(&batch) < 0) {
+        for (i = 0; i < ram_batch.nr_segments; i++) {
+            ram_memory_register(ram_batch.segments[i].start_address,
+                                ram_batch.segments[i].size,
+                                ram_batch.segments[i].prot);
+        }
+    }
+
+    /* Page descriptors only after the regions they describe */
+    for (i = 0; i < ram_batch.nr_pages; i++) {
+        page = &ram_batch.pages[i];
+        kvm_user_update_pageDesc(page->start_address, page->sizeOrend,
+                                 page->flags, page->Invalidate);
+    }
+
+    for (i = 0; i < ram_batch.nr_images; i++) {
+        g_free((char *)(uintptr_t)ram_batch.images[i].name);
+    }
+    ram_batch.nr_segments = 0;
+    ram_batch.nr_images = 0;
+    ram_batch.nr_pages = 0;
+}
+
+void ram_memory_update_page(target_ulong start, target_ulong sizeOrend,
+                            int flags, bool invalidate)
+{
+    struct kvm_user_update_page *page;
+
+    if (!ram_batch.active) {
+        kvm_user_update_pageDesc(start, sizeOrend, flags, invalidate);
+        return;
+    }
+    if (ram_batch.nr_pages == ram_batch.max_pages) {
+        ram_batch.max_pages = ram_batch.max_pages * 2 + 8;
+        ram_batch.pages = g_renew(struct kvm_user_update_page,
+                                  ram_batch.pages, ram_batch.max_pages);
+    }
+    page = &ram_batch.pages[ram_batch.nr_pages++];
+    page->Invalidate = invalidate;
+    page->start_address = start;
+    page->sizeOrend = sizeOrend;
+    page->flags = flags;
+}
+
+void ram_memory_change(abi_ulong start, abi_ulong size, int prot)
+{
+    struct kvm_user_mem_segment *seg;
+
+    if (!ram_batch.active) {
+        ram_memory_register(start, size, prot);
+        return;
+    }
+    if (ram_batch.nr_segments == ram_batch.max_segments) {
+        ram_batch.max_segments = ram_batch.max_segments * 2 + 8;
+        ram_batch.segments = g_renew(struct kvm_user_mem_segment,
+                                     ram_batch.segments,
+                                     ram_batch.max_segments);
+    }
+    seg = &ram_batch.segments[ram_batch.nr_segments++];
+    seg->start_address = start;
+    seg->size = size;
+    seg->prot = prot;
+    seg->pad = 0;
+}
 #else
 void ram_memory_change(abi_ulong start, abi_ulong size, int prot) {
 	fprintf(stderr, "%s: start = %x, size = %x\n", __FUNCTION__,start,size);
@@ -411,6 +572,7 @@ abi_long target_mmap(abi_ulong start, abi_ulong len, int prot,
                      int flags, int fd, abi_ulong offset)
 {
     abi_ulong ret, end, real_start, real_end, retaddr, host_offset, host_len;
+    int replay_prot = -1, replay_file = -1;
     mmap_lock();
 #ifdef DEBUG_MMAP
     {
@@ -443,6 +605,27 @@ abi_long target_mmap(abi_ulong start, abi_ulong len, int prot,
         goto fail;
     }
 
+    if (replay_mode == REPLAY_PLAY &&
+        replay_mmap_addr(&start, &replay_file)) {
+        /* Put the mapping where the recorded run got it.  The guest's
+           file is not open on replay: map the recorded file again,
+           privately so that replay never writes to it, or fill an
+           anonymous mapping with the contents from the log.  */
+        flags |= MAP_FIXED;
+        if (!(flags & MAP_ANONYMOUS)) {
+            if (replay_file >= 0) {
+                fd = replay_file;
+                flags = (flags & ~MAP_TYPE) | MAP_PRIVATE;
+            } else {
+                flags |= MAP_ANONYMOUS;
+                fd = -1;
+                offset = 0;
+                replay_prot = prot;
+                prot |= PROT_READ | PROT_WRITE;
+            }
+        }
+    }
+
     len = TARGET_PAGE_ALIGN(len);
     if (len == 0)
         goto the_end;
@@ -609,9 +792,21 @@ abi_long target_mmap(abi_ulong start, abi_ulong len, int prot,
  the_end:
     debug_page_alloc();
     tb_invalidate_phys_range(start, start + len, 0);
+    if (replay_capture && !(flags & MAP_ANONYMOUS)) {
+        replay_record_file(start, len, fd, offset);
+    } else if (replay_prot >= 0) {
+        replay_apply_writes();
+        target_mprotect(start, len, replay_prot);
+    }
+    if (replay_file >= 0) {
+        close(replay_file);
+    }
     mmap_unlock();
     return start;
 fail:
+    if (replay_file >= 0) {
+        close(replay_file);
+    }
     mmap_unlock();
     return -1;
 }
@@ -792,6 +987,11 @@ abi_long target_mremap(abi_ulong old_addr, abi_ulong old_size,
 	    ram_memory_change(new_addr, new_size, prot);
         page_set_flags(old_addr, old_addr + old_size, 0);
         page_set_flags(new_addr, new_addr + new_size, prot | PAGE_VALID);
+        /* TBs may be chained across pages in user mode, so code that
+           moved away must not stay reachable through direct jumps.  */
+        if (old_addr != new_addr) {
+            tb_invalidate_phys_range(old_addr, old_addr + old_size, 0);
+        }
     }
     tb_invalidate_phys_range(new_addr, new_addr + new_size, 0);
     mmap_unlock();
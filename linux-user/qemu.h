@@ -92,6 +92,7 @@ struct vm86_saved_state {
 struct sigqueue {
     struct sigqueue *next;
     target_siginfo_t info;
+    int async; /* queued by host_signal_handler */
 };
 
 struct emulated_sigtable {
@@ -148,6 +149,7 @@ void task_settid(TaskState *);
 void stop_all_tasks(void);
 void debug_page_alloc(void);
 extern const char *qemu_uname_release;
+extern const char *symcache_dir;
 extern unsigned long mmap_min_addr;
 
 /* ??? See if we can avoid exposing so much of the loader internals.  */
@@ -275,11 +277,46 @@ void mmap_fork_end(int child);
 #endif
 #ifdef CONFIG_USER_KVM
 void ram_memory_change(abi_ulong start, abi_ulong size, int prot);
+void ram_memory_begin(void);
+void ram_memory_add_image(const char *name, abi_ulong load_bias,
+                          abi_ulong start, abi_ulong end);
+void ram_memory_commit(void);
+void ram_memory_update_page(target_ulong start, target_ulong sizeOrend,
+                            int flags, bool invalidate);
 #endif
 
 /* main.c */
 extern unsigned long guest_stack_size;
 
+/* replay.c */
+enum {
+    REPLAY_NONE,
+    REPLAY_RECORD,
+    REPLAY_PLAY,
+};
+extern int replay_mode;
+extern int replay_capture; /* record: syscall writes go to the log */
+void replay_init(const char *filename, int mode);
+void replay_random(void *buf, size_t len);
+void replay_syscall_begin(CPUArchState *env, int num);
+void replay_syscall_end(CPUArchState *env, int num, abi_long ret);
+void replay_record_write(abi_ulong addr, const void *data, abi_ulong len);
+void replay_record_file(abi_ulong start, abi_ulong len, int fd,
+                        abi_ulong offset);
+abi_long replay_syscall(CPUArchState *env, int num);
+void replay_check_result(CPUArchState *env, int num, abi_long ret);
+int replay_mmap_addr(abi_ulong *addr, int *fd);
+void replay_apply_writes(void);
+void replay_syscall_done(CPUArchState *env);
+void replay_signal(CPUArchState *env, int sig, const target_siginfo_t *info);
+void replay_inject_signals(CPUArchState *env);
+void replay_fork_child(void);
+
+/* afl.c */
+void afl_init(struct image_info *info);
+void afl_forkserver(CPUArchState *env);
+void afl_fork_child(void);
+
 /* user access */
 
 #define VERIFY_READ 0
@@ -435,6 +472,9 @@ static inline void *lock_user(int type, abi_ulong guest_addr, long len, int copy
 static inline void unlock_user(void *host_ptr, abi_ulong guest_addr,
                                long len)
 {
+    if (replay_capture && host_ptr && len > 0) {
+        replay_record_write(guest_addr, host_ptr, len);
+    }
 
 #ifdef DEBUG_REMAP
     if (!host_ptr)
@@ -0,0 +1,531 @@
+/*
+ *  Record and replay of syscall results and signal delivery
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* In record mode every syscall result, the guest memory the syscall
+   wrote (as seen through unlock_user()), and every asynchronous signal
+   delivered to the guest are appended to a log, stamped with the number
+   of guest instructions executed so far.  In replay mode syscalls that
+   talk to the outside world are not executed; their results and memory
+   writes come from the log instead, and signals are injected when the
+   instruction count reaches the recorded delivery point.  Syscalls
+   that replay runs again must give the recorded result.  Files the
+   guest maps are logged by name and identity rather than by contents,
+   and replay maps them again once it has checked that they did not
+   change.  Only single threaded guests are supported.  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#include "qemu.h"
+
+#define REPLAY_MAGIC "QEMURR02"
+
+enum {
+    REPLAY_EV_RANDOM,   /* AT_RANDOM bytes handed to the loaded program */
+    REPLAY_EV_SYSCALL,  /* payload: ReplayWrite chunks */
+    REPLAY_EV_SIGNAL,   /* payload: target_siginfo_t */
+};
+
+typedef struct ReplayEvent {
+    uint32_t kind;
+    int32_t num;        /* syscall or target signal number */
+    uint64_t icount;    /* env->insn_count when the event happened */
+    int64_t ret;        /* syscall result */
+    uint32_t size;      /* bytes of payload following the event */
+    uint32_t pad;
+} ReplayEvent;
+
+enum {
+    REPLAY_WRITE_DATA,  /* len bytes to copy to addr */
+    REPLAY_WRITE_FILE,  /* a ReplayFile and the file name mapped at addr */
+};
+
+typedef struct ReplayWrite {
+    uint64_t addr;
+    uint32_t len;
+    uint32_t kind;
+} ReplayWrite;
+
+typedef struct ReplayFile {
+    uint64_t dev;
+    uint64_t ino;
+    int64_t mtime;
+    int64_t mtime_nsec;
+    uint64_t size;
+} ReplayFile;
+
+int replay_mode;
+int replay_capture;
+
+static int replay_fd = -1;
+
+/* Record: the event being built.  Replay: the next unconsumed event.  */
+static ReplayEvent replay_ev;
+/* Replay: the recorded result of the syscall being replayed.  */
+static int64_t replay_ret;
+static uint8_t *replay_buf;
+static size_t replay_len, replay_size;
+static int replay_ev_valid;
+/* Replay: payload of the syscall being replayed not yet applied.  */
+static int replay_writes_pending;
+
+static void replay_reserve(size_t len)
+{
+    if (replay_len + len > replay_size) {
+        replay_size = MAX(replay_size * 2, replay_len + len);
+        replay_buf = g_realloc(replay_buf, replay_size);
+    }
+}
+
+static void replay_write_full(const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+
+    while (len) {
+        ssize_t n = write(replay_fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("qemu: record");
+            exit(1);
+        }
+        p += n;
+        len -= n;
+    }
+}
+
+static int replay_read_full(void *buf, size_t len)
+{
+    uint8_t *p = buf;
+
+    while (len) {
+        ssize_t n = read(replay_fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Write the event in replay_ev/replay_buf.  Each event goes out with a
+   single write() so that the log survives the guest crashing us.  */
+static void replay_emit(void)
+{
+    size_t len = replay_len;
+
+    replay_ev.size = len;
+    replay_reserve(sizeof(replay_ev));
+    memmove(replay_buf + sizeof(replay_ev), replay_buf, len);
+    memcpy(replay_buf, &replay_ev, sizeof(replay_ev));
+    replay_write_full(replay_buf, len + sizeof(replay_ev));
+    replay_len = 0;
+}
+
+static void QEMU_NORETURN replay_end_of_log(CPUArchState *env)
+{
+    fprintf(stderr, "qemu: replay: end of log after %" PRIu64
+            " instructions\n", env ? env->insn_count : 0);
+    exit(1);
+}
+
+static void QEMU_NORETURN replay_diverged(CPUArchState *env,
+                                          const char *what, int num)
+{
+    fprintf(stderr, "qemu: replay: diverged at %" PRIu64 " instructions: "
+            "guest %s %d, log has %s %d at %" PRIu64 "\n",
+            env->insn_count, what, num,
+            replay_ev.kind == REPLAY_EV_SIGNAL ? "signal" : "syscall",
+            replay_ev.num, replay_ev.icount);
+    exit(1);
+}
+
+/* Replay: load the next event.  Returns NULL at the end of the log.  */
+static ReplayEvent *replay_peek(void)
+{
+    if (replay_ev_valid) {
+        return &replay_ev;
+    }
+    if (replay_read_full(&replay_ev, sizeof(replay_ev)) < 0) {
+        return NULL;
+    }
+    replay_len = 0;
+    replay_reserve(replay_ev.size);
+    if (replay_read_full(replay_buf, replay_ev.size) < 0) {
+        return NULL;
+    }
+    replay_len = replay_ev.size;
+    replay_ev_valid = 1;
+    return &replay_ev;
+}
+
+/* Replay: stop execution where the next recorded signal was delivered.
+   Blocks only stop chaining while such a signal is pending.  */
+static void replay_set_limit(void)
+{
+    ReplayEvent *ev = replay_peek();
+
+    if (ev && ev->kind == REPLAY_EV_SIGNAL) {
+        tb_insn_limit = ev->icount;
+        if (!tb_insn_bounded) {
+            /* the chains made so far would run past the limit */
+            tb_unchain_all();
+            tb_insn_bounded = 1;
+        }
+    } else {
+        tb_insn_limit = UINT64_MAX;
+        tb_insn_bounded = 0;
+    }
+}
+
+void replay_init(const char *filename, int mode)
+{
+    char magic[8];
+
+    if (mode == REPLAY_RECORD) {
+        replay_fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    } else {
+        replay_fd = open(filename, O_RDONLY);
+    }
+    if (replay_fd < 0) {
+        perror(filename);
+        exit(1);
+    }
+    fcntl(replay_fd, F_SETFD, FD_CLOEXEC);
+    if (mode == REPLAY_RECORD) {
+        replay_write_full(REPLAY_MAGIC, sizeof(magic));
+    } else if (replay_read_full(magic, sizeof(magic)) < 0 ||
+               memcmp(magic, REPLAY_MAGIC, sizeof(magic)) != 0) {
+        fprintf(stderr, "qemu: %s: not a replay log\n", filename);
+        exit(1);
+    }
+    replay_mode = mode;
+    tb_count_insns = 1;
+}
+
+void replay_random(void *buf, size_t len)
+{
+    ReplayEvent *ev;
+
+    switch (replay_mode) {
+    case REPLAY_RECORD:
+        memset(&replay_ev, 0, sizeof(replay_ev));
+        replay_ev.kind = REPLAY_EV_RANDOM;
+        replay_reserve(len);
+        memcpy(replay_buf, buf, len);
+        replay_len = len;
+        replay_emit();
+        break;
+    case REPLAY_PLAY:
+        ev = replay_peek();
+        if (!ev || ev->kind != REPLAY_EV_RANDOM || ev->size != len) {
+            fprintf(stderr, "qemu: replay: log does not start with the "
+                    "initial program state\n");
+            exit(1);
+        }
+        memcpy(buf, replay_buf, len);
+        replay_ev_valid = 0;
+        replay_set_limit();
+        break;
+    }
+}
+
+static void replay_syscall_event(CPUArchState *env, int num, abi_long ret)
+{
+    replay_ev.kind = REPLAY_EV_SYSCALL;
+    replay_ev.num = num;
+    replay_ev.icount = env->insn_count;
+    replay_ev.ret = ret;
+    replay_emit();
+}
+
+void replay_syscall_begin(CPUArchState *env, int num)
+{
+    replay_len = 0;
+    replay_capture = 1;
+    /* These do not come back.  */
+    if (num == TARGET_NR_exit
+#ifdef TARGET_NR_exit_group
+        || num == TARGET_NR_exit_group
+#endif
+        ) {
+        replay_capture = 0;
+        replay_syscall_event(env, num, 0);
+    }
+}
+
+void replay_syscall_end(CPUArchState *env, int num, abi_long ret)
+{
+    if (replay_mode != REPLAY_RECORD) {
+        /* The child of a fork.  */
+        return;
+    }
+    replay_capture = 0;
+    replay_syscall_event(env, num, ret);
+}
+
+void replay_record_write(abi_ulong addr, const void *data, abi_ulong len)
+{
+    ReplayWrite w;
+
+    w.addr = addr;
+    w.len = len;
+    w.kind = REPLAY_WRITE_DATA;
+    replay_reserve(sizeof(w) + len);
+    memcpy(replay_buf + replay_len, &w, sizeof(w));
+    memcpy(replay_buf + replay_len + sizeof(w), data, len);
+    replay_len += sizeof(w) + len;
+}
+
+/* Record: log the file 'fd' mapped at 'start' by name and identity if
+   replay can open it again, i.e. it is a regular file still reachable
+   under its name.  Returns 0 on success.  */
+static int replay_record_file_name(abi_ulong start, int fd)
+{
+    char link[32], path[PATH_MAX];
+    struct stat st, st_path;
+    ReplayWrite w;
+    ReplayFile f;
+    ssize_t n;
+
+    snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+    n = readlink(link, path, sizeof(path) - 1);
+    if (n <= 0 || path[0] != '/') {
+        return -1;
+    }
+    path[n] = '\0';
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) ||
+        stat(path, &st_path) < 0 ||
+        st.st_dev != st_path.st_dev || st.st_ino != st_path.st_ino) {
+        return -1;
+    }
+    f.dev = st.st_dev;
+    f.ino = st.st_ino;
+    f.mtime = st.st_mtim.tv_sec;
+    f.mtime_nsec = st.st_mtim.tv_nsec;
+    f.size = st.st_size;
+    w.addr = start;
+    w.len = sizeof(f) + n + 1;
+    w.kind = REPLAY_WRITE_FILE;
+    replay_reserve(sizeof(w) + w.len);
+    memcpy(replay_buf + replay_len, &w, sizeof(w));
+    memcpy(replay_buf + replay_len + sizeof(w), &f, sizeof(f));
+    memcpy(replay_buf + replay_len + sizeof(w) + sizeof(f), path, n + 1);
+    replay_len += sizeof(w) + w.len;
+    return 0;
+}
+
+void replay_record_file(abi_ulong start, abi_ulong len, int fd,
+                        abi_ulong offset)
+{
+    ReplayWrite w;
+    ssize_t n;
+
+    if (replay_record_file_name(start, fd) == 0) {
+        return;
+    }
+    /* Anything else goes into the log.  Read the file rather than the
+       mapping: the guest may not be allowed to read it, and pages past
+       the end of the file would fault.  */
+    replay_reserve(sizeof(w) + len);
+    n = pread(fd, replay_buf + replay_len + sizeof(w), len, offset);
+    if (n <= 0) {
+        return;
+    }
+    w.addr = start;
+    w.len = n;
+    w.kind = REPLAY_WRITE_DATA;
+    memcpy(replay_buf + replay_len, &w, sizeof(w));
+    replay_len += sizeof(w) + n;
+}
+
+abi_long replay_syscall(CPUArchState *env, int num)
+{
+    ReplayEvent *ev = replay_peek();
+
+    if (!ev) {
+        replay_end_of_log(env);
+    }
+    if (ev->kind != REPLAY_EV_SYSCALL || ev->num != num ||
+        ev->icount != env->insn_count) {
+        replay_diverged(env, "syscall", num);
+    }
+    replay_ev_valid = 0;
+    replay_writes_pending = 1;
+    replay_capture = 0;
+    replay_ret = ev->ret;
+    return ev->ret;
+}
+
+/* Replay: 'ret' is what a syscall that replay ran again returned.  */
+void replay_check_result(CPUArchState *env, int num, abi_long ret)
+{
+    if (ret != replay_ret) {
+        fprintf(stderr, "qemu: replay: diverged at %" PRIu64 " instructions: "
+                "syscall %d returned " TARGET_ABI_FMT_ld ", log has %" PRId64
+                "\n", env->insn_count, num, ret, replay_ret);
+        exit(1);
+    }
+}
+
+/* Replay: open the file the recorded mmap mapped, if it was logged by
+   name, and check that it is still the same file.  */
+static int replay_open_file(void)
+{
+    size_t pos = 0;
+    ReplayWrite w;
+    ReplayFile f;
+    struct stat st;
+    const char *path;
+    int fd;
+
+    w.kind = REPLAY_WRITE_DATA;
+    while (pos + sizeof(w) <= replay_len) {
+        memcpy(&w, replay_buf + pos, sizeof(w));
+        pos += sizeof(w);
+        if (w.kind == REPLAY_WRITE_FILE) {
+            break;
+        }
+        pos += w.len;
+    }
+    if (w.kind != REPLAY_WRITE_FILE) {
+        return -1;
+    }
+    memcpy(&f, replay_buf + pos, sizeof(f));
+    path = (const char *)replay_buf + pos + sizeof(f);
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "qemu: replay: %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    if (fstat(fd, &st) < 0 || st.st_dev != f.dev || st.st_ino != f.ino ||
+        st.st_mtim.tv_sec != f.mtime || st.st_mtim.tv_nsec != f.mtime_nsec ||
+        st.st_size != f.size) {
+        fprintf(stderr, "qemu: replay: %s changed since the run was "
+                "recorded\n", path);
+        exit(1);
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    return fd;
+}
+
+/* Replay: if the syscall being replayed is an mmap, return 1 and where
+   it mapped.  '*fd' is then the file to map again, to be closed by the
+   caller, or -1 if the contents come from the log.  */
+int replay_mmap_addr(abi_ulong *addr, int *fd)
+{
+    *fd = -1;
+    if (!replay_writes_pending) {
+        return 0;
+    }
+    switch (replay_ev.num) {
+#ifdef TARGET_NR_mmap
+    case TARGET_NR_mmap:
+#endif
+#ifdef TARGET_NR_mmap2
+    case TARGET_NR_mmap2:
+#endif
+        *addr = replay_ev.ret;
+        *fd = replay_open_file();
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+void replay_apply_writes(void)
+{
+    size_t pos = 0;
+    ReplayWrite w;
+
+    if (!replay_writes_pending) {
+        return;
+    }
+    while (pos + sizeof(w) <= replay_len) {
+        memcpy(&w, replay_buf + pos, sizeof(w));
+        pos += sizeof(w);
+        if (w.kind == REPLAY_WRITE_DATA) {
+            memcpy(g2h(w.addr), replay_buf + pos, w.len);
+        }
+        pos += w.len;
+    }
+    replay_writes_pending = 0;
+}
+
+void replay_syscall_done(CPUArchState *env)
+{
+    replay_apply_writes();
+    replay_set_limit();
+}
+
+void replay_signal(CPUArchState *env, int sig, const target_siginfo_t *info)
+{
+    if (replay_mode != REPLAY_RECORD) {
+        return;
+    }
+    replay_len = 0;
+    replay_reserve(sizeof(*info));
+    memcpy(replay_buf, info, sizeof(*info));
+    replay_len = sizeof(*info);
+    replay_ev.kind = REPLAY_EV_SIGNAL;
+    replay_ev.num = sig;
+    replay_ev.icount = env->insn_count;
+    replay_ev.ret = 0;
+    replay_emit();
+}
+
+void replay_inject_signals(CPUArchState *env)
+{
+    ReplayEvent *ev;
+    target_siginfo_t info;
+
+    while ((ev = replay_peek()) && ev->kind == REPLAY_EV_SIGNAL) {
+        if (ev->icount > env->insn_count) {
+            break;
+        }
+        if (ev->icount < env->insn_count || ev->size != sizeof(info)) {
+            replay_diverged(env, "missed signal", ev->num);
+        }
+        memcpy(&info, replay_buf, sizeof(info));
+        replay_ev_valid = 0;
+        queue_signal(env, ev->num, &info);
+    }
+    replay_set_limit();
+}
+
+void replay_fork_child(void)
+{
+    /* Only the parent is recorded.  */
+    if (replay_mode == REPLAY_RECORD) {
+        close(replay_fd);
+        replay_fd = -1;
+        replay_mode = REPLAY_NONE;
+        replay_capture = 0;
+        tb_count_insns = 0;
+    }
+}
@@ -415,7 +415,10 @@ static void QEMU_NORETURN force_sig(int target_sig)
 
 /* queue a signal so that it will be send to the virtual CPU as soon
    as possible */
-int queue_signal(CPUArchState *env, int sig, target_siginfo_t *info)
+/* ASYNC is set for signals that come from the host rather than from
+   the guest's own execution; only those need to be recorded.  */
+static int do_queue_signal(CPUArchState *env, int sig,
+                           target_siginfo_t *info, int async)
 {
     TaskState *ts = env->opaque;
     struct emulated_sigtable *k;
@@ -471,6 +474,7 @@ int queue_signal(CPUArchState *env, int sig, target_siginfo_t *info)
         }
         *pq = q;
         q->info = *info;
+        q->async = async;
         q->next = NULL;
         k->pending = 1;
         /* signal that a new signal is pending */
@@ -479,6 +483,11 @@ int queue_signal(CPUArchState *env, int sig, target_siginfo_t *info)
     }
 }
 
+int queue_signal(CPUArchState *env, int sig, target_siginfo_t *info)
+{
+    return do_queue_signal(env, sig, info, 0);
+}
+
 static void host_signal_handler(int host_signum, siginfo_t *info,
                                 void *puc)
 {
@@ -493,6 +502,10 @@ static void host_signal_handler(int host_signum, siginfo_t *info,
             return;
     }
 
+    /* On replay, asynchronous signals come from the log.  */
+    if (replay_mode == REPLAY_PLAY)
+        return;
+
     /* get target signal number */
     sig = host_to_target_signal(host_signum);
     if (sig < 1 || sig > TARGET_NSIG)
@@ -501,7 +514,7 @@ static void host_signal_handler(int host_signum, siginfo_t *info,
     fprintf(stderr, "qemu: got signal %d\n", sig);
 #endif
     host_to_target_siginfo_noswap(&tinfo, info);
-    if (queue_signal(thread_env, sig, &tinfo) == 1) {
+    if (do_queue_signal(thread_env, sig, &tinfo, 1) == 1) {
         /* interrupt the virtual CPU as soon as possible */
         cpu_exit(thread_env);
     }
@@ -5472,6 +5485,9 @@ void process_pending_signals(CPUArchState *cpu_env)
     struct sigqueue *q;
     TaskState *ts = cpu_env->opaque;
 
+    if (replay_mode == REPLAY_PLAY)
+        replay_inject_signals(cpu_env);
+
     if (!ts->signal_pending)
         return;
 
@@ -5496,6 +5512,9 @@ void process_pending_signals(CPUArchState *cpu_env)
     if (!k->first)
         k->pending = 0;
 
+    if (q->async && replay_mode == REPLAY_RECORD)
+        replay_signal(cpu_env, sig, &q->info);
+
     sig = gdb_handlesig (cpu_env, sig);
     if (!sig) {
         sa = NULL;
@@ -109,6 +109,7 @@ int __clone2(int (*fn)(void *), void *child_stack_base,
 #include "cpu-uname.h"
 
 #include "qemu.h"
+#include "tcg.h"
 
 #ifdef HOST_ARM
 #include <sys/syscall.h>
@@ -3312,6 +3313,7 @@ static inline abi_long do_shmdt(abi_ulong shmaddr)
         if (shm_regions[i].start == shmaddr) {
             shm_regions[i].start = 0;
             page_set_flags(shmaddr, shmaddr + shm_regions[i].size, 0);
+            tb_invalidate_phys_range(shmaddr, shmaddr + shm_regions[i].size, 0);
             break;
         }
     }
@@ -4465,13 +4467,16 @@ static abi_long do_arch_prctl(CPUX86State *env, int code, abi_ulong addr)
 
 #endif /* defined(TARGET_I386) */
 
-#define NEW_STACK_SIZE 0x40000
+/* glibc carves the static TLS, which holds the translator state of
+   the thread, out of this too.  */
+#define NEW_STACK_SIZE 0x80000
 
 #if defined(CONFIG_USE_NPTL)
 
 static pthread_mutex_t clone_lock = PTHREAD_MUTEX_INITIALIZER;
 typedef struct {
     CPUArchState *env;
+    TCGContext *tcg_ctx;
     pthread_mutex_t mutex;
     pthread_cond_t cond;
     pthread_t thread;
@@ -4489,6 +4494,8 @@ static void *clone_func(void *arg)
 
     env = info->env;
     thread_env = env;
+    /* The parent waits for us below, so its context is stable.  */
+    tcg_context_clone(&tcg_ctx, info->tcg_ctx);
     ts = (TaskState *)thread_env->opaque;
     info->tid = gettid();
     env->host_tid = info->tid;
@@ -4541,6 +4548,10 @@ static int do_fork(CPUArchState *env, unsigned int flags, abi_ulong newsp,
     if (flags & CLONE_VFORK)
         flags &= ~(CLONE_VFORK | CLONE_VM);
 
+    /* Record/replay does not handle a second thread.  */
+    if ((flags & CLONE_VM) && replay_mode != REPLAY_NONE)
+        return -TARGET_EAGAIN;
+
     if (flags & CLONE_VM) {
         TaskState *parent_ts = (TaskState *)env->opaque;
 #if defined(CONFIG_USE_NPTL)
@@ -4578,6 +4589,7 @@ static int do_fork(CPUArchState *env, unsigned int flags, abi_ulong newsp,
         pthread_mutex_lock(&info.mutex);
         pthread_cond_init(&info.cond, NULL);
         info.env = new_env;
+        info.tcg_ctx = &tcg_ctx;
         if (nptl_flags & CLONE_CHILD_SETTID)
             info.child_tidptr = child_tidptr;
         if (nptl_flags & CLONE_PARENT_SETTID)
@@ -4628,6 +4640,8 @@ static int do_fork(CPUArchState *env, unsigned int flags, abi_ulong newsp,
         ret = fork();
         if (ret == 0) {
             /* Child Process.  */
+            replay_fork_child();
+            afl_fork_child();
             cpu_clone_regs(env, newsp);
             fork_end(1);
 #if defined(CONFIG_USE_NPTL)
@@ -5334,10 +5348,10 @@ static int do_open(void *cpu_env, const char *pathname, int flags, mode_t mode)
 /* do_syscall() should always have a single exit point at the end so
    that actions, such as logging of syscall results, can be performed.
    All errnos that do_syscall() returns must be -TARGET_<errcode>. */
-abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
-                    abi_long arg2, abi_long arg3, abi_long arg4,
-                    abi_long arg5, abi_long arg6, abi_long arg7,
-                    abi_long arg8)
+static abi_long do_syscall1(void *cpu_env, int num, abi_long arg1,
+                            abi_long arg2, abi_long arg3, abi_long arg4,
+                            abi_long arg5, abi_long arg6, abi_long arg7,
+                            abi_long arg8)
 {
     abi_long ret;
     struct stat st;
@@ -5394,6 +5408,7 @@ abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
         _mcleanup();
 #endif
         gdb_exit(cpu_env, arg1);
+        tb_profile_report();
         _exit(arg1);
         ret = 0; /* avoid warning */
         break;
@@ -7158,6 +7173,7 @@ abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
         _mcleanup();
 #endif
         gdb_exit(cpu_env, arg1);
+        tb_profile_report();
         ret = get_errno(exit_group(arg1));
         break;
 #endif
@@ -9099,3 +9115,76 @@ efault:
     ret = -TARGET_EFAULT;
     goto fail;
 }
+
+/* Syscalls that only change the state of the emulator or of the guest
+   address space.  Replay runs them again; everything else just gets its
+   recorded result and memory writes.  */
+static int replay_reexecute(int num)
+{
+    switch (num) {
+    case TARGET_NR_exit:
+#ifdef TARGET_NR_exit_group
+    case TARGET_NR_exit_group:
+#endif
+    case TARGET_NR_brk:
+#ifdef TARGET_NR_mmap
+    case TARGET_NR_mmap:
+#endif
+#ifdef TARGET_NR_mmap2
+    case TARGET_NR_mmap2:
+#endif
+    case TARGET_NR_munmap:
+    case TARGET_NR_mprotect:
+#ifdef TARGET_NR_mremap
+    case TARGET_NR_mremap:
+#endif
+#ifdef TARGET_NR_signal
+    case TARGET_NR_signal:
+#endif
+#ifdef TARGET_NR_sigaction
+    case TARGET_NR_sigaction:
+#endif
+    case TARGET_NR_rt_sigaction:
+#ifdef TARGET_NR_sigprocmask
+    case TARGET_NR_sigprocmask:
+#endif
+    case TARGET_NR_rt_sigprocmask:
+#ifdef TARGET_NR_sigreturn
+    case TARGET_NR_sigreturn:
+#endif
+    case TARGET_NR_rt_sigreturn:
+    case TARGET_NR_sigaltstack:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
+                    abi_long arg2, abi_long arg3, abi_long arg4,
+                    abi_long arg5, abi_long arg6, abi_long arg7,
+                    abi_long arg8)
+{
+    abi_long ret;
+
+    switch (replay_mode) {
+    case REPLAY_RECORD:
+        replay_syscall_begin(cpu_env, num);
+        ret = do_syscall1(cpu_env, num, arg1, arg2, arg3, arg4,
+                          arg5, arg6, arg7, arg8);
+        replay_syscall_end(cpu_env, num, ret);
+        return ret;
+    case REPLAY_PLAY:
+        ret = replay_syscall(cpu_env, num);
+        if (replay_reexecute(num) && !is_error(ret)) {
+            ret = do_syscall1(cpu_env, num, arg1, arg2, arg3, arg4,
+                              arg5, arg6, arg7, arg8);
+            replay_check_result(cpu_env, num, ret);
+        }
+        replay_syscall_done(cpu_env);
+        return ret;
+    default:
+        return do_syscall1(cpu_env, num, arg1, arg2, arg3, arg4,
+                           arg5, arg6, arg7, arg8);
+    }
+}
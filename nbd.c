@@ -34,6 +34,8 @@
 
 #ifdef __linux__
 #include <linux/fs.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
 #endif
 
 #include "qemu_socket.h"
@@ -580,11 +582,8 @@ ssize_t nbd_receive_reply(int csock, struct nbd_reply *reply)
     return 0;
 }
 
-static ssize_t nbd_send_reply(int csock, struct nbd_reply *reply)
+static void nbd_encode_reply(uint8_t *buf, struct nbd_reply *reply)
 {
-    uint8_t buf[4 + 4 + 8];
-    ssize_t ret;
-
     /* Reply
        [ 0 ..  3]    magic   (NBD_REPLY_MAGIC)
        [ 4 ..  7]    error   (0 == no error)
@@ -593,19 +592,6 @@ static ssize_t nbd_send_reply(int csock, struct nbd_reply *reply)
     cpu_to_be32w((uint32_t*)buf, NBD_REPLY_MAGIC);
     cpu_to_be32w((uint32_t*)(buf + 4), reply->error);
     cpu_to_be64w((uint64_t*)(buf + 8), reply->handle);
-
-    TRACE("Sending response to client");
-
-    ret = write_sync(csock, buf, sizeof(buf));
-    if (ret < 0) {
-        return ret;
-    }
-
-    if (ret != sizeof(buf)) {
-        LOG("writing to socket failed");
-        return -EINVAL;
-    }
-    return 0;
 }
 
 #define MAX_NBD_REQUESTS 16
@@ -623,6 +609,7 @@ struct NBDExport {
     off_t dev_offset;
     off_t size;
     uint32_t nbdflags;
+    int max_requests;           /* per client */
     QSIMPLEQ_HEAD(, NBDRequest) requests;
 };
 
@@ -669,12 +656,11 @@ static NBDRequest *nbd_request_get(NBDClient *client)
     NBDRequest *req;
     NBDExport *exp = client->exp;
 
-    assert(client->nb_requests <= MAX_NBD_REQUESTS - 1);
+    assert(client->nb_requests <= exp->max_requests - 1);
     client->nb_requests++;
 
     if (QSIMPLEQ_EMPTY(&exp->requests)) {
         req = g_malloc0(sizeof(NBDRequest));
-        req->data = qemu_blockalign(exp->bs, NBD_BUFFER_SIZE);
     } else {
         req = QSIMPLEQ_FIRST(&exp->requests);
         QSIMPLEQ_REMOVE_HEAD(&exp->requests, entry);
@@ -684,11 +670,20 @@ static NBDRequest *nbd_request_get(NBDClient *client)
     return req;
 }
 
+/* Reads sent with sendfile() need no buffer, so it is allocated on demand */
+static uint8_t *nbd_request_buffer(NBDRequest *req)
+{
+    if (!req->data) {
+        req->data = qemu_blockalign(req->client->exp->bs, NBD_BUFFER_SIZE);
+    }
+    return req->data;
+}
+
 static void nbd_request_put(NBDRequest *req)
 {
     NBDClient *client = req->client;
     QSIMPLEQ_INSERT_HEAD(&client->exp->requests, req, entry);
-    if (client->nb_requests-- == MAX_NBD_REQUESTS) {
+    if (client->nb_requests-- == client->exp->max_requests) {
         qemu_notify_event();
     }
     nbd_client_put(client);
@@ -703,9 +698,17 @@ NBDExport *nbd_export_new(BlockDriverState *bs, off_t dev_offset,
     exp->dev_offset = dev_offset;
     exp->nbdflags = nbdflags;
     exp->size = size == -1 ? bdrv_getlength(bs) : size;
+    exp->max_requests = MAX_NBD_REQUESTS;
     return exp;
 }
 
+/* Number of requests of a client that are processed at the same time */
+void nbd_export_set_max_requests(NBDExport *exp, int max_requests)
+{
+    assert(max_requests > 0);
+    exp->max_requests = max_requests;
+}
+
 void nbd_export_close(NBDExport *exp)
 {
     while (!QSIMPLEQ_EMPTY(&exp->requests)) {
@@ -723,37 +726,124 @@ static int nbd_can_read(void *opaque);
 static void nbd_read(void *opaque);
 static void nbd_restart_write(void *opaque);
 
+static void nbd_co_send_begin(NBDClient *client)
+{
+    qemu_co_mutex_lock(&client->send_lock);
+    qemu_set_fd_handler2(client->sock, nbd_can_read, nbd_read,
+                         nbd_restart_write, client);
+    client->send_coroutine = qemu_coroutine_self();
+}
+
+static void nbd_co_send_end(NBDClient *client)
+{
+    client->send_coroutine = NULL;
+    qemu_set_fd_handler2(client->sock, nbd_can_read, nbd_read, NULL, client);
+    qemu_co_mutex_unlock(&client->send_lock);
+}
+
+/* Sends the reply and len bytes of req->data with a single sendmsg() */
 static ssize_t nbd_co_send_reply(NBDRequest *req, struct nbd_reply *reply,
                                  int len)
 {
     NBDClient *client = req->client;
-    int csock = client->sock;
+    uint8_t buf[NBD_REPLY_SIZE];
+    struct iovec iov[2];
     ssize_t rc, ret;
 
-    qemu_co_mutex_lock(&client->send_lock);
-    qemu_set_fd_handler2(csock, nbd_can_read, nbd_read,
-                         nbd_restart_write, client);
-    client->send_coroutine = qemu_coroutine_self();
+    nbd_encode_reply(buf, reply);
+    iov[0].iov_base = buf;
+    iov[0].iov_len = sizeof(buf);
+    iov[1].iov_base = req->data;
+    iov[1].iov_len = len;
 
-    if (!len) {
-        rc = nbd_send_reply(csock, reply);
+    TRACE("Sending response to client");
+
+    nbd_co_send_begin(client);
+    ret = qemu_co_sendv(client->sock, iov, len ? 2 : 1, 0, sizeof(buf) + len);
+    if (ret < 0) {
+        rc = ret;
+    } else if (ret != sizeof(buf) + len) {
+        LOG("writing to socket failed");
+        rc = -EIO;
     } else {
-        socket_set_cork(csock, 1);
-        rc = nbd_send_reply(csock, reply);
-        if (rc >= 0) {
-            ret = qemu_co_send(csock, req->data, len);
-            if (ret != len) {
-                rc = -EIO;
-            }
-        }
-        socket_set_cork(csock, 0);
+        rc = 0;
     }
+    nbd_co_send_end(client);
+    return rc;
+}
 
-    client->send_coroutine = NULL;
-    qemu_set_fd_handler2(csock, nbd_can_read, nbd_read, NULL, client);
-    qemu_co_mutex_unlock(&client->send_lock);
+#ifdef __linux__
+/* sendfile() runs in the event loop and blocks it while the kernel reads
+ * data that is not cached, so it is only used for ranges that are already
+ * in the page cache.  Other reads go through the block layer, which reads
+ * in the thread pool and leaves the data cached for later requests. */
+static bool nbd_in_page_cache(int fd, off_t offset, int len)
+{
+    long page_size = getpagesize();
+    off_t start = offset & ~(off_t)(page_size - 1);
+    size_t map_len = offset + len - start;
+    size_t i, pages = DIV_ROUND_UP(map_len, page_size);
+    unsigned char *vec;
+    void *map;
+    bool cached;
+
+    map = mmap(NULL, map_len, PROT_READ, MAP_SHARED, fd, start);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+    vec = g_malloc(pages);
+    cached = mincore(map, map_len, vec) == 0;
+    for (i = 0; cached && i < pages; i++) {
+        cached = vec[i] & 1;
+    }
+    g_free(vec);
+    munmap(map, map_len);
+    return cached;
+}
+
+/* Sends the reply, followed by len bytes of fd at offset that the kernel
+ * copies to the socket without going through our address space.  Errors
+ * reading fd are only noticed after the reply has been sent, so they are
+ * fatal for the connection. */
+static ssize_t nbd_co_send_reply_file(NBDRequest *req,
+                                      struct nbd_reply *reply,
+                                      int fd, off_t offset, int len)
+{
+    NBDClient *client = req->client;
+    int csock = client->sock;
+    uint8_t buf[NBD_REPLY_SIZE];
+    ssize_t rc = 0, ret;
+
+    nbd_encode_reply(buf, reply);
+
+    TRACE("Sending response to client");
+
+    nbd_co_send_begin(client);
+    socket_set_cork(csock, 1);
+    ret = qemu_co_send(csock, buf, sizeof(buf));
+    if (ret != sizeof(buf)) {
+        LOG("writing to socket failed");
+        rc = ret < 0 ? ret : -EIO;
+    }
+    while (rc == 0 && len > 0) {
+        ret = sendfile(csock, fd, &offset, len);
+        if (ret < 0 && errno == EAGAIN) {
+            qemu_coroutine_yield();
+        } else if (ret < 0 && errno != EINTR) {
+            rc = -errno;
+            LOG("sendfile failed");
+        } else if (ret == 0) {
+            LOG("unexpected end of file");
+            rc = -EIO;
+        } else if (ret > 0) {
+            len -= ret;
+        }
+    }
+    socket_set_cork(csock, 0);
+    nbd_co_send_end(client);
     return rc;
 }
+#endif
 
 static ssize_t nbd_co_receive_request(NBDRequest *req, struct nbd_request *request)
 {
@@ -789,7 +879,8 @@ static ssize_t nbd_co_receive_request(NBDRequest *req, struct nbd_request *reque
     if ((request->type & NBD_CMD_MASK_COMMAND) == NBD_CMD_WRITE) {
         TRACE("Reading %u byte(s)", request->len);
 
-        if (qemu_co_recv(csock, req->data, request->len) != request->len) {
+        if (qemu_co_recv(csock, nbd_request_buffer(req), request->len) !=
+            request->len) {
             LOG("reading from socket failed");
             rc = -EIO;
             goto out;
@@ -809,6 +900,8 @@ static void nbd_trip(void *opaque)
     NBDExport *exp = client->exp;
     struct nbd_request request;
     struct nbd_reply reply;
+    struct iovec iov;
+    QEMUIOVector qiov;
     ssize_t ret;
 
     TRACE("Reading request.");
@@ -851,8 +944,26 @@ static void nbd_trip(void *opaque)
             }
         }
 
-        ret = bdrv_read(exp->bs, (request.from + exp->dev_offset) / 512,
-                        req->data, request.len / 512);
+#ifdef __linux__
+        ret = bdrv_get_host_fd(exp->bs);
+        if (ret >= 0 && request.len &&
+            nbd_in_page_cache(ret, request.from + exp->dev_offset,
+                              request.len)) {
+            TRACE("Sending %u byte(s) from the file", request.len);
+            if (nbd_co_send_reply_file(req, &reply, ret,
+                                       request.from + exp->dev_offset,
+                                       request.len) < 0) {
+                goto out;
+            }
+            break;
+        }
+#endif
+
+        iov.iov_base = nbd_request_buffer(req);
+        iov.iov_len = request.len;
+        qemu_iovec_init_external(&qiov, &iov, 1);
+        ret = bdrv_co_readv(exp->bs, (request.from + exp->dev_offset) / 512,
+                            request.len / 512, &qiov);
         if (ret < 0) {
             LOG("reading from file failed");
             reply.error = -ret;
@@ -874,8 +985,11 @@ static void nbd_trip(void *opaque)
 
         TRACE("Writing to device");
 
-        ret = bdrv_write(exp->bs, (request.from + exp->dev_offset) / 512,
-                         req->data, request.len / 512);
+        iov.iov_base = req->data;
+        iov.iov_len = request.len;
+        qemu_iovec_init_external(&qiov, &iov, 1);
+        ret = bdrv_co_writev(exp->bs, (request.from + exp->dev_offset) / 512,
+                             request.len / 512, &qiov);
         if (ret < 0) {
             LOG("writing to file failed");
             reply.error = -ret;
@@ -949,7 +1063,8 @@ static int nbd_can_read(void *opaque)
 {
     NBDClient *client = opaque;
 
-    return client->recv_coroutine || client->nb_requests < MAX_NBD_REQUESTS;
+    return client->recv_coroutine ||
+           client->nb_requests < client->exp->max_requests;
 }
 
 static void nbd_read(void *opaque)
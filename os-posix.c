@@ -39,6 +39,8 @@
 #include "sysemu.h"
 #include "net/slirp.h"
 #include "qemu-options.h"
+#include "block.h"
+#include "block/raw-posix-aio.h"
 
 #ifdef CONFIG_LINUX
 #include <sys/prctl.h>
@@ -188,6 +190,12 @@ void os_parse_cmd_args(int index, const char *optarg)
     case QEMU_OPTION_daemonize:
         daemonize = 1;
         break;
+    case QEMU_OPTION_aio_threads:
+        if (paio_set_max_threads(atoi(optarg)) < 0) {
+            fprintf(stderr, "Invalid number of AIO threads: %s\n", optarg);
+            exit(1);
+        }
+        break;
 #if defined(CONFIG_LINUX)
     case QEMU_OPTION_enablefips:
         fips_set_state(true);
@@ -33,6 +33,20 @@
 
 #include "block/raw-posix-aio.h"
 
+/*
+ * Requests run in a pool of up to max_threads worker threads.  Workers are
+ * started on demand and never exit.  Each has its own queue; a request goes
+ * to an idle worker if there is one, to a new worker while the pool is not
+ * full, and round robin otherwise.  A worker whose queue is empty steals
+ * from the others before going to sleep.
+ *
+ * Completed requests are put on a single list, and the main thread is only
+ * woken up when that list becomes non-empty, so a burst of completions
+ * costs one eventfd write.
+ */
+
+typedef struct PaioWorker PaioWorker;
+
 static void do_spawn_thread(void);
 
 struct qemu_paiocb {
@@ -41,36 +55,53 @@ struct qemu_paiocb {
     union {
         struct iovec *aio_iov;
         void *aio_ioctl_buf;
+        void *aio_func_arg;
     };
+    int (*aio_func)(void *arg);
     int aio_niov;
     size_t aio_nbytes;
 #define aio_ioctl_cmd   aio_nbytes /* for QEMU_AIO_IOCTL */
     off_t aio_offset;
 
+    /* in worker->queue, then in done_list */
     QTAILQ_ENTRY(qemu_paiocb) node;
+    PaioWorker *worker;
     int aio_type;
     ssize_t ret;
     int active;
-    struct qemu_paiocb *next;
+};
+
+struct PaioWorker {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    QTAILQ_HEAD(, qemu_paiocb) queue;
+    bool idle;
 };
 
 typedef struct PosixAioState {
     int rfd, wfd;
-    struct qemu_paiocb *first_aio;
+    int nb_requests;
 } PosixAioState;
 
+static PosixAioState *posix_aio_state;
+
 
+/* protects the pool itself: nb_workers, idle_workers, thread creation */
 static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
 static pthread_t thread_id;
 static pthread_attr_t attr;
 static int max_threads = 64;
-static int cur_threads = 0;
-static int idle_threads = 0;
-static int new_threads = 0;     /* backlog of threads we need to create */
+static PaioWorker *workers;
+static int nb_workers = 0;
+static int started_threads = 0;
 static int pending_threads = 0; /* threads created but not running yet */
+static PaioWorker **idle_workers;
+static int nb_idle_workers = 0;
+static int next_worker = 0;
 static QEMUBH *new_thread_bh;
-static QTAILQ_HEAD(, qemu_paiocb) request_list;
+
+static pthread_mutex_t done_lock = PTHREAD_MUTEX_INITIALIZER;
+static QTAILQ_HEAD(, qemu_paiocb) done_list;
 
 #ifdef CONFIG_PREADV
 static int preadv_present = 1;
@@ -89,6 +120,12 @@ static void die(const char *what)
     die2(errno, what);
 }
 
+static void mutex_init(pthread_mutex_t *mutex)
+{
+    int ret = pthread_mutex_init(mutex, NULL);
+    if (ret) die2(ret, "pthread_mutex_init");
+}
+
 static void mutex_lock(pthread_mutex_t *mutex)
 {
     int ret = pthread_mutex_lock(mutex);
@@ -101,12 +138,16 @@ static void mutex_unlock(pthread_mutex_t *mutex)
     if (ret) die2(ret, "pthread_mutex_unlock");
 }
 
-static int cond_timedwait(pthread_cond_t *cond, pthread_mutex_t *mutex,
-                           struct timespec *ts)
+static void cond_init(pthread_cond_t *cond)
+{
+    int ret = pthread_cond_init(cond, NULL);
+    if (ret) die2(ret, "pthread_cond_init");
+}
+
+static void cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex)
 {
-    int ret = pthread_cond_timedwait(cond, mutex, ts);
-    if (ret && ret != ETIMEDOUT) die2(ret, "pthread_cond_timedwait");
-    return ret;
+    int ret = pthread_cond_wait(cond, mutex);
+    if (ret) die2(ret, "pthread_cond_wait");
 }
 
 static void cond_signal(pthread_cond_t *cond)
@@ -312,39 +353,89 @@ static ssize_t handle_aiocb_rw(struct qemu_paiocb *aiocb)
 
 static void posix_aio_notify_event(void);
 
-static void *aio_thread(void *unused)
+static struct qemu_paiocb *pop_request(PaioWorker *w)
 {
+    struct qemu_paiocb *aiocb;
+
+    mutex_lock(&w->lock);
+    aiocb = QTAILQ_FIRST(&w->queue);
+    if (aiocb) {
+        QTAILQ_REMOVE(&w->queue, aiocb, node);
+        aiocb->active = 1;
+    }
+    mutex_unlock(&w->lock);
+
+    return aiocb;
+}
+
+static struct qemu_paiocb *steal_request(PaioWorker *self)
+{
+    struct qemu_paiocb *aiocb;
+    int i, n;
+
     mutex_lock(&lock);
-    pending_threads--;
+    n = nb_workers;
     mutex_unlock(&lock);
-    do_spawn_thread();
 
-    while (1) {
-        struct qemu_paiocb *aiocb;
-        ssize_t ret = 0;
-        qemu_timeval tv;
-        struct timespec ts;
+    for (i = 1; i < n; i++) {
+        PaioWorker *w = &workers[(self - workers + i) % n];
 
-        qemu_gettimeofday(&tv);
-        ts.tv_sec = tv.tv_sec + 10;
-        ts.tv_nsec = 0;
+        /* only a hint, pop_request() checks again under the lock */
+        if (QTAILQ_EMPTY(&w->queue)) {
+            continue;
+        }
+        aiocb = pop_request(w);
+        if (aiocb) {
+            return aiocb;
+        }
+    }
+    return NULL;
+}
 
-        mutex_lock(&lock);
+static struct qemu_paiocb *get_request(PaioWorker *w)
+{
+    struct qemu_paiocb *aiocb;
 
-        while (QTAILQ_EMPTY(&request_list) &&
-               !(ret == ETIMEDOUT)) {
-            idle_threads++;
-            ret = cond_timedwait(&cond, &lock, &ts);
-            idle_threads--;
+    for (;;) {
+        aiocb = pop_request(w);
+        if (aiocb) {
+            return aiocb;
+        }
+        aiocb = steal_request(w);
+        if (aiocb) {
+            return aiocb;
         }
 
-        if (QTAILQ_EMPTY(&request_list))
-            break;
-
-        aiocb = QTAILQ_FIRST(&request_list);
-        QTAILQ_REMOVE(&request_list, aiocb, node);
-        aiocb->active = 1;
+        /* nothing to do: sleep until qemu_paio_submit() hands us a request */
+        mutex_lock(&lock);
+        mutex_lock(&w->lock);
+        if (QTAILQ_EMPTY(&w->queue)) {
+            w->idle = true;
+            idle_workers[nb_idle_workers++] = w;
+        }
         mutex_unlock(&lock);
+        while (w->idle) {
+            cond_wait(&w->cond, &w->lock);
+        }
+        mutex_unlock(&w->lock);
+    }
+}
+
+static void *aio_thread(void *opaque)
+{
+    PaioWorker *w = opaque;
+
+    mutex_lock(&lock);
+    pending_threads--;
+    mutex_unlock(&lock);
+    do_spawn_thread();
+
+    while (1) {
+        struct qemu_paiocb *aiocb;
+        ssize_t ret = 0;
+        bool notify;
+
+        aiocb = get_request(w);
 
         switch (aiocb->aio_type & QEMU_AIO_TYPE_MASK) {
         case QEMU_AIO_READ:
@@ -367,36 +458,42 @@ static void *aio_thread(void *unused)
         case QEMU_AIO_IOCTL:
             ret = handle_aiocb_ioctl(aiocb);
             break;
+        case QEMU_AIO_FUNC:
+            ret = aiocb->aio_func(aiocb->aio_func_arg);
+            break;
         default:
             fprintf(stderr, "invalid aio request (0x%x)\n", aiocb->aio_type);
             ret = -EINVAL;
             break;
         }
 
-        mutex_lock(&lock);
+        mutex_lock(&done_lock);
         aiocb->ret = ret;
-        mutex_unlock(&lock);
+        /* the main thread empties the list before going back to sleep */
+        notify = QTAILQ_EMPTY(&done_list);
+        QTAILQ_INSERT_TAIL(&done_list, aiocb, node);
+        mutex_unlock(&done_lock);
 
-        posix_aio_notify_event();
+        if (notify) {
+            posix_aio_notify_event();
+        }
     }
 
-    cur_threads--;
-    mutex_unlock(&lock);
-
     return NULL;
 }
 
 static void do_spawn_thread(void)
 {
     sigset_t set, oldset;
+    PaioWorker *w;
 
     mutex_lock(&lock);
-    if (!new_threads) {
+    if (started_threads == nb_workers) {
         mutex_unlock(&lock);
         return;
     }
 
-    new_threads--;
+    w = &workers[started_threads++];
     pending_threads++;
 
     mutex_unlock(&lock);
@@ -405,7 +502,7 @@ static void do_spawn_thread(void)
     if (sigfillset(&set)) die("sigfillset");
     if (sigprocmask(SIG_SETMASK, &set, &oldset)) die("sigprocmask");
 
-    thread_create(&thread_id, &attr, aio_thread, NULL);
+    thread_create(&thread_id, &attr, aio_thread, w);
 
     if (sigprocmask(SIG_SETMASK, &oldset, NULL)) die("sigprocmask restore");
 }
@@ -415,10 +512,17 @@ static void spawn_thread_bh_fn(void *opaque)
     do_spawn_thread();
 }
 
-static void spawn_thread(void)
+/* Called with lock held */
+static PaioWorker *spawn_worker(void)
 {
-    cur_threads++;
-    new_threads++;
+    PaioWorker *w = &workers[nb_workers];
+
+    mutex_init(&w->lock);
+    cond_init(&w->cond);
+    QTAILQ_INIT(&w->queue);
+    w->idle = false;
+    nb_workers++;
+
     /* If there are threads being created, they will spawn new workers, so
      * we don't spend time creating many threads in a loop holding a mutex or
      * starving the current vcpu.
@@ -429,51 +533,48 @@ static void spawn_thread(void)
     if (!pending_threads) {
         qemu_bh_schedule(new_thread_bh);
     }
+    return w;
 }
 
 static void qemu_paio_submit(struct qemu_paiocb *aiocb)
 {
+    PaioWorker *w;
+    bool wake;
+
     aiocb->ret = -EINPROGRESS;
     aiocb->active = 0;
-    mutex_lock(&lock);
-    if (idle_threads == 0 && cur_threads < max_threads)
-        spawn_thread();
-    QTAILQ_INSERT_TAIL(&request_list, aiocb, node);
-    mutex_unlock(&lock);
-    cond_signal(&cond);
-}
-
-static ssize_t qemu_paio_return(struct qemu_paiocb *aiocb)
-{
-    ssize_t ret;
+    posix_aio_state->nb_requests++;
 
     mutex_lock(&lock);
-    ret = aiocb->ret;
+    if (nb_idle_workers) {
+        w = idle_workers[--nb_idle_workers];
+    } else if (nb_workers < max_threads) {
+        w = spawn_worker();
+    } else {
+        w = &workers[next_worker++ % nb_workers];
+    }
     mutex_unlock(&lock);
 
-    return ret;
-}
-
-static int qemu_paio_error(struct qemu_paiocb *aiocb)
-{
-    ssize_t ret = qemu_paio_return(aiocb);
+    aiocb->worker = w;
+    mutex_lock(&w->lock);
+    QTAILQ_INSERT_TAIL(&w->queue, aiocb, node);
+    wake = w->idle;
+    w->idle = false;
+    mutex_unlock(&w->lock);
 
-    if (ret < 0)
-        ret = -ret;
-    else
-        ret = 0;
-
-    return ret;
+    if (wake) {
+        cond_signal(&w->cond);
+    }
 }
 
 static void posix_aio_read(void *opaque)
 {
     PosixAioState *s = opaque;
-    struct qemu_paiocb *acb, **pacb;
-    int ret;
+    struct qemu_paiocb *acb;
     ssize_t len;
+    int ret;
 
-    /* read all bytes from signal pipe */
+    /* drain the notifier; for eventfd, only 8 bytes will be read */
     for (;;) {
         char bytes[16];
 
@@ -485,106 +586,78 @@ static void posix_aio_read(void *opaque)
         break;
     }
 
-    for(;;) {
-        pacb = &s->first_aio;
-        for(;;) {
-            acb = *pacb;
-            if (!acb)
-                return;
-
-            ret = qemu_paio_error(acb);
-            if (ret == ECANCELED) {
-                /* remove the request */
-                *pacb = acb->next;
-                qemu_aio_release(acb);
-            } else if (ret != EINPROGRESS) {
-                /* end of aio */
-                if (ret == 0) {
-                    ret = qemu_paio_return(acb);
-                    if (ret == acb->aio_nbytes)
-                        ret = 0;
-                    else
-                        ret = -EINVAL;
-                } else {
-                    ret = -ret;
-                }
-
-                trace_paio_complete(acb, acb->common.opaque, ret);
-
-                /* remove the request */
-                *pacb = acb->next;
-                /* call the callback */
-                acb->common.cb(acb->common.opaque, ret);
-                qemu_aio_release(acb);
-                break;
-            } else {
-                pacb = &acb->next;
-            }
+    /* Take requests one at a time: a callback may cancel one of the others */
+    for (;;) {
+        mutex_lock(&done_lock);
+        acb = QTAILQ_FIRST(&done_list);
+        if (acb) {
+            QTAILQ_REMOVE(&done_list, acb, node);
         }
+        mutex_unlock(&done_lock);
+        if (!acb) {
+            break;
+        }
+
+        ret = acb->ret;
+        if (ret == acb->aio_nbytes) {
+            ret = 0;
+        } else if (ret >= 0) {
+            ret = -EINVAL;
+        }
+
+        trace_paio_complete(acb, acb->common.opaque, ret);
+
+        s->nb_requests--;
+        acb->common.cb(acb->common.opaque, ret);
+        qemu_aio_release(acb);
     }
 }
 
 static int posix_aio_flush(void *opaque)
 {
     PosixAioState *s = opaque;
-    return !!s->first_aio;
+    return !!s->nb_requests;
 }
 
-static PosixAioState *posix_aio_state;
-
 static void posix_aio_notify_event(void)
 {
-    char byte = 0;
+    uint64_t val = 1;
     ssize_t ret;
 
-    ret = write(posix_aio_state->wfd, &byte, sizeof(byte));
+    ret = write(posix_aio_state->wfd, &val, sizeof(val));
     if (ret < 0 && errno != EAGAIN)
         die("write()");
 }
 
-static void paio_remove(struct qemu_paiocb *acb)
-{
-    struct qemu_paiocb **pacb;
-
-    /* remove the callback from the queue */
-    pacb = &posix_aio_state->first_aio;
-    for(;;) {
-        if (*pacb == NULL) {
-            fprintf(stderr, "paio_remove: aio request not found!\n");
-            break;
-        } else if (*pacb == acb) {
-            *pacb = acb->next;
-            qemu_aio_release(acb);
-            break;
-        }
-        pacb = &(*pacb)->next;
-    }
-}
-
 static void paio_cancel(BlockDriverAIOCB *blockacb)
 {
     struct qemu_paiocb *acb = (struct qemu_paiocb *)blockacb;
-    int active = 0;
+    PaioWorker *w = acb->worker;
+    bool done = false;
 
     trace_paio_cancel(acb, acb->common.opaque);
 
-    mutex_lock(&lock);
+    /* a request only ever leaves the queue it was put on under its lock */
+    mutex_lock(&w->lock);
     if (!acb->active) {
-        QTAILQ_REMOVE(&request_list, acb, node);
+        QTAILQ_REMOVE(&w->queue, acb, node);
         acb->ret = -ECANCELED;
-    } else if (acb->ret == -EINPROGRESS) {
-        active = 1;
+        done = true;
     }
-    mutex_unlock(&lock);
-
-    if (active) {
-        /* fail safe: if the aio could not be canceled, we wait for
-           it */
-        while (qemu_paio_error(acb) == EINPROGRESS)
-            ;
+    mutex_unlock(&w->lock);
+
+    /* fail safe: if the aio could not be canceled, we wait for it */
+    while (!done) {
+        mutex_lock(&done_lock);
+        if (acb->ret != -EINPROGRESS) {
+            QTAILQ_REMOVE(&done_list, acb, node);
+            done = true;
+        }
+        mutex_unlock(&done_lock);
     }
 
-    paio_remove(acb);
+    posix_aio_state->nb_requests--;
+    qemu_aio_release(acb);
 }
 
 static AIOPool raw_aio_pool = {
@@ -609,9 +682,6 @@ BlockDriverAIOCB *paio_submit(BlockDriverState *bs, int fd,
     acb->aio_nbytes = nb_sectors * 512;
     acb->aio_offset = sector_num * 512;
 
-    acb->next = posix_aio_state->first_aio;
-    posix_aio_state->first_aio = acb;
-
     trace_paio_submit(acb, opaque, sector_num, nb_sectors, type);
     qemu_paio_submit(acb);
     return &acb->common;
@@ -630,13 +700,45 @@ BlockDriverAIOCB *paio_ioctl(BlockDriverState *bs, int fd,
     acb->aio_ioctl_buf = buf;
     acb->aio_ioctl_cmd = req;
 
-    acb->next = posix_aio_state->first_aio;
-    posix_aio_state->first_aio = acb;
+    qemu_paio_submit(acb);
+    return &acb->common;
+}
+
+/* Run func(arg) in a worker thread; cb gets its return value, which is 0 or
+ * -errno.  Used to move CPU heavy or blocking work such as compression off
+ * the main thread.  bs is only used to identify the request and may be NULL
+ * for users outside the block layer.  paio_init() must have been called. */
+BlockDriverAIOCB *paio_submit_func(BlockDriverState *bs,
+        int (*func)(void *arg), void *arg,
+        BlockDriverCompletionFunc *cb, void *opaque)
+{
+    struct qemu_paiocb *acb;
+
+    acb = qemu_aio_get(&raw_aio_pool, bs, cb, opaque);
+    acb->aio_type = QEMU_AIO_FUNC;
+    acb->aio_fildes = -1;
+    acb->aio_offset = 0;
+    acb->aio_nbytes = 0;
+    acb->aio_func = func;
+    acb->aio_func_arg = arg;
 
     qemu_paio_submit(acb);
     return &acb->common;
 }
 
+/* Sets the size of the worker pool.  Only possible before paio_init(). */
+int paio_set_max_threads(int n)
+{
+    if (n < 1) {
+        return -EINVAL;
+    }
+    if (posix_aio_state) {
+        return -EBUSY;
+    }
+    max_threads = n;
+    return 0;
+}
+
 int paio_init(void)
 {
     PosixAioState *s;
@@ -648,9 +750,9 @@ int paio_init(void)
 
     s = g_malloc(sizeof(PosixAioState));
 
-    s->first_aio = NULL;
-    if (qemu_pipe(fds) == -1) {
-        fprintf(stderr, "failed to create pipe\n");
+    s->nb_requests = 0;
+    if (qemu_eventfd(fds) == -1) {
+        fprintf(stderr, "failed to create eventfd\n");
         g_free(s);
         return -1;
     }
@@ -671,7 +773,9 @@ int paio_init(void)
     if (ret)
         die2(ret, "pthread_attr_setdetachstate");
 
-    QTAILQ_INIT(&request_list);
+    workers = g_malloc0(sizeof(*workers) * max_threads);
+    idle_workers = g_malloc0(sizeof(*idle_workers) * max_threads);
+    QTAILQ_INIT(&done_list);
     new_thread_bh = qemu_bh_new(spawn_thread_bh_fn, NULL);
 
     posix_aio_state = s;
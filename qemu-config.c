@@ -62,6 +62,10 @@ static QemuOptsList qemu_drive_opts = {
             .name = "aio",
             .type = QEMU_OPT_STRING,
             .help = "host AIO implementation (threads, native)",
+        },{
+            .name = "aio-max-events",
+            .type = QEMU_OPT_NUMBER,
+            .help = "queue size for aio=native",
         },{
             .name = "format",
             .type = QEMU_OPT_STRING,
@@ -114,6 +118,18 @@ static QemuOptsList qemu_drive_opts = {
             .name = "copy-on-read",
             .type = QEMU_OPT_BOOL,
             .help = "copy read data from backing file into image file",
+        },{
+            .name = "l2-cache-size",
+            .type = QEMU_OPT_SIZE,
+            .help = "size of the L2 table cache in bytes",
+        },{
+            .name = "l2-cache-coverage",
+            .type = QEMU_OPT_SIZE,
+            .help = "amount of the disk mapped by the L2 table cache",
+        },{
+            .name = "refcount-cache-size",
+            .type = QEMU_OPT_SIZE,
+            .help = "size of the refcount block cache in bytes",
         },
         { /* end of list */ }
     },
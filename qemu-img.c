@@ -84,6 +84,8 @@ static void help(void)
            "  '-p' show progress of command (only certain commands)\n"
            "  '-S' indicates the consecutive number of bytes that must contain only zeros\n"
            "       for qemu-img to create a sparse image during conversion\n"
+           "  '-m' number of parallel coroutines for the conversion (default: 8)\n"
+           "  '-W' allow the conversion to write the output image out of order\n"
            "\n"
            "Parameters to check subcommand:\n"
            "  '-r' tries to repair any inconsistencies that are found during the check.\n"
@@ -653,17 +655,198 @@ static int compare_sectors(const uint8_t *buf1, const uint8_t *buf2, int n,
 
 #define IO_BUF_SIZE (2 * 1024 * 1024)
 
+/* Number of chunks converted concurrently, unless -m says otherwise */
+#define CONVERT_COROUTINES      8
+#define CONVERT_MAX_COROUTINES  16
+
+typedef struct ImgConvertState {
+    BlockDriverState **src;
+    int64_t *src_sectors;
+    int src_num;
+    int src_cur;
+    int64_t src_cur_offset;
+    int64_t total_sectors;
+    int64_t sector_num;         /* first sector not handed out yet */
+    int64_t wr_offs;            /* first sector not written yet, if in order */
+    BlockDriverState *target;
+    bool has_zero_init;
+    bool target_has_backing;
+    bool wr_in_order;
+    int min_sparse;
+    float local_progress;
+    int running_coroutines;
+    int ret;
+    CoMutex lock;
+    CoQueue wr_queue;
+} ImgConvertState;
+
+static int coroutine_fn convert_co_write(ImgConvertState *s,
+                                         int64_t sector_num, int n,
+                                         uint8_t *buf)
+{
+    struct iovec iov;
+    QEMUIOVector qiov;
+    int n1, ret;
+
+    while (n > 0) {
+        n1 = n;
+        /* If the output image is being created as a copy on write image,
+           copy all sectors even the ones containing only NUL bytes,
+           because they may differ from the sectors in the base image.
+
+           If the output is to a host device, we also write out
+           sectors that are entirely 0, since whatever data was
+           already there is garbage, not 0s. */
+        if (!s->has_zero_init || s->target_has_backing ||
+            is_allocated_sectors_min(buf, n, &n1, s->min_sparse)) {
+            iov.iov_base = buf;
+            iov.iov_len = n1 * BDRV_SECTOR_SIZE;
+            qemu_iovec_init_external(&qiov, &iov, 1);
+
+            ret = bdrv_co_writev(s->target, sector_num, n1, &qiov);
+            if (ret < 0) {
+                error_report("error while writing sector %" PRId64
+                             ": %s", sector_num, strerror(-ret));
+                return ret;
+            }
+        }
+        sector_num += n1;
+        n -= n1;
+        buf += n1 * BDRV_SECTOR_SIZE;
+    }
+    return 0;
+}
+
+/*
+ * Each coroutine repeatedly takes the next chunk of the input, reads it and
+ * writes it out, so that several reads and writes are in flight at a time.
+ * Unless -W was given, a chunk is only written once all chunks before it
+ * have been, which keeps the layout of the output the same as with a
+ * sequential copy.
+ */
+static void coroutine_fn convert_co_do_copy(void *opaque)
+{
+    ImgConvertState *s = opaque;
+    uint8_t *buf = qemu_blockalign(s->target, IO_BUF_SIZE);
+    struct iovec iov;
+    QEMUIOVector qiov;
+
+    for (;;) {
+        int64_t sector_num, src_num;
+        int src_idx, n, n1, ret = 0;
+        bool copy = true;
+
+        qemu_co_mutex_lock(&s->lock);
+        if (s->ret < 0 || s->sector_num >= s->total_sectors) {
+            qemu_co_mutex_unlock(&s->lock);
+            break;
+        }
+        sector_num = s->sector_num;
+        while (sector_num - s->src_cur_offset >= s->src_sectors[s->src_cur]) {
+            s->src_cur_offset += s->src_sectors[s->src_cur];
+            s->src_cur++;
+            assert(s->src_cur < s->src_num);
+        }
+        src_idx = s->src_cur;
+        src_num = sector_num - s->src_cur_offset;
+
+        n = MIN(s->total_sectors - sector_num, IO_BUF_SIZE / BDRV_SECTOR_SIZE);
+        n = MIN(n, s->src_sectors[src_idx] - src_num);
+
+        /* If the output image is being created as a copy on write image,
+           assume that sectors which are unallocated in the input image
+           are present in both the output's and input's base images (no
+           need to copy them). */
+        if (s->has_zero_init && s->target_has_backing) {
+            ret = bdrv_co_is_allocated(s->src[src_idx], src_num, n, &n1);
+            if (ret < 0) {
+                error_report("error while reading sector %" PRId64 ": %s",
+                             src_num, strerror(-ret));
+                s->ret = ret;
+                qemu_co_queue_restart_all(&s->wr_queue);
+                qemu_co_mutex_unlock(&s->lock);
+                break;
+            }
+            copy = ret;
+            ret = 0;
+            n = n1;
+        }
+        s->sector_num += n;
+        qemu_co_mutex_unlock(&s->lock);
+
+        if (copy) {
+            iov.iov_base = buf;
+            iov.iov_len = n * BDRV_SECTOR_SIZE;
+            qemu_iovec_init_external(&qiov, &iov, 1);
+
+            ret = bdrv_co_readv(s->src[src_idx], src_num, n, &qiov);
+            if (ret < 0) {
+                error_report("error while reading sector %" PRId64 ": %s",
+                             src_num, strerror(-ret));
+            }
+        }
+
+        if (s->wr_in_order) {
+            while (ret == 0 && s->ret == 0 && s->wr_offs != sector_num) {
+                qemu_co_queue_wait(&s->wr_queue);
+            }
+        }
+        if (ret == 0 && s->ret < 0) {
+            /* another chunk failed */
+            break;
+        }
+        if (ret == 0 && copy) {
+            ret = convert_co_write(s, sector_num, n, buf);
+        }
+        if (ret < 0) {
+            s->ret = ret;
+            qemu_co_queue_restart_all(&s->wr_queue);
+            break;
+        }
+        if (s->wr_in_order) {
+            s->wr_offs = sector_num + n;
+            qemu_co_queue_restart_all(&s->wr_queue);
+        }
+        if (copy) {
+            qemu_progress_print(s->local_progress, 100);
+        }
+    }
+
+    qemu_vfree(buf);
+    s->running_coroutines--;
+}
+
+static int convert_do_copy(ImgConvertState *s, int num_coroutines)
+{
+    Coroutine *co;
+    int i;
+
+    qemu_co_mutex_init(&s->lock);
+    qemu_co_queue_init(&s->wr_queue);
+
+    s->running_coroutines = num_coroutines;
+    for (i = 0; i < num_coroutines; i++) {
+        co = qemu_coroutine_create(convert_co_do_copy);
+        qemu_coroutine_enter(co, s);
+    }
+    while (s->running_coroutines) {
+        qemu_aio_wait();
+    }
+    return s->ret;
+}
+
 static int img_convert(int argc, char **argv)
 {
-    int c, ret = 0, n, n1, bs_n, bs_i, compress, cluster_size, cluster_sectors;
-    int progress = 0, flags;
+    int c, ret = 0, n, bs_n, bs_i, compress, cluster_size, cluster_sectors;
+    int progress = 0, flags, num_coroutines = CONVERT_COROUTINES;
+    bool wr_in_order = true;
     const char *fmt, *out_fmt, *cache, *out_baseimg, *out_filename;
     BlockDriver *drv, *proto_drv;
     BlockDriverState **bs = NULL, *out_bs = NULL;
     int64_t total_sectors, nb_sectors, sector_num, bs_offset;
     uint64_t bs_sectors;
+    int64_t *src_sectors = NULL;
     uint8_t * buf = NULL;
-    const uint8_t *buf1;
     BlockDriverInfo bdi;
     QEMUOptionParameter *param = NULL, *create_options = NULL;
     QEMUOptionParameter *out_baseimg_param;
@@ -678,7 +861,7 @@ static int img_convert(int argc, char **argv)
     out_baseimg = NULL;
     compress = 0;
     for(;;) {
-        c = getopt(argc, argv, "f:O:B:s:hce6o:pS:t:");
+        c = getopt(argc, argv, "f:O:B:s:hce6o:pS:t:m:W");
         if (c == -1) {
             break;
         }
@@ -732,6 +915,22 @@ static int img_convert(int argc, char **argv)
         case 't':
             cache = optarg;
             break;
+        case 'm':
+        {
+            char *end;
+            num_coroutines = strtol(optarg, &end, 10);
+            if (*end || num_coroutines < 1 ||
+                num_coroutines > CONVERT_MAX_COROUTINES) {
+                error_report("Invalid number of coroutines. Allowed number of"
+                             " coroutines is between 1 and %d",
+                             CONVERT_MAX_COROUTINES);
+                return 1;
+            }
+            break;
+        }
+        case 'W':
+            wr_in_order = false;
+            break;
         }
     }
 
@@ -750,6 +949,13 @@ static int img_convert(int argc, char **argv)
         goto out;
     }
 
+    if (compress && !wr_in_order) {
+        error_report("Out of order writes and compression are mutually "
+                     "exclusive");
+        ret = -1;
+        goto out;
+    }
+
     if (bs_n > 1 && out_baseimg) {
         error_report("-B makes no sense when concatenating multiple input "
                      "images");
@@ -760,6 +966,7 @@ static int img_convert(int argc, char **argv)
     qemu_progress_print(0, 100);
 
     bs = g_malloc0(bs_n * sizeof(BlockDriverState *));
+    src_sectors = g_malloc0(bs_n * sizeof(int64_t));
 
     total_sectors = 0;
     for (bs_i = 0; bs_i < bs_n; bs_i++) {
@@ -770,6 +977,7 @@ static int img_convert(int argc, char **argv)
             goto out;
         }
         bdrv_get_geometry(bs[bs_i], &bs_sectors);
+        src_sectors[bs_i] = bs_sectors;
         total_sectors += bs_sectors;
     }
 
@@ -974,93 +1182,31 @@ static int img_convert(int argc, char **argv)
             sector_num += n;
             qemu_progress_print(local_progress, 100);
         }
-        /* signal EOF to align */
-        bdrv_write_compressed(out_bs, 0, NULL, 0);
+        /* signal EOF to align; this also waits for the clusters that are
+         * still being compressed */
+        ret = bdrv_write_compressed(out_bs, 0, NULL, 0);
+        if (ret < 0) {
+            error_report("error while compressing: %s", strerror(-ret));
+            goto out;
+        }
     } else {
-        int has_zero_init = bdrv_has_zero_init(out_bs);
+        ImgConvertState state = {
+            .src                = bs,
+            .src_sectors        = src_sectors,
+            .src_num            = bs_n,
+            .total_sectors      = total_sectors,
+            .target             = out_bs,
+            .has_zero_init      = bdrv_has_zero_init(out_bs),
+            .target_has_backing = !!out_baseimg,
+            .wr_in_order        = wr_in_order,
+            .min_sparse         = min_sparse,
+        };
 
-        sector_num = 0; // total number of sectors converted so far
-        nb_sectors = total_sectors - sector_num;
-        local_progress = (float)100 /
+        nb_sectors = total_sectors;
+        state.local_progress = (float)100 /
             (nb_sectors / MIN(nb_sectors, IO_BUF_SIZE / 512));
 
-        for(;;) {
-            nb_sectors = total_sectors - sector_num;
-            if (nb_sectors <= 0) {
-                break;
-            }
-            if (nb_sectors >= (IO_BUF_SIZE / 512)) {
-                n = (IO_BUF_SIZE / 512);
-            } else {
-                n = nb_sectors;
-            }
-
-            while (sector_num - bs_offset >= bs_sectors) {
-                bs_i ++;
-                assert (bs_i < bs_n);
-                bs_offset += bs_sectors;
-                bdrv_get_geometry(bs[bs_i], &bs_sectors);
-                /* printf("changing part: sector_num=%" PRId64 ", bs_i=%d, "
-                  "bs_offset=%" PRId64 ", bs_sectors=%" PRId64 "\n",
-                   sector_num, bs_i, bs_offset, bs_sectors); */
-            }
-
-            if (n > bs_offset + bs_sectors - sector_num) {
-                n = bs_offset + bs_sectors - sector_num;
-            }
-
-            if (has_zero_init) {
-                /* If the output image is being created as a copy on write image,
-                   assume that sectors which are unallocated in the input image
-                   are present in both the output's and input's base images (no
-                   need to copy them). */
-                if (out_baseimg) {
-                    if (!bdrv_is_allocated(bs[bs_i], sector_num - bs_offset,
-                                           n, &n1)) {
-                        sector_num += n1;
-                        continue;
-                    }
-                    /* The next 'n1' sectors are allocated in the input image. Copy
-                       only those as they may be followed by unallocated sectors. */
-                    n = n1;
-                }
-            } else {
-                n1 = n;
-            }
-
-            ret = bdrv_read(bs[bs_i], sector_num - bs_offset, buf, n);
-            if (ret < 0) {
-                error_report("error while reading sector %" PRId64 ": %s",
-                             sector_num - bs_offset, strerror(-ret));
-                goto out;
-            }
-            /* NOTE: at the same time we convert, we do not write zero
-               sectors to have a chance to compress the image. Ideally, we
-               should add a specific call to have the info to go faster */
-            buf1 = buf;
-            while (n > 0) {
-                /* If the output image is being created as a copy on write image,
-                   copy all sectors even the ones containing only NUL bytes,
-                   because they may differ from the sectors in the base image.
-
-                   If the output is to a host device, we also write out
-                   sectors that are entirely 0, since whatever data was
-                   already there is garbage, not 0s. */
-                if (!has_zero_init || out_baseimg ||
-                    is_allocated_sectors_min(buf1, n, &n1, min_sparse)) {
-                    ret = bdrv_write(out_bs, sector_num, buf1, n1);
-                    if (ret < 0) {
-                        error_report("error while writing sector %" PRId64
-                                     ": %s", sector_num, strerror(-ret));
-                        goto out;
-                    }
-                }
-                sector_num += n1;
-                n -= n1;
-                buf1 += n1 * 512;
-            }
-            qemu_progress_print(local_progress, 100);
-        }
+        ret = convert_do_copy(&state, num_coroutines);
     }
 out:
     qemu_progress_end();
@@ -1078,6 +1224,7 @@ out:
         }
         g_free(bs);
     }
+    g_free(src_sectors);
     if (ret) {
         return 1;
     }
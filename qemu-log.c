@@ -106,6 +106,9 @@ const CPULogItem cpu_log_items[] = {
       "show interrupts/exceptions in short format" },
     { CPU_LOG_EXEC, "exec",
       "show trace before each executed TB (lots of logs)" },
+    { CPU_LOG_EXEC_INSN, "exec_insn",
+      "show target assembly code before each executed TB,\n"
+      "disassembled once per TB" },
     { CPU_LOG_TB_CPU, "cpu",
       "show CPU state before block translation" },
     { CPU_LOG_PCALL, "pcall",
@@ -36,6 +36,7 @@
 #define SOCKET_PATH         "/var/lock/qemu-nbd-%s"
 #define QEMU_NBD_OPT_CACHE  1
 #define QEMU_NBD_OPT_AIO    2
+#define QEMU_NBD_OPT_MAX_REQUESTS 3
 
 static NBDExport *exp;
 static int verbose;
@@ -61,6 +62,8 @@ static void usage(const char *name)
 "  -k, --socket=PATH    path to the unix socket\n"
 "                       (default '"SOCKET_PATH"')\n"
 "  -e, --shared=NUM     device can be shared by NUM clients (default '1')\n"
+"      --max-requests=NUM  process up to NUM requests of each client at a time\n"
+"                       (default '16')\n"
 "  -t, --persistent     don't exit on the last connection\n"
 "  -v, --verbose        display extra debugging information\n"
 "\n"
@@ -317,6 +320,7 @@ int main(int argc, char **argv)
         { "aio", 1, NULL, QEMU_NBD_OPT_AIO },
 #endif
         { "shared", 1, NULL, 'e' },
+        { "max-requests", 1, NULL, QEMU_NBD_OPT_MAX_REQUESTS },
         { "persistent", 0, NULL, 't' },
         { "verbose", 0, NULL, 'v' },
         { NULL, 0, NULL, 0 }
@@ -330,6 +334,7 @@ int main(int argc, char **argv)
     int ret;
     int fd;
     int persistent = 0;
+    int max_requests = 0;
     bool seen_cache = false;
 #ifdef CONFIG_LINUX_AIO
     bool seen_aio = false;
@@ -429,6 +434,12 @@ int main(int argc, char **argv)
                 errx(EXIT_FAILURE, "Shared device number must be greater than 0\n");
             }
             break;
+        case QEMU_NBD_OPT_MAX_REQUESTS:
+            max_requests = strtol(optarg, &end, 0);
+            if (*end || max_requests < 1) {
+                errx(EXIT_FAILURE, "Invalid number of requests `%s'", optarg);
+            }
+            break;
 	case 't':
 	    persistent = 1;
 	    break;
@@ -547,6 +558,9 @@ int main(int argc, char **argv)
     }
 
     exp = nbd_export_new(bs, dev_offset, fd_size, nbdflags);
+    if (max_requests) {
+        nbd_export_set_max_requests(exp, max_requests);
+    }
 
     if (sockpath) {
         fd = unix_socket_incoming(sockpath);
@@ -148,8 +148,10 @@ DEF("drive", HAS_ARG, QEMU_OPTION_drive,
     "       [,cyls=c,heads=h,secs=s[,trans=t]][,snapshot=on|off]\n"
     "       [,cache=writethrough|writeback|none|directsync|unsafe][,format=f]\n"
     "       [,serial=s][,addr=A][,id=name][,aio=threads|native]\n"
+    "       [,aio-max-events=n]\n"
     "       [,readonly=on|off][,copy-on-read=on|off]\n"
     "       [[,bps=b]|[[,bps_rd=r][,bps_wr=w]]][[,iops=i]|[[,iops_rd=r][,iops_wr=w]]\n"
+    "       [[,l2-cache-size=s]|[,l2-cache-coverage=s]][,refcount-cache-size=s]\n"
     "                use 'file' as a drive image\n", QEMU_ARCH_ALL)
 STEXI
 @item -drive @var{option}[,@var{option}[,@var{option}[,...]]]
@@ -184,6 +186,9 @@ These options have the same definition as they have in @option{-hdachs}.
 @var{cache} is "none", "writeback", "unsafe", "directsync" or "writethrough" and controls how the host cache is used to access block data.
 @item aio=@var{aio}
 @var{aio} is "threads", or "native" and selects between pthread based disk I/O and native Linux AIO.
+@item aio-max-events=@var{n}
+Number of requests that native Linux AIO keeps in flight; more wait in
+QEMU until earlier ones complete.  The default is 128.
 @item format=@var{format}
 Specify which disk @var{format} will be used rather than detecting
 the format.  Can be used to specifiy format=raw to avoid interpreting
@@ -203,6 +208,13 @@ Open drive @option{file} as read-only. Guest write attempts will fail.
 @item copy-on-read=@var{copy-on-read}
 @var{copy-on-read} is "on" or "off" and enables whether to copy read backing
 file sectors into the image file.
+@item l2-cache-size=@var{size}
+@item l2-cache-coverage=@var{size}
+Size of the qcow2 L2 table cache, either in bytes of tables or in bytes of
+disk mapped by the cached tables.  Both default to the minimum cache of 16
+tables.
+@item refcount-cache-size=@var{size}
+Size of the qcow2 refcount block cache in bytes.  The minimum is 4 blocks.
 @end table
 
 By default, writethrough caching is used for all block device.  This means that
@@ -2725,6 +2737,19 @@ Immediately before starting guest execution, drop root privileges, switching
 to the specified user.
 ETEXI
 
+#ifndef _WIN32
+DEF("aio-threads", HAS_ARG, QEMU_OPTION_aio_threads, \
+    "-aio-threads n  use at most n threads for asynchronous I/O (default 64)\n",
+    QEMU_ARCH_ALL)
+#endif
+STEXI
+@item -aio-threads @var{n}
+@findex -aio-threads
+Run the blocking I/O of @code{aio=threads} drives in a pool of at most
+@var{n} threads.  Threads are started as needed and then kept for the
+lifetime of QEMU.  The default is 64.
+ETEXI
+
 DEF("prom-env", HAS_ARG, QEMU_OPTION_prom_env,
     "-prom-env variable=value\n"
     "                set OpenBIOS nvram variables\n",
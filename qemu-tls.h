@@ -49,4 +49,15 @@
 #define tls_var(x)           tls__##x
 #endif
 
+/* Qualifier for the code generator state.  linux-user runs every guest
+ * thread on its own host thread and lets them translate concurrently,
+ * so each one gets a private copy (see tcg_context_clone).  Everything
+ * else translates from a single thread.
+ */
+#if defined(__linux__) && defined(CONFIG_LINUX_USER)
+#define TCG_THREAD __thread
+#else
+#define TCG_THREAD
+#endif
+
 #endif
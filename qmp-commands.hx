@@ -1575,6 +1575,14 @@ Each json-object contain the following:
     - "flush_total_time_ns": total time spend on cache flushes in nano-seconds (json-int)
     - "wr_highest_offset": Highest offset of a sector written since the
                            BlockDriverState has been opened (json-int)
+    - "l2_cache_hits": L2 table lookups served by the metadata cache
+                       (json-int, optional)
+    - "l2_cache_misses": L2 tables read into the metadata cache
+                         (json-int, optional)
+    - "refcount_cache_hits": refcount block lookups served by the metadata
+                             cache (json-int, optional)
+    - "refcount_cache_misses": refcount blocks read into the metadata cache
+                               (json-int, optional)
 - "parent": Contains recursively the statistics of the underlying
             protocol (e.g. the host file for a qcow2 image). If there is
             no underlying protocol, this field is omitted
@@ -2514,3 +2522,9 @@ EQMP
         .args_type  = "",
         .mhandler.cmd_new = qmp_marshal_input_query_target,
     },
+
+    {
+        .name       = "query-translation-buffer",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_translation_buffer,
+    },
@@ -35,6 +35,9 @@
 #include "softfloat.h"
 
 #define TARGET_HAS_ICE 1
+#define TARGET_HAS_INSN_RECORDS 1
+#define TARGET_HAS_PARALLEL_TRANSLATION 1
+#define TARGET_HAS_TB_STORE 1
 
 #define EXCP_UDEF            1   /* undefined instruction */
 #define EXCP_SWI             2   /* software interrupt */
@@ -907,6 +910,13 @@ static inline void cpu_get_tb_cpu_state(CPUARMState *env, target_ulong *pc,
     }
 }
 
+/* What the translated code depends on besides the TB flags, for the
+   translation store shared between processes.  */
+static inline uint64_t cpu_tb_store_config(CPUARMState *env)
+{
+    return env->features;
+}
+
 static inline bool cpu_has_work(CPUARMState *env)
 {
     return env->interrupt_request &
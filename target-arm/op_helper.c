@@ -458,3 +458,64 @@ uint32_t HELPER(ror_cc)(CPUARMState *env, uint32_t x, uint32_t i)
         return ((uint32_t)x >> shift) | (x << (32 - shift));
     }
 }
+
+#ifdef CONFIG_USER_ONLY
+/* Store exclusive of 'val' ({Rt2:Rt} for a doubleword) at 'addr' with
+   a host compare-and-swap against the value seen by the load exclusive.
+   Returns 0 on success, 1 on failure, and 2 when the store must be done
+   by cpu_loop() with the other CPUs stopped: the access would fault, is
+   misaligned, or is a doubleword the host cannot swap atomically.  */
+uint32_t HELPER(strex)(CPUARMState *env, uint32_t addr, uint64_t val,
+                       uint32_t size)
+{
+    int len = size == 3 ? 8 : 1 << size;
+    void *p;
+    bool ok;
+
+    if (addr != env->exclusive_addr) {
+        return 1;
+    }
+    if ((addr & (len - 1)) != 0 ||
+        page_check_range(addr, len, PAGE_READ | PAGE_WRITE) < 0) {
+        return 2;
+    }
+    p = g2h(addr);
+    switch (size) {
+    case 0:
+        ok = __sync_bool_compare_and_swap((uint8_t *)p,
+                                          (uint8_t)env->exclusive_val,
+                                          (uint8_t)val);
+        break;
+    case 1:
+        ok = __sync_bool_compare_and_swap((uint16_t *)p,
+                                          tswap16(env->exclusive_val),
+                                          tswap16(val));
+        break;
+    case 2:
+        ok = __sync_bool_compare_and_swap((uint32_t *)p,
+                                          tswap32(env->exclusive_val),
+                                          tswap32(val));
+        break;
+    default:
+#if HOST_LONG_BITS == 64
+        {
+            /* the two words in guest memory order */
+            uint32_t oldw[2], neww[2];
+            uint64_t oldv, newv;
+
+            oldw[0] = tswap32(env->exclusive_val);
+            oldw[1] = tswap32(env->exclusive_high);
+            neww[0] = tswap32(val);
+            neww[1] = tswap32(val >> 32);
+            memcpy(&oldv, oldw, sizeof(oldv));
+            memcpy(&newv, neww, sizeof(newv));
+            ok = __sync_bool_compare_and_swap((uint64_t *)p, oldv, newv);
+        }
+        break;
+#else
+        return 2;
+#endif
+    }
+    return ok ? 0 : 1;
+}
+#endif
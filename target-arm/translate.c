@@ -91,7 +91,7 @@ typedef struct DisasContext {
     int vec_stride;
 } DisasContext;
 
-static uint32_t gen_opc_condexec_bits[OPC_BUF_SIZE];
+static TCG_THREAD uint32_t gen_opc_condexec_bits[OPC_BUF_SIZE];
 
 #if defined(CONFIG_USER_ONLY)
 #define IS_USER(s) 1
@@ -106,7 +106,7 @@ static uint32_t gen_opc_condexec_bits[OPC_BUF_SIZE];
 
 static TCGv_ptr cpu_env;
 /* We reuse the same 64-bit temporaries for efficiency.  */
-static TCGv_i64 cpu_V0, cpu_V1, cpu_M0;
+static TCG_THREAD TCGv_i64 cpu_V0, cpu_V1, cpu_M0;
 static TCGv_i32 cpu_R[16];
 static TCGv_i32 cpu_exclusive_addr;
 static TCGv_i32 cpu_exclusive_val;
@@ -117,8 +117,8 @@ static TCGv_i32 cpu_exclusive_info;
 #endif
 
 /* FIXME:  These should be removed.  */
-static TCGv cpu_F0s, cpu_F1s;
-static TCGv_i64 cpu_F0d, cpu_F1d;
+static TCG_THREAD TCGv cpu_F0s, cpu_F1s;
+static TCG_THREAD TCGv_i64 cpu_F0d, cpu_F1d;
 
 #include "gen-icount.h"
 
@@ -3358,12 +3358,27 @@ static int disas_vfp_insn(CPUARMState * env, DisasContext *s, uint32_t insn)
     return 0;
 }
 
+/* Whether a direct jump from this TB to DEST may be chained.  In
+   system mode the destination page may be remapped behind our back,
+   so only jumps within the page of the TB are chained.  In user mode
+   guest addresses do not change meaning while a TB lives, and
+   tb_phys_invalidate() unlinks every incoming jump whatever page it
+   comes from, so we can chain across pages.  */
+static inline bool use_goto_tb(DisasContext *s, uint32_t dest)
+{
+#ifdef CONFIG_USER_ONLY
+    return true;
+#else
+    return (s->tb->pc & TARGET_PAGE_MASK) == (dest & TARGET_PAGE_MASK);
+#endif
+}
+
 static inline void gen_goto_tb(DisasContext *s, int n, uint32_t dest)
 {
     TranslationBlock *tb;
 
     tb = s->tb;
-    if ((tb->pc & TARGET_PAGE_MASK) == (dest & TARGET_PAGE_MASK)) {
+    if (use_goto_tb(s, dest)) {
         tcg_gen_goto_tb(n);
         gen_set_pc_im(dest);
         tcg_gen_exit_tb((tcg_target_long)tb + n);
@@ -6350,7 +6365,9 @@ static int disas_coproc_insn(CPUARMState * env, DisasContext *s, uint32_t insn)
                     TCGv_ptr tmpptr;
                     gen_set_pc_im(s->pc);
                     tmp64 = tcg_temp_new_i64();
+                    /* ri is a pointer into this process' heap */
                     tmpptr = tcg_const_ptr(ri);
+                    tb_gen_private = 1;
                     gen_helper_get_cp_reg64(tmp64, cpu_env, tmpptr);
                     tcg_temp_free_ptr(tmpptr);
                 } else {
@@ -6374,6 +6391,7 @@ static int disas_coproc_insn(CPUARMState * env, DisasContext *s, uint32_t insn)
                     gen_set_pc_im(s->pc);
                     tmp = tcg_temp_new_i32();
                     tmpptr = tcg_const_ptr(ri);
+                    tb_gen_private = 1;
                     gen_helper_get_cp_reg(tmp, cpu_env, tmpptr);
                     tcg_temp_free_ptr(tmpptr);
                 } else {
@@ -6406,6 +6424,7 @@ static int disas_coproc_insn(CPUARMState * env, DisasContext *s, uint32_t insn)
                 tcg_temp_free_i32(tmphi);
                 if (ri->writefn) {
                     TCGv_ptr tmpptr = tcg_const_ptr(ri);
+                    tb_gen_private = 1;
                     gen_set_pc_im(s->pc);
                     gen_helper_set_cp_reg64(cpu_env, tmpptr, tmp64);
                     tcg_temp_free_ptr(tmpptr);
@@ -6420,6 +6439,7 @@ static int disas_coproc_insn(CPUARMState * env, DisasContext *s, uint32_t insn)
                     gen_set_pc_im(s->pc);
                     tmp = load_reg(s, rt);
                     tmpptr = tcg_const_ptr(ri);
+                    tb_gen_private = 1;
                     gen_helper_set_cp_reg(cpu_env, tmpptr, tmp);
                     tcg_temp_free_ptr(tmpptr);
                     tcg_temp_free_i32(tmp);
@@ -6545,13 +6565,45 @@ static void gen_clrex(DisasContext *s)
 }
 
 #ifdef CONFIG_USER_ONLY
+/* The store is done by helper_strex with a host compare-and-swap, so
+   that other threads keep running.  Only the cases it cannot handle
+   raise EXCP_STREX and go through do_strex() in cpu_loop().  */
 static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
                                 TCGv addr, int size)
 {
+    TCGv tmp, tmp2, res;
+    TCGv_i64 val;
+    int done_label;
+
+    val = tcg_temp_new_i64();
+    tmp = load_reg(s, rt);
+    if (size == 3) {
+        tmp2 = load_reg(s, rt2);
+        tcg_gen_concat_i32_i64(val, tmp, tmp2);
+        tcg_temp_free_i32(tmp2);
+    } else {
+        tcg_gen_extu_i32_i64(val, tmp);
+    }
+    tcg_temp_free_i32(tmp);
+    res = tcg_temp_local_new_i32();
+    tmp = tcg_const_i32(size);
+    gen_helper_strex(res, cpu_env, addr, val, tmp);
+    tcg_temp_free_i32(tmp);
+    tcg_temp_free_i64(val);
+
+    done_label = gen_new_label();
+    tcg_gen_brcondi_i32(TCG_COND_NE, res, 2, done_label);
     tcg_gen_mov_i32(cpu_exclusive_test, addr);
     tcg_gen_movi_i32(cpu_exclusive_info,
                      size | (rd << 4) | (rt << 8) | (rt2 << 12));
-    gen_exception_insn(s, 4, EXCP_STREX);
+    /* does not return */
+    gen_set_condexec(s);
+    gen_set_pc_im(s->pc - 4);
+    gen_exception(EXCP_STREX);
+    gen_set_label(done_label);
+    tcg_gen_mov_i32(cpu_R[rd], res);
+    tcg_temp_free_i32(res);
+    tcg_gen_movi_i32(cpu_exclusive_addr, -1);
 }
 #else
 static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
@@ -10017,7 +10069,9 @@ static inline void gen_intermediate_code_internal(CPUARMState *env,
                 }
             }
         }
-        if (search_pc) {
+        /* cpu_gen_code() turns these into the insn records of the
+           blocks of the translation store and of the decode cache */
+        if (search_pc || tb_gen_insn_starts) {
             j = gen_opc_ptr - gen_opc_buf;
             if (lj < j) {
                 lj++;
@@ -10147,21 +10201,20 @@ static inline void gen_intermediate_code_internal(CPUARMState *env,
 done_generating:
     gen_icount_end(tb, num_insns);
     *gen_opc_ptr = INDEX_op_end;
-////#ifdef DEBUG_DISAS
-////    if (qemu_loglevel_mask(CPU_LOG_TB_IN_ASM)) {
+    if (qemu_loglevel_mask(CPU_LOG_TB_IN_ASM)) {
         qemu_log("----------------\n");
         qemu_log("IN: %s\n", lookup_symbol(pc_start));
         log_target_disas(pc_start, dc->pc - pc_start,
                          dc->thumb | (dc->bswap_code << 1));
         qemu_log("\n");
-////    }
-////#endif
-    if (search_pc) {
+    }
+    if (search_pc || tb_gen_insn_starts) {
         j = gen_opc_ptr - gen_opc_buf;
         lj++;
         while (lj <= j)
             gen_opc_instr_start[lj++] = 0;
-    } else {
+    }
+    if (!search_pc) {
         tb->size = dc->pc - pc_start;
         tb->icount = num_insns;
     }
@@ -10239,3 +10292,15 @@ void restore_state_to_opc(CPUARMState *env, TranslationBlock *tb, int pc_pos)
     env->regs[15] = gen_opc_pc[pc_pos];
     env->condexec_bits = gen_opc_condexec_bits[pc_pos];
 }
+
+uint16_t insn_record_data(int pc_pos)
+{
+    return gen_opc_condexec_bits[pc_pos];
+}
+
+void restore_state_to_insn(CPUARMState *env, TranslationBlock *tb,
+                           const TBInsnRecord *rec)
+{
+    env->regs[15] = rec->pc;
+    env->condexec_bits = rec->data;
+}
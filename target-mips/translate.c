@@ -479,7 +479,7 @@ static TCGv cpu_dspctrl, btarget, bcond;
 static TCGv_i32 hflags;
 static TCGv_i32 fpu_fcr0, fpu_fcr31;
 
-static uint32_t gen_opc_hflags[OPC_BUF_SIZE];
+static TCG_THREAD uint32_t gen_opc_hflags[OPC_BUF_SIZE];
 
 #include "gen-icount.h"
 
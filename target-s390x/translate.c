@@ -139,7 +139,7 @@ static TCGv_i64 cc_vr;
 static char cpu_reg_names[10*3 + 6*4];
 static TCGv_i64 regs[16];
 
-static uint8_t gen_opc_cc_op[OPC_BUF_SIZE];
+static TCG_THREAD uint8_t gen_opc_cc_op[OPC_BUF_SIZE];
 
 void s390x_translate_init(void)
 {
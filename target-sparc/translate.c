@@ -65,8 +65,8 @@ static TCGv_i64 cpu_tmp64;
 /* Floating point registers */
 static TCGv_i64 cpu_fpr[TARGET_DPREGS];
 
-static target_ulong gen_opc_npc[OPC_BUF_SIZE];
-static target_ulong gen_opc_jump_pc[2];
+static TCG_THREAD target_ulong gen_opc_npc[OPC_BUF_SIZE];
+static TCG_THREAD target_ulong gen_opc_jump_pc[2];
 
 #include "gen-icount.h"
 
@@ -425,15 +425,20 @@ static void tcg_out_modrm_sib_offset(TCGContext *s, int opc, int r, int rm,
     if (index < 0 && rm < 0) {
         if (TCG_TARGET_REG_BITS == 64) {
             /* Try for a rip-relative addressing mode.  This has replaced
-               the 32-bit-mode absolute addressing encoding.  */
-            tcg_target_long pc = (tcg_target_long)s->code_ptr + 5 + ~rm;
-            tcg_target_long disp = offset - pc;
+               the 32-bit-mode absolute addressing encoding.  The
+               displacement is relative to the end of the instruction,
+               whose opcode may have prefixes: emit those first.  */
+            uint8_t *start = s->code_ptr;
+            tcg_target_long disp;
+
+            tcg_out_opc(s, opc, r, 0, 0);
+            tcg_out8(s, (LOWREGMASK(r) << 3) | 5);
+            disp = offset - ((tcg_target_long)s->code_ptr + 4 + ~rm);
             if (disp == (int32_t)disp) {
-                tcg_out_opc(s, opc, r, 0, 0);
-                tcg_out8(s, (LOWREGMASK(r) << 3) | 5);
                 tcg_out32(s, disp);
                 return;
             }
+            s->code_ptr = start;
 
             /* Try for an absolute address encoding.  This requires the
                use of the MODRM+SIB encoding and is therefore larger than
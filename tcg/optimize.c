@@ -48,7 +48,7 @@ struct tcg_temp_info {
     tcg_target_ulong val;
 };
 
-static struct tcg_temp_info temps[TCG_MAX_TEMPS];
+static TCG_THREAD struct tcg_temp_info temps[TCG_MAX_TEMPS];
 
 /* Reset TEMP's state to TCG_TEMP_UNDEF.  If TEMP only had one copy, remove
    the copy flag from the left temp.  */
@@ -103,8 +103,8 @@ static TCGRegSet tcg_target_available_regs[2];
 static TCGRegSet tcg_target_call_clobber_regs;
 
 /* XXX: move that inside the context */
-uint16_t *gen_opc_ptr;
-TCGArg *gen_opparam_ptr;
+TCG_THREAD uint16_t *gen_opc_ptr;
+TCG_THREAD TCGArg *gen_opparam_ptr;
 
 static inline void tcg_out8(TCGContext *s, uint8_t v)
 {
@@ -271,6 +271,22 @@ void tcg_context_init(TCGContext *s)
     tcg_target_init(s);
 }
 
+/* Initialize the context of a new thread from the one of the thread
+   that creates it, which must not be generating code meanwhile.  The
+   globals and helpers registered so far are shared; the memory pool is
+   private to each context.  */
+void tcg_context_clone(TCGContext *s, const TCGContext *src)
+{
+    *s = *src;
+    s->temps = s->static_temps;
+    s->pool_cur = s->pool_end = NULL;
+    s->pool_first = s->pool_current = s->pool_first_large = NULL;
+    s->labels = NULL;
+    s->nb_labels = 0;
+    s->helpers = g_memdup(src->helpers,
+                          src->allocated_helpers * sizeof(TCGHelperInfo));
+}
+
 void tcg_prologue_init(TCGContext *s)
 {
     /* init global prologue and epilogue */
@@ -2041,14 +2057,11 @@ static inline int tcg_gen_code_common(TCGContext *s, uint8_t *gen_code_buf,
     const TCGArg *args;
 
 #ifdef DEBUG_DISAS
-//    if (unlikely(qemu_loglevel_mask(CPU_LOG_TB_OP))) {
-//        qemu_log("OP:\n");
-//        tcg_dump_ops(s);
-//        qemu_log("\n");
-	fprintf(stderr, "TCG IR:\n");
-   	tcg_dump_ops(s);
-	fprintf(stderr, "\n");
-//    }
+    if (unlikely(qemu_loglevel_mask(CPU_LOG_TB_OP))) {
+        qemu_log("OP:\n");
+        tcg_dump_ops(s);
+        qemu_log("\n");
+    }
 #endif
 
 #ifdef USE_TCG_OPTIMIZATIONS
@@ -2148,6 +2161,9 @@ static inline int tcg_gen_code_common(TCGContext *s, uint8_t *gen_code_buf,
         }
         args += def->nb_args;
     next:
+        if (s->op_host_end) {
+            s->op_host_end[op_index] = s->code_ptr - gen_code_buf;
+        }
         if (search_pc >= 0 && search_pc < s->code_ptr - gen_code_buf) {
             return op_index;
         }
@@ -2177,6 +2193,9 @@ int tcg_gen_code(TCGContext *s, uint8_t *gen_code_buf)
 #endif
 
     tcg_gen_code_common(s, gen_code_buf, -1);
+#if defined(TCI_THREADED)
+    tci_predecode(gen_code_buf, s->code_ptr);
+#endif
 
     /* flush instruction cache */
     flush_icache_range((tcg_target_ulong)gen_code_buf,
@@ -2191,6 +2210,17 @@ int tcg_gen_code(TCGContext *s, uint8_t *gen_code_buf)
    Return -1 if not found. */
 int tcg_gen_code_search_pc(TCGContext *s, uint8_t *gen_code_buf, long offset)
 {
+#if defined(TCI_THREADED)
+    /* The predecoded block may be running in another thread, and its
+       handler slots would be overwritten with opcodes: generate into a
+       scratch buffer instead, the ops have the same offsets there.  */
+    static TCG_THREAD uint8_t *scratch_buf;
+
+    if (!scratch_buf) {
+        scratch_buf = g_malloc(TCG_MAX_OP_SIZE * OPC_BUF_SIZE);
+    }
+    gen_code_buf = scratch_buf;
+#endif
     return tcg_gen_code_common(s, gen_code_buf, offset);
 }
 
@@ -22,6 +22,7 @@
  * THE SOFTWARE.
  */
 #include "qemu-common.h"
+#include "qemu-tls.h"
 
 /* Target word size (must be identical to pointer size). */
 #if UINTPTR_MAX == UINT32_MAX
@@ -347,6 +348,11 @@ struct TCGContext {
     uintptr_t *tb_next;
     uint16_t *tb_next_offset;
     uint16_t *tb_jmp_offset; /* != NULL if USE_DIRECT_JUMP */
+    uint64_t *tb_exec_count; /* != NULL if TB entries are counted */
+    uint32_t *tb_icount; /* != NULL if guest insns are counted */
+    uint8_t *tb_coverage_map; /* != NULL if edge coverage is recorded */
+    uint32_t tb_coverage_loc; /* location of the TB in tb_coverage_map */
+    uint32_t *op_host_end; /* != NULL to record the host code end of ops */
 
     /* liveness analysis */
     uint16_t *op_dead_args; /* for each operation, each bit tells if the
@@ -392,11 +398,11 @@ struct TCGContext {
 #endif
 };
 
-extern TCGContext tcg_ctx;
-extern uint16_t *gen_opc_ptr;
-extern TCGArg *gen_opparam_ptr;
-extern uint16_t gen_opc_buf[];
-extern TCGArg gen_opparam_buf[];
+extern TCG_THREAD TCGContext tcg_ctx;
+extern TCG_THREAD uint16_t *gen_opc_ptr;
+extern TCG_THREAD TCGArg *gen_opparam_ptr;
+extern TCG_THREAD uint16_t gen_opc_buf[];
+extern TCG_THREAD TCGArg gen_opparam_buf[];
 
 /* pool based memory allocation */
 
@@ -420,6 +426,7 @@ static inline void *tcg_malloc(int size)
 }
 
 void tcg_context_init(TCGContext *s);
+void tcg_context_clone(TCGContext *s, const TCGContext *src);
 void tcg_prologue_init(TCGContext *s);
 void tcg_func_start(TCGContext *s);
 
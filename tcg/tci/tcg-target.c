@@ -431,7 +431,12 @@ static void tcg_out64(TCGContext *s, uint64_t v)
 /* Write opcode. */
 static void tcg_out_op_t(TCGContext *s, TCGOpcode op)
 {
+#if defined(TCI_THREADED)
+    /* Replaced by the address of the handler in tci_predecode(). */
+    tcg_out_i(s, op);
+#else
     tcg_out8(s, op);
+#endif
     tcg_out8(s, 0);
 }
 
@@ -514,7 +519,7 @@ static void tcg_out_ld(TCGContext *s, TCGType type, TCGReg ret, TCGReg arg1,
         TODO();
 #endif
     }
-    old_code_ptr[1] = s->code_ptr - old_code_ptr;
+    old_code_ptr[TCI_OP_SIZE_OFFSET] = s->code_ptr - old_code_ptr;
 }
 
 static void tcg_out_mov(TCGContext *s, TCGType type, TCGReg ret, TCGReg arg)
@@ -528,7 +533,7 @@ static void tcg_out_mov(TCGContext *s, TCGType type, TCGReg ret, TCGReg arg)
 #endif
     tcg_out_r(s, ret);
     tcg_out_r(s, arg);
-    old_code_ptr[1] = s->code_ptr - old_code_ptr;
+    old_code_ptr[TCI_OP_SIZE_OFFSET] = s->code_ptr - old_code_ptr;
 }
 
 static void tcg_out_movi(TCGContext *s, TCGType type,
@@ -550,7 +555,7 @@ static void tcg_out_movi(TCGContext *s, TCGType type,
         TODO();
 #endif
     }
-    old_code_ptr[1] = s->code_ptr - old_code_ptr;
+    old_code_ptr[TCI_OP_SIZE_OFFSET] = s->code_ptr - old_code_ptr;
 }
 
 static void tcg_out_op(TCGContext *s, TCGOpcode opc, const TCGArg *args,
@@ -829,7 +834,7 @@ static void tcg_out_op(TCGContext *s, TCGOpcode opc, const TCGArg *args,
         fprintf(stderr, "Missing: %s\n", tcg_op_defs[opc].name);
         tcg_abort();
     }
-    old_code_ptr[1] = s->code_ptr - old_code_ptr;
+    old_code_ptr[TCI_OP_SIZE_OFFSET] = s->code_ptr - old_code_ptr;
 }
 
 static void tcg_out_st(TCGContext *s, TCGType type, TCGReg arg, TCGReg arg1,
@@ -852,7 +857,7 @@ static void tcg_out_st(TCGContext *s, TCGType type, TCGReg arg, TCGReg arg1,
         TODO();
 #endif
     }
-    old_code_ptr[1] = s->code_ptr - old_code_ptr;
+    old_code_ptr[TCI_OP_SIZE_OFFSET] = s->code_ptr - old_code_ptr;
 }
 
 /* Test if a constant matches the constraint. */
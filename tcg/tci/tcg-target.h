@@ -154,11 +154,32 @@ typedef enum {
     TCG_CONST = UINT8_MAX
 } TCGReg;
 
+/* Direct threaded code (see tci_predecode()) needs GCC's labels as
+   values. */
+#if defined(CONFIG_TCI_THREADED) && defined(__GNUC__)
+# define TCI_THREADED
+#endif
+
+#if defined(TCI_THREADED)
+/* Each op starts with a native size slot for the address of its handler
+   (the opcode until tci_predecode() has run), followed by its size. */
+# define TCI_OP_SIZE_OFFSET sizeof(tcg_target_ulong)
+#else
+/* Each op starts with its opcode and its size. */
+# define TCI_OP_SIZE_OFFSET 1
+#endif
+#define TCI_OP_HEADER_SIZE (TCI_OP_SIZE_OFFSET + 1)
+
 void tci_disas(uint8_t opc);
 
 tcg_target_ulong tcg_qemu_tb_exec(CPUArchState *env, uint8_t *tb_ptr);
 #define tcg_qemu_tb_exec tcg_qemu_tb_exec
 
+#if defined(TCI_THREADED)
+void tci_predecode(uint8_t *start, uint8_t *end);
+int tci_handler_opc(tcg_target_ulong handler);
+#endif
+
 static inline void flush_icache_range(tcg_target_ulong start,
                                       tcg_target_ulong stop)
 {
@@ -26,16 +26,28 @@ int print_insn_tci(bfd_vma addr, disassemble_info *info)
     int length;
     uint8_t byte;
     int status;
-    TCGOpcode op;
+    int op;
+#if defined(TCI_THREADED)
+    tcg_target_ulong handler;
 
+    /* The code has been predecoded: find the opcode of the handler. */
+    status = info->read_memory_func(addr, (bfd_byte *)&handler,
+                                    sizeof(handler), info);
+    if (status != 0) {
+        info->memory_error_func(status, addr, info);
+        return -1;
+    }
+    op = tci_handler_opc(handler);
+#else
     status = info->read_memory_func(addr, &byte, 1, info);
     if (status != 0) {
         info->memory_error_func(status, addr, info);
         return -1;
     }
     op = byte;
+#endif
 
-    addr++;
+    addr += TCI_OP_SIZE_OFFSET;
     status = info->read_memory_func(addr, &byte, 1, info);
     if (status != 0) {
         info->memory_error_func(status, addr, info);
@@ -43,7 +55,7 @@ int print_insn_tci(bfd_vma addr, disassemble_info *info)
     }
     length = byte;
 
-    if (op >= tcg_op_defs_max) {
+    if (op < 0 || (size_t)op >= tcg_op_defs_max) {
         info->fprintf_func(info->stream, "illegal opcode %d", op);
     } else {
         const TCGOpDef *def = &tcg_op_defs[op];
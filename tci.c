@@ -429,59 +429,423 @@ static bool tci_compare64(uint64_t u0, uint64_t u1, TCGCond condition)
     return result;
 }
 
+/* Direct threaded code.  The bytecode of a block is turned into direct
+   threaded code by tci_predecode() once it has been generated: the slot
+   in front of each op gets the address of its handler, so that every
+   handler jumps straight to the next one without decoding an opcode.
+   The predecoder also picks handlers specialized for register and
+   constant operands, and fuses common sequences of ops into
+   superinstructions.  Without it, the bytecode starts with the opcode
+   and is interpreted by a switch. */
+
+#if defined(TCI_THREADED)
+/* Handler addresses, exported by tcg_qemu_tb_exec(NULL, NULL). */
+static const void *const *tci_handlers_op;
+/* Both inputs in registers, and the second input constant. */
+static const void *const *tci_handlers_rr;
+static const void *const *tci_handlers_ri;
+/* Superinstructions: setcond_i32 + brcond_i32, and ld + op + st by the
+   opcode of the op. */
+static const void *const *tci_handler_setcond_brcond_i32;
+static const void *const *tci_handlers_ld_op_st;
+#endif
+
+#if !defined(NDEBUG)
+# define TCI_FETCH_DEBUG() \
+    do { \
+        op_size = tb_ptr[TCI_OP_SIZE_OFFSET]; \
+        old_code_ptr = tb_ptr; \
+    } while (0)
+#else
+# define TCI_FETCH_DEBUG() do { } while (0)
+#endif
+
+#if defined(GETPC)
+# define TCI_FETCH_TB_PTR() (tci_tb_ptr = (uintptr_t)tb_ptr)
+#else
+# define TCI_FETCH_TB_PTR() do { } while (0)
+#endif
+
+#if defined(TCI_THREADED)
+/* Jump to the handler of the op at tb_ptr. */
+# define TCI_DISPATCH() \
+    do { \
+        TCI_FETCH_TB_PTR(); \
+        TCI_FETCH_DEBUG(); \
+        tb_ptr += TCI_OP_HEADER_SIZE; \
+        goto **(void **)(tb_ptr - TCI_OP_HEADER_SIZE); \
+    } while (0)
+# define TCI_CASE(name) case INDEX_op_##name: tci_do_##name
+# define TCI_DEFAULT default: tci_do_default
+/* End of a handler which falls through to the next opcode. */
+# define TCI_NEXT() \
+    do { \
+        assert(tb_ptr == old_code_ptr + op_size); \
+        TCI_DISPATCH(); \
+    } while (0)
+/* End of a handler which has set tb_ptr to a branch target. */
+# define TCI_JUMP() TCI_DISPATCH()
+/* Step over the header of the next op of a superinstruction. */
+# define TCI_FUSED_NEXT() \
+    do { \
+        assert(tb_ptr == old_code_ptr + op_size); \
+        TCI_FETCH_DEBUG(); \
+        tb_ptr += TCI_OP_HEADER_SIZE; \
+    } while (0)
+#else
+# define TCI_CASE(name) case INDEX_op_##name
+# define TCI_DEFAULT default
+# define TCI_NEXT() break
+# define TCI_JUMP() continue
+#endif
+
+/* Operations shared by the plain handlers and the superinstructions. */
+#define TCI_LD(bits) \
+    do { \
+        t0 = *tb_ptr++; \
+        t1 = tci_read_r(&tb_ptr); \
+        t2 = tci_read_i32(&tb_ptr); \
+        tci_write_reg##bits(t0, *(uint##bits##_t *)(t1 + t2)); \
+    } while (0)
+#define TCI_ST(bits) \
+    do { \
+        t0 = tci_read_r##bits(&tb_ptr); \
+        t1 = tci_read_r(&tb_ptr); \
+        t2 = tci_read_i32(&tb_ptr); \
+        *(uint##bits##_t *)(t1 + t2) = t0; \
+    } while (0)
+#define TCI_BINOP(bits, expr) \
+    do { \
+        t0 = *tb_ptr++; \
+        t1 = tci_read_ri##bits(&tb_ptr); \
+        t2 = tci_read_ri##bits(&tb_ptr); \
+        tci_write_reg##bits(t0, expr); \
+    } while (0)
+
+#if defined(TCI_THREADED)
+/* Binary operation with both inputs in registers. */
+# define TCI_BINOP_RR(name, bits, expr) \
+        tci_do_##name##_rr: \
+            t0 = tb_ptr[0]; \
+            t1 = (uint##bits##_t)tci_reg[tb_ptr[1]]; \
+            t2 = (uint##bits##_t)tci_reg[tb_ptr[2]]; \
+            tb_ptr += 3; \
+            tci_write_reg##bits(t0, expr); \
+            TCI_NEXT();
+/* Binary operation with a constant second input. */
+# define TCI_BINOP_RI(name, bits, expr) \
+        tci_do_##name##_ri: \
+            t0 = tb_ptr[0]; \
+            t1 = (uint##bits##_t)tci_reg[tb_ptr[1]]; \
+            t2 = *(uint##bits##_t *)(tb_ptr + 3); \
+            tb_ptr += 3 + sizeof(uint##bits##_t); \
+            tci_write_reg##bits(t0, expr); \
+            TCI_NEXT();
+/* Load a value, operate on it and store the result back. */
+# define TCI_LD_OP_ST(name, bits, expr) \
+        tci_do_ld_##name##_st: \
+            TCI_LD(bits); \
+            TCI_FUSED_NEXT(); \
+            TCI_BINOP(bits, expr); \
+            TCI_FUSED_NEXT(); \
+            TCI_ST(bits); \
+            TCI_NEXT();
+/* The binary operations with specialized handlers. */
+# define TCI_FOR_BINOPS(bits, OP) \
+        OP(add_i##bits, bits, t1 + t2) \
+        OP(sub_i##bits, bits, t1 - t2) \
+        OP(mul_i##bits, bits, t1 * t2) \
+        OP(and_i##bits, bits, t1 & t2) \
+        OP(or_i##bits, bits, t1 | t2) \
+        OP(xor_i##bits, bits, t1 ^ t2) \
+        OP(shl_i##bits, bits, t1 << t2) \
+        OP(shr_i##bits, bits, t1 >> t2) \
+        OP(sar_i##bits, bits, (int##bits##_t)t1 >> t2)
+# define TCI_HANDLER_RR(name, bits, expr) \
+        [INDEX_op_##name] = &&tci_do_##name##_rr,
+# define TCI_HANDLER_RI(name, bits, expr) \
+        [INDEX_op_##name] = &&tci_do_##name##_ri,
+# define TCI_HANDLER_LD_OP_ST(name, bits, expr) \
+        [INDEX_op_##name] = &&tci_do_ld_##name##_st,
+#endif
+
+#if defined(TCI_THREADED)
+/* The handler tables hold label addresses inside tcg_qemu_tb_exec() and
+   are exported by calling it with NULL arguments.  An inlined or cloned
+   copy of the function has labels of its own, so it must stay a single
+   out of line function. */
+# if QEMU_GNUC_PREREQ(4, 5)
+#  define TCI_EXEC_ATTR __attribute__((noinline, noclone))
+# else
+#  define TCI_EXEC_ATTR __attribute__((noinline))
+# endif
+#else
+# define TCI_EXEC_ATTR
+#endif
+
 /* Interpret pseudo code in tb. */
-tcg_target_ulong tcg_qemu_tb_exec(CPUArchState *cpustate, uint8_t *tb_ptr)
+tcg_target_ulong TCI_EXEC_ATTR tcg_qemu_tb_exec(CPUArchState *cpustate,
+                                                uint8_t *tb_ptr)
 {
     tcg_target_ulong next_tb = 0;
+    TCGOpcode opc;
+#if !defined(NDEBUG)
+    uint8_t op_size;
+    uint8_t *old_code_ptr;
+#endif
+    tcg_target_ulong t0;
+    tcg_target_ulong t1;
+    tcg_target_ulong t2;
+    tcg_target_ulong label;
+    TCGCond condition;
+    target_ulong taddr;
+#ifndef CONFIG_SOFTMMU
+    tcg_target_ulong host_addr;
+#endif
+    uint8_t tmp8;
+    uint16_t tmp16;
+    uint32_t tmp32;
+    uint64_t tmp64;
+#if TCG_TARGET_REG_BITS == 32
+    uint64_t v64;
+#endif
+#if defined(TCI_THREADED)
+    static const void *const tci_handlers[NB_OPS] = {
+        [0 ... NB_OPS - 1] = &&tci_do_default,
+        [INDEX_op_end] = &&tci_do_end,
+        [INDEX_op_nop] = &&tci_do_nop,
+        [INDEX_op_nop1] = &&tci_do_nop1,
+        [INDEX_op_nop2] = &&tci_do_nop2,
+        [INDEX_op_nop3] = &&tci_do_nop3,
+        [INDEX_op_nopn] = &&tci_do_nopn,
+        [INDEX_op_discard] = &&tci_do_discard,
+        [INDEX_op_set_label] = &&tci_do_set_label,
+        [INDEX_op_call] = &&tci_do_call,
+        [INDEX_op_jmp] = &&tci_do_jmp,
+        [INDEX_op_br] = &&tci_do_br,
+        [INDEX_op_setcond_i32] = &&tci_do_setcond_i32,
+#if TCG_TARGET_REG_BITS == 32
+        [INDEX_op_setcond2_i32] = &&tci_do_setcond2_i32,
+#elif TCG_TARGET_REG_BITS == 64
+        [INDEX_op_setcond_i64] = &&tci_do_setcond_i64,
+#endif
+        [INDEX_op_mov_i32] = &&tci_do_mov_i32,
+        [INDEX_op_movi_i32] = &&tci_do_movi_i32,
+        [INDEX_op_ld8u_i32] = &&tci_do_ld8u_i32,
+        [INDEX_op_ld8s_i32] = &&tci_do_ld8s_i32,
+        [INDEX_op_ld16u_i32] = &&tci_do_ld16u_i32,
+        [INDEX_op_ld16s_i32] = &&tci_do_ld16s_i32,
+        [INDEX_op_ld_i32] = &&tci_do_ld_i32,
+        [INDEX_op_st8_i32] = &&tci_do_st8_i32,
+        [INDEX_op_st16_i32] = &&tci_do_st16_i32,
+        [INDEX_op_st_i32] = &&tci_do_st_i32,
+        [INDEX_op_add_i32] = &&tci_do_add_i32,
+        [INDEX_op_sub_i32] = &&tci_do_sub_i32,
+        [INDEX_op_mul_i32] = &&tci_do_mul_i32,
+#if TCG_TARGET_HAS_div_i32
+        [INDEX_op_div_i32] = &&tci_do_div_i32,
+        [INDEX_op_divu_i32] = &&tci_do_divu_i32,
+        [INDEX_op_rem_i32] = &&tci_do_rem_i32,
+        [INDEX_op_remu_i32] = &&tci_do_remu_i32,
+#elif TCG_TARGET_HAS_div2_i32
+        [INDEX_op_div2_i32] = &&tci_do_div2_i32,
+        [INDEX_op_divu2_i32] = &&tci_do_divu2_i32,
+#endif
+        [INDEX_op_and_i32] = &&tci_do_and_i32,
+        [INDEX_op_or_i32] = &&tci_do_or_i32,
+        [INDEX_op_xor_i32] = &&tci_do_xor_i32,
+        [INDEX_op_shl_i32] = &&tci_do_shl_i32,
+        [INDEX_op_shr_i32] = &&tci_do_shr_i32,
+        [INDEX_op_sar_i32] = &&tci_do_sar_i32,
+#if TCG_TARGET_HAS_rot_i32
+        [INDEX_op_rotl_i32] = &&tci_do_rotl_i32,
+        [INDEX_op_rotr_i32] = &&tci_do_rotr_i32,
+#endif
+        [INDEX_op_brcond_i32] = &&tci_do_brcond_i32,
+#if TCG_TARGET_REG_BITS == 32
+        [INDEX_op_add2_i32] = &&tci_do_add2_i32,
+        [INDEX_op_sub2_i32] = &&tci_do_sub2_i32,
+        [INDEX_op_brcond2_i32] = &&tci_do_brcond2_i32,
+        [INDEX_op_mulu2_i32] = &&tci_do_mulu2_i32,
+#endif /* TCG_TARGET_REG_BITS == 32 */
+#if TCG_TARGET_HAS_ext8s_i32
+        [INDEX_op_ext8s_i32] = &&tci_do_ext8s_i32,
+#endif
+#if TCG_TARGET_HAS_ext16s_i32
+        [INDEX_op_ext16s_i32] = &&tci_do_ext16s_i32,
+#endif
+#if TCG_TARGET_HAS_ext8u_i32
+        [INDEX_op_ext8u_i32] = &&tci_do_ext8u_i32,
+#endif
+#if TCG_TARGET_HAS_ext16u_i32
+        [INDEX_op_ext16u_i32] = &&tci_do_ext16u_i32,
+#endif
+#if TCG_TARGET_HAS_bswap16_i32
+        [INDEX_op_bswap16_i32] = &&tci_do_bswap16_i32,
+#endif
+#if TCG_TARGET_HAS_bswap32_i32
+        [INDEX_op_bswap32_i32] = &&tci_do_bswap32_i32,
+#endif
+#if TCG_TARGET_HAS_not_i32
+        [INDEX_op_not_i32] = &&tci_do_not_i32,
+#endif
+#if TCG_TARGET_HAS_neg_i32
+        [INDEX_op_neg_i32] = &&tci_do_neg_i32,
+#endif
+#if TCG_TARGET_REG_BITS == 64
+        [INDEX_op_mov_i64] = &&tci_do_mov_i64,
+        [INDEX_op_movi_i64] = &&tci_do_movi_i64,
+        [INDEX_op_ld8u_i64] = &&tci_do_ld8u_i64,
+        [INDEX_op_ld8s_i64] = &&tci_do_ld8s_i64,
+        [INDEX_op_ld16u_i64] = &&tci_do_ld16u_i64,
+        [INDEX_op_ld16s_i64] = &&tci_do_ld16s_i64,
+        [INDEX_op_ld32u_i64] = &&tci_do_ld32u_i64,
+        [INDEX_op_ld32s_i64] = &&tci_do_ld32s_i64,
+        [INDEX_op_ld_i64] = &&tci_do_ld_i64,
+        [INDEX_op_st8_i64] = &&tci_do_st8_i64,
+        [INDEX_op_st16_i64] = &&tci_do_st16_i64,
+        [INDEX_op_st32_i64] = &&tci_do_st32_i64,
+        [INDEX_op_st_i64] = &&tci_do_st_i64,
+        [INDEX_op_add_i64] = &&tci_do_add_i64,
+        [INDEX_op_sub_i64] = &&tci_do_sub_i64,
+        [INDEX_op_mul_i64] = &&tci_do_mul_i64,
+#if TCG_TARGET_HAS_div_i64
+        [INDEX_op_div_i64] = &&tci_do_div_i64,
+        [INDEX_op_divu_i64] = &&tci_do_divu_i64,
+        [INDEX_op_rem_i64] = &&tci_do_rem_i64,
+        [INDEX_op_remu_i64] = &&tci_do_remu_i64,
+#elif TCG_TARGET_HAS_div2_i64
+        [INDEX_op_div2_i64] = &&tci_do_div2_i64,
+        [INDEX_op_divu2_i64] = &&tci_do_divu2_i64,
+#endif
+        [INDEX_op_and_i64] = &&tci_do_and_i64,
+        [INDEX_op_or_i64] = &&tci_do_or_i64,
+        [INDEX_op_xor_i64] = &&tci_do_xor_i64,
+        [INDEX_op_shl_i64] = &&tci_do_shl_i64,
+        [INDEX_op_shr_i64] = &&tci_do_shr_i64,
+        [INDEX_op_sar_i64] = &&tci_do_sar_i64,
+#if TCG_TARGET_HAS_rot_i64
+        [INDEX_op_rotl_i64] = &&tci_do_rotl_i64,
+        [INDEX_op_rotr_i64] = &&tci_do_rotr_i64,
+#endif
+        [INDEX_op_brcond_i64] = &&tci_do_brcond_i64,
+#if TCG_TARGET_HAS_ext8u_i64
+        [INDEX_op_ext8u_i64] = &&tci_do_ext8u_i64,
+#endif
+#if TCG_TARGET_HAS_ext8s_i64
+        [INDEX_op_ext8s_i64] = &&tci_do_ext8s_i64,
+#endif
+#if TCG_TARGET_HAS_ext16s_i64
+        [INDEX_op_ext16s_i64] = &&tci_do_ext16s_i64,
+#endif
+#if TCG_TARGET_HAS_ext16u_i64
+        [INDEX_op_ext16u_i64] = &&tci_do_ext16u_i64,
+#endif
+#if TCG_TARGET_HAS_ext32s_i64
+        [INDEX_op_ext32s_i64] = &&tci_do_ext32s_i64,
+#endif
+#if TCG_TARGET_HAS_ext32u_i64
+        [INDEX_op_ext32u_i64] = &&tci_do_ext32u_i64,
+#endif
+#if TCG_TARGET_HAS_bswap16_i64
+        [INDEX_op_bswap16_i64] = &&tci_do_bswap16_i64,
+#endif
+#if TCG_TARGET_HAS_bswap32_i64
+        [INDEX_op_bswap32_i64] = &&tci_do_bswap32_i64,
+#endif
+#if TCG_TARGET_HAS_bswap64_i64
+        [INDEX_op_bswap64_i64] = &&tci_do_bswap64_i64,
+#endif
+#if TCG_TARGET_HAS_not_i64
+        [INDEX_op_not_i64] = &&tci_do_not_i64,
+#endif
+#if TCG_TARGET_HAS_neg_i64
+        [INDEX_op_neg_i64] = &&tci_do_neg_i64,
+#endif
+#endif /* TCG_TARGET_REG_BITS == 64 */
+        [INDEX_op_debug_insn_start] = &&tci_do_debug_insn_start,
+        [INDEX_op_exit_tb] = &&tci_do_exit_tb,
+        [INDEX_op_goto_tb] = &&tci_do_goto_tb,
+        [INDEX_op_qemu_ld8u] = &&tci_do_qemu_ld8u,
+        [INDEX_op_qemu_ld8s] = &&tci_do_qemu_ld8s,
+        [INDEX_op_qemu_ld16u] = &&tci_do_qemu_ld16u,
+        [INDEX_op_qemu_ld16s] = &&tci_do_qemu_ld16s,
+#if TCG_TARGET_REG_BITS == 64
+        [INDEX_op_qemu_ld32u] = &&tci_do_qemu_ld32u,
+        [INDEX_op_qemu_ld32s] = &&tci_do_qemu_ld32s,
+#endif /* TCG_TARGET_REG_BITS == 64 */
+        [INDEX_op_qemu_ld32] = &&tci_do_qemu_ld32,
+        [INDEX_op_qemu_ld64] = &&tci_do_qemu_ld64,
+        [INDEX_op_qemu_st8] = &&tci_do_qemu_st8,
+        [INDEX_op_qemu_st16] = &&tci_do_qemu_st16,
+        [INDEX_op_qemu_st32] = &&tci_do_qemu_st32,
+        [INDEX_op_qemu_st64] = &&tci_do_qemu_st64,
+    };
+    static const void *const tci_rr[NB_OPS] = {
+        TCI_FOR_BINOPS(32, TCI_HANDLER_RR)
+#if TCG_TARGET_REG_BITS == 64
+        TCI_FOR_BINOPS(64, TCI_HANDLER_RR)
+#endif
+    };
+    static const void *const tci_ri[NB_OPS] = {
+        TCI_FOR_BINOPS(32, TCI_HANDLER_RI)
+#if TCG_TARGET_REG_BITS == 64
+        TCI_FOR_BINOPS(64, TCI_HANDLER_RI)
+#endif
+    };
+    static const void *const tci_setcond_brcond_i32[] = {
+        &&tci_do_setcond_brcond_i32,
+    };
+    static const void *const tci_ld_op_st[NB_OPS] = {
+        TCI_FOR_BINOPS(32, TCI_HANDLER_LD_OP_ST)
+#if TCG_TARGET_REG_BITS == 64
+        TCI_FOR_BINOPS(64, TCI_HANDLER_LD_OP_ST)
+#endif
+    };
+
+    if (unlikely(!tb_ptr)) {
+        tci_handlers_op = tci_handlers;
+        tci_handlers_rr = tci_rr;
+        tci_handlers_ri = tci_ri;
+        tci_handler_setcond_brcond_i32 = tci_setcond_brcond_i32;
+        tci_handlers_ld_op_st = tci_ld_op_st;
+        return 0;
+    }
+#endif
 
     env = cpustate;
     tci_reg[TCG_AREG0] = (tcg_target_ulong)env;
     assert(tb_ptr);
 
-    for (;;) {
-#if defined(GETPC)
-        tci_tb_ptr = (uintptr_t)tb_ptr;
+#if defined(TCI_THREADED)
+    TCI_DISPATCH();
 #endif
-        TCGOpcode opc = tb_ptr[0];
+    for (;;) {
+        TCI_FETCH_TB_PTR();
+        opc = tb_ptr[0];
 #if !defined(NDEBUG)
-        uint8_t op_size = tb_ptr[1];
-        uint8_t *old_code_ptr = tb_ptr;
-#endif
-        tcg_target_ulong t0;
-        tcg_target_ulong t1;
-        tcg_target_ulong t2;
-        tcg_target_ulong label;
-        TCGCond condition;
-        target_ulong taddr;
-#ifndef CONFIG_SOFTMMU
-        tcg_target_ulong host_addr;
-#endif
-        uint8_t tmp8;
-        uint16_t tmp16;
-        uint32_t tmp32;
-        uint64_t tmp64;
-#if TCG_TARGET_REG_BITS == 32
-        uint64_t v64;
+        op_size = tb_ptr[1];
+        old_code_ptr = tb_ptr;
 #endif
 
         /* Skip opcode and size entry. */
         tb_ptr += 2;
 
         switch (opc) {
-        case INDEX_op_end:
-        case INDEX_op_nop:
-            break;
-        case INDEX_op_nop1:
-        case INDEX_op_nop2:
-        case INDEX_op_nop3:
-        case INDEX_op_nopn:
-        case INDEX_op_discard:
+        TCI_CASE(end):
+        TCI_CASE(nop):
+            TCI_NEXT();
+        TCI_CASE(nop1):
+        TCI_CASE(nop2):
+        TCI_CASE(nop3):
+        TCI_CASE(nopn):
+        TCI_CASE(discard):
             TODO();
-            break;
-        case INDEX_op_set_label:
+            TCI_NEXT();
+        TCI_CASE(set_label):
             TODO();
-            break;
-        case INDEX_op_call:
+            TCI_NEXT();
+        TCI_CASE(call):
             t0 = tci_read_ri(&tb_ptr);
 #if TCG_TARGET_REG_BITS == 32
             tmp64 = ((helper_function)t0)(tci_read_reg(TCG_REG_R0),
@@ -504,193 +868,133 @@ tcg_target_ulong tcg_qemu_tb_exec(CPUArchState *cpustate, uint8_t *tb_ptr)
                                           tci_read_reg(TCG_REG_R5));
             tci_write_reg(TCG_REG_R0, tmp64);
 #endif
-            break;
-        case INDEX_op_jmp:
-        case INDEX_op_br:
+            TCI_NEXT();
+        TCI_CASE(jmp):
+        TCI_CASE(br):
             label = tci_read_label(&tb_ptr);
             assert(tb_ptr == old_code_ptr + op_size);
             tb_ptr = (uint8_t *)label;
-            continue;
-        case INDEX_op_setcond_i32:
+            TCI_JUMP();
+        TCI_CASE(setcond_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r32(&tb_ptr);
             t2 = tci_read_ri32(&tb_ptr);
             condition = *tb_ptr++;
             tci_write_reg32(t0, tci_compare32(t1, t2, condition));
-            break;
+            TCI_NEXT();
 #if TCG_TARGET_REG_BITS == 32
-        case INDEX_op_setcond2_i32:
+        TCI_CASE(setcond2_i32):
             t0 = *tb_ptr++;
             tmp64 = tci_read_r64(&tb_ptr);
             v64 = tci_read_ri64(&tb_ptr);
             condition = *tb_ptr++;
             tci_write_reg32(t0, tci_compare64(tmp64, v64, condition));
-            break;
+            TCI_NEXT();
 #elif TCG_TARGET_REG_BITS == 64
-        case INDEX_op_setcond_i64:
+        TCI_CASE(setcond_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r64(&tb_ptr);
             t2 = tci_read_ri64(&tb_ptr);
             condition = *tb_ptr++;
             tci_write_reg64(t0, tci_compare64(t1, t2, condition));
-            break;
+            TCI_NEXT();
 #endif
-        case INDEX_op_mov_i32:
+        TCI_CASE(mov_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r32(&tb_ptr);
             tci_write_reg32(t0, t1);
-            break;
-        case INDEX_op_movi_i32:
+            TCI_NEXT();
+        TCI_CASE(movi_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_i32(&tb_ptr);
             tci_write_reg32(t0, t1);
-            break;
+            TCI_NEXT();
 
             /* Load/store operations (32 bit). */
 
-        case INDEX_op_ld8u_i32:
-            t0 = *tb_ptr++;
-            t1 = tci_read_r(&tb_ptr);
-            t2 = tci_read_i32(&tb_ptr);
-            tci_write_reg8(t0, *(uint8_t *)(t1 + t2));
-            break;
-        case INDEX_op_ld8s_i32:
-        case INDEX_op_ld16u_i32:
+        TCI_CASE(ld8u_i32):
+            TCI_LD(8);
+            TCI_NEXT();
+        TCI_CASE(ld8s_i32):
+        TCI_CASE(ld16u_i32):
             TODO();
-            break;
-        case INDEX_op_ld16s_i32:
+            TCI_NEXT();
+        TCI_CASE(ld16s_i32):
             TODO();
-            break;
-        case INDEX_op_ld_i32:
-            t0 = *tb_ptr++;
-            t1 = tci_read_r(&tb_ptr);
-            t2 = tci_read_i32(&tb_ptr);
-            tci_write_reg32(t0, *(uint32_t *)(t1 + t2));
-            break;
-        case INDEX_op_st8_i32:
-            t0 = tci_read_r8(&tb_ptr);
-            t1 = tci_read_r(&tb_ptr);
-            t2 = tci_read_i32(&tb_ptr);
-            *(uint8_t *)(t1 + t2) = t0;
-            break;
-        case INDEX_op_st16_i32:
-            t0 = tci_read_r16(&tb_ptr);
-            t1 = tci_read_r(&tb_ptr);
-            t2 = tci_read_i32(&tb_ptr);
-            *(uint16_t *)(t1 + t2) = t0;
-            break;
-        case INDEX_op_st_i32:
-            t0 = tci_read_r32(&tb_ptr);
-            t1 = tci_read_r(&tb_ptr);
-            t2 = tci_read_i32(&tb_ptr);
-            *(uint32_t *)(t1 + t2) = t0;
-            break;
+            TCI_NEXT();
+        TCI_CASE(ld_i32):
+            TCI_LD(32);
+            TCI_NEXT();
+        TCI_CASE(st8_i32):
+            TCI_ST(8);
+            TCI_NEXT();
+        TCI_CASE(st16_i32):
+            TCI_ST(16);
+            TCI_NEXT();
+        TCI_CASE(st_i32):
+            TCI_ST(32);
+            TCI_NEXT();
 
             /* Arithmetic operations (32 bit). */
 
-        case INDEX_op_add_i32:
-            t0 = *tb_ptr++;
-            t1 = tci_read_ri32(&tb_ptr);
-            t2 = tci_read_ri32(&tb_ptr);
-            tci_write_reg32(t0, t1 + t2);
-            break;
-        case INDEX_op_sub_i32:
-            t0 = *tb_ptr++;
-            t1 = tci_read_ri32(&tb_ptr);
-            t2 = tci_read_ri32(&tb_ptr);
-            tci_write_reg32(t0, t1 - t2);
-            break;
-        case INDEX_op_mul_i32:
-            t0 = *tb_ptr++;
-            t1 = tci_read_ri32(&tb_ptr);
-            t2 = tci_read_ri32(&tb_ptr);
-            tci_write_reg32(t0, t1 * t2);
-            break;
+        TCI_CASE(add_i32):
+            TCI_BINOP(32, t1 + t2);
+            TCI_NEXT();
+        TCI_CASE(sub_i32):
+            TCI_BINOP(32, t1 - t2);
+            TCI_NEXT();
+        TCI_CASE(mul_i32):
+            TCI_BINOP(32, t1 * t2);
+            TCI_NEXT();
 #if TCG_TARGET_HAS_div_i32
-        case INDEX_op_div_i32:
-            t0 = *tb_ptr++;
-            t1 = tci_read_ri32(&tb_ptr);
-            t2 = tci_read_ri32(&tb_ptr);
-            tci_write_reg32(t0, (int32_t)t1 / (int32_t)t2);
-            break;
-        case INDEX_op_divu_i32:
-            t0 = *tb_ptr++;
-            t1 = tci_read_ri32(&tb_ptr);
-            t2 = tci_read_ri32(&tb_ptr);
-            tci_write_reg32(t0, t1 / t2);
-            break;
-        case INDEX_op_rem_i32:
-            t0 = *tb_ptr++;
-            t1 = tci_read_ri32(&tb_ptr);
-            t2 = tci_read_ri32(&tb_ptr);
-            tci_write_reg32(t0, (int32_t)t1 % (int32_t)t2);
-            break;
-        case INDEX_op_remu_i32:
-            t0 = *tb_ptr++;
-            t1 = tci_read_ri32(&tb_ptr);
-            t2 = tci_read_ri32(&tb_ptr);
-            tci_write_reg32(t0, t1 % t2);
-            break;
+        TCI_CASE(div_i32):
+            TCI_BINOP(32, (int32_t)t1 / (int32_t)t2);
+            TCI_NEXT();
+        TCI_CASE(divu_i32):
+            TCI_BINOP(32, t1 / t2);
+            TCI_NEXT();
+        TCI_CASE(rem_i32):
+            TCI_BINOP(32, (int32_t)t1 % (int32_t)t2);
+            TCI_NEXT();
+        TCI_CASE(remu_i32):
+            TCI_BINOP(32, t1 % t2);
+            TCI_NEXT();
 #elif TCG_TARGET_HAS_div2_i32
-        case INDEX_op_div2_i32:
-        case INDEX_op_divu2_i32:
+        TCI_CASE(div2_i32):
+        TCI_CASE(divu2_i32):
             TODO();
-            break;
+            TCI_NEXT();
 #endif
-        case INDEX_op_and_i32:
-            t0 = *tb_ptr++;
-            t1 = tci_read_ri32(&tb_ptr);
-            t2 = tci_read_ri32(&tb_ptr);
-            tci_write_reg32(t0, t1 & t2);
-            break;
-        case INDEX_op_or_i32:
-            t0 = *tb_ptr++;
-            t1 = tci_read_ri32(&tb_ptr);
-            t2 = tci_read_ri32(&tb_ptr);
-            tci_write_reg32(t0, t1 | t2);
-            break;
-        case INDEX_op_xor_i32:
-            t0 = *tb_ptr++;
-            t1 = tci_read_ri32(&tb_ptr);
-            t2 = tci_read_ri32(&tb_ptr);
-            tci_write_reg32(t0, t1 ^ t2);
-            break;
+        TCI_CASE(and_i32):
+            TCI_BINOP(32, t1 & t2);
+            TCI_NEXT();
+        TCI_CASE(or_i32):
+            TCI_BINOP(32, t1 | t2);
+            TCI_NEXT();
+        TCI_CASE(xor_i32):
+            TCI_BINOP(32, t1 ^ t2);
+            TCI_NEXT();
 
             /* Shift/rotate operations (32 bit). */
 
-        case INDEX_op_shl_i32:
-            t0 = *tb_ptr++;
-            t1 = tci_read_ri32(&tb_ptr);
-            t2 = tci_read_ri32(&tb_ptr);
-            tci_write_reg32(t0, t1 << t2);
-            break;
-        case INDEX_op_shr_i32:
-            t0 = *tb_ptr++;
-            t1 = tci_read_ri32(&tb_ptr);
-            t2 = tci_read_ri32(&tb_ptr);
-            tci_write_reg32(t0, t1 >> t2);
-            break;
-        case INDEX_op_sar_i32:
-            t0 = *tb_ptr++;
-            t1 = tci_read_ri32(&tb_ptr);
-            t2 = tci_read_ri32(&tb_ptr);
-            tci_write_reg32(t0, ((int32_t)t1 >> t2));
-            break;
+        TCI_CASE(shl_i32):
+            TCI_BINOP(32, t1 << t2);
+            TCI_NEXT();
+        TCI_CASE(shr_i32):
+            TCI_BINOP(32, t1 >> t2);
+            TCI_NEXT();
+        TCI_CASE(sar_i32):
+            TCI_BINOP(32, ((int32_t)t1 >> t2));
+            TCI_NEXT();
 #if TCG_TARGET_HAS_rot_i32
-        case INDEX_op_rotl_i32:
-            t0 = *tb_ptr++;
-            t1 = tci_read_ri32(&tb_ptr);
-            t2 = tci_read_ri32(&tb_ptr);
-            tci_write_reg32(t0, (t1 << t2) | (t1 >> (32 - t2)));
-            break;
-        case INDEX_op_rotr_i32:
-            t0 = *tb_ptr++;
-            t1 = tci_read_ri32(&tb_ptr);
-            t2 = tci_read_ri32(&tb_ptr);
-            tci_write_reg32(t0, (t1 >> t2) | (t1 << (32 - t2)));
-            break;
+        TCI_CASE(rotl_i32):
+            TCI_BINOP(32, (t1 << t2) | (t1 >> (32 - t2)));
+            TCI_NEXT();
+        TCI_CASE(rotr_i32):
+            TCI_BINOP(32, (t1 >> t2) | (t1 << (32 - t2)));
+            TCI_NEXT();
 #endif
-        case INDEX_op_brcond_i32:
+        TCI_CASE(brcond_i32):
             t0 = tci_read_r32(&tb_ptr);
             t1 = tci_read_ri32(&tb_ptr);
             condition = *tb_ptr++;
@@ -698,25 +1002,25 @@ tcg_target_ulong tcg_qemu_tb_exec(CPUArchState *cpustate, uint8_t *tb_ptr)
             if (tci_compare32(t0, t1, condition)) {
                 assert(tb_ptr == old_code_ptr + op_size);
                 tb_ptr = (uint8_t *)label;
-                continue;
+                TCI_JUMP();
             }
-            break;
+            TCI_NEXT();
 #if TCG_TARGET_REG_BITS == 32
-        case INDEX_op_add2_i32:
+        TCI_CASE(add2_i32):
             t0 = *tb_ptr++;
             t1 = *tb_ptr++;
             tmp64 = tci_read_r64(&tb_ptr);
             tmp64 += tci_read_r64(&tb_ptr);
             tci_write_reg64(t1, t0, tmp64);
-            break;
-        case INDEX_op_sub2_i32:
+            TCI_NEXT();
+        TCI_CASE(sub2_i32):
             t0 = *tb_ptr++;
             t1 = *tb_ptr++;
             tmp64 = tci_read_r64(&tb_ptr);
             tmp64 -= tci_read_r64(&tb_ptr);
             tci_write_reg64(t1, t0, tmp64);
-            break;
-        case INDEX_op_brcond2_i32:
+            TCI_NEXT();
+        TCI_CASE(brcond2_i32):
             tmp64 = tci_read_r64(&tb_ptr);
             v64 = tci_read_ri64(&tb_ptr);
             condition = *tb_ptr++;
@@ -724,220 +1028,172 @@ tcg_target_ulong tcg_qemu_tb_exec(CPUArchState *cpustate, uint8_t *tb_ptr)
             if (tci_compare64(tmp64, v64, condition)) {
                 assert(tb_ptr == old_code_ptr + op_size);
                 tb_ptr = (uint8_t *)label;
-                continue;
+                TCI_JUMP();
             }
-            break;
-        case INDEX_op_mulu2_i32:
+            TCI_NEXT();
+        TCI_CASE(mulu2_i32):
             t0 = *tb_ptr++;
             t1 = *tb_ptr++;
             t2 = tci_read_r32(&tb_ptr);
             tmp64 = tci_read_r32(&tb_ptr);
             tci_write_reg64(t1, t0, t2 * tmp64);
-            break;
+            TCI_NEXT();
 #endif /* TCG_TARGET_REG_BITS == 32 */
 #if TCG_TARGET_HAS_ext8s_i32
-        case INDEX_op_ext8s_i32:
+        TCI_CASE(ext8s_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r8s(&tb_ptr);
             tci_write_reg32(t0, t1);
-            break;
+            TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_ext16s_i32
-        case INDEX_op_ext16s_i32:
+        TCI_CASE(ext16s_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r16s(&tb_ptr);
             tci_write_reg32(t0, t1);
-            break;
+            TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_ext8u_i32
-        case INDEX_op_ext8u_i32:
+        TCI_CASE(ext8u_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r8(&tb_ptr);
             tci_write_reg32(t0, t1);
-            break;
+            TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_ext16u_i32
-        case INDEX_op_ext16u_i32:
+        TCI_CASE(ext16u_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r16(&tb_ptr);
             tci_write_reg32(t0, t1);
-            break;
+            TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_bswap16_i32
-        case INDEX_op_bswap16_i32:
+        TCI_CASE(bswap16_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r16(&tb_ptr);
             tci_write_reg32(t0, bswap16(t1));
-            break;
+            TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_bswap32_i32
-        case INDEX_op_bswap32_i32:
+        TCI_CASE(bswap32_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r32(&tb_ptr);
             tci_write_reg32(t0, bswap32(t1));
-            break;
+            TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_not_i32
-        case INDEX_op_not_i32:
+        TCI_CASE(not_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r32(&tb_ptr);
             tci_write_reg32(t0, ~t1);
-            break;
+            TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_neg_i32
-        case INDEX_op_neg_i32:
+        TCI_CASE(neg_i32):
             t0 = *tb_ptr++;
             t1 = tci_read_r32(&tb_ptr);
             tci_write_reg32(t0, -t1);
-            break;
+            TCI_NEXT();
 #endif
 #if TCG_TARGET_REG_BITS == 64
-        case INDEX_op_mov_i64:
+        TCI_CASE(mov_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r64(&tb_ptr);
             tci_write_reg64(t0, t1);
-            break;
-        case INDEX_op_movi_i64:
+            TCI_NEXT();
+        TCI_CASE(movi_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_i64(&tb_ptr);
             tci_write_reg64(t0, t1);
-            break;
+            TCI_NEXT();
 
             /* Load/store operations (64 bit). */
 
-        case INDEX_op_ld8u_i64:
-            t0 = *tb_ptr++;
-            t1 = tci_read_r(&tb_ptr);
-            t2 = tci_read_i32(&tb_ptr);
-            tci_write_reg8(t0, *(uint8_t *)(t1 + t2));
-            break;
-        case INDEX_op_ld8s_i64:
-        case INDEX_op_ld16u_i64:
-        case INDEX_op_ld16s_i64:
+        TCI_CASE(ld8u_i64):
+            TCI_LD(8);
+            TCI_NEXT();
+        TCI_CASE(ld8s_i64):
+        TCI_CASE(ld16u_i64):
+        TCI_CASE(ld16s_i64):
             TODO();
-            break;
-        case INDEX_op_ld32u_i64:
-            t0 = *tb_ptr++;
-            t1 = tci_read_r(&tb_ptr);
-            t2 = tci_read_i32(&tb_ptr);
-            tci_write_reg32(t0, *(uint32_t *)(t1 + t2));
-            break;
-        case INDEX_op_ld32s_i64:
+            TCI_NEXT();
+        TCI_CASE(ld32u_i64):
+            TCI_LD(32);
+            TCI_NEXT();
+        TCI_CASE(ld32s_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r(&tb_ptr);
             t2 = tci_read_i32(&tb_ptr);
             tci_write_reg32s(t0, *(int32_t *)(t1 + t2));
-            break;
-        case INDEX_op_ld_i64:
-            t0 = *tb_ptr++;
-            t1 = tci_read_r(&tb_ptr);
-            t2 = tci_read_i32(&tb_ptr);
-            tci_write_reg64(t0, *(uint64_t *)(t1 + t2));
-            break;
-        case INDEX_op_st8_i64:
-            t0 = tci_read_r8(&tb_ptr);
-            t1 = tci_read_r(&tb_ptr);
-            t2 = tci_read_i32(&tb_ptr);
-            *(uint8_t *)(t1 + t2) = t0;
-            break;
-        case INDEX_op_st16_i64:
-            t0 = tci_read_r16(&tb_ptr);
-            t1 = tci_read_r(&tb_ptr);
-            t2 = tci_read_i32(&tb_ptr);
-            *(uint16_t *)(t1 + t2) = t0;
-            break;
-        case INDEX_op_st32_i64:
-            t0 = tci_read_r32(&tb_ptr);
-            t1 = tci_read_r(&tb_ptr);
-            t2 = tci_read_i32(&tb_ptr);
-            *(uint32_t *)(t1 + t2) = t0;
-            break;
-        case INDEX_op_st_i64:
-            t0 = tci_read_r64(&tb_ptr);
-            t1 = tci_read_r(&tb_ptr);
-            t2 = tci_read_i32(&tb_ptr);
-            *(uint64_t *)(t1 + t2) = t0;
-            break;
+            TCI_NEXT();
+        TCI_CASE(ld_i64):
+            TCI_LD(64);
+            TCI_NEXT();
+        TCI_CASE(st8_i64):
+            TCI_ST(8);
+            TCI_NEXT();
+        TCI_CASE(st16_i64):
+            TCI_ST(16);
+            TCI_NEXT();
+        TCI_CASE(st32_i64):
+            TCI_ST(32);
+            TCI_NEXT();
+        TCI_CASE(st_i64):
+            TCI_ST(64);
+            TCI_NEXT();
 
             /* Arithmetic operations (64 bit). */
 
-        case INDEX_op_add_i64:
-            t0 = *tb_ptr++;
-            t1 = tci_read_ri64(&tb_ptr);
-            t2 = tci_read_ri64(&tb_ptr);
-            tci_write_reg64(t0, t1 + t2);
-            break;
-        case INDEX_op_sub_i64:
-            t0 = *tb_ptr++;
-            t1 = tci_read_ri64(&tb_ptr);
-            t2 = tci_read_ri64(&tb_ptr);
-            tci_write_reg64(t0, t1 - t2);
-            break;
-        case INDEX_op_mul_i64:
-            t0 = *tb_ptr++;
-            t1 = tci_read_ri64(&tb_ptr);
-            t2 = tci_read_ri64(&tb_ptr);
-            tci_write_reg64(t0, t1 * t2);
-            break;
+        TCI_CASE(add_i64):
+            TCI_BINOP(64, t1 + t2);
+            TCI_NEXT();
+        TCI_CASE(sub_i64):
+            TCI_BINOP(64, t1 - t2);
+            TCI_NEXT();
+        TCI_CASE(mul_i64):
+            TCI_BINOP(64, t1 * t2);
+            TCI_NEXT();
 #if TCG_TARGET_HAS_div_i64
-        case INDEX_op_div_i64:
-        case INDEX_op_divu_i64:
-        case INDEX_op_rem_i64:
-        case INDEX_op_remu_i64:
+        TCI_CASE(div_i64):
+        TCI_CASE(divu_i64):
+        TCI_CASE(rem_i64):
+        TCI_CASE(remu_i64):
             TODO();
-            break;
+            TCI_NEXT();
 #elif TCG_TARGET_HAS_div2_i64
-        case INDEX_op_div2_i64:
-        case INDEX_op_divu2_i64:
+        TCI_CASE(div2_i64):
+        TCI_CASE(divu2_i64):
             TODO();
-            break;
+            TCI_NEXT();
 #endif
-        case INDEX_op_and_i64:
-            t0 = *tb_ptr++;
-            t1 = tci_read_ri64(&tb_ptr);
-            t2 = tci_read_ri64(&tb_ptr);
-            tci_write_reg64(t0, t1 & t2);
-            break;
-        case INDEX_op_or_i64:
-            t0 = *tb_ptr++;
-            t1 = tci_read_ri64(&tb_ptr);
-            t2 = tci_read_ri64(&tb_ptr);
-            tci_write_reg64(t0, t1 | t2);
-            break;
-        case INDEX_op_xor_i64:
-            t0 = *tb_ptr++;
-            t1 = tci_read_ri64(&tb_ptr);
-            t2 = tci_read_ri64(&tb_ptr);
-            tci_write_reg64(t0, t1 ^ t2);
-            break;
+        TCI_CASE(and_i64):
+            TCI_BINOP(64, t1 & t2);
+            TCI_NEXT();
+        TCI_CASE(or_i64):
+            TCI_BINOP(64, t1 | t2);
+            TCI_NEXT();
+        TCI_CASE(xor_i64):
+            TCI_BINOP(64, t1 ^ t2);
+            TCI_NEXT();
 
             /* Shift/rotate operations (64 bit). */
 
-        case INDEX_op_shl_i64:
-            t0 = *tb_ptr++;
-            t1 = tci_read_ri64(&tb_ptr);
-            t2 = tci_read_ri64(&tb_ptr);
-            tci_write_reg64(t0, t1 << t2);
-            break;
-        case INDEX_op_shr_i64:
-            t0 = *tb_ptr++;
-            t1 = tci_read_ri64(&tb_ptr);
-            t2 = tci_read_ri64(&tb_ptr);
-            tci_write_reg64(t0, t1 >> t2);
-            break;
-        case INDEX_op_sar_i64:
-            t0 = *tb_ptr++;
-            t1 = tci_read_ri64(&tb_ptr);
-            t2 = tci_read_ri64(&tb_ptr);
-            tci_write_reg64(t0, ((int64_t)t1 >> t2));
-            break;
+        TCI_CASE(shl_i64):
+            TCI_BINOP(64, t1 << t2);
+            TCI_NEXT();
+        TCI_CASE(shr_i64):
+            TCI_BINOP(64, t1 >> t2);
+            TCI_NEXT();
+        TCI_CASE(sar_i64):
+            TCI_BINOP(64, ((int64_t)t1 >> t2));
+            TCI_NEXT();
 #if TCG_TARGET_HAS_rot_i64
-        case INDEX_op_rotl_i64:
-        case INDEX_op_rotr_i64:
+        TCI_CASE(rotl_i64):
+        TCI_CASE(rotr_i64):
             TODO();
-            break;
+            TCI_NEXT();
 #endif
-        case INDEX_op_brcond_i64:
+        TCI_CASE(brcond_i64):
             t0 = tci_read_r64(&tb_ptr);
             t1 = tci_read_ri64(&tb_ptr);
             condition = *tb_ptr++;
@@ -945,110 +1201,109 @@ tcg_target_ulong tcg_qemu_tb_exec(CPUArchState *cpustate, uint8_t *tb_ptr)
             if (tci_compare64(t0, t1, condition)) {
                 assert(tb_ptr == old_code_ptr + op_size);
                 tb_ptr = (uint8_t *)label;
-                continue;
+                TCI_JUMP();
             }
-            break;
+            TCI_NEXT();
 #if TCG_TARGET_HAS_ext8u_i64
-        case INDEX_op_ext8u_i64:
+        TCI_CASE(ext8u_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r8(&tb_ptr);
             tci_write_reg64(t0, t1);
-            break;
+            TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_ext8s_i64
-        case INDEX_op_ext8s_i64:
+        TCI_CASE(ext8s_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r8s(&tb_ptr);
             tci_write_reg64(t0, t1);
-            break;
+            TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_ext16s_i64
-        case INDEX_op_ext16s_i64:
+        TCI_CASE(ext16s_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r16s(&tb_ptr);
             tci_write_reg64(t0, t1);
-            break;
+            TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_ext16u_i64
-        case INDEX_op_ext16u_i64:
+        TCI_CASE(ext16u_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r16(&tb_ptr);
             tci_write_reg64(t0, t1);
-            break;
+            TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_ext32s_i64
-        case INDEX_op_ext32s_i64:
+        TCI_CASE(ext32s_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r32s(&tb_ptr);
             tci_write_reg64(t0, t1);
-            break;
+            TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_ext32u_i64
-        case INDEX_op_ext32u_i64:
+        TCI_CASE(ext32u_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r32(&tb_ptr);
             tci_write_reg64(t0, t1);
-            break;
+            TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_bswap16_i64
-        case INDEX_op_bswap16_i64:
+        TCI_CASE(bswap16_i64):
             TODO();
             t0 = *tb_ptr++;
             t1 = tci_read_r16(&tb_ptr);
             tci_write_reg64(t0, bswap16(t1));
-            break;
+            TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_bswap32_i64
-        case INDEX_op_bswap32_i64:
+        TCI_CASE(bswap32_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r32(&tb_ptr);
             tci_write_reg64(t0, bswap32(t1));
-            break;
+            TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_bswap64_i64
-        case INDEX_op_bswap64_i64:
+        TCI_CASE(bswap64_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r64(&tb_ptr);
             tci_write_reg64(t0, bswap64(t1));
-            break;
+            TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_not_i64
-        case INDEX_op_not_i64:
+        TCI_CASE(not_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r64(&tb_ptr);
             tci_write_reg64(t0, ~t1);
-            break;
+            TCI_NEXT();
 #endif
 #if TCG_TARGET_HAS_neg_i64
-        case INDEX_op_neg_i64:
+        TCI_CASE(neg_i64):
             t0 = *tb_ptr++;
             t1 = tci_read_r64(&tb_ptr);
             tci_write_reg64(t0, -t1);
-            break;
+            TCI_NEXT();
 #endif
 #endif /* TCG_TARGET_REG_BITS == 64 */
 
             /* QEMU specific operations. */
 
 #if TARGET_LONG_BITS > TCG_TARGET_REG_BITS
-        case INDEX_op_debug_insn_start:
+        TCI_CASE(debug_insn_start):
             TODO();
-            break;
+            TCI_NEXT();
 #else
-        case INDEX_op_debug_insn_start:
+        TCI_CASE(debug_insn_start):
             TODO();
-            break;
+            TCI_NEXT();
 #endif
-        case INDEX_op_exit_tb:
+        TCI_CASE(exit_tb):
             next_tb = *(uint64_t *)tb_ptr;
             goto exit;
-            break;
-        case INDEX_op_goto_tb:
+        TCI_CASE(goto_tb):
             t0 = tci_read_i32(&tb_ptr);
             assert(tb_ptr == old_code_ptr + op_size);
             tb_ptr += (int32_t)t0;
-            continue;
-        case INDEX_op_qemu_ld8u:
+            TCI_JUMP();
+        TCI_CASE(qemu_ld8u):
             t0 = *tb_ptr++;
             taddr = tci_read_ulong(&tb_ptr);
 #ifdef CONFIG_SOFTMMU
@@ -1059,8 +1314,8 @@ tcg_target_ulong tcg_qemu_tb_exec(CPUArchState *cpustate, uint8_t *tb_ptr)
             tmp8 = *(uint8_t *)(host_addr + GUEST_BASE);
 #endif
             tci_write_reg8(t0, tmp8);
-            break;
-        case INDEX_op_qemu_ld8s:
+            TCI_NEXT();
+        TCI_CASE(qemu_ld8s):
             t0 = *tb_ptr++;
             taddr = tci_read_ulong(&tb_ptr);
 #ifdef CONFIG_SOFTMMU
@@ -1071,8 +1326,8 @@ tcg_target_ulong tcg_qemu_tb_exec(CPUArchState *cpustate, uint8_t *tb_ptr)
             tmp8 = *(uint8_t *)(host_addr + GUEST_BASE);
 #endif
             tci_write_reg8s(t0, tmp8);
-            break;
-        case INDEX_op_qemu_ld16u:
+            TCI_NEXT();
+        TCI_CASE(qemu_ld16u):
             t0 = *tb_ptr++;
             taddr = tci_read_ulong(&tb_ptr);
 #ifdef CONFIG_SOFTMMU
@@ -1083,8 +1338,8 @@ tcg_target_ulong tcg_qemu_tb_exec(CPUArchState *cpustate, uint8_t *tb_ptr)
             tmp16 = tswap16(*(uint16_t *)(host_addr + GUEST_BASE));
 #endif
             tci_write_reg16(t0, tmp16);
-            break;
-        case INDEX_op_qemu_ld16s:
+            TCI_NEXT();
+        TCI_CASE(qemu_ld16s):
             t0 = *tb_ptr++;
             taddr = tci_read_ulong(&tb_ptr);
 #ifdef CONFIG_SOFTMMU
@@ -1095,9 +1350,9 @@ tcg_target_ulong tcg_qemu_tb_exec(CPUArchState *cpustate, uint8_t *tb_ptr)
             tmp16 = tswap16(*(uint16_t *)(host_addr + GUEST_BASE));
 #endif
             tci_write_reg16s(t0, tmp16);
-            break;
+            TCI_NEXT();
 #if TCG_TARGET_REG_BITS == 64
-        case INDEX_op_qemu_ld32u:
+        TCI_CASE(qemu_ld32u):
             t0 = *tb_ptr++;
             taddr = tci_read_ulong(&tb_ptr);
 #ifdef CONFIG_SOFTMMU
@@ -1108,8 +1363,8 @@ tcg_target_ulong tcg_qemu_tb_exec(CPUArchState *cpustate, uint8_t *tb_ptr)
             tmp32 = tswap32(*(uint32_t *)(host_addr + GUEST_BASE));
 #endif
             tci_write_reg32(t0, tmp32);
-            break;
-        case INDEX_op_qemu_ld32s:
+            TCI_NEXT();
+        TCI_CASE(qemu_ld32s):
             t0 = *tb_ptr++;
             taddr = tci_read_ulong(&tb_ptr);
 #ifdef CONFIG_SOFTMMU
@@ -1120,9 +1375,9 @@ tcg_target_ulong tcg_qemu_tb_exec(CPUArchState *cpustate, uint8_t *tb_ptr)
             tmp32 = tswap32(*(uint32_t *)(host_addr + GUEST_BASE));
 #endif
             tci_write_reg32s(t0, tmp32);
-            break;
+            TCI_NEXT();
 #endif /* TCG_TARGET_REG_BITS == 64 */
-        case INDEX_op_qemu_ld32:
+        TCI_CASE(qemu_ld32):
             t0 = *tb_ptr++;
             taddr = tci_read_ulong(&tb_ptr);
 #ifdef CONFIG_SOFTMMU
@@ -1133,8 +1388,8 @@ tcg_target_ulong tcg_qemu_tb_exec(CPUArchState *cpustate, uint8_t *tb_ptr)
             tmp32 = tswap32(*(uint32_t *)(host_addr + GUEST_BASE));
 #endif
             tci_write_reg32(t0, tmp32);
-            break;
-        case INDEX_op_qemu_ld64:
+            TCI_NEXT();
+        TCI_CASE(qemu_ld64):
             t0 = *tb_ptr++;
 #if TCG_TARGET_REG_BITS == 32
             t1 = *tb_ptr++;
@@ -1151,8 +1406,8 @@ tcg_target_ulong tcg_qemu_tb_exec(CPUArchState *cpustate, uint8_t *tb_ptr)
 #if TCG_TARGET_REG_BITS == 32
             tci_write_reg(t1, tmp64 >> 32);
 #endif
-            break;
-        case INDEX_op_qemu_st8:
+            TCI_NEXT();
+        TCI_CASE(qemu_st8):
             t0 = tci_read_r8(&tb_ptr);
             taddr = tci_read_ulong(&tb_ptr);
 #ifdef CONFIG_SOFTMMU
@@ -1163,8 +1418,8 @@ tcg_target_ulong tcg_qemu_tb_exec(CPUArchState *cpustate, uint8_t *tb_ptr)
             assert(taddr == host_addr);
             *(uint8_t *)(host_addr + GUEST_BASE) = t0;
 #endif
-            break;
-        case INDEX_op_qemu_st16:
+            TCI_NEXT();
+        TCI_CASE(qemu_st16):
             t0 = tci_read_r16(&tb_ptr);
             taddr = tci_read_ulong(&tb_ptr);
 #ifdef CONFIG_SOFTMMU
@@ -1175,8 +1430,8 @@ tcg_target_ulong tcg_qemu_tb_exec(CPUArchState *cpustate, uint8_t *tb_ptr)
             assert(taddr == host_addr);
             *(uint16_t *)(host_addr + GUEST_BASE) = tswap16(t0);
 #endif
-            break;
-        case INDEX_op_qemu_st32:
+            TCI_NEXT();
+        TCI_CASE(qemu_st32):
             t0 = tci_read_r32(&tb_ptr);
             taddr = tci_read_ulong(&tb_ptr);
 #ifdef CONFIG_SOFTMMU
@@ -1187,8 +1442,8 @@ tcg_target_ulong tcg_qemu_tb_exec(CPUArchState *cpustate, uint8_t *tb_ptr)
             assert(taddr == host_addr);
             *(uint32_t *)(host_addr + GUEST_BASE) = tswap32(t0);
 #endif
-            break;
-        case INDEX_op_qemu_st64:
+            TCI_NEXT();
+        TCI_CASE(qemu_st64):
             tmp64 = tci_read_r64(&tb_ptr);
             taddr = tci_read_ulong(&tb_ptr);
 #ifdef CONFIG_SOFTMMU
@@ -1199,13 +1454,132 @@ tcg_target_ulong tcg_qemu_tb_exec(CPUArchState *cpustate, uint8_t *tb_ptr)
             assert(taddr == host_addr);
             *(uint64_t *)(host_addr + GUEST_BASE) = tswap64(tmp64);
 #endif
-            break;
-        default:
+            TCI_NEXT();
+        TCI_DEFAULT:
             TODO();
-            break;
+            TCI_NEXT();
+#if defined(TCI_THREADED)
+
+            /* Handlers only reached from direct threaded code. */
+
+        TCI_FOR_BINOPS(32, TCI_BINOP_RR)
+        TCI_FOR_BINOPS(32, TCI_BINOP_RI)
+        TCI_FOR_BINOPS(32, TCI_LD_OP_ST)
+#if TCG_TARGET_REG_BITS == 64
+        TCI_FOR_BINOPS(64, TCI_BINOP_RR)
+        TCI_FOR_BINOPS(64, TCI_BINOP_RI)
+        TCI_FOR_BINOPS(64, TCI_LD_OP_ST)
+#endif
+        tci_do_setcond_brcond_i32:
+            t0 = *tb_ptr++;
+            t1 = tci_read_r32(&tb_ptr);
+            t2 = tci_read_ri32(&tb_ptr);
+            condition = *tb_ptr++;
+            tci_write_reg32(t0, tci_compare32(t1, t2, condition));
+            TCI_FUSED_NEXT();
+            t0 = tci_read_r32(&tb_ptr);
+            t1 = tci_read_ri32(&tb_ptr);
+            condition = *tb_ptr++;
+            label = tci_read_label(&tb_ptr);
+            if (tci_compare32(t0, t1, condition)) {
+                assert(tb_ptr == old_code_ptr + op_size);
+                tb_ptr = (uint8_t *)label;
+                TCI_JUMP();
+            }
+            TCI_NEXT();
+#endif
         }
         assert(tb_ptr == old_code_ptr + op_size);
     }
 exit:
     return next_tb;
 }
+
+#if defined(TCI_THREADED)
+static TCGOpcode tci_op_at(const uint8_t *p)
+{
+    return *(const tcg_target_ulong *)p;
+}
+
+/* Test if ld + op + st has a superinstruction (all of the same size). */
+static bool tci_fuse_ld_op_st(TCGOpcode ld, TCGOpcode op, TCGOpcode st)
+{
+    bool op64 = (tcg_op_defs[op].flags & TCG_OPF_64BIT) != 0;
+
+    if (!tci_handlers_ld_op_st[op]) {
+        return false;
+    }
+    if (ld == INDEX_op_ld_i32 && st == INDEX_op_st_i32) {
+        return !op64;
+    }
+    if (ld == INDEX_op_ld_i64 && st == INDEX_op_st_i64) {
+        return op64;
+    }
+    return false;
+}
+
+/* Turn the bytecode in [start, end), which holds the ops of a block just
+   generated, into direct threaded code.  The layout of the ops does not
+   change: a superinstruction replaces the handler of the first op of a
+   sequence only, so the code still works when a branch enters the
+   sequence in the middle. */
+void tci_predecode(uint8_t *start, uint8_t *end)
+{
+    uint8_t *p, *q, *r;
+    const uint8_t *args;
+    const void *handler;
+    TCGOpcode opc;
+
+    if (!tci_handlers_op) {
+        tcg_qemu_tb_exec(NULL, NULL);
+    }
+    for (p = start; p < end; p = q) {
+        opc = tci_op_at(p);
+        assert(opc < NB_OPS);
+        args = p + TCI_OP_HEADER_SIZE;
+        q = p + p[TCI_OP_SIZE_OFFSET];
+        r = q < end ? q + q[TCI_OP_SIZE_OFFSET] : end;
+
+        handler = tci_handlers_op[opc];
+        if (tci_handlers_rr[opc] && args[1] != TCG_CONST) {
+            /* op r0, r1, r2 or op r0, r1, const */
+            handler = args[2] != TCG_CONST ? tci_handlers_rr[opc] :
+                tci_handlers_ri[opc];
+        }
+        if (opc == INDEX_op_setcond_i32 && q < end &&
+            tci_op_at(q) == INDEX_op_brcond_i32) {
+            handler = tci_handler_setcond_brcond_i32[0];
+        } else if (r < end &&
+                   tci_fuse_ld_op_st(opc, tci_op_at(q), tci_op_at(r))) {
+            handler = tci_handlers_ld_op_st[tci_op_at(q)];
+        }
+        *(tcg_target_ulong *)p = (uintptr_t)handler;
+    }
+}
+
+/* Return the opcode interpreted by a handler, or -1.  Superinstructions
+   return the opcode of their first op. */
+int tci_handler_opc(tcg_target_ulong handler)
+{
+    const void *h = (const void *)(uintptr_t)handler;
+    int i;
+
+    if (!tci_handlers_op) {
+        tcg_qemu_tb_exec(NULL, NULL);
+    }
+    if (h == tci_handler_setcond_brcond_i32[0]) {
+        return INDEX_op_setcond_i32;
+    }
+    for (i = 0; i < NB_OPS; i++) {
+        if (h == tci_handlers_op[i] || h == tci_handlers_rr[i] ||
+            h == tci_handlers_ri[i]) {
+            return i;
+        }
+        if (h == tci_handlers_ld_op_st[i]) {
+            return tcg_op_defs[i].flags & TCG_OPF_64BIT ?
+                INDEX_op_ld_i64 : INDEX_op_ld_i32;
+        }
+    }
+    return -1;
+}
+#endif
@@ -0,0 +1,104 @@
+/*
+ * Record/replay round trip test for linux-user.
+ *
+ * The program folds values that differ on every run (time, pid, random
+ * bytes, where a timer signal interrupts a loop) and the contents of a
+ * mapped file into a hash, and exits with its low byte.  A replay of a
+ * recorded run must exit with the same status; output is not compared
+ * because replay does not execute write().
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+static volatile sig_atomic_t alarmed;
+
+static void alarm_handler(int sig)
+{
+    alarmed = 1;
+}
+
+static uint32_t hash(uint32_t h, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+
+    while (len--) {
+        h = (h ^ *p++) * 16777619;
+    }
+    return h;
+}
+
+int main(int argc, char **argv)
+{
+    struct itimerval it;
+    struct timeval tv;
+    struct stat st;
+    uint32_t h = 2166136261u;
+    uint32_t loops = 0;
+    uint8_t rnd[16];
+    pid_t pid;
+    void *p;
+    int fd;
+
+    gettimeofday(&tv, NULL);
+    h = hash(h, &tv, sizeof(tv));
+    pid = getpid();
+    h = hash(h, &pid, sizeof(pid));
+
+    fd = open("/dev/urandom", O_RDONLY);
+    if (fd >= 0) {
+        if (read(fd, rnd, sizeof(rnd)) == sizeof(rnd)) {
+            h = hash(h, rnd, sizeof(rnd));
+        }
+        close(fd);
+    }
+
+    /* the program itself: replay maps it again rather than logging it */
+    fd = open(argv[0], O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(argv[0]);
+        return 1;
+    }
+    p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    h = hash(h, p, st.st_size);
+    munmap(p, st.st_size);
+    close(fd);
+
+    /* the signal must be injected at the same instruction on replay */
+    signal(SIGALRM, alarm_handler);
+    memset(&it, 0, sizeof(it));
+    it.it_value.tv_usec = 20000;
+    setitimer(ITIMER_REAL, &it, NULL);
+    while (!alarmed) {
+        loops++;
+    }
+    h = hash(h, &loops, sizeof(loops));
+
+    printf("hash %08x\n", h);
+    return h & 0xff;
+}
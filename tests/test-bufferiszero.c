@@ -0,0 +1,106 @@
+/*
+ * buffer_is_zero() and buffer_is_uniform() unit tests
+ *
+ * The accelerated checks are compared against a byte by byte scan for
+ * every alignment of the buffer, a range of lengths around the block
+ * size, and a wrong byte at the start, at the block boundaries and in
+ * between.
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+
+#define BLOCK 128
+#define MAX_LEN (8 * BLOCK + 64)
+
+static bool buffer_is_filled_ref(const uint8_t *buf, size_t len, uint8_t c)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        if (buf[i] != c) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void check_buffer(const uint8_t *buf, size_t len, uint8_t c)
+{
+    bool expected = buffer_is_filled_ref(buf, len, c);
+
+    if (c == 0) {
+        g_assert(buffer_is_zero(buf, len) == expected);
+    }
+    g_assert(buffer_is_uniform(buf, len) ==
+             (len == 0 || buffer_is_filled_ref(buf, len, buf[0])));
+}
+
+static void test_fill(uint8_t c)
+{
+    static const size_t lens[] = {
+        0, 1, 7, 8, 9, 31, 32, 33, 63, 64, 65, 127, 128, 129,
+        255, 256, 257, 511, 512, 513, 1000, 4 * BLOCK + 1, MAX_LEN,
+    };
+    uint8_t *mem = g_malloc(MAX_LEN + 2 * BLOCK);
+    uint8_t *base = (uint8_t *)(((uintptr_t)mem + BLOCK - 1) &
+                                ~(uintptr_t)(BLOCK - 1));
+    size_t off, i, pos, step;
+
+    for (off = 0; off < BLOCK; off++) {
+        uint8_t *buf = base + off;
+
+        for (i = 0; i < ARRAY_SIZE(lens); i++) {
+            size_t len = lens[i];
+
+            memset(base, c, MAX_LEN + BLOCK);
+            check_buffer(buf, len, c);
+
+            step = MAX(len / 16, 1);
+            for (pos = 0; pos < len; pos++) {
+                bool boundary = ((off + pos) % BLOCK) == 0 ||
+                                ((off + pos) % BLOCK) == BLOCK - 1;
+
+                if (pos > 8 && pos < len - 1 && !boundary && pos % step) {
+                    continue;
+                }
+                buf[pos] = c ^ 0x01;
+                check_buffer(buf, len, c);
+                buf[pos] = c ^ 0x80;
+                check_buffer(buf, len, c);
+                buf[pos] = c;
+            }
+
+            /* bytes just outside the buffer must not matter */
+            if (off > 0) {
+                buf[-1] = c ^ 0xff;
+            }
+            buf[len] = c ^ 0xff;
+            check_buffer(buf, len, c);
+        }
+    }
+
+    g_free(mem);
+}
+
+static void test_buffer_is_zero(void)
+{
+    test_fill(0);
+}
+
+static void test_buffer_is_uniform(void)
+{
+    test_fill(0xa5);
+    test_fill(0xff);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/cutils/buffer_is_zero", test_buffer_is_zero);
+    g_test_add_func("/cutils/buffer_is_uniform", test_buffer_is_uniform);
+    return g_test_run();
+}
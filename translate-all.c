@@ -31,20 +31,418 @@
 #include "qemu-timer.h"
 #define DEBUG_DISAS
 /* code generation context */
-TCGContext tcg_ctx;
+TCG_THREAD TCGContext tcg_ctx;
 
-uint16_t gen_opc_buf[OPC_BUF_SIZE];
-TCGArg gen_opparam_buf[OPPARAM_BUF_SIZE];
+TCG_THREAD uint16_t gen_opc_buf[OPC_BUF_SIZE];
+TCG_THREAD TCGArg gen_opparam_buf[OPPARAM_BUF_SIZE];
 
-target_ulong gen_opc_pc[OPC_BUF_SIZE];
-uint16_t gen_opc_icount[OPC_BUF_SIZE];
-uint8_t gen_opc_instr_start[OPC_BUF_SIZE];
+TCG_THREAD target_ulong gen_opc_pc[OPC_BUF_SIZE];
+TCG_THREAD uint16_t gen_opc_icount[OPC_BUF_SIZE];
+TCG_THREAD uint8_t gen_opc_instr_start[OPC_BUF_SIZE];
+#ifdef TARGET_HAS_INSN_RECORDS
+static TCG_THREAD uint32_t gen_opc_host_end[OPC_BUF_SIZE];
+#endif
+TCG_THREAD int tb_gen_insn_starts;
+
+#if defined(TARGET_HAS_INSN_RECORDS) && defined(CONFIG_USER_ONLY)
+#define USE_DECODE_CACHE
+#endif
 
 void cpu_gen_init(void)
 {
     tcg_context_init(&tcg_ctx); 
 }
 
+#ifdef TARGET_HAS_INSN_RECORDS
+/* Store one record per guest instruction after the 'code_size' bytes of
+   host code of 'tb'.  Returns the number of bytes used for them.  */
+static int tb_record_insns(TranslationBlock *tb, int code_size)
+{
+    TCGContext *s = &tcg_ctx;
+    TBInsnRecord *rec;
+    uintptr_t start;
+    int j, n, nb_ops;
+
+    start = ((uintptr_t)tb->tc_ptr + code_size + sizeof(TBInsnRecord) - 1) &
+        ~(uintptr_t)(sizeof(TBInsnRecord) - 1);
+    rec = (TBInsnRecord *)start;
+    nb_ops = gen_opc_ptr - gen_opc_buf;
+    n = 0;
+    for (j = 0; j < nb_ops; j++) {
+        if (!gen_opc_instr_start[j]) {
+            continue;
+        }
+        /* the ops emitted before the first insn belong to it */
+        rec[n].host_start = n == 0 ? 0 : s->op_host_end[j - 1];
+        rec[n].icount = gen_opc_icount[j];
+        rec[n].data = insn_record_data(j);
+        rec[n].pc = gen_opc_pc[j];
+        n++;
+    }
+    rec[n].host_start = code_size;
+    rec[n].icount = 0;
+    rec[n].data = 0;
+    rec[n].pc = 0;
+
+    tb->insn_records = rec;
+    tb->nb_insn_records = n;
+    return (uintptr_t)(rec + n + 1) - ((uintptr_t)tb->tc_ptr + code_size);
+}
+
+/* Restore the state from the records of 'tb'.  Returns -1 if
+   'searched_pc' is not within its host code.  */
+static int cpu_restore_state_from_records(TranslationBlock *tb,
+                                          CPUArchState *env,
+                                          uintptr_t searched_pc)
+{
+    const TBInsnRecord *rec = tb->insn_records;
+    uintptr_t offset = searched_pc - (uintptr_t)tb->tc_ptr;
+    int lo, hi, mid;
+
+    if (searched_pc < (uintptr_t)tb->tc_ptr ||
+        tb->nb_insn_records == 0 ||
+        offset >= rec[tb->nb_insn_records].host_start) {
+        return -1;
+    }
+    /* find the last insn starting at or before 'offset' */
+    lo = 0;
+    hi = tb->nb_insn_records - 1;
+    while (lo < hi) {
+        mid = (lo + hi + 1) / 2;
+        if (rec[mid].host_start <= offset) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    if (use_icount) {
+        /* Reset the cycle counter to the start of the block.  */
+        env->icount_decr.u16.low += tb->icount;
+        /* Clear the IO flag.  */
+        env->can_do_io = 0;
+    }
+    env->icount_decr.u16.low -= rec[lo].icount;
+    restore_state_to_insn(env, tb, &rec[lo]);
+    return 0;
+}
+#endif
+
+#ifdef USE_DECODE_CACHE
+/* Decoded blocks, kept per guest page across code buffer flushes.
+
+   The output of the front end for a block (its TCG ops, parameters,
+   temps and guest instruction boundaries) is saved together with a copy
+   of the guest code it was decoded from.  When the block is translated
+   again, after a flush or by cpu_restore_state(), and the guest code is
+   unchanged, the saved ops are handed to the back end and the guest
+   code is not decoded again.  In user mode the ops of a block only
+   depend on its guest code and on pc, cs_base and flags, except for the
+   cases that decode_cache_usable() rules out.  The only value that
+   depends on the TranslationBlock itself, the TB address passed to
+   exit_tb, is stored relative to it.  */
+
+#define DECODE_CACHE_BUCKETS 4096
+/* everything is dropped when the cache grows beyond this */
+#define DECODE_CACHE_MAX_BYTES (64 * 1024 * 1024)
+
+typedef struct DecodedInsn {
+    uint16_t op_index;
+    uint16_t icount;
+    uint16_t data;          /* see insn_record_data() */
+    target_ulong pc;
+} DecodedInsn;
+
+typedef struct DecodedBlock {
+    struct DecodedBlock *next;
+    target_ulong pc;
+    target_ulong cs_base;
+    uint64_t flags;
+    uint32_t size;          /* bytes of guest code */
+    uint32_t icount;
+    uint32_t nb_params;
+    uint16_t nb_ops;        /* INDEX_op_end included */
+    uint16_t nb_temps;      /* temps after the globals */
+    uint16_t nb_labels;
+    uint16_t nb_insns;
+    uint16_t nb_exits;
+    size_t bytes;
+    TCGArg *params;
+    TCGTemp *temps;
+    DecodedInsn *insns;
+    uint32_t *exits;        /* params that hold the TB address */
+    uint16_t *ops;
+    uint8_t *guest_code;
+} DecodedBlock;
+
+typedef struct DecodedPage {
+    struct DecodedPage *next;
+    target_ulong page;
+    DecodedBlock *blocks;
+} DecodedPage;
+
+static DecodedPage *decode_cache[DECODE_CACHE_BUCKETS];
+static size_t decode_cache_bytes;
+static spinlock_t decode_cache_lock = SPIN_LOCK_UNLOCKED;
+/* per op data of a block loaded for cpu_restore_state() */
+static TCG_THREAD uint16_t gen_opc_data[OPC_BUF_SIZE];
+
+/* Whether the ops of this block only depend on its guest code and key */
+static inline int decode_cache_usable(CPUArchState *env,
+                                      TranslationBlock *tb)
+{
+    return tb->cflags == 0 && !tb->stored && !singlestep &&
+        !env->singlestep_enabled && QTAILQ_EMPTY(&env->breakpoints) &&
+        !tb_profile_top && !tb_count_insns && !tb_coverage_map &&
+        !qemu_loglevel_mask(CPU_LOG_TB_IN_ASM | CPU_LOG_TB_OP);
+}
+
+static inline unsigned int decode_cache_hash(target_ulong page)
+{
+    return (page >> TARGET_PAGE_BITS) & (DECODE_CACHE_BUCKETS - 1);
+}
+
+static DecodedPage *decode_cache_page(target_ulong pc, int create)
+{
+    target_ulong page = pc & TARGET_PAGE_MASK;
+    DecodedPage **pp = &decode_cache[decode_cache_hash(page)];
+    DecodedPage *p;
+
+    for (p = *pp; p; p = p->next) {
+        if (p->page == page) {
+            return p;
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+    p = g_malloc0(sizeof(*p));
+    p->page = page;
+    p->next = *pp;
+    *pp = p;
+    decode_cache_bytes += sizeof(*p);
+    return p;
+}
+
+static void decode_cache_free_block(DecodedBlock *b)
+{
+    decode_cache_bytes -= b->bytes;
+    g_free(b);
+}
+
+static void decode_cache_clear(void)
+{
+    DecodedPage *p, *next_p;
+    DecodedBlock *b, *next_b;
+    int i;
+
+    for (i = 0; i < DECODE_CACHE_BUCKETS; i++) {
+        for (p = decode_cache[i]; p; p = next_p) {
+            next_p = p->next;
+            for (b = p->blocks; b; b = next_b) {
+                next_b = b->next;
+                decode_cache_free_block(b);
+            }
+            g_free(p);
+        }
+        decode_cache[i] = NULL;
+    }
+    decode_cache_bytes = 0;
+}
+
+static int tcg_op_nb_args(uint16_t opc, const TCGArg *args)
+{
+    if (opc == INDEX_op_call) {
+        return 1 + (args[0] >> 16) + (args[0] & 0xffff) +
+            tcg_op_defs[opc].nb_cargs;
+    } else if (opc == INDEX_op_nopn) {
+        return args[0];
+    }
+    return tcg_op_defs[opc].nb_args;
+}
+
+/* Save the ops the front end just generated for 'tb'.  The gen_opc_*
+   arrays must have been filled, see tb_gen_insn_starts.  */
+static void decode_cache_insert(TCGContext *s, TranslationBlock *tb)
+{
+    uint32_t exits[OPC_BUF_SIZE];
+    DecodedBlock *b, **pb;
+    DecodedPage *p;
+    const TCGArg *args;
+    size_t bytes;
+    int i, n, nb_ops, nb_params, nb_temps, nb_insns, nb_exits;
+
+    nb_ops = gen_opc_ptr - gen_opc_buf + 1;
+    nb_params = gen_opparam_ptr - gen_opparam_buf;
+    nb_temps = s->nb_temps - s->nb_globals;
+    nb_insns = 0;
+    nb_exits = 0;
+    args = gen_opparam_buf;
+    for (i = 0; i < nb_ops - 1; i++) {
+        if (gen_opc_instr_start[i]) {
+            nb_insns++;
+        }
+        if (gen_opc_buf[i] == INDEX_op_exit_tb &&
+            (args[0] & ~(TCGArg)3) == (uintptr_t)tb) {
+            exits[nb_exits++] = args - gen_opparam_buf;
+        }
+        args += tcg_op_nb_args(gen_opc_buf[i], args);
+    }
+
+    bytes = sizeof(*b) + nb_params * sizeof(TCGArg) +
+        nb_temps * sizeof(TCGTemp) + nb_insns * sizeof(DecodedInsn) +
+        nb_exits * sizeof(uint32_t) + nb_ops * sizeof(uint16_t) + tb->size;
+    b = g_malloc(bytes);
+    b->pc = tb->pc;
+    b->cs_base = tb->cs_base;
+    b->flags = tb->flags;
+    b->size = tb->size;
+    b->icount = tb->icount;
+    b->nb_params = nb_params;
+    b->nb_ops = nb_ops;
+    b->nb_temps = nb_temps;
+    b->nb_labels = s->nb_labels;
+    b->nb_insns = nb_insns;
+    b->nb_exits = nb_exits;
+    b->bytes = bytes;
+    b->params = (TCGArg *)(b + 1);
+    b->temps = (TCGTemp *)(b->params + nb_params);
+    b->insns = (DecodedInsn *)(b->temps + nb_temps);
+    b->exits = (uint32_t *)(b->insns + nb_insns);
+    b->ops = (uint16_t *)(b->exits + nb_exits);
+    b->guest_code = (uint8_t *)(b->ops + nb_ops);
+
+    memcpy(b->params, gen_opparam_buf, nb_params * sizeof(TCGArg));
+    memcpy(b->temps, &s->temps[s->nb_globals], nb_temps * sizeof(TCGTemp));
+    memcpy(b->exits, exits, nb_exits * sizeof(uint32_t));
+    memcpy(b->ops, gen_opc_buf, nb_ops * sizeof(uint16_t));
+    memcpy(b->guest_code, g2h(tb->pc), tb->size);
+    for (i = 0; i < nb_exits; i++) {
+        b->params[exits[i]] -= (uintptr_t)tb;
+    }
+    n = 0;
+    for (i = 0; i < nb_ops - 1; i++) {
+        if (gen_opc_instr_start[i]) {
+            b->insns[n].op_index = i;
+            b->insns[n].icount = gen_opc_icount[i];
+            b->insns[n].data = insn_record_data(i);
+            b->insns[n].pc = gen_opc_pc[i];
+            n++;
+        }
+    }
+
+    spin_lock(&decode_cache_lock);
+    if (decode_cache_bytes + bytes > DECODE_CACHE_MAX_BYTES) {
+        decode_cache_clear();
+    }
+    p = decode_cache_page(tb->pc, 1);
+    /* this translation replaces any other one of the same block */
+    for (pb = &p->blocks; *pb; ) {
+        DecodedBlock *old = *pb;
+        if (old->pc == tb->pc && old->cs_base == tb->cs_base &&
+            old->flags == tb->flags) {
+            *pb = old->next;
+            decode_cache_free_block(old);
+        } else {
+            pb = &old->next;
+        }
+    }
+    b->next = p->blocks;
+    p->blocks = b;
+    decode_cache_bytes += bytes;
+    spin_unlock(&decode_cache_lock);
+}
+
+/* Load the saved ops of 'tb' after tcg_func_start(), as the front end
+   would have generated them.  For cpu_restore_state() ('search_pc')
+   the instruction boundaries are loaded too.  Returns 0 if there are
+   none for the current guest code.  */
+static int decode_cache_load(TCGContext *s, TranslationBlock *tb,
+                             int search_pc)
+{
+    DecodedBlock *b, **pb;
+    DecodedPage *p;
+    int i, j;
+
+    spin_lock(&decode_cache_lock);
+    p = decode_cache_page(tb->pc, 0);
+    b = NULL;
+    for (pb = p ? &p->blocks : NULL; pb && *pb; ) {
+        b = *pb;
+        if (b->pc == tb->pc && b->cs_base == tb->cs_base &&
+            b->flags == tb->flags) {
+            /* the compare needs the guest code mapped */
+            if ((page_get_flags(b->pc) & PAGE_READ) &&
+                (page_get_flags(b->pc + b->size - 1) & PAGE_READ) &&
+                memcmp(g2h(b->pc), b->guest_code, b->size) == 0) {
+                break;
+            }
+            *pb = b->next;
+            decode_cache_free_block(b);
+        } else {
+            pb = &b->next;
+        }
+        b = NULL;
+    }
+    if (!b) {
+        spin_unlock(&decode_cache_lock);
+        return 0;
+    }
+
+    memcpy(gen_opc_buf, b->ops, b->nb_ops * sizeof(uint16_t));
+    gen_opc_ptr = gen_opc_buf + b->nb_ops - 1;
+    memcpy(gen_opparam_buf, b->params, b->nb_params * sizeof(TCGArg));
+    gen_opparam_ptr = gen_opparam_buf + b->nb_params;
+    for (i = 0; i < b->nb_exits; i++) {
+        gen_opparam_buf[b->exits[i]] += (uintptr_t)tb;
+    }
+    memcpy(&s->temps[s->nb_globals], b->temps,
+           b->nb_temps * sizeof(TCGTemp));
+    s->nb_temps = s->nb_globals + b->nb_temps;
+    for (i = 0; i < b->nb_labels; i++) {
+        s->labels[i].has_value = 0;
+        s->labels[i].u.first_reloc = NULL;
+    }
+    s->nb_labels = b->nb_labels;
+
+    if (search_pc) {
+        memset(gen_opc_instr_start, 0, b->nb_ops);
+        for (i = 0; i < b->nb_insns; i++) {
+            j = b->insns[i].op_index;
+            gen_opc_instr_start[j] = 1;
+            gen_opc_icount[j] = b->insns[i].icount;
+            gen_opc_data[j] = b->insns[i].data;
+            gen_opc_pc[j] = b->insns[i].pc;
+        }
+    } else {
+        tb->size = b->size;
+        tb->icount = b->icount;
+    }
+    spin_unlock(&decode_cache_lock);
+    return 1;
+}
+#endif
+
+#ifdef CONFIG_USER_ONLY
+/* Make sure the decode cache is consistent for calling fork().  */
+void tb_decode_cache_fork_start(void)
+{
+#ifdef USE_DECODE_CACHE
+    spin_lock(&decode_cache_lock);
+#endif
+}
+
+void tb_decode_cache_fork_end(int child)
+{
+#ifdef USE_DECODE_CACHE
+    if (child) {
+        pthread_mutex_init(&decode_cache_lock, NULL);
+    } else {
+        spin_unlock(&decode_cache_lock);
+    }
+#endif
+}
+#endif
+
 /* return non zero if the very first instruction is invalid so that
    the virtual CPU can trigger an exception.
 
@@ -57,6 +455,7 @@ int cpu_gen_code(CPUArchState *env, TranslationBlock *tb, int *gen_code_size_ptr
     TCGContext *s = &tcg_ctx;
     uint8_t *gen_code_buf;
     int gen_code_size;
+    int decoded = 0;
 #ifdef CONFIG_PROFILER
     int64_t ti;
 #endif
@@ -67,8 +466,32 @@ int cpu_gen_code(CPUArchState *env, TranslationBlock *tb, int *gen_code_size_ptr
     ti = profile_getclock();
 #endif
     tcg_func_start(s);
+    s->tb_exec_count = tb_profile_top ? &tb->exec_count : NULL;
+    s->tb_icount = tb_count_insns ? &tb->icount : NULL;
+    s->tb_coverage_map = tb_coverage(tb->pc) ? tb_coverage_map : NULL;
+    s->tb_coverage_loc = tb_coverage_loc(tb->pc);
+#ifdef TARGET_HAS_INSN_RECORDS
+    s->op_host_end = tb->stored ? gen_opc_host_end : NULL;
+#endif
+    tb_gen_insn_starts = tb->stored;
 
-    gen_intermediate_code(env, tb);
+#ifdef USE_DECODE_CACHE
+    if (decode_cache_usable(env, tb)) {
+        decoded = decode_cache_load(s, tb, 0);
+        if (!decoded) {
+            /* decode_cache_insert() needs the insn boundaries */
+            tb_gen_insn_starts = 1;
+            gen_intermediate_code(env, tb);
+            if (tb->size) {
+                decode_cache_insert(s, tb);
+            }
+            decoded = 1;
+        }
+    }
+#endif
+    if (!decoded) {
+        gen_intermediate_code(env, tb);
+    }
     /* generate machine code */
     gen_code_buf = tb->tc_ptr;
     tb->tb_next_offset[0] = 0xffff;
@@ -77,6 +500,13 @@ int cpu_gen_code(CPUArchState *env, TranslationBlock *tb, int *gen_code_size_ptr
 #ifdef USE_DIRECT_JUMP
     s->tb_jmp_offset = tb->tb_jmp_offset;
     s->tb_next = NULL;
+#ifdef CONFIG_USER_ONLY
+    if (tb->stored) {
+        /* jump through the TranslationBlock of the process */
+        s->tb_jmp_offset = NULL;
+        s->tb_next = tb->tb_next;
+    }
+#endif
 #else
     s->tb_jmp_offset = NULL;
     s->tb_next = tb->tb_next;
@@ -96,10 +526,18 @@ int cpu_gen_code(CPUArchState *env, TranslationBlock *tb, int *gen_code_size_ptr
 #endif
 
 #ifdef DEBUG_DISAS
-        qemu_log("OUT: [size=%d]\n", *gen_code_size_ptr);
-        log_disas(tb->tc_ptr, *gen_code_size_ptr);
+    if (qemu_loglevel_mask(CPU_LOG_TB_OUT_ASM)) {
+        qemu_log("OUT: [size=%d]\n", gen_code_size);
+        log_disas(tb->tc_ptr, gen_code_size);
         qemu_log("\n");
-//        qemu_log_flush();
+        qemu_log_flush();
+    }
+#endif
+#ifdef TARGET_HAS_INSN_RECORDS
+    /* blocks of the shared store cannot be translated again in place */
+    if (tb->stored) {
+        *gen_code_size_ptr += tb_record_insns(tb, gen_code_size);
+    }
 #endif
     return 0;
 }
@@ -110,7 +548,7 @@ int cpu_restore_state(TranslationBlock *tb,
                       CPUArchState *env, uintptr_t searched_pc)
 {
     TCGContext *s = &tcg_ctx;
-    int j;
+    int j, decoded = 0;
     uintptr_t tc_ptr;
 #ifdef CONFIG_PROFILER
     int64_t ti;
@@ -118,10 +556,34 @@ int cpu_restore_state(TranslationBlock *tb,
 
 #ifdef CONFIG_PROFILER
     ti = profile_getclock();
+#endif
+#ifdef TARGET_HAS_INSN_RECORDS
+    if (tb->insn_records) {
+        if (cpu_restore_state_from_records(tb, env, searched_pc) < 0) {
+            return -1;
+        }
+#ifdef CONFIG_PROFILER
+        s->restore_time += profile_getclock() - ti;
+        s->restore_count++;
+#endif
+        return 0;
+    }
+    s->op_host_end = NULL;
 #endif
     tcg_func_start(s);
+    s->tb_exec_count = tb_profile_top ? &tb->exec_count : NULL;
+    s->tb_icount = tb_count_insns ? &tb->icount : NULL;
+    s->tb_coverage_map = tb_coverage(tb->pc) ? tb_coverage_map : NULL;
+    s->tb_coverage_loc = tb_coverage_loc(tb->pc);
 
-    gen_intermediate_code_pc(env, tb);
+#ifdef USE_DECODE_CACHE
+    if (decode_cache_usable(env, tb)) {
+        decoded = decode_cache_load(s, tb, 1);
+    }
+#endif
+    if (!decoded) {
+        gen_intermediate_code_pc(env, tb);
+    }
 
     if (use_icount) {
         /* Reset the cycle counter to the start of the block.  */
@@ -139,6 +601,13 @@ int cpu_restore_state(TranslationBlock *tb,
 #ifdef USE_DIRECT_JUMP
     s->tb_jmp_offset = tb->tb_jmp_offset;
     s->tb_next = NULL;
+#ifdef CONFIG_USER_ONLY
+    if (tb->stored) {
+        /* jump through the TranslationBlock of the process */
+        s->tb_jmp_offset = NULL;
+        s->tb_next = tb->tb_next;
+    }
+#endif
 #else
     s->tb_jmp_offset = NULL;
     s->tb_next = tb->tb_next;
@@ -151,7 +620,20 @@ int cpu_restore_state(TranslationBlock *tb,
         j--;
     env->icount_decr.u16.low -= gen_opc_icount[j];
 
-    restore_state_to_opc(env, tb, j);
+#ifdef USE_DECODE_CACHE
+    if (decoded) {
+        TBInsnRecord rec;
+
+        rec.host_start = 0;
+        rec.icount = gen_opc_icount[j];
+        rec.data = gen_opc_data[j];
+        rec.pc = gen_opc_pc[j];
+        restore_state_to_insn(env, tb, &rec);
+    } else
+#endif
+    {
+        restore_state_to_opc(env, tb, j);
+    }
 
 #ifdef CONFIG_PROFILER
     s->restore_time += profile_getclock() - ti;